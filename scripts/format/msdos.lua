@@ -2,13 +2,22 @@
 #############################
 # DiscFerret Format Specification File
 #
-# 40/80 track generic, soft sectored
+# 40/80 track generic, soft sectored; IBM PC formats
 #############################
 ]]
 
 formatspec_version = 1.0
 
 formatspecs = {
+	-- Besides the fields described in gen40 below, a format can give:
+	--   tpi		tracks per inch; used to work out the track stepping in
+	--				drives with a different track pitch (0 or absent = use
+	--				trackstep)
+	--   encoding	data encoding, "fm" or "mfm" (used to check captures
+	--				with --verify)
+	--   datarate	data rate in kbps
+	--   spt		sectors per track
+
 	gen40 = {
 		-- format name
 		friendlyname	= "40 track, soft-sectored, generic",
@@ -28,7 +37,7 @@ formatspecs = {
 
 	gen80ds = {
 		-- format name
-		name			= "80 track, double-sided, soft-sectored, generic",
+		friendlyname	= "80 track, double-sided, soft-sectored, generic",
 		-- minimum track number
 		mintrack		= 0,
 		-- maximum track number
@@ -41,6 +50,62 @@ formatspecs = {
 		maxhead			= 1,
 		-- sectoring; 0=soft-sectored
 		sectors			= 0,
+	},
+
+	pc360 = {
+		friendlyname	= "IBM PC 360K, 5.25in double density",
+		mintrack		= 0,
+		maxtrack		= 39,
+		trackstep		= 1,
+		minhead			= 0,
+		maxhead			= 1,
+		sectors			= 0,
+		tpi				= 48,
+		encoding		= "mfm",
+		datarate		= 250,
+		spt				= 9,
+	},
+
+	pc720 = {
+		friendlyname	= "IBM PC 720K, 3.5in double density",
+		mintrack		= 0,
+		maxtrack		= 79,
+		trackstep		= 1,
+		minhead			= 0,
+		maxhead			= 1,
+		sectors			= 0,
+		tpi				= 135,
+		encoding		= "mfm",
+		datarate		= 250,
+		spt				= 9,
+	},
+
+	pc1200 = {
+		friendlyname	= "IBM PC 1.2M, 5.25in high density",
+		mintrack		= 0,
+		maxtrack		= 79,
+		trackstep		= 1,
+		minhead			= 0,
+		maxhead			= 1,
+		sectors			= 0,
+		tpi				= 96,
+		encoding		= "mfm",
+		datarate		= 500,
+		spt				= 15,
+	},
+
+	pc1440 = {
+		friendlyname	= "IBM PC 1.44M, 3.5in high density",
+		mintrack		= 0,
+		maxtrack		= 79,
+		trackstep		= 1,
+		minhead			= 0,
+		maxhead			= 1,
+		sectors			= 0,
+		tpi				= 135,
+		encoding		= "mfm",
+		datarate		= 500,
+		spt				= 18,
 	}
 }
 
@@ -0,0 +1,54 @@
+// STL headers
+#include <string>
+#include <sstream>
+#include <vector>
+
+// Local headers
+#include "Exceptions.hpp"
+#include "AcquisitionPlan.hpp"
+
+using namespace std;
+
+CAcquisitionPlan::CAcquisitionPlan(CDriveScript *drivescript, const std::string drivetype, CDriveInfo &driveinfo, const unsigned long sectors)
+{
+	_drivetype = drivetype;
+	_tracks = driveinfo.tracks();
+	_heads = driveinfo.heads();
+	_sectors = sectors;
+
+	vOutputs.resize(_tracks * _heads * _sectors);
+
+	for (unsigned long track = 0; track < _tracks; track++) {
+		for (unsigned long head = 0; head < _heads; head++) {
+			for (unsigned long sector = 1; sector <= _sectors; sector++) {
+				int outputs = drivescript->getDriveOutputs(drivetype, track, head, sector);
+
+				// The drive control register is eight bits wide
+				if ((outputs < 0) || (outputs > 0xFF)) {
+					stringstream s;
+					s << "getDriveOutputs() returned out-of-range value " << outputs
+						<< " for CHS " << track << ":" << head << ":" << sector;
+					throw EDriveSpecParse(s.str(), drivescript->getFilename(), drivetype);
+				}
+
+				vOutputs[index(track, head, sector)] = outputs;
+			}
+		}
+	}
+}
+
+size_t CAcquisitionPlan::index(const unsigned long track, const unsigned long head, const unsigned long sector) const
+{
+	return ((track * _heads) + head) * _sectors + (sector - 1);
+}
+
+unsigned char CAcquisitionPlan::driveOutputs(const unsigned long track, const unsigned long head, const unsigned long sector) const
+{
+	if ((track >= _tracks) || (head >= _heads) || (sector < 1) || (sector > _sectors)) {
+		stringstream s;
+		s << "CHS " << track << ":" << head << ":" << sector << " is outside the acquisition plan for drive type '" << _drivetype << "'";
+		throw EApplicationError(s.str());
+	}
+
+	return vOutputs[index(track, head, sector)];
+}
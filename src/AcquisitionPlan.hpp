@@ -0,0 +1,61 @@
+#ifndef _hpp_AcquisitionPlan
+#define _hpp_AcquisitionPlan
+
+// C++ STL headers
+#include <string>
+#include <vector>
+
+// Local headers
+#include "CDriveInfo.hpp"
+#include "ScriptInterfaces.hpp"
+
+/**
+ * @brief	Precomputed drive control outputs for every address on a drive.
+ *
+ * Built before the drive is selected, by calling the DriveScript's
+ * getDriveOutputs() function once for every (track, head, sector) address.
+ * Every result is range-checked as it's stored, so a broken script is caught
+ * at startup instead of half way through an acquisition -- and the
+ * acquisition loop doesn't need to call into Lua at all.
+ */
+class CAcquisitionPlan {
+	private:
+		std::string		_drivetype;
+		unsigned long	_tracks;		///< Number of physical tracks covered by the plan
+		unsigned long	_heads;			///< Number of physical heads covered by the plan
+		unsigned long	_sectors;		///< Number of sectors per track (1 for soft-sectored media)
+
+		/// DRIVE_CONTROL register values, indexed by index()
+		std::vector<unsigned char>	vOutputs;
+
+		size_t index(const unsigned long track, const unsigned long head, const unsigned long sector) const;
+
+	public:
+		/**
+		 * @brief	Build an acquisition plan.
+		 *
+		 * @param	drivescript	Drive script for this drive type
+		 * @param	drivetype	Drive type string
+		 * @param	driveinfo	Drive information, from CDriveScript::GetDriveInfo()
+		 * @param	sectors		Number of sectors per track (1 for soft-sectored media)
+		 *
+		 * Throws ELuaError if the script fails, or EDriveSpecParse if it returns
+		 * a value which can't be written to the drive control register.
+		 */
+		CAcquisitionPlan(CDriveScript *drivescript, const std::string drivetype, CDriveInfo &driveinfo, const unsigned long sectors = 1);
+
+		/**
+		 * @brief	Get the drive control outputs for a given address.
+		 *
+		 * @param	track	Physical track
+		 * @param	head	Physical head
+		 * @param	sector	Physical sector (starts at 1)
+		 */
+		unsigned char driveOutputs(const unsigned long track, const unsigned long head, const unsigned long sector) const;
+
+		unsigned long tracks(void) const	{ return _tracks; };
+		unsigned long heads(void) const		{ return _heads; };
+		unsigned long sectors(void) const	{ return _sectors; };
+};
+
+#endif // _hpp_AcquisitionPlan
@@ -0,0 +1,521 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <cmath>
+
+// C++11 threads and timekeeping
+#include <thread>
+#include <chrono>
+
+// Local headers
+#include "Autotune.hpp"
+#include "PollScheduler.hpp"
+#include "DFE2.hpp"
+#include "Exceptions.hpp"
+
+using namespace std;
+
+/// Time allowed for the drive to spin down before measuring spin-up, in milliseconds
+static const unsigned long SPINDOWN_MS = 3000;
+/// Give up waiting for the disc to reach a stable speed after this long, in milliseconds
+static const unsigned long SPINUP_TIMEOUT_MS = 10000;
+/// Timeout for the drive to become ready, in milliseconds
+static const unsigned long READY_TIMEOUT_MS = 10000;
+/// Index periods within this fraction of each other are considered stable
+static const double PERIOD_TOLERANCE = 0.01;
+/// Number of consecutive stable index periods needed
+static const int STABLE_PERIODS = 3;
+
+/// Trials per candidate step rate or settle time
+static const int TRIALS = 3;
+/// Two flux intervals match if they differ by no more than this fraction
+static const double INTERVAL_TOLERANCE = 0.15;
+/// Number of intervals compared when lining up two revolutions
+static const long RESYNC_WINDOW = 32;
+/// Furthest two revolutions are shifted to line them up, in intervals
+static const long RESYNC_RANGE = 8;
+/// Line the revolutions up again after this many consecutive mismatches
+static const int RESYNC_MISSES = 3;
+/// Length of the start of a capture which is checked for settling, in microseconds
+static const unsigned long SCORE_WINDOW_US = 10000;
+/// Settle time used to measure the baseline match rate, in microseconds
+static const unsigned long BASELINE_SETTLE_US = 100000;
+/// Minimum baseline match rate -- anything less and there's probably no formatted disc
+static const double MIN_BASELINE = 0.8;
+/// A settle time passes if it matches this close to the baseline
+static const double SETTLE_TOLERANCE = 0.03;
+
+CAutotune::CAutotune(CDeviceBackend *_dev, CRegisterCache &_regs, CDriveScript *_drivescript,
+		const std::string _drivetype, CDriveInfo &_driveinfo, const CAcquisitionPlan &_plan,
+		const int _clksel, std::ostream &_out, const bool _verbose) :
+	dev(_dev), regs(_regs), drivescript(_drivescript), drivetype(_drivetype),
+	driveinfo(_driveinfo), plan(_plan), clksel(_clksel), out(_out), bVerbose(_verbose)
+{
+	steprate_us = 0;
+	headpos = -1;
+	period_us = 0;
+	baseline = 0;
+	vBuf.resize(512*1024);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Drive control helpers
+
+bool CAutotune::setStepRate(const unsigned long us)
+{
+	if (us == steprate_us) return true;
+
+	DISCFERRET_ERROR e = dev->seekSetRate(us);
+	if (e == DISCFERRET_E_BAD_PARAMETER) return false;
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting seek rate.");
+	steprate_us = us;
+	return true;
+}
+
+void CAutotune::select(const unsigned long track, const unsigned long head)
+{
+	DISCFERRET_ERROR e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(track, head, 1));
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting disc drive control outputs");
+}
+
+void CAutotune::waitReady(const unsigned long expect_us)
+{
+	CPollScheduler sched("drive ready", expect_us, READY_TIMEOUT_MS * 1000UL);
+	long stat;
+	do {
+		sched.wait();
+		stat = dev->getStatus();
+	} while ((stat >= 0) && (!drivescript->isDriveReady(drivetype, stat)));
+	if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+}
+
+void CAutotune::seekTo(const unsigned long track)
+{
+	if (headpos == (long)track) return;
+
+	unsigned long dist = (headpos < 0) ? driveinfo.tracks() : labs(headpos - (long)track);
+	if (dev->seekAbsolute(track) != DISCFERRET_E_OK) throw EApplicationError("Error seeking");
+	headpos = track;
+	waitReady(dist * steprate_us);
+}
+
+/**
+ * Step the heads in (positive) or out (negative) and wait for the seek to
+ * finish, allowing rate_us per step.
+ */
+void CAutotune::step(const long tracks, const unsigned long rate_us)
+{
+	if (dev->seekRelative(tracks) != DISCFERRET_E_OK) throw EApplicationError("Error seeking");
+	waitReady(labs(tracks) * rate_us);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Spin-up
+
+unsigned long CAutotune::measureSpinup(void)
+{
+	out << "Measuring spin-up time..." << endl;
+
+	// Let the disc spin down, then start it up again
+	DISCFERRET_ERROR e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, 0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error deselecting disc drive");
+	this_thread::sleep_for(chrono::milliseconds(SPINDOWN_MS));
+	select(0, 0);
+
+	// Time the index pulses until STABLE_PERIODS consecutive periods agree
+	chrono::steady_clock::time_point tStart = chrono::steady_clock::now();
+	vector<double> edges;
+	bool last = true;		// ignore an index pulse which is already in progress
+	while (true) {
+		long stat = dev->getStatus();
+		if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+		double t = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tStart).count();
+
+		bool idx = (stat & DISCFERRET_STATUS_INDEX) != 0;
+		if (idx && !last) {
+			edges.push_back(t);
+			if (edges.size() > STABLE_PERIODS) {
+				double pmin = 1e12, pmax = 0, psum = 0;
+				for (size_t i = edges.size() - STABLE_PERIODS; i < edges.size(); i++) {
+					double p = edges[i] - edges[i-1];
+					pmin = min(pmin, p);
+					pmax = max(pmax, p);
+					psum += p;
+				}
+				if ((pmax - pmin) <= (PERIOD_TOLERANCE * psum / STABLE_PERIODS)) {
+					// The disc was up to speed at the start of the first stable period
+					period_us = psum / STABLE_PERIODS;
+					double spinup_us = edges[edges.size() - STABLE_PERIODS - 1];
+					if (bVerbose) out << "  index period " << (unsigned long)period_us << "us, stable after " << (unsigned long)(spinup_us / 1000) << "ms" << endl;
+					return (unsigned long)(spinup_us * 1.2 / 1000) + 1;
+				}
+			}
+		}
+		last = idx;
+
+		if (t > (SPINUP_TIMEOUT_MS * 1000.0)) {
+			out << "WARNING: disc speed didn't settle within " << SPINUP_TIMEOUT_MS << "ms; keeping the drive script's spin-up time." << endl;
+			return driveinfo.spinup_ms();
+		}
+		this_thread::sleep_for(chrono::microseconds(500));
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Step rate
+
+/**
+ * Check whether the drive follows steps at a given rate.
+ *
+ * Steps in 'distance' tracks at the candidate rate, then counts the steps
+ * needed to get back to track zero at the drive script's (safe) rate. Then
+ * does the reverse: steps in at the safe rate, and out to track 1 at the
+ * candidate rate. A lost step in either direction shows up as a wrong count.
+ */
+bool CAutotune::stepTest(const unsigned long rate_us, const unsigned long distance)
+{
+	const unsigned long safe = driveinfo.steprate_us();
+	long stat;
+
+	// Start from track zero
+	setStepRate(safe);
+	if (dev->seekRecalibrate(driveinfo.tracks()) != DISCFERRET_E_OK) throw EApplicationError("Error recalibrating");
+	headpos = 0;
+	waitReady(0);
+
+	// In at the candidate rate, out one track at a time at the safe rate
+	if (!setStepRate(rate_us)) return false;
+	step(distance, rate_us);
+	setStepRate(safe);
+	unsigned long count = 0;
+	while (true) {
+		stat = dev->getStatus();
+		if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+		if ((stat & DISCFERRET_STATUS_TRACK0) || (count > distance)) break;
+		step(-1, safe);
+		count++;
+	}
+	headpos = -1;
+	if (count != distance) {
+		if (bVerbose) out << "  " << rate_us << "us: stepped in " << distance << ", took " << count << " steps back" << endl;
+		return false;
+	}
+
+	// In at the safe rate, out at the candidate rate. The heads should stop
+	// one track short of zero.
+	step(distance, safe);
+	setStepRate(rate_us);
+	step(-(long)(distance - 1), rate_us);
+	stat = dev->getStatus();
+	if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+	bool ok = !(stat & DISCFERRET_STATUS_TRACK0);
+	setStepRate(safe);
+	step(-1, safe);
+	stat = dev->getStatus();
+	if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+	ok = ok && (stat & DISCFERRET_STATUS_TRACK0);
+	headpos = ok ? 0 : -1;
+	if (!ok && bVerbose) out << "  " << rate_us << "us: lost steps stepping out" << endl;
+
+	return ok;
+}
+
+unsigned long CAutotune::tuneStepRate(void)
+{
+	// Candidates, in sixteenths of the drive script's step rate
+	static const unsigned long FRACTIONS[] = { 16, 12, 8, 6, 4, 3, 2 };
+
+	const unsigned long safe = driveinfo.steprate_us();
+	const unsigned long distance = (driveinfo.tracks() > 2) ? driveinfo.tracks() - 2 : 1;
+
+	out << "Tuning step rate (drive script says " << safe << "us)..." << endl;
+
+	unsigned long best = safe;
+	for (size_t i=0; i<(sizeof(FRACTIONS)/sizeof(FRACTIONS[0])); i++) {
+		unsigned long rate = safe * FRACTIONS[i] / 16;
+		if (rate == 0) break;
+
+		bool ok = true;
+		for (int t=0; ok && (t<TRIALS); t++) ok = stepTest(rate, distance);
+		if (bVerbose) out << "  " << rate << "us: " << (ok ? "ok" : "FAILED") << endl;
+		if (!ok) break;
+		best = rate;
+	}
+
+	// Leave the heads at track zero, at a known step rate
+	setStepRate(safe);
+	if (dev->seekRecalibrate(driveinfo.tracks()) != DISCFERRET_E_OK) throw EApplicationError("Error recalibrating");
+	headpos = 0;
+	waitReady(0);
+
+	// Allow some margin for wear and temperature
+	return min(safe, best + (best / 4));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Head settle
+
+/**
+ * Compare two intervals, allowing for jitter.
+ */
+static inline bool interval_match(const unsigned long a, const unsigned long b)
+{
+	unsigned long d = (a > b) ? (a - b) : (b - a);
+	return d <= (INTERVAL_TOLERANCE * max(a, b));
+}
+
+/**
+ * Find the offset which best lines up two stretches of flux intervals.
+ *
+ * Compares RESYNC_WINDOW intervals working backwards from iv[i] with the
+ * same number working backwards from iv[j + shift], for every shift up to
+ * RESYNC_RANGE either way, and returns the shift with the most matches.
+ */
+static long best_shift(const vector<unsigned long> &iv, const long i, const long j, const long jmin, const long jmax)
+{
+	long best = 0, bestn = -1;
+	for (long d = -RESYNC_RANGE; d <= RESYNC_RANGE; d++) {
+		if (((j + d) > jmax) || ((j + d) < jmin)) continue;
+		long n = 0;
+		for (long k = 0; (k < RESYNC_WINDOW) && ((i - k) >= 0) && ((j + d - k) >= jmin); k++) {
+			if (interval_match(iv[i - k], iv[j + d - k])) n++;
+		}
+		if ((n > bestn) || ((n == bestn) && (labs(d) < labs(best)))) {
+			best = d;
+			bestn = n;
+		}
+	}
+	return best;
+}
+
+/**
+ * Seek to a track, wait for a settle time, capture from then until the
+ * second index pulse and score how well the start of the capture matches the
+ * same part of the disc one revolution later.
+ *
+ * @return	Fraction of the flux intervals in the first SCORE_WINDOW_US of the
+ * 			capture which matched, or -1 if the capture couldn't be scored
+ * 			(e.g. it started too close to the index pulse).
+ */
+double CAutotune::settleTrial(const unsigned long track, const unsigned long settle_us)
+{
+	DISCFERRET_ERROR e;
+
+	// Approach from the previous track, as the acquisition loop does
+	seekTo((track > 0) ? track - 1 : track + 1);
+	this_thread::sleep_for(chrono::microseconds(BASELINE_SETTLE_US));
+	if (dev->seekAbsolute(track) != DISCFERRET_E_OK) throw EApplicationError("Error seeking");
+	headpos = track;
+	this_thread::sleep_for(chrono::microseconds(settle_us));
+
+	// Capture from now until the second index pulse
+	e = regs.poke(DISCFERRET_R_ACQ_START_EVT, DISCFERRET_ACQ_EVENT_ALWAYS);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event");
+	e = regs.poke(DISCFERRET_R_ACQ_START_NUM, 0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event count");
+	e = regs.poke(DISCFERRET_R_ACQ_STOP_EVT, DISCFERRET_ACQ_EVENT_INDEX);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event");
+	e = regs.poke(DISCFERRET_R_ACQ_STOP_NUM, 1);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event count");
+	e = regs.poke(DISCFERRET_R_ACQ_CLKSEL, clksel);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq clock rate");
+	e = dev->ramAddrSet(0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
+	e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_START);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error starting acquisition");
+
+	do { // scope limiter
+		CPollScheduler sched("acquisition to complete", (unsigned long)(2 * period_us), (unsigned long)(4 * period_us) + 1000000);
+		long i;
+		do {
+			sched.wait();
+			i = dev->getStatus();
+		} while ((i > 0) && ((i & DISCFERRET_STATUS_ACQSTATUS_MASK) != DISCFERRET_STATUS_ACQ_IDLE));
+		if (i < 0) throw EApplicationError("Error reading DiscFerret status register");
+	} while (false);
+
+	long nbytes = dev->ramAddrGet();
+	long stat = dev->getStatus();
+	if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+	if (stat & DISCFERRET_STATUS_RAM_FULL) nbytes = vBuf.size();
+	if ((nbytes < 1) || ((size_t)nbytes > vBuf.size())) throw EApplicationError("Invalid byte count!");
+	e = dev->ramAddrSet(0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address to zero");
+	e = dev->ramRead(&vBuf[0], nbytes);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error reading data from acquisition RAM");
+
+	vector<unsigned long> iv;
+	vector<size_t> marks, idx;
+	dfe2_decode(&vBuf[0], nbytes, iv, &marks);
+
+	// An index pulse can be marked more than once; keep the first mark of each
+	for (vector<size_t>::const_iterator it = marks.begin(); it != marks.end(); it++) {
+		if (idx.empty() || ((*it - idx.back()) > 64)) idx.push_back(*it);
+	}
+	if (idx.empty()) return -1;
+
+	// The capture stops at the second index pulse, which may or may not be
+	// marked at the end of the data
+	const size_t end = (idx.size() > 1) ? idx[1] : iv.size();
+
+	// Work out how many intervals fall in the scoring window
+	unsigned long clock_hz;
+	switch (clksel) {
+		case DISCFERRET_ACQ_RATE_25MHZ:		clock_hz = 25000000; break;
+		case DISCFERRET_ACQ_RATE_50MHZ:		clock_hz = 50000000; break;
+		default:							clock_hz = 100000000; break;
+	}
+	const unsigned long long window = (unsigned long long)SCORE_WINDOW_US * (clock_hz / 1000000);
+	size_t nscore = 0;
+	for (unsigned long long ticks = 0; (nscore < idx[0]) && (ticks < window); nscore++) ticks += iv[nscore];
+
+	// The capture has to start well clear of the index pulse
+	if (nscore >= idx[0]) return -1;
+
+	// Walk backwards from the first index pulse (partial revolution) and the
+	// second (full revolution) in step. The capture may not stop exactly on
+	// the index, and noise can add or drop transitions, so line the two up
+	// again whenever they stop matching.
+	const long jmin = idx[0], jmax = end - 1;
+	long i = idx[0] - 1, j = jmax;
+	j += best_shift(iv, i, j, jmin, jmax);
+	unsigned long matched = 0, scored = 0;
+	int misses = 0;
+	while ((i >= 0) && (j >= jmin)) {
+		bool m = interval_match(iv[i], iv[j]);
+		if (i < (long)nscore) {
+			scored++;
+			if (m) matched++;
+		}
+		i--; j--;
+		misses = m ? 0 : (misses + 1);
+		if ((misses >= RESYNC_MISSES) && (i >= 0) && (j >= jmin)) {
+			j += best_shift(iv, i, j, jmin, jmax);
+			misses = 0;
+		}
+	}
+
+	if (scored == 0) return -1;
+	return (double)matched / scored;
+}
+
+double CAutotune::settleScore(const unsigned long track, const unsigned long settle_us, const int trials)
+{
+	double total = 0;
+	int n = 0;
+
+	// Trials which can't be scored don't count, but don't try forever
+	for (int t=0; (n < trials) && (t < (trials * 3)); t++) {
+		double s = settleTrial(track, settle_us);
+		if (s < 0) continue;
+		total += s;
+		n++;
+	}
+	return (n > 0) ? (total / n) : -1;
+}
+
+unsigned long CAutotune::tuneSettle(void)
+{
+	// Candidate settle times, in milliseconds
+	static const unsigned long CANDIDATES[] = { 0, 1, 2, 3, 5, 8, 12, 18, 25, 35, 50 };
+
+	// Use an even track a quarter of the way in. Discs which were written in
+	// a lower density drive only have data on the even tracks.
+	const unsigned long track = (driveinfo.tracks() / 4) & ~1UL;
+
+	out << "Tuning head settle time..." << endl;
+	select(track, 0);
+
+	if (period_us <= 0) {
+		double freq = 0;
+		if ((dev->getIndexFrequency(false, &freq) != DISCFERRET_E_OK) || (freq <= 0))
+			throw EApplicationError("Unable to measure the disc rotation speed.");
+		period_us = 60.0e6 / freq;
+	}
+
+	// How well do captures match when the heads have had plenty of time to settle?
+	baseline = settleScore(track, BASELINE_SETTLE_US, TRIALS);
+	if (bVerbose) out << "  baseline match rate " << (baseline * 100.0) << "%" << endl;
+	if (baseline < MIN_BASELINE)
+		throw EApplicationError("Captures don't repeat from one revolution to the next. Is there a formatted disc in the drive?");
+
+	unsigned long best = BASELINE_SETTLE_US;
+	for (size_t i=0; i<(sizeof(CANDIDATES)/sizeof(CANDIDATES[0])); i++) {
+		double s = settleScore(track, CANDIDATES[i] * 1000, TRIALS);
+		if (bVerbose) out << "  " << CANDIDATES[i] << "ms: match rate " << (s * 100.0) << "%" << endl;
+		if (s >= (baseline - SETTLE_TOLERANCE)) {
+			best = CANDIDATES[i] * 1000;
+			break;
+		}
+	}
+
+	// Allow some margin, and at least a millisecond
+	return best + max(best / 4, 1000UL);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Verification
+
+bool CAutotune::verify(const CTimingProfile &profile)
+{
+	out << "Verifying: step rate " << profile.steprate_us << "us, settle " << (profile.settle_us / 1000)
+		<< "ms, spin-up " << profile.spinup_ms << "ms..." << endl;
+
+	// Full-stroke seeks at the tuned step rate
+	const unsigned long distance = (driveinfo.tracks() > 2) ? driveinfo.tracks() - 2 : 1;
+	if (!stepTest(profile.steprate_us, distance)) {
+		out << "  step rate failed" << endl;
+		return false;
+	}
+
+	// Spin up for the tuned time; the disc should then be at full speed
+	DISCFERRET_ERROR e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, 0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error deselecting disc drive");
+	this_thread::sleep_for(chrono::milliseconds(SPINDOWN_MS));
+	select(0, 0);
+	this_thread::sleep_for(chrono::milliseconds(profile.spinup_ms));
+	double freq = 0;
+	e = dev->getIndexFrequency(false, &freq);
+	if ((e != DISCFERRET_E_OK) || (freq <= 0) || (fabs((60.0e6 / freq) - period_us) > (2 * PERIOD_TOLERANCE * period_us))) {
+		out << "  spin-up failed" << endl;
+		return false;
+	}
+
+	// Captures spread across the disc, seeking at the tuned step rate
+	setStepRate(profile.steprate_us);
+	for (unsigned long k=1; k<=4; k++) {
+		unsigned long track = (driveinfo.tracks() * k / 5) & ~1UL;
+		select(track, 0);
+		double s = settleScore(track, profile.settle_us, 1);
+		if (bVerbose) out << "  track " << track << ": match rate " << (s * 100.0) << "%" << endl;
+		if (s < (baseline - SETTLE_TOLERANCE)) {
+			out << "  settle time failed on track " << track << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+CTimingProfile CAutotune::run(void)
+{
+	CTimingProfile profile;
+
+	profile.spinup_ms = measureSpinup();
+	profile.steprate_us = tuneStepRate();
+	setStepRate(profile.steprate_us);
+	profile.settle_us = tuneSettle();
+
+	// Relax the settings until they pass verification
+	for (int attempt=0; attempt<4; attempt++) {
+		if (verify(profile)) return profile;
+
+		profile.steprate_us = min(driveinfo.steprate_us(), profile.steprate_us + (profile.steprate_us / 2));
+		profile.settle_us = (profile.settle_us * 2) + 1000;
+		profile.spinup_ms = profile.spinup_ms + (profile.spinup_ms / 4);
+	}
+
+	throw EApplicationError("Unable to find drive timings which pass verification.");
+}
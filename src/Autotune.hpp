@@ -0,0 +1,124 @@
+#ifndef _hpp_Autotune
+#define _hpp_Autotune
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <ostream>
+
+// Local headers
+#include "DeviceBackend.hpp"
+#include "RegisterCache.hpp"
+#include "ScriptInterfaces.hpp"
+#include "AcquisitionPlan.hpp"
+#include "CDriveInfo.hpp"
+#include "TimingProfile.hpp"
+
+/**
+ * @brief	Drive timing autotuner.
+ *
+ * Measures the timing of the physical drive attached to the DiscFerret,
+ * instead of trusting the (usually very conservative) figures in its drive
+ * script:
+ *
+ *   - Spin-up: the drive is deselected long enough to spin down, then
+ *     reselected; spin-up is the time until the index period is stable.
+ *   - Step rate: successively faster rates are tried until the drive starts
+ *     losing steps. Lost steps are detected by stepping in at the candidate
+ *     rate and counting the (slow) steps needed to get back to track zero.
+ *   - Head settle: a capture is started straight after a seek and stopped
+ *     at the second index pulse, so the start of the capture can be compared
+ *     against the same part of the disc one revolution later. Once the
+ *     heads have settled, the two match as well as they do on a track which
+ *     has had all the time in the world to settle.
+ *
+ * The chosen values are then checked with verification captures spread
+ * across the disc, and relaxed if they fail. A formatted disc must be in the
+ * drive.
+ */
+class CAutotune {
+	private:
+		CDeviceBackend		*dev;
+		CRegisterCache		&regs;
+		CDriveScript		*drivescript;
+		std::string			drivetype;
+		CDriveInfo			&driveinfo;
+		const CAcquisitionPlan	&plan;
+		int					clksel;			///< Acquisition clock select value
+		std::ostream		&out;			///< Progress messages
+		bool				bVerbose;
+
+		unsigned long		steprate_us;	///< Step rate currently programmed
+		long				headpos;		///< Current physical track, or -1 if not known
+		double				period_us;		///< Index period once the disc is up to speed
+		double				baseline;		///< Capture match rate with the heads fully settled
+
+		/// Capture buffer
+		std::vector<unsigned char>	vBuf;
+
+		bool setStepRate(const unsigned long us);
+		void select(const unsigned long track, const unsigned long head);
+		void waitReady(const unsigned long expect_us);
+		void seekTo(const unsigned long track);
+		void step(const long tracks, const unsigned long rate_us);
+		bool stepTest(const unsigned long rate_us, const unsigned long distance);
+		double settleTrial(const unsigned long track, const unsigned long settle_us);
+		double settleScore(const unsigned long track, const unsigned long settle_us, const int trials);
+
+		// Non-copyable
+		CAutotune(const CAutotune &);
+		CAutotune &operator=(const CAutotune &);
+
+	public:
+		/**
+		 * @param	_dev			DiscFerret device
+		 * @param	_regs			Register cache for the device
+		 * @param	_drivescript	Drive script for this drive type
+		 * @param	_drivetype		Drive type string
+		 * @param	_driveinfo		Drive information, from CDriveScript::GetDriveInfo()
+		 * @param	_plan			Drive control outputs for the drive
+		 * @param	_clksel			Acquisition clock select (DISCFERRET_ACQ_RATE_*)
+		 * @param	_out			Stream for progress messages and warnings
+		 * @param	_verbose		Print the result of every trial
+		 */
+		CAutotune(CDeviceBackend *_dev, CRegisterCache &_regs, CDriveScript *_drivescript,
+				const std::string _drivetype, CDriveInfo &_driveinfo, const CAcquisitionPlan &_plan,
+				const int _clksel, std::ostream &_out, const bool _verbose = false);
+
+		/**
+		 * @brief	Measure the drive spin-up time.
+		 * @return	Spin-up time in milliseconds, including a safety margin
+		 */
+		unsigned long measureSpinup(void);
+
+		/**
+		 * @brief	Find the fastest step rate the drive can follow reliably.
+		 * @return	Step rate in microseconds, including a safety margin
+		 */
+		unsigned long tuneStepRate(void);
+
+		/**
+		 * @brief	Find the shortest head settle time which gives clean captures.
+		 *
+		 * Throws EApplicationError if no formatted disc is in the drive.
+		 *
+		 * @return	Settle time in microseconds, including a safety margin
+		 */
+		unsigned long tuneSettle(void);
+
+		/**
+		 * @brief	Check a timing profile with seeks and captures across the disc.
+		 * @return	true if the profile passed
+		 */
+		bool verify(const CTimingProfile &profile);
+
+		/**
+		 * @brief	Run the complete autotune sequence.
+		 *
+		 * Measures spin-up, step rate and settle time, verifies them and relaxes
+		 * them until verification passes.
+		 */
+		CTimingProfile run(void);
+};
+
+#endif // _hpp_Autotune
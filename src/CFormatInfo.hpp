@@ -0,0 +1,102 @@
+#ifndef _hpp_CFormatInfo
+#define _hpp_CFormatInfo
+
+#include <string>
+
+/**
+ * @brief	Format information class
+ *
+ * Used to store information about a disc format: which tracks and heads
+ * it uses, and how far apart its tracks are.
+ */
+class CFormatInfo {
+	private:
+		std::string		_format_type;		///< Format type string (immutable)
+		std::string		_friendly_name;		///< Friendly name (displayed to user)
+		unsigned long	_mintrack;			///< First track used by the format
+		unsigned long	_maxtrack;			///< Last track used by the format
+		unsigned long	_trackstep;			///< Physical tracks per format track (1=single step, 2=double step)
+		unsigned long	_minhead;			///< First head used by the format
+		unsigned long	_maxhead;			///< Last head used by the format
+		unsigned long	_sectors;			///< Number of hard sectors, or 0 if soft-sectored
+		float			_tpi;				///< Tracks per inch, or 0 if not specified
+		std::string		_encoding;			///< Data encoding ("fm" or "mfm"), or empty if not specified
+		unsigned long	_datarate;			///< Data rate in kbps, or 0 if not specified
+		unsigned long	_spt;				///< Sectors per track, or 0 if not specified
+	public:
+		const std::string format_type()			{ return _format_type;		};
+		void format_type(const std::string x)	{ _format_type = x;			};
+		const std::string friendly_name()		{ return _friendly_name;	};
+		void friendly_name(const std::string x)	{ _friendly_name = x;		};
+		const unsigned long mintrack()			{ return _mintrack;			};
+		void mintrack(const unsigned long x)	{ _mintrack = x;			};
+		const unsigned long maxtrack()			{ return _maxtrack;			};
+		void maxtrack(const unsigned long x)	{ _maxtrack = x;			};
+		const unsigned long trackstep()			{ return _trackstep;		};
+		void trackstep(const unsigned long x)	{ _trackstep = x;			};
+		const unsigned long minhead()			{ return _minhead;			};
+		void minhead(const unsigned long x)		{ _minhead = x;				};
+		const unsigned long maxhead()			{ return _maxhead;			};
+		void maxhead(const unsigned long x)		{ _maxhead = x;				};
+		const unsigned long sectors()			{ return _sectors;			};
+		void sectors(const unsigned long x)		{ _sectors = x;				};
+		const float tpi()						{ return _tpi;				};
+		void tpi(const float x)					{ _tpi = x;					};
+		const std::string encoding()			{ return _encoding;			};
+		void encoding(const std::string x)		{ _encoding = x;			};
+		const unsigned long datarate()			{ return _datarate;			};
+		void datarate(const unsigned long x)	{ _datarate = x;			};
+		const unsigned long spt()				{ return _spt;				};
+		void spt(const unsigned long x)			{ _spt = x;					};
+
+		/// No-args ctor for CFormatInfo
+		CFormatInfo() :
+			_mintrack(0), _maxtrack(0), _trackstep(1),
+			_minhead(0), _maxhead(0), _sectors(0),
+			_tpi(0), _datarate(0), _spt(0)
+		{
+		}
+
+		/**
+		 * ctor for CFormatInfo.
+		 *
+		 * @param	format_type		Format type string.
+		 * @param	friendly_name	Friendly name
+		 * @param	mintrack		First track
+		 * @param	maxtrack		Last track
+		 * @param	trackstep		Track stepping (1=single step, 2=double step)
+		 * @param	minhead			First head
+		 * @param	maxhead			Last head
+		 * @param	sectors			Number of hard sectors, or 0 if soft-sectored
+		 * @param	tpi				Number of tracks per inch, or 0 if not known
+		 * @param	encoding		Data encoding ("fm" or "mfm"), or "" if not known
+		 * @param	datarate		Data rate in kbps, or 0 if not known
+		 * @param	spt				Sectors per track, or 0 if not known
+		 */
+		CFormatInfo(
+				std::string format_type, std::string friendly_name,
+				unsigned long mintrack, unsigned long maxtrack,
+				unsigned long trackstep,
+				unsigned long minhead, unsigned long maxhead,
+				unsigned long sectors,
+				float tpi,
+				std::string encoding,
+				unsigned long datarate,
+				unsigned long spt)
+		{
+			_format_type	= format_type;
+			_friendly_name	= friendly_name;
+			_mintrack		= mintrack;
+			_maxtrack		= maxtrack;
+			_trackstep		= trackstep;
+			_minhead		= minhead;
+			_maxhead		= maxhead;
+			_sectors		= sectors;
+			_tpi			= tpi;
+			_encoding		= encoding;
+			_datarate		= datarate;
+			_spt			= spt;
+		}
+};
+
+#endif // _hpp_CFormatInfo
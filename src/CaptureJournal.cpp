@@ -0,0 +1,193 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+// Platform headers for fsync
+#ifdef _WIN32
+#  include <io.h>
+#  define fsync(fd)			_commit(fd)
+#  define fseeko(f, o, w)	_fseeki64(f, o, w)
+#else
+#  include <unistd.h>
+#endif
+
+// Local headers
+#include "Exceptions.hpp"
+#include "DFE2.hpp"
+#include "CaptureJournal.hpp"
+
+using namespace std;
+
+/// First line of a journal
+static const char *JOURNAL_HEADER = "# Magpie capture journal, version 1";
+
+CCaptureJournal::CCaptureJournal(const std::string _filename) :
+	filename(_filename), fp(NULL), bSync(false), bResumed(false)
+{
+}
+
+CCaptureJournal::~CCaptureJournal()
+{
+	if (fp != NULL) fclose(fp);
+}
+
+bool CCaptureJournal::load(void)
+{
+	ifstream f(filename.c_str(), ios::in | ios::binary);
+	if (!f.is_open()) return false;
+
+	// Read the whole journal, and drop anything after the last newline: it's
+	// a line which was being written when the capture stopped
+	stringstream buf;
+	buf << f.rdbuf();
+	string all = buf.str();
+	size_t nl = all.rfind('\n');
+	all.erase((nl == string::npos) ? 0 : (nl + 1));
+
+	stringstream ss(all);
+	string line;
+	if (!getline(ss, line) || (line != JOURNAL_HEADER))
+		throw EApplicationError("'" + filename + "' is not a Magpie capture journal");
+
+	mSettings.clear();
+	vRecords.clear();
+	while (getline(ss, line)) {
+		if (line.empty() || (line[0] == '#')) continue;
+		size_t sp = line.find(' ');
+		string key = line.substr(0, sp), value = (sp == string::npos) ? "" : line.substr(sp + 1);
+
+		if (key == "record") {
+			CJournalRecord r;
+			stringstream rs(value);
+			if (!(rs >> r.track >> r.head >> r.sector >> r.offset >> r.len >> r.clock_hz >> r.revs >> r.rpm_milli))
+				throw EApplicationError("Bad record in capture journal '" + filename + "': " + line);
+			vRecords.push_back(r);
+		} else if (vRecords.empty()) {
+			mSettings[key] = value;
+		} else {
+			throw EApplicationError("Setting after the records in capture journal '" + filename + "': " + line);
+		}
+	}
+
+	bResumed = true;
+	return true;
+}
+
+size_t CCaptureJournal::validate(const std::string outfile, const std::string magic)
+{
+	FILE *f = fopen(outfile.c_str(), "rb");
+	if (f == NULL) {
+		throw EApplicationError("Unable to open output file '" + outfile + "': " + strerror(errno));
+	}
+
+	// The file has to start with the right magic, or none of it is any use
+	char m[8];
+	if ((magic.length() > sizeof(m)) || (fread(m, 1, magic.length(), f) != magic.length()) || (memcmp(m, magic.c_str(), magic.length()) != 0)) {
+		fclose(f);
+		throw EApplicationError("'" + outfile + "' isn't the " + magic + " image in capture journal '" + filename + "'");
+	}
+
+	// Each record has to be where the journal says, with the right header,
+	// and all of its payload
+	size_t good = 0;
+	unsigned long long expect = magic.length() + DFE2_RECORD_HEADER_LEN;
+	for (vector<CJournalRecord>::const_iterator it = vRecords.begin(); it != vRecords.end(); it++) {
+		unsigned char x[DFE2_RECORD_HEADER_LEN];
+		if (it->offset != expect) break;
+		if (fseeko(f, it->offset - DFE2_RECORD_HEADER_LEN, SEEK_SET) != 0) break;
+		if (fread(x, 1, DFE2_RECORD_HEADER_LEN, f) != DFE2_RECORD_HEADER_LEN) break;
+		unsigned long track = (x[0] << 8) | x[1], head = (x[2] << 8) | x[3], sector = (x[4] << 8) | x[5];
+		unsigned long len = ((unsigned long)x[6] << 24) | ((unsigned long)x[7] << 16) | (x[8] << 8) | x[9];
+		if ((track != it->track) || (head != it->head) || (sector != it->sector) || (len != it->len)) break;
+
+		// Make sure the last byte of the payload made it to the file
+		if ((it->len > 0) && ((fseeko(f, it->offset + it->len - 1, SEEK_SET) != 0) || (fgetc(f) == EOF))) break;
+
+		good++;
+		expect = it->offset + it->len + DFE2_RECORD_HEADER_LEN;
+	}
+	fclose(f);
+
+	truncate(good);
+	return good;
+}
+
+void CCaptureJournal::truncate(const size_t n)
+{
+	if (n < vRecords.size()) vRecords.resize(n);
+}
+
+void CCaptureJournal::start(const bool sync)
+{
+	bSync = sync;
+	if (fp != NULL) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	const string tmpname = filename + ".tmp";
+	FILE *f = fopen(tmpname.c_str(), "w");
+	if (f == NULL) {
+		throw EApplicationError("Unable to create capture journal '" + tmpname + "': " + strerror(errno));
+	}
+	fprintf(f, "%s\n", JOURNAL_HEADER);
+	for (map<string, string>::const_iterator it = mSettings.begin(); it != mSettings.end(); it++)
+		fprintf(f, "%s %s\n", it->first.c_str(), it->second.c_str());
+	for (vector<CJournalRecord>::const_iterator it = vRecords.begin(); it != vRecords.end(); it++)
+		fprintf(f, "record %lu %lu %lu %llu %lu %lu %u %lu\n", it->track, it->head, it->sector,
+				it->offset, (unsigned long)it->len, it->clock_hz, it->revs, it->rpm_milli);
+	bool ok = (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+	ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+	// rename() won't replace an existing file on Windows
+	if (ok) ::remove(filename.c_str());
+#endif
+	if (!ok || (rename(tmpname.c_str(), filename.c_str()) != 0)) {
+		string err = strerror(errno);
+		::remove(tmpname.c_str());
+		throw EApplicationError("Unable to write capture journal '" + filename + "': " + err);
+	}
+
+	fp = fopen(filename.c_str(), "a");
+	if (fp == NULL) {
+		throw EApplicationError("Unable to open capture journal '" + filename + "': " + strerror(errno));
+	}
+}
+
+void CCaptureJournal::add(const CJournalRecord &rec)
+{
+	if (fp == NULL) return;
+	if ((fprintf(fp, "record %lu %lu %lu %llu %lu %lu %u %lu\n", rec.track, rec.head, rec.sector,
+				rec.offset, (unsigned long)rec.len, rec.clock_hz, rec.revs, rec.rpm_milli) < 0) ||
+			(fflush(fp) != 0) || (bSync && (fsync(fileno(fp)) != 0))) {
+		throw EApplicationError("Error writing to capture journal '" + filename + "': " + strerror(errno));
+	}
+	vRecords.push_back(rec);
+}
+
+void CCaptureJournal::remove(void)
+{
+	if (fp != NULL) {
+		fclose(fp);
+		fp = NULL;
+	}
+	::remove(filename.c_str());
+}
+
+std::string CCaptureJournal::get(const std::string name) const
+{
+	map<string, string>::const_iterator it = mSettings.find(name);
+	return (it == mSettings.end()) ? "" : it->second;
+}
+
+unsigned long long CCaptureJournal::dataEnd(const std::string magic) const
+{
+	if (vRecords.empty()) return magic.length();
+	return vRecords.back().offset + vRecords.back().len;
+}
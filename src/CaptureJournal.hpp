@@ -0,0 +1,133 @@
+#ifndef _hpp_CaptureJournal
+#define _hpp_CaptureJournal
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstddef>
+
+/**
+ * @brief	A track record which has been written to the output file.
+ */
+class CJournalRecord {
+	public:
+		unsigned long		track, head, sector;
+		unsigned long long	offset;		///< File offset of the record's payload
+		size_t				len;		///< Length of the payload, in bytes
+		unsigned long		clock_hz;	///< Acquisition clock rate
+		unsigned int		revs;		///< Number of revolutions captured
+		unsigned long		rpm_milli;	///< Rotation speed in thousandths of an RPM, or 0 if unknown
+
+		CJournalRecord() : track(0), head(0), sector(0), offset(0), len(0), clock_hz(0), revs(0), rpm_milli(0) { };
+};
+
+/**
+ * @brief	Journal of the tracks written so far, so an interrupted capture can
+ * 			be carried on with --resume.
+ *
+ * The journal is a text file next to the output file. It starts with the
+ * settings the capture was started with (drive, format, clock rate and so
+ * on), then has one line per track record, added once the record has been
+ * written. Lines are only ever appended, so after a crash the worst case is
+ * a partial last line, which is ignored.
+ *
+ * When a capture is resumed, the records in the journal are checked against
+ * the output file, and any which aren't there (or don't match) are dropped.
+ * The journal is then rewritten with just the good records, and the capture
+ * carries on after them.
+ */
+class CCaptureJournal {
+	private:
+		std::string			filename;
+		FILE				*fp;
+		bool				bSync;		///< fsync after every record
+		bool				bResumed;	///< Loaded from an existing journal
+		std::map<std::string, std::string>	mSettings;
+		std::vector<CJournalRecord>			vRecords;
+
+		// Non-copyable
+		CCaptureJournal(const CCaptureJournal &);
+		CCaptureJournal &operator=(const CCaptureJournal &);
+
+	public:
+		/**
+		 * @param	_filename	Journal filename (normally the output filename
+		 * 						with ".journal" on the end)
+		 */
+		CCaptureJournal(const std::string _filename);
+		~CCaptureJournal();
+
+		/**
+		 * @brief	Read an existing journal.
+		 *
+		 * Throws EApplicationError if the journal can't be read or isn't a
+		 * Magpie journal.
+		 *
+		 * @return	false if there is no journal
+		 */
+		bool load(void);
+
+		/**
+		 * @brief	Check the records against the output file, and drop any
+		 * 			which aren't there or don't match (and all the ones after
+		 * 			them).
+		 *
+		 * Throws EApplicationError if the output file can't be read, or
+		 * doesn't start with the magic.
+		 *
+		 * @param	outfile		Output filename
+		 * @param	magic		File magic the output file should start with
+		 * @return	Number of records which were good
+		 */
+		size_t validate(const std::string outfile, const std::string magic);
+
+		/// Drop all but the first 'n' records
+		void truncate(const size_t n);
+
+		/**
+		 * @brief	(Re)write the journal with the current settings and records,
+		 * 			and open it for adding records.
+		 *
+		 * The new journal is written under a temporary name and renamed into
+		 * place, so the old one is never lost.
+		 *
+		 * @param	sync	If true, flush the journal to stable storage after
+		 * 					each record is added
+		 */
+		void start(const bool sync);
+
+		/**
+		 * @brief	Add a record to the journal.
+		 *
+		 * Throws EApplicationError if the journal can't be written.
+		 */
+		void add(const CJournalRecord &rec);
+
+		/// Close the journal and delete it (the capture has finished)
+		void remove(void);
+
+		/// Set a capture setting (only before start())
+		void set(const std::string name, const std::string value)	{ mSettings[name] = value; };
+
+		/// Return a capture setting, or an empty string if it isn't set
+		std::string get(const std::string name) const;
+
+		/// Return true if the journal was loaded from an existing file
+		bool resumed(void) const		{ return bResumed; };
+
+		/// Return true if the journal has been started, and not removed
+		bool active(void) const			{ return (fp != NULL); };
+
+		/// Return the records in the journal
+		const std::vector<CJournalRecord> &records(void) const	{ return vRecords; };
+
+		/**
+		 * @brief	Return the length the output file should be: the end of the
+		 * 			last record, or just the magic if there are no records.
+		 */
+		unsigned long long dataEnd(const std::string magic) const;
+};
+
+#endif // _hpp_CaptureJournal
@@ -0,0 +1,80 @@
+// STL headers
+#include <string>
+#include <ostream>
+#include <map>
+
+// C++11 threading
+#include <mutex>
+
+// Local headers
+#include "ConsoleStream.hpp"
+
+using namespace std;
+
+/// Lock for each real stream, and how many line buffers are using it
+struct CTargetLock {
+	mutex			mtx;
+	unsigned long	users;
+};
+
+/// Locks for the real streams in use, by stream
+static map<const ostream *, CTargetLock *> mTargetLocks;
+
+/// Held while mTargetLocks is looked at or changed
+static mutex targetLocksMutex;
+
+CConsoleStream::CLineBuf::CLineBuf(std::ostream &_target, const std::string _prefix) :
+	target(_target), prefix(_prefix)
+{
+	lock_guard<mutex> lock(targetLocksMutex);
+	CTargetLock *&tl = mTargetLocks[&target];
+	if (tl == NULL) {
+		tl = new CTargetLock();
+		tl->users = 0;
+	}
+	tl->users++;
+	targetLock = &tl->mtx;
+}
+
+CConsoleStream::CLineBuf::~CLineBuf()
+{
+	lock_guard<mutex> lock(targetLocksMutex);
+	map<const ostream *, CTargetLock *>::iterator it = mTargetLocks.find(&target);
+	if ((it != mTargetLocks.end()) && (--it->second->users == 0)) {
+		delete it->second;
+		mTargetLocks.erase(it);
+	}
+}
+
+int CConsoleStream::CLineBuf::overflow(int c)
+{
+	if (c == traits_type::eof()) return traits_type::not_eof(c);
+	line += (char)c;
+	if (c == '\n') emit();
+	return c;
+}
+
+void CConsoleStream::CLineBuf::emit(void)
+{
+	if (line.empty()) return;
+	if (line[line.length() - 1] != '\n') line += '\n';
+
+	// Written in one go, so it can't be split up by another stream writing
+	// to the same terminal
+	string text = prefix + line;
+	line.clear();
+	lock_guard<mutex> lock(*targetLock);
+	target << text;
+	target.flush();
+}
+
+CConsoleStream::CConsoleStream(std::ostream &_target, const std::string _prefix) :
+	std::ostream(NULL), buf(_target, _prefix)
+{
+	rdbuf(&buf);
+}
+
+CConsoleStream::~CConsoleStream()
+{
+	buf.emit();
+}
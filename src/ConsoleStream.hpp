@@ -0,0 +1,63 @@
+#ifndef _hpp_ConsoleStream
+#define _hpp_ConsoleStream
+
+// C++ STL headers
+#include <string>
+#include <ostream>
+#include <streambuf>
+
+// C++11 threading
+#include <mutex>
+
+/**
+ * @brief	Console output for one of several threads.
+ *
+ * When several DiscFerrets are capturing at once, each one's messages go
+ * through its own CConsoleStream. Text is collected until the end of each
+ * line, then the whole line is written to the real stream (cout or cerr)
+ * with a prefix saying where it came from. The console streams writing to
+ * the same real stream share a lock, so lines from different threads never
+ * get mixed together; a real stream which is slow to take a line (such as a
+ * daemon client's socket) only holds up the threads writing to it.
+ *
+ * A CConsoleStream itself must only be written by one thread.
+ */
+class CConsoleStream : public std::ostream {
+	private:
+		/// Line buffer which hands complete lines to the real stream
+		class CLineBuf : public std::streambuf {
+			private:
+				std::ostream	&target;
+				std::mutex		*targetLock;	///< Held while a line is written to target
+				std::string		prefix;
+				std::string		line;		///< Text since the last newline
+
+			protected:
+				virtual int overflow(int c);
+
+			public:
+				CLineBuf(std::ostream &_target, const std::string _prefix);
+				~CLineBuf();
+
+				/// Write out the line so far, if there is one
+				void emit(void);
+		};
+
+		CLineBuf	buf;
+
+		// Non-copyable
+		CConsoleStream(const CConsoleStream &);
+		CConsoleStream &operator=(const CConsoleStream &);
+
+	public:
+		/**
+		 * @param	_target		Stream to write the lines to
+		 * @param	_prefix		Text to put at the start of each line
+		 */
+		CConsoleStream(std::ostream &_target, const std::string _prefix);
+
+		/// Writes out any unfinished line
+		~CConsoleStream();
+};
+
+#endif // _hpp_ConsoleStream
@@ -0,0 +1,118 @@
+// STL headers
+#include <vector>
+#include <algorithm>
+
+// Local headers
+#include "DFE2.hpp"
+
+using namespace std;
+
+void dfe2_put_transition(std::vector<unsigned char> &out, unsigned long count)
+{
+	while (count >= DFE2_CARRY) {
+		out.push_back(DFE2_CARRY);
+		count -= DFE2_CARRY;
+	}
+	out.push_back(count);
+}
+
+void dfe2_put_index(std::vector<unsigned char> &out, unsigned long count)
+{
+	while (count >= DFE2_CARRY) {
+		out.push_back(DFE2_CARRY);
+		count -= DFE2_CARRY;
+	}
+	out.push_back(DFE2_INDEX_FLAG | count);
+}
+
+void dfe2_decode(const unsigned char *data, const size_t len, std::vector<unsigned long> &intervals, std::vector<size_t> *index)
+{
+	unsigned long count = 0;
+
+	for (size_t i=0; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			count += DFE2_CARRY;
+		} else if (b & DFE2_INDEX_FLAG) {
+			count += (b & DFE2_COUNT_MASK);
+			if (index != NULL) index->push_back(intervals.size());
+		} else {
+			intervals.push_back(count + b);
+			count = 0;
+		}
+	}
+}
+
+unsigned long long dfe2_revolution_ticks(const unsigned char *data, const size_t len)
+{
+	// Consecutive index markers belong to the same pulse
+	unsigned long long t = 0, tIndex = 0;
+	bool seen = false, inpulse = false;
+	for (size_t i=0; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			t += DFE2_CARRY;
+		} else if (b & DFE2_INDEX_FLAG) {
+			t += (b & DFE2_COUNT_MASK);
+			if (!seen) {
+				seen = inpulse = true;
+				tIndex = t;
+			} else if (!inpulse) {
+				return t - tIndex;
+			}
+		} else {
+			t += b;
+			inpulse = false;
+		}
+	}
+	return 0;
+}
+
+size_t dfe2_rotate_to_index(unsigned char *data, const size_t len, unsigned long long rev_ticks, const unsigned int revs)
+{
+	// Find the first index pulse
+	unsigned long long t = 0;
+	size_t first = len;
+	for (size_t i=0; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			t += DFE2_CARRY;
+		} else if (b & DFE2_INDEX_FLAG) {
+			t += (b & DFE2_COUNT_MASK);
+			first = i;
+			break;
+		} else {
+			t += b;
+		}
+	}
+	if (first == len) return 0;
+
+	// If the next index pulse was captured too, time the revolution from the
+	// data instead of trusting the caller's estimate
+	unsigned long long measured = dfe2_revolution_ticks(data, len);
+	if (measured > 0) rev_ticks = measured;
+
+	// Find the end of the last whole revolution, on a transition
+	const unsigned long long target = rev_ticks * revs;
+	size_t end = 0;
+	t = 0;
+	for (size_t i=0; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			t += DFE2_CARRY;
+		} else if (b & DFE2_INDEX_FLAG) {
+			t += (b & DFE2_COUNT_MASK);
+		} else {
+			t += b;
+			if (t >= target) {
+				end = i + 1;
+				break;
+			}
+		}
+	}
+	if ((end == 0) || (end <= first)) return 0;
+
+	// Move the part of the revolution before the index to the end
+	rotate(data, data + first, data + end);
+	return end;
+}
@@ -0,0 +1,129 @@
+#ifndef _hpp_DFE2
+#define _hpp_DFE2
+
+// C++ STL headers
+#include <vector>
+#include <cstddef>
+
+/**
+ * @file
+ * DiscFerret DFE2 timing data format.
+ *
+ * A DFE2 image starts with the magic string "DFE2", followed by one record
+ * per track. Each record is a 10-byte header -- track, head and sector (16
+ * bits each) and the data length (32 bits), all big-endian -- followed by
+ * the acquisition data.
+ *
+ * The acquisition data is a stream of bytes, one per event:
+ *   - 0x7F (bits 6..0 all set): counter overflow. Add 127 to the running
+ *     count; no flux transition.
+ *   - bit 7 set: index pulse. Add bits 6..0 to the running count; no flux
+ *     transition.
+ *   - anything else: flux transition. The interval since the previous
+ *     transition is the running count plus bits 6..0.
+ *
+ * Counts are in acquisition clock cycles (25, 50 or 100MHz).
+ *
+ * An indexed image ends with a track directory, so a reader can go straight
+ * to any track without parsing the records before it. The directory is
+ * stored as one more record, with track, head and sector all 0xFFFF, so
+ * anything which reads the records in order can skip over it. Its payload
+ * (all big-endian) is:
+ *   - a 12-byte header: DFE2_INDEX_MAGIC, version (16 bits), entry length
+ *     (16 bits) and the number of entries (32 bits);
+ *   - one entry per track record, in file order: track, head, sector and
+ *     flags (16 bits each), the file offset of the acquisition data (64
+ *     bits), its length (32 bits), the acquisition clock rate in Hz (32
+ *     bits), the number of revolutions captured (16 bits), 16 reserved bits
+ *     and the measured rotation speed in thousandths of an RPM (32 bits,
+ *     zero if unknown);
+ *   - a 16-byte trailer: the file offset of the directory record header
+ *     (64 bits), the length of the directory payload (32 bits) and
+ *     DFE2_INDEX_MAGIC again.
+ * Readers should ignore entries whose version they don't understand, and
+ * any bytes past the ones they know about at the end of each entry.
+ */
+
+/// File magic for a DFE2 image
+#define DFE2_MAGIC				"DFE2"
+/// Length of the track record header, in bytes
+#define DFE2_RECORD_HEADER_LEN	10
+
+/// Magic string at the start and end of the track directory
+#define DFE2_INDEX_MAGIC		"DIDX"
+/// Track directory version written by this version of Magpie
+#define DFE2_INDEX_VERSION		1
+/// Track/head/sector number of the record which holds the track directory
+#define DFE2_INDEX_RECORD_ID	0xFFFF
+/// Length of the track directory header, in bytes
+#define DFE2_INDEX_HEADER_LEN	12
+/// Length of a track directory entry, in bytes
+#define DFE2_INDEX_ENTRY_LEN	32
+/// Length of the track directory trailer, in bytes
+#define DFE2_INDEX_TRAILER_LEN	16
+
+/// Index pulse flag
+const unsigned char DFE2_INDEX_FLAG = 0x80;
+/// Timing count bits
+const unsigned char DFE2_COUNT_MASK = 0x7F;
+/// Counter overflow (carry) value
+const unsigned char DFE2_CARRY = 0x7F;
+
+/**
+ * @brief	Append a flux transition to a DFE2 stream.
+ *
+ * @param	out		Stream to append to
+ * @param	count	Interval since the last transition, in clock cycles
+ */
+void dfe2_put_transition(std::vector<unsigned char> &out, unsigned long count);
+
+/**
+ * @brief	Append an index marker to a DFE2 stream.
+ *
+ * @param	out		Stream to append to
+ * @param	count	Interval since the last transition, in clock cycles. Any part of
+ * 					this which doesn't fit in the marker byte is stored as carries.
+ */
+void dfe2_put_index(std::vector<unsigned char> &out, unsigned long count);
+
+/**
+ * @brief	Decode a DFE2 stream into flux transition intervals.
+ *
+ * @param	data		DFE2 acquisition data
+ * @param	len			Length of data, in bytes
+ * @param	intervals	Receives the interval before each flux transition, in clock cycles
+ * @param	index		If not NULL, receives the position of each index pulse, as
+ * 						the number of transitions which came before it
+ */
+void dfe2_decode(const unsigned char *data, const size_t len, std::vector<unsigned long> &intervals, std::vector<size_t> *index = NULL);
+
+/**
+ * @brief	Measure the time between the first two index pulses in a capture.
+ *
+ * @param	data		DFE2 acquisition data
+ * @param	len			Length of data, in bytes
+ * @return	Length of the revolution in clock cycles, or 0 if the capture
+ * 			doesn't contain two index pulses
+ */
+unsigned long long dfe2_revolution_ticks(const unsigned char *data, const size_t len);
+
+/**
+ * @brief	Turn a capture which started at an arbitrary point on the track into
+ * 			one which starts at the index pulse.
+ *
+ * The capture must cover at least 'revs' revolutions. The data before the
+ * first index pulse is moved to the end, where it completes the last
+ * revolution, and anything after that is dropped. There's one bad interval
+ * where the end of the capture is joined to the start.
+ *
+ * @param	data		DFE2 acquisition data; rotated in place
+ * @param	len			Length of data, in bytes
+ * @param	rev_ticks	Estimated length of a revolution, in clock cycles. Used
+ * 						only if the capture doesn't contain two index pulses.
+ * @param	revs		Number of revolutions to keep
+ * @return	New length of the data, or 0 if the capture has no index pulse or
+ * 			is too short
+ */
+size_t dfe2_rotate_to_index(unsigned char *data, const size_t len, unsigned long long rev_ticks, const unsigned int revs);
+
+#endif // _hpp_DFE2
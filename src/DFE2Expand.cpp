@@ -0,0 +1,281 @@
+// C++ headers
+#include <cstddef>
+
+// Local headers
+#include "DFE2Expand.hpp"
+#include "DFE2.hpp"
+
+// The SIMD implementations are compiled with per-function target attributes,
+// so the rest of the program doesn't need building for a newer CPU than it
+// runs on; which one to use is decided at run time.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#  define DFE2_EXPAND_X86
+#  include <immintrin.h>
+#endif
+
+/**
+ * Byte-at-a-time expansion of data[i] to data[len-1].
+ *
+ * This is the reference implementation, and also finishes off the bytes
+ * left over at the end by the SIMD implementations. nout, nidx and count
+ * (the count since the last transition) carry the state over.
+ */
+static inline void expand_bytes(const unsigned char *data, size_t i, const size_t len, unsigned int *intervals,
+		size_t &nout, size_t *index, const size_t maxindex, size_t &nidx, unsigned int &count)
+{
+	for (; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			count += DFE2_CARRY;
+		} else if (b & DFE2_INDEX_FLAG) {
+			count += (b & DFE2_COUNT_MASK);
+			if ((index != NULL) && (nidx < maxindex)) index[nidx] = nout;
+			nidx++;
+		} else {
+			intervals[nout++] = count + b;
+			count = 0;
+		}
+	}
+}
+
+static size_t expand_scalar(const unsigned char *data, const size_t len, unsigned int *intervals,
+		size_t *index, const size_t maxindex, size_t &nindex)
+{
+	size_t nout = 0, nidx = 0;
+	unsigned int count = 0;
+
+	expand_bytes(data, 0, len, intervals, nout, index, maxindex, nidx, count);
+	nindex = nidx;
+	return nout;
+}
+
+#ifdef DFE2_EXPAND_X86
+
+/*
+ * The SIMD implementations work on a block of bytes at a time. Every byte
+ * adds its low 7 bits to the running count (a carry byte is 0x7F, so that
+ * includes carries), and each transition takes the count since the previous
+ * transition. So a block is handled by working out which bytes are
+ * transitions and index markers, and the running sum of the counts across
+ * the block; each interval is then the difference between the running sums
+ * at two consecutive transitions.
+ *
+ * Blocks which are all transitions (common at low clock rates) are simpler:
+ * each byte is an interval, apart from the first, which also takes whatever
+ * was left over from the previous block.
+ */
+
+/// Count the set bits below bit 'n'
+static inline unsigned int bits_below(const unsigned int mask, const int n)
+{
+	return __builtin_popcount(mask & ((1U << n) - 1));
+}
+
+/**
+ * Turn the block masks and running sums into intervals and index positions.
+ *
+ * @param	tmask	Transition bytes in the block
+ * @param	imask	Index marker bytes in the block
+ * @param	sums	Running sum of the counts at each byte of the block
+ * @param	n		Block size
+ * @param	acc		Count carried in from the previous block; updated
+ */
+static inline void expand_block(unsigned int tmask, unsigned int imask, const unsigned short *sums, const int n,
+		unsigned int *intervals, size_t &nout, size_t *index, const size_t maxindex, size_t &nidx, unsigned int &acc)
+{
+	// Index markers, numbered by the transitions before them
+	while (imask != 0) {
+		int b = __builtin_ctz(imask);
+		imask &= imask - 1;
+		if ((index != NULL) && (nidx < maxindex)) index[nidx] = nout + bits_below(tmask, b);
+		nidx++;
+	}
+
+	// Transitions. 'prev' is the running sum at the previous transition, which
+	// for the first one in the block is minus the carried-in count.
+	unsigned int prev = -acc;
+	while (tmask != 0) {
+		int b = __builtin_ctz(tmask);
+		tmask &= tmask - 1;
+		intervals[nout++] = sums[b] - prev;
+		prev = sums[b];
+	}
+	acc = sums[n - 1] - prev;
+}
+
+/**
+ * SSE2 implementation: 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static size_t expand_sse2(const unsigned char *data, const size_t len, unsigned int *intervals,
+		size_t *index, const size_t maxindex, size_t &nindex)
+{
+	size_t nout = 0, nidx = 0, i = 0;
+	unsigned int acc = 0;
+	unsigned short sums[16] __attribute__((aligned(16)));
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(-1);
+	const __m128i k7f = _mm_set1_epi8(DFE2_CARRY);
+
+	for (; (i + 16) <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+
+		// Transitions are 0x00 to 0x7E: not negative, and less than 0x7F
+		unsigned int tmask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, ones), _mm_cmplt_epi8(v, k7f)));
+		unsigned int imask = _mm_movemask_epi8(v);
+
+		if (tmask == 0xFFFF) {
+			// All transitions: zero-extend the bytes to 32 bits
+			__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_si128((__m128i *)(intervals + nout +  0), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(intervals + nout +  4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(intervals + nout +  8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i *)(intervals + nout + 12), _mm_unpackhi_epi16(hi, zero));
+			intervals[nout] += acc;
+			nout += 16;
+			acc = 0;
+			continue;
+		}
+
+		// Running sum of the counts, in 16 bits (at most 16 * 127)
+		__m128i c = _mm_and_si128(v, k7f);
+		__m128i lo = _mm_unpacklo_epi8(c, zero), hi = _mm_unpackhi_epi8(c, zero);
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+		hi = _mm_add_epi16(hi, _mm_set1_epi16(_mm_extract_epi16(lo, 7)));
+		_mm_store_si128((__m128i *)(sums + 0), lo);
+		_mm_store_si128((__m128i *)(sums + 8), hi);
+
+		expand_block(tmask, imask, sums, 16, intervals, nout, index, maxindex, nidx, acc);
+	}
+
+	// Finish off the last few bytes one at a time
+	expand_bytes(data, i, len, intervals, nout, index, maxindex, nidx, acc);
+	nindex = nidx;
+	return nout;
+}
+
+/**
+ * AVX2 implementation: 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t expand_avx2(const unsigned char *data, const size_t len, unsigned int *intervals,
+		size_t *index, const size_t maxindex, size_t &nindex)
+{
+	size_t nout = 0, nidx = 0, i = 0;
+	unsigned int acc = 0;
+	unsigned short sums[32] __attribute__((aligned(32)));
+
+	const __m256i ones = _mm256_set1_epi8(-1);
+	const __m256i k7f = _mm256_set1_epi8(DFE2_CARRY);
+	// Shuffle which copies 16-bit element 7 of the low lane across the high lane
+	const __m256i bcast7 = _mm256_setr_epi8(
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15);
+
+	for (; (i + 32) <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+
+		// Transitions are 0x00 to 0x7E: not negative, and less than 0x7F
+		unsigned int tmask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(v, ones), _mm256_cmpgt_epi8(k7f, v)));
+		unsigned int imask = _mm256_movemask_epi8(v);
+
+		if (tmask == 0xFFFFFFFF) {
+			// All transitions: zero-extend the bytes to 32 bits
+			for (int k=0; k<4; k++)
+				_mm256_storeu_si256((__m256i *)(intervals + nout + (k * 8)),
+						_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(data + i + (k * 8)))));
+			intervals[nout] += acc;
+			nout += 32;
+			acc = 0;
+			continue;
+		}
+
+		// Running sum of the counts, in 16 bits (at most 32 * 127). The shifts
+		// only work within each 128-bit lane, so the low lane's total has to be
+		// added to the high lane afterwards, and the first half's total to the
+		// second half.
+		__m256i c = _mm256_and_si256(v, k7f);
+		__m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c));
+		__m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1));
+		lo = _mm256_add_epi16(lo, _mm256_slli_si256(lo, 2));
+		hi = _mm256_add_epi16(hi, _mm256_slli_si256(hi, 2));
+		lo = _mm256_add_epi16(lo, _mm256_slli_si256(lo, 4));
+		hi = _mm256_add_epi16(hi, _mm256_slli_si256(hi, 4));
+		lo = _mm256_add_epi16(lo, _mm256_slli_si256(lo, 8));
+		hi = _mm256_add_epi16(hi, _mm256_slli_si256(hi, 8));
+		lo = _mm256_add_epi16(lo, _mm256_shuffle_epi8(_mm256_permute2x128_si256(lo, lo, 0x00), bcast7));
+		hi = _mm256_add_epi16(hi, _mm256_shuffle_epi8(_mm256_permute2x128_si256(hi, hi, 0x00), bcast7));
+		hi = _mm256_add_epi16(hi, _mm256_set1_epi16(_mm256_extract_epi16(lo, 15)));
+		_mm256_store_si256((__m256i *)(sums + 0), lo);
+		_mm256_store_si256((__m256i *)(sums + 16), hi);
+
+		expand_block(tmask, imask, sums, 32, intervals, nout, index, maxindex, nidx, acc);
+	}
+
+	// Finish off the last few bytes one at a time
+	expand_bytes(data, i, len, intervals, nout, index, maxindex, nidx, acc);
+	nindex = nidx;
+	return nout;
+}
+
+#endif // DFE2_EXPAND_X86
+
+bool dfe2_expand_supported(const DFE2ExpandPath path)
+{
+	switch (path) {
+		case DFE2_EXPAND_AUTO:
+		case DFE2_EXPAND_SCALAR:
+			return true;
+#ifdef DFE2_EXPAND_X86
+		case DFE2_EXPAND_SSE2:
+			return __builtin_cpu_supports("sse2");
+		case DFE2_EXPAND_AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+		default:
+			return false;
+	}
+}
+
+/// Work out which implementation to use
+static DFE2ExpandPath choose(const DFE2ExpandPath path)
+{
+	if (path == DFE2_EXPAND_AUTO) {
+		static const DFE2ExpandPath best =
+			dfe2_expand_supported(DFE2_EXPAND_AVX2) ? DFE2_EXPAND_AVX2 :
+			dfe2_expand_supported(DFE2_EXPAND_SSE2) ? DFE2_EXPAND_SSE2 :
+			DFE2_EXPAND_SCALAR;
+		return best;
+	}
+	return dfe2_expand_supported(path) ? path : DFE2_EXPAND_SCALAR;
+}
+
+const char *dfe2_expand_name(const DFE2ExpandPath path)
+{
+	switch (choose(path)) {
+		case DFE2_EXPAND_SSE2:	return "sse2";
+		case DFE2_EXPAND_AVX2:	return "avx2";
+		default:				return "scalar";
+	}
+}
+
+size_t dfe2_expand(const unsigned char *data, const size_t len, unsigned int *intervals,
+		size_t *index, const size_t maxindex, size_t &nindex, const DFE2ExpandPath path)
+{
+	switch (choose(path)) {
+#ifdef DFE2_EXPAND_X86
+		case DFE2_EXPAND_SSE2:
+			return expand_sse2(data, len, intervals, index, maxindex, nindex);
+		case DFE2_EXPAND_AVX2:
+			return expand_avx2(data, len, intervals, index, maxindex, nindex);
+#endif
+		default:
+			return expand_scalar(data, len, intervals, index, maxindex, nindex);
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef _hpp_DFE2Expand
+#define _hpp_DFE2Expand
+
+// C++ STL headers
+#include <cstddef>
+
+/**
+ * @file
+ * Bulk expansion of DFE2 acquisition data into flux interval arrays.
+ *
+ * This does the same job as dfe2_decode(), but writes into buffers owned by
+ * the caller, so nothing is allocated per track, and uses SSE2 or AVX2 when
+ * the CPU has them. Every implementation gives exactly the same output as
+ * the scalar one.
+ */
+
+/// DFE2 expander implementations
+enum DFE2ExpandPath {
+	DFE2_EXPAND_AUTO,		///< The fastest one this CPU supports
+	DFE2_EXPAND_SCALAR,		///< Byte at a time (reference)
+	DFE2_EXPAND_SSE2,		///< 16 bytes at a time
+	DFE2_EXPAND_AVX2		///< 32 bytes at a time
+};
+
+/**
+ * @brief	Check whether an expander implementation can be used on this CPU.
+ */
+bool dfe2_expand_supported(const DFE2ExpandPath path);
+
+/**
+ * @brief	Return the name of an expander implementation (e.g. "sse2").
+ *
+ * For DFE2_EXPAND_AUTO, this is the name of the implementation it chooses.
+ */
+const char *dfe2_expand_name(const DFE2ExpandPath path);
+
+/**
+ * @brief	Expand DFE2 acquisition data into flux transition intervals.
+ *
+ * Any time after the last flux transition is dropped, as it is by
+ * dfe2_decode().
+ *
+ * @param	data		DFE2 acquisition data
+ * @param	len			Length of data, in bytes
+ * @param	intervals	Receives the interval before each flux transition, in
+ * 						clock cycles. Must have room for 'len' entries.
+ * @param	index		Receives the position of each index pulse, as the number
+ * 						of transitions which came before it. May be NULL.
+ * @param	maxindex	Number of entries there is room for in 'index'. Any
+ * 						index pulses after that are counted but not stored.
+ * @param	nindex		Receives the number of index pulses
+ * @param	path		Implementation to use. If it isn't supported, the scalar
+ * 						one is used instead.
+ * @return	Number of flux transitions
+ */
+size_t dfe2_expand(const unsigned char *data, const size_t len, unsigned int *intervals,
+		size_t *index, const size_t maxindex, size_t &nindex, const DFE2ExpandPath path = DFE2_EXPAND_AUTO);
+
+#endif // _hpp_DFE2Expand
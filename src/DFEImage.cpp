@@ -0,0 +1,206 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+
+// Platform headers for memory mapping
+#ifndef _WIN32
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+// Local headers
+#include "Exceptions.hpp"
+#include "DFE2.hpp"
+#include "DFEZ.hpp"
+#include "DFEImage.hpp"
+
+using namespace std;
+
+/// Read a big-endian value of 'n' bytes
+static unsigned long long get_be(const unsigned char *p, const int n)
+{
+	unsigned long long v = 0;
+	for (int i=0; i<n; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+CDFEImage::CDFEImage(const std::string _filename) :
+	filename(_filename), base(NULL), size(0), bIndexed(false)
+{
+#ifdef _WIN32
+	// No mmap; read the whole file instead
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) {
+		throw EApplicationError("Unable to open image '" + filename + "': " + strerror(errno));
+	}
+	unsigned char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) vFile.insert(vFile.end(), buf, buf + n);
+	bool bad = (ferror(fp) != 0);
+	fclose(fp);
+	if (bad) throw EApplicationError("Error reading image '" + filename + "'");
+	size = vFile.size();
+	base = vFile.empty() ? NULL : &vFile[0];
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw EApplicationError("Unable to open image '" + filename + "': " + strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		string err = strerror(errno);
+		::close(fd);
+		throw EApplicationError("Unable to read image '" + filename + "': " + err);
+	}
+	size = st.st_size;
+	if (size > 0) {
+		void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			string err = strerror(errno);
+			::close(fd);
+			throw EApplicationError("Unable to map image '" + filename + "': " + err);
+		}
+		base = (const unsigned char *)p;
+	}
+	// The mapping stays valid after the file is closed
+	::close(fd);
+#endif
+
+	try {
+		if (size < 4) throw EApplicationError("'" + filename + "' is not a DFE2 image");
+		sMagic.assign((const char *)base, 4);
+		if ((sMagic != DFE2_MAGIC) && (sMagic != DFEZ_MAGIC) && (sMagic != "DFER"))
+			throw EApplicationError("'" + filename + "' is not a DFE2 image");
+
+		bIndexed = readDirectory();
+		if (!bIndexed) scanRecords();
+	} catch (EApplicationError &) {
+		unmap();
+		throw;
+	}
+
+	for (size_t i=0; i<vTracks.size(); i++)
+		mLookup[make_pair(vTracks[i].track, vTracks[i].head)] = i;
+}
+
+CDFEImage::~CDFEImage()
+{
+	unmap();
+}
+
+void CDFEImage::unmap(void)
+{
+#ifndef _WIN32
+	if (base != NULL) munmap((void *)base, size);
+#endif
+	base = NULL;
+}
+
+bool CDFEImage::readDirectory(void)
+{
+	// The trailer tells us where the directory record is. Anything which
+	// doesn't add up means there's no directory, not that the image is bad:
+	// it could be an unindexed image that happens to end in "DIDX".
+	if (size < (4 + DFE2_RECORD_HEADER_LEN + DFE2_INDEX_HEADER_LEN + DFE2_INDEX_TRAILER_LEN)) return false;
+	const unsigned char *trailer = base + size - DFE2_INDEX_TRAILER_LEN;
+	if (memcmp(trailer + 12, DFE2_INDEX_MAGIC, 4) != 0) return false;
+
+	unsigned long long offset = get_be(trailer, 8);
+	unsigned long long payload = get_be(trailer + 8, 4);
+	if ((offset < 4) || (offset > size) || ((offset + DFE2_RECORD_HEADER_LEN + payload) != size)) return false;
+
+	const unsigned char *rec = base + offset;
+	if ((get_be(rec, 2) != DFE2_INDEX_RECORD_ID) || (get_be(rec + 2, 2) != DFE2_INDEX_RECORD_ID) ||
+			(get_be(rec + 4, 2) != DFE2_INDEX_RECORD_ID) || (get_be(rec + 6, 4) != payload))
+		return false;
+
+	const unsigned char *hdr = rec + DFE2_RECORD_HEADER_LEN;
+	if (memcmp(hdr, DFE2_INDEX_MAGIC, 4) != 0) return false;
+	if (get_be(hdr + 4, 2) != DFE2_INDEX_VERSION) return false;
+	size_t entlen = get_be(hdr + 6, 2);
+	unsigned long long count = get_be(hdr + 8, 4);
+	if ((entlen < DFE2_INDEX_ENTRY_LEN) ||
+			((DFE2_INDEX_HEADER_LEN + (count * entlen) + DFE2_INDEX_TRAILER_LEN) != payload))
+		return false;
+
+	// The directory is there, so from here on anything wrong with it is an error
+	vTracks.resize(count);
+	const unsigned char *p = hdr + DFE2_INDEX_HEADER_LEN;
+	for (size_t i=0; i<count; i++, p += entlen) {
+		CDFETrack &t = vTracks[i];
+		t.track = get_be(p, 2);
+		t.head = get_be(p + 2, 2);
+		t.sector = get_be(p + 4, 2);
+		unsigned long long dataofs = get_be(p + 8, 8);
+		t.len = get_be(p + 16, 4);
+		t.clock_hz = get_be(p + 20, 4);
+		t.revs = get_be(p + 24, 2);
+		t.rpm = get_be(p + 28, 4) / 1000.0;
+		if ((dataofs < (4 + DFE2_RECORD_HEADER_LEN)) || (dataofs > offset) || (t.len > (offset - dataofs)))
+			throw EApplicationError("Track directory in '" + filename + "' is corrupt");
+		t.data = base + dataofs;
+	}
+
+	return true;
+}
+
+void CDFEImage::scanRecords(void)
+{
+	size_t pos = 4;
+	while (pos < size) {
+		if ((size - pos) < DFE2_RECORD_HEADER_LEN)
+			throw EApplicationError("'" + filename + "' is truncated");
+		const unsigned char *p = base + pos;
+		CDFETrack t;
+		t.track = get_be(p, 2);
+		t.head = get_be(p + 2, 2);
+		t.sector = get_be(p + 4, 2);
+		t.len = get_be(p + 6, 4);
+		pos += DFE2_RECORD_HEADER_LEN;
+		if ((size - pos) < t.len)
+			throw EApplicationError("'" + filename + "' is truncated");
+		t.data = base + pos;
+		pos += t.len;
+
+		// A directory we couldn't use (e.g. a newer version) isn't a track
+		if ((t.track == DFE2_INDEX_RECORD_ID) && (t.head == DFE2_INDEX_RECORD_ID) && (t.sector == DFE2_INDEX_RECORD_ID))
+			continue;
+		vTracks.push_back(t);
+	}
+}
+
+const CDFETrack *CDFEImage::find(const unsigned long track, const unsigned long head) const
+{
+	map<pair<unsigned long, unsigned long>, size_t>::const_iterator it = mLookup.find(make_pair(track, head));
+	if (it == mLookup.end()) return NULL;
+	return &vTracks[it->second];
+}
+
+bool CDFEImage::compressed(void) const
+{
+	return (sMagic == DFEZ_MAGIC);
+}
+
+void CDFEImage::read(const CDFETrack &t, std::vector<unsigned char> &out) const
+{
+	if (!compressed()) {
+		out.assign(t.data, t.data + t.len);
+		return;
+	}
+
+	// Each call has its own codec, so tracks can be unpacked on several threads at once
+	CDFEZCodec codec;
+	if (!codec.decompress(t.data, t.len, out)) {
+		stringstream ss;
+		ss << "Track " << t.track << " head " << t.head << " in '" << filename << "' is corrupt";
+		throw EApplicationError(ss.str());
+	}
+}
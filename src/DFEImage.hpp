@@ -0,0 +1,109 @@
+#ifndef _hpp_DFEImage
+#define _hpp_DFEImage
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+/**
+ * @brief	One track record in a DFE2 image.
+ *
+ * The data points straight into the image's memory map, so it's only valid
+ * for as long as the CDFEImage is open. In a DFEZ image, it's the compressed
+ * block; use CDFEImage::read() to unpack it.
+ */
+class CDFETrack {
+	public:
+		unsigned long		track;		///< Track number, as the format numbers it (not always the physical cylinder)
+		unsigned long		head;		///< Physical head number
+		unsigned long		sector;		///< Physical sector number
+		const unsigned char	*data;		///< Acquisition data (or compressed block)
+		size_t				len;		///< Length of data, in bytes
+		unsigned long		clock_hz;	///< Acquisition clock rate, or 0 if not known
+		unsigned int		revs;		///< Number of revolutions captured, or 0 if not known
+		double				rpm;		///< Measured rotation speed, or 0 if not known
+
+		CDFETrack() : track(0), head(0), sector(0), data(NULL), len(0), clock_hz(0), revs(0), rpm(0) { };
+};
+
+/**
+ * @brief	Read-only access to a DFE2 image, without copying it.
+ *
+ * The file is memory-mapped, and only the pages which are actually used get
+ * read from disc. If the image has a track directory (see DFE2.hpp), opening
+ * it touches just the end of the file, so finding one track in a big image
+ * costs the same as in a small one. Images without a directory are still
+ * readable; the record headers are scanned once when the image is opened.
+ *
+ * DFEZ (compressed) images are read the same way. Each track is unpacked
+ * only when it's asked for.
+ */
+class CDFEImage {
+	private:
+		std::string			filename;
+		std::string			sMagic;
+		const unsigned char	*base;		///< Start of the file mapping
+		size_t				size;		///< Length of the file
+		bool				bIndexed;
+#ifdef _WIN32
+		std::vector<unsigned char>	vFile;	///< Whole file, where mmap isn't available
+#endif
+
+		std::vector<CDFETrack>	vTracks;	///< Track records, in file order
+		std::map<std::pair<unsigned long, unsigned long>, size_t>	mLookup;	///< Last record for each (track, head)
+
+		bool readDirectory(void);
+		void scanRecords(void);
+		void unmap(void);
+
+		// Non-copyable
+		CDFEImage(const CDFEImage &);
+		CDFEImage &operator=(const CDFEImage &);
+
+	public:
+		/**
+		 * @brief	Open and map an image.
+		 *
+		 * Throws EApplicationError if the file can't be opened, or isn't a
+		 * DFE2 image.
+		 */
+		CDFEImage(const std::string _filename);
+		~CDFEImage();
+
+		/// Return the file magic ("DFE2", "DFEZ", or "DFER" for old microcode)
+		const std::string &magic(void) const			{ return sMagic; };
+
+		/// Return true if the track records are compressed (a DFEZ image)
+		bool compressed(void) const;
+
+		/// Return true if the image has a track directory
+		bool indexed(void) const						{ return bIndexed; };
+
+		/// Return all the track records, in file order
+		const std::vector<CDFETrack> &tracks(void) const	{ return vTracks; };
+
+		/**
+		 * @brief	Find a track.
+		 *
+		 * If the track was captured more than once (e.g. re-read by --verify),
+		 * the last capture is returned.
+		 *
+		 * @return	The track record, or NULL if the track isn't in the image
+		 */
+		const CDFETrack *find(const unsigned long track, const unsigned long head) const;
+
+		/**
+		 * @brief	Get the acquisition data for a track, unpacking it if need be.
+		 *
+		 * For an uncompressed image, this is just a copy; use CDFETrack::data
+		 * to avoid that. Throws EApplicationError if the block is corrupt.
+		 *
+		 * @param	t		Track record, from this image
+		 * @param	out		Receives the acquisition data
+		 */
+		void read(const CDFETrack &t, std::vector<unsigned char> &out) const;
+};
+
+#endif // _hpp_DFEImage
@@ -0,0 +1,324 @@
+// STL headers
+#include <vector>
+#include <algorithm>
+
+// Local headers
+#include "DFE2.hpp"
+#include "DFEZ.hpp"
+
+using namespace std;
+
+/// Bits of precision in a probability
+static const int PROB_BITS = 11;
+/// Probability of a 0 bit before anything has been seen (one half)
+static const unsigned short PROB_INIT = (1 << PROB_BITS) / 2;
+/// How quickly the probabilities adapt (higher is slower)
+static const int PROB_SHIFT = 5;
+/// The range is topped up a byte at a time when it drops below this
+static const unsigned int RANGE_TOP = 1U << 24;
+
+/// Flux intervals are coded in this many bits; longer ones are escaped
+static const int VALUE_BITS = 12;
+/// Escape code for an interval which doesn't fit in VALUE_BITS
+static const unsigned long VALUE_ESCAPE = (1UL << VALUE_BITS) - 1;
+/// Number of contexts for the interval probabilities (see value_context())
+static const size_t VALUE_CONTEXTS = 44;
+
+/// Offsets into the probability table
+static const size_t P_IS_TRANSITION = 0;
+static const size_t P_IS_INDEX = 1;
+static const size_t P_VALUE = 2;
+static const size_t P_TOTAL = P_VALUE + (VALUE_CONTEXTS << VALUE_BITS);
+
+/**
+ * Choose the interval probabilities from the previous interval. The
+ * contexts are about a quarter of an octave wide, which keeps the FM and
+ * MFM peaks (1:2 and 2:3:4) apart at any clock rate.
+ */
+static size_t value_context(unsigned long long prev)
+{
+	if (prev < 4) return prev;
+	if (prev > VALUE_ESCAPE) prev = VALUE_ESCAPE;
+	int e = 0;
+	while ((prev >> e) > 1) e++;		// e = index of the top bit, 2..11
+	return 4 + ((e - 2) * 4) + ((prev >> (e - 2)) & 3);
+}
+
+/// Store a big-endian 32-bit value
+static void put_be32(unsigned char *p, const unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+/// Binary range encoder
+class CRangeEncoder {
+	private:
+		std::vector<unsigned char>	&out;
+		unsigned long long	low;
+		unsigned int		range;
+		unsigned char		cache;
+		unsigned long long	cacheSize;
+
+		void shiftLow(void)
+		{
+			// Hold back 0xFF bytes until we know whether a carry will ripple through them
+			if (((unsigned int)low < 0xFF000000U) || ((low >> 32) != 0)) {
+				unsigned char carry = (unsigned char)(low >> 32);
+				unsigned char b = cache;
+				do {
+					out.push_back(b + carry);
+					b = 0xFF;
+				} while (--cacheSize != 0);
+				cache = (unsigned char)(low >> 24);
+			}
+			cacheSize++;
+			low = (low & 0x00FFFFFF) << 8;
+		}
+
+	public:
+		CRangeEncoder(std::vector<unsigned char> &_out) : out(_out), low(0), range(0xFFFFFFFFU), cache(0), cacheSize(1) { };
+
+		void bit(unsigned short &prob, const unsigned int b)
+		{
+			unsigned int bound = (range >> PROB_BITS) * prob;
+			if (b == 0) {
+				range = bound;
+				prob += ((1 << PROB_BITS) - prob) >> PROB_SHIFT;
+			} else {
+				low += bound;
+				range -= bound;
+				prob -= prob >> PROB_SHIFT;
+			}
+			while (range < RANGE_TOP) {
+				range <<= 8;
+				shiftLow();
+			}
+		}
+
+		/// Code 'n' bits with no model (each costs exactly one bit)
+		void direct(const unsigned long v, int n)
+		{
+			while (n-- > 0) {
+				range >>= 1;
+				if ((v >> n) & 1) low += range;
+				while (range < RANGE_TOP) {
+					range <<= 8;
+					shiftLow();
+				}
+			}
+		}
+
+		void flush(void)
+		{
+			for (int i=0; i<5; i++) shiftLow();
+		}
+};
+
+/// Binary range decoder
+class CRangeDecoder {
+	private:
+		const unsigned char	*p, *end;
+		unsigned int		range, code;
+		bool				bOverrun;
+
+		unsigned char next(void)
+		{
+			if (p < end) return *p++;
+			bOverrun = true;
+			return 0;
+		}
+
+	public:
+		CRangeDecoder(const unsigned char *data, const size_t len) : p(data), end(data + len), range(0xFFFFFFFFU), code(0), bOverrun(false)
+		{
+			for (int i=0; i<5; i++) code = (code << 8) | next();
+		};
+
+		unsigned int bit(unsigned short &prob)
+		{
+			unsigned int bound = (range >> PROB_BITS) * prob, b;
+			if (code < bound) {
+				range = bound;
+				prob += ((1 << PROB_BITS) - prob) >> PROB_SHIFT;
+				b = 0;
+			} else {
+				code -= bound;
+				range -= bound;
+				prob -= prob >> PROB_SHIFT;
+				b = 1;
+			}
+			while (range < RANGE_TOP) {
+				range <<= 8;
+				code = (code << 8) | next();
+			}
+			return b;
+		}
+
+		unsigned long direct(int n)
+		{
+			unsigned long v = 0;
+			while (n-- > 0) {
+				range >>= 1;
+				unsigned int b = (code >= range) ? 1 : 0;
+				if (b) code -= range;
+				v = (v << 1) | b;
+				while (range < RANGE_TOP) {
+					range <<= 8;
+					code = (code << 8) | next();
+				}
+			}
+			return v;
+		}
+
+		/// Return true if the decoder has tried to read past the end of the block
+		bool overrun(void) const	{ return bOverrun; };
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+CDFEZCodec::CDFEZCodec()
+{
+	vProbs.resize(P_TOTAL);
+}
+
+void CDFEZCodec::resetModel(void)
+{
+	fill(vProbs.begin(), vProbs.end(), PROB_INIT);
+}
+
+void CDFEZCodec::compress(const unsigned char *data, const size_t len, std::vector<unsigned char> &out)
+{
+	// Too big for the decoder to accept; store it
+	if (len > DFEZ_MAX_RAWLEN) {
+		out.resize(DFEZ_BLOCK_HEADER_LEN);
+		out[0] = DFEZ_CODEC_STORED;
+		put_be32(&out[1], len);
+		out.insert(out.end(), data, data + len);
+		return;
+	}
+
+	out.resize(DFEZ_BLOCK_HEADER_LEN);
+	out[0] = DFEZ_CODEC_FLUX;
+	put_be32(&out[1], len);
+
+	resetModel();
+	unsigned short *probs = &vProbs[0];
+	CRangeEncoder rc(out);
+	unsigned long carries = 0;
+	unsigned long long prev = 0;
+
+	for (size_t i=0; i<len; i++) {
+		unsigned char b = data[i];
+		if (b == DFE2_CARRY) {
+			carries++;
+		} else if (!(b & DFE2_INDEX_FLAG)) {
+			// Flux transition: code the whole interval
+			rc.bit(probs[P_IS_TRANSITION], 1);
+			unsigned long long v = ((unsigned long long)carries * DFE2_CARRY) + b;
+			unsigned long sym = (v < VALUE_ESCAPE) ? v : VALUE_ESCAPE;
+			unsigned short *tree = probs + P_VALUE + (value_context(prev) << VALUE_BITS);
+			size_t m = 1;
+			for (int k=VALUE_BITS-1; k>=0; k--) {
+				unsigned int bit = (sym >> k) & 1;
+				rc.bit(tree[m], bit);
+				m = (m << 1) | bit;
+			}
+			if (sym == VALUE_ESCAPE) {
+				rc.direct(carries, 32);
+				rc.direct(b, 7);
+			}
+			prev = v;
+			carries = 0;
+		} else {
+			// Index pulse. There are only a few of these per revolution.
+			rc.bit(probs[P_IS_TRANSITION], 0);
+			rc.bit(probs[P_IS_INDEX], 1);
+			rc.direct(carries, 32);
+			rc.direct(b & DFE2_COUNT_MASK, 7);
+			carries = 0;
+		}
+	}
+
+	// End of the data, and any carries after the last event
+	rc.bit(probs[P_IS_TRANSITION], 0);
+	rc.bit(probs[P_IS_INDEX], 0);
+	rc.direct(carries, 32);
+	rc.flush();
+
+	// Store the data instead if it didn't get any smaller
+	if ((out.size() - DFEZ_BLOCK_HEADER_LEN) >= len) {
+		out.resize(DFEZ_BLOCK_HEADER_LEN);
+		out[0] = DFEZ_CODEC_STORED;
+		out.insert(out.end(), data, data + len);
+	}
+}
+
+bool CDFEZCodec::decompress(const unsigned char *block, const size_t len, std::vector<unsigned char> &out)
+{
+	out.clear();
+	if (len < DFEZ_BLOCK_HEADER_LEN) return false;
+	const size_t rawlen = ((unsigned long)block[1] << 24) | ((unsigned long)block[2] << 16) | ((unsigned long)block[3] << 8) | block[4];
+	const unsigned char *payload = block + DFEZ_BLOCK_HEADER_LEN;
+	const size_t paylen = len - DFEZ_BLOCK_HEADER_LEN;
+
+	switch (block[0]) {
+		case DFEZ_CODEC_STORED:
+			if (paylen != rawlen) return false;
+			out.assign(payload, payload + paylen);
+			return true;
+
+		case DFEZ_CODEC_FLUX:
+			// Don't let a corrupt header make us allocate gigabytes
+			if (rawlen > DFEZ_MAX_RAWLEN) return false;
+			break;
+
+		default:
+			return false;
+	}
+
+	out.reserve(rawlen);
+	resetModel();
+	unsigned short *probs = &vProbs[0];
+	CRangeDecoder rc(payload, paylen);
+	unsigned long long prev = 0;
+
+	while (true) {
+		unsigned long carries;
+		unsigned char b;
+		if (rc.bit(probs[P_IS_TRANSITION])) {
+			unsigned short *tree = probs + P_VALUE + (value_context(prev) << VALUE_BITS);
+			size_t m = 1;
+			for (int k=0; k<VALUE_BITS; k++) m = (m << 1) | rc.bit(tree[m]);
+			unsigned long sym = m - (1UL << VALUE_BITS);
+			if (sym != VALUE_ESCAPE) {
+				carries = sym / DFE2_CARRY;
+				b = sym % DFE2_CARRY;
+			} else {
+				carries = rc.direct(32);
+				b = rc.direct(7);
+				if (b == DFE2_CARRY) return false;
+			}
+			prev = ((unsigned long long)carries * DFE2_CARRY) + b;
+		} else if (rc.bit(probs[P_IS_INDEX])) {
+			carries = rc.direct(32);
+			b = DFE2_INDEX_FLAG | rc.direct(7);
+		} else {
+			// End of the data
+			carries = rc.direct(32);
+			if ((rawlen - out.size()) != carries) return false;
+			out.insert(out.end(), carries, DFE2_CARRY);
+			break;
+		}
+
+		if (rc.overrun() || ((rawlen - out.size()) <= carries)) return false;
+		out.insert(out.end(), carries, DFE2_CARRY);
+		out.push_back(b);
+	}
+
+	return !rc.overrun();
+}
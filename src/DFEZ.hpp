@@ -0,0 +1,83 @@
+#ifndef _hpp_DFEZ
+#define _hpp_DFEZ
+
+// C++ STL headers
+#include <vector>
+#include <cstddef>
+
+/**
+ * @file
+ * DFEZ: DFE2 images with compressed track records.
+ *
+ * A DFEZ image is laid out exactly like a DFE2 image (including the optional
+ * track directory), but starts with DFEZ_MAGIC, and the payload of each track
+ * record is a compressed block instead of raw acquisition data. Each block
+ * stands on its own, so any track can be unpacked without the others.
+ *
+ * A block starts with a 5-byte header: the codec (8 bits) and the length of
+ * the unpacked acquisition data (32 bits, big-endian). The codecs are:
+ *   - DFEZ_CODEC_STORED: the data follows as-is.
+ *   - DFEZ_CODEC_FLUX: the data is coded as a series of events (a flux
+ *     transition, an index pulse, or the end of the data) with an adaptive
+ *     binary range coder. Flux intervals are coded bit by bit, most
+ *     significant first, with the probabilities chosen by the length of the
+ *     previous interval. Intervals cluster tightly around two, three or four
+ *     bit cells, so after the first few hundred intervals most of each one
+ *     costs next to nothing. The coding is lossless: the exact DFE2 bytes come
+ *     back out, carries and all.
+ */
+
+/// File magic for a DFEZ image
+#define DFEZ_MAGIC				"DFEZ"
+/// Length of the compressed block header, in bytes
+#define DFEZ_BLOCK_HEADER_LEN	5
+/// Largest unpacked length a flux-coded block may claim (16 fills of the
+/// 512K acquisition RAM); bigger records are stored instead
+#define DFEZ_MAX_RAWLEN			(16UL * 524288UL)
+
+/// Block codecs
+enum DFEZCodec {
+	DFEZ_CODEC_STORED = 0,	///< Not compressed
+	DFEZ_CODEC_FLUX = 1		///< Flux event range coder
+};
+
+/**
+ * @brief	Packs and unpacks DFEZ track blocks.
+ *
+ * Keeps its probability tables between calls, so nothing big is allocated
+ * per track. Not thread-safe; use one per thread.
+ */
+class CDFEZCodec {
+	private:
+		std::vector<unsigned short>	vProbs;		///< Bit probabilities, reset for every block
+
+		void resetModel(void);
+
+	public:
+		CDFEZCodec();
+
+		/**
+		 * @brief	Compress acquisition data into a block.
+		 *
+		 * If the data doesn't compress, it's stored instead, so the block is
+		 * never more than DFEZ_BLOCK_HEADER_LEN bytes bigger than the data.
+		 *
+		 * @param	data	DFE2 acquisition data
+		 * @param	len		Length of data, in bytes
+		 * @param	out		Receives the block
+		 */
+		void compress(const unsigned char *data, const size_t len, std::vector<unsigned char> &out);
+
+		/**
+		 * @brief	Unpack a block.
+		 *
+		 * @param	block	Compressed block
+		 * @param	len		Length of the block, in bytes
+		 * @param	out		Receives the acquisition data
+		 * @return	false if the block is corrupt, uses an unknown codec, or
+		 * 			claims to unpack to more than DFEZ_MAX_RAWLEN bytes
+		 */
+		bool decompress(const unsigned char *block, const size_t len, std::vector<unsigned char> &out);
+};
+
+#endif // _hpp_DFEZ
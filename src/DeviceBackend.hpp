@@ -0,0 +1,57 @@
+#ifndef _hpp_DeviceBackend
+#define _hpp_DeviceBackend
+
+#include <cstddef>
+
+// DiscFerret (for error codes, register and status definitions)
+#include <discferret/discferret.h>
+
+/**
+ * @brief	Interface to a DiscFerret, real or otherwise.
+ *
+ * Covers the subset of the libdiscferret API used by the acquisition code.
+ * Functions take the same parameters and return the same values as their
+ * libdiscferret equivalents (minus the device handle), so an implementation
+ * can be swapped in without touching the code which uses it.
+ */
+class CDeviceBackend {
+	public:
+		virtual ~CDeviceBackend() {};
+
+		/// Get information about the device (see discferret_get_info)
+		virtual DISCFERRET_ERROR getInfo(DISCFERRET_DEVICE_INFO *info) =0;
+		/// Load the default microcode (see discferret_fpga_load_default)
+		virtual DISCFERRET_ERROR loadMicrocode(void) =0;
+
+		/// Write to a register (see discferret_reg_poke)
+		virtual DISCFERRET_ERROR regPoke(const unsigned int addr, const unsigned char data) =0;
+		/// Read the status register (see discferret_get_status)
+		virtual long getStatus(void) =0;
+
+		/// Set the step rate in microseconds (see discferret_seek_set_rate)
+		virtual DISCFERRET_ERROR seekSetRate(const unsigned long steprate_us) =0;
+		/// Seek to track zero (see discferret_seek_recalibrate)
+		virtual DISCFERRET_ERROR seekRecalibrate(const unsigned long maxsteps) =0;
+		/// Step the heads in or out (see discferret_seek_relative)
+		virtual DISCFERRET_ERROR seekRelative(const long steps) =0;
+		/// Seek to a physical track (see discferret_seek_absolute)
+		virtual DISCFERRET_ERROR seekAbsolute(const unsigned long track) =0;
+
+		/// Set the acquisition RAM address (see discferret_ram_addr_set)
+		virtual DISCFERRET_ERROR ramAddrSet(const unsigned long addr) =0;
+		/// Get the acquisition RAM address (see discferret_ram_addr_get)
+		virtual long ramAddrGet(void) =0;
+		/// Read from acquisition RAM (see discferret_ram_read)
+		virtual DISCFERRET_ERROR ramRead(unsigned char *block, const size_t len) =0;
+		/**
+		 * Return true if host RAM reads have an address counter of their own,
+		 * so acquisition RAM can be read while a capture is writing to it.
+		 * Otherwise ramAddrSet() moves the acquisition's write pointer.
+		 */
+		virtual bool hasReadPointer(void) =0;
+
+		/// Measure the disc rotation speed in RPM (see discferret_get_index_frequency)
+		virtual DISCFERRET_ERROR getIndexFrequency(const bool usecache, double *freq) =0;
+};
+
+#endif // _hpp_DeviceBackend
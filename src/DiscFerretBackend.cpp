@@ -0,0 +1,160 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+
+// C++11 threading
+#include <mutex>
+
+// DiscFerret
+#include <discferret/discferret.h>
+
+// Local headers
+#include "Exceptions.hpp"
+#include "DiscFerretBackend.hpp"
+
+using namespace std;
+
+// libdiscferret must be initialised once, before the first device is
+// opened, and shut down after the last one is closed.
+static mutex libMutex;
+static unsigned int libUsers = 0;
+
+CDiscFerretBackend::CDiscFerretBackend(const std::string serialnum)
+{
+	DISCFERRET_ERROR e;
+
+	dh = NULL;
+
+	// Try and initialise the DiscFerret API
+	{
+		lock_guard<mutex> lock(libMutex);
+		if (libUsers == 0) {
+			e = discferret_init();
+			if (e != DISCFERRET_E_OK) {
+				stringstream s;
+				s << "Error initialising libdiscferret. Error code: ";
+				s << e;
+				throw EApplicationError(s.str());
+			}
+		}
+		libUsers++;
+	}
+
+	// Did the user spec a DiscFerret serial number to look for?
+	if (serialnum.length() > 0) {
+		// Yep -- open the specific DiscFerret requested
+		e = discferret_open(serialnum.c_str(), &dh);
+	} else {
+		// No serial number specified, open the first DiscFerret
+		e = discferret_open_first(&dh);
+	}
+
+	if (e != DISCFERRET_E_OK) {
+		{
+			lock_guard<mutex> lock(libMutex);
+			if (--libUsers == 0) discferret_done();
+		}
+		stringstream s;
+		s << "Error opening DiscFerret device. Is it connected and powered on? (error code ";
+		s << e << ")";
+		throw EApplicationError(s.str());
+	}
+}
+
+CDiscFerretBackend::~CDiscFerretBackend()
+{
+	discferret_close(dh);
+
+	lock_guard<mutex> lock(libMutex);
+	if (--libUsers == 0) discferret_done();
+}
+
+void CDiscFerretBackend::findDevices(std::vector<std::string> &serials)
+{
+	lock_guard<mutex> lock(libMutex);
+	if (libUsers == 0) {
+		DISCFERRET_ERROR e = discferret_init();
+		if (e != DISCFERRET_E_OK) {
+			stringstream s;
+			s << "Error initialising libdiscferret. Error code: ";
+			s << e;
+			throw EApplicationError(s.str());
+		}
+	}
+
+	// The list is allocated by libdiscferret, and has to be freed by us
+	DISCFERRET_DEVICE_INFO *devlist = NULL;
+	int n = discferret_find_devices(&devlist);
+	serials.clear();
+	for (int i=0; i<n; i++) serials.push_back(devlist[i].serialnumber);
+	free(devlist);
+
+	if (libUsers == 0) discferret_done();
+	if (n < 0) {
+		stringstream s;
+		s << "Error listing DiscFerret devices (error code " << n << ")";
+		throw EApplicationError(s.str());
+	}
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::getInfo(DISCFERRET_DEVICE_INFO *info)
+{
+	return discferret_get_info(dh, info);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::loadMicrocode(void)
+{
+	return discferret_fpga_load_default(dh);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::regPoke(const unsigned int addr, const unsigned char data)
+{
+	return discferret_reg_poke(dh, addr, data);
+}
+
+long CDiscFerretBackend::getStatus(void)
+{
+	return discferret_get_status(dh);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::seekSetRate(const unsigned long steprate_us)
+{
+	return discferret_seek_set_rate(dh, steprate_us);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::seekRecalibrate(const unsigned long maxsteps)
+{
+	return discferret_seek_recalibrate(dh, maxsteps);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::seekRelative(const long steps)
+{
+	return discferret_seek_relative(dh, steps);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::seekAbsolute(const unsigned long track)
+{
+	return discferret_seek_absolute(dh, track);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::ramAddrSet(const unsigned long addr)
+{
+	return discferret_ram_addr_set(dh, addr);
+}
+
+long CDiscFerretBackend::ramAddrGet(void)
+{
+	return discferret_ram_addr_get(dh);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::ramRead(unsigned char *block, const size_t len)
+{
+	return discferret_ram_read(dh, block, len);
+}
+
+DISCFERRET_ERROR CDiscFerretBackend::getIndexFrequency(const bool usecache, double *freq)
+{
+	return discferret_get_index_frequency(dh, usecache, freq);
+}
@@ -0,0 +1,65 @@
+#ifndef _hpp_DiscFerretBackend
+#define _hpp_DiscFerretBackend
+
+#include <string>
+#include <vector>
+
+// DiscFerret
+#include <discferret/discferret.h>
+
+// Local headers
+#include "DeviceBackend.hpp"
+
+/**
+ * @brief	Device backend for a real DiscFerret, using libdiscferret.
+ */
+class CDiscFerretBackend : public CDeviceBackend {
+	private:
+		DISCFERRET_DEVICE_HANDLE *dh;
+
+		// Owns a device handle; can't be copied
+		CDiscFerretBackend(const CDiscFerretBackend &);
+		CDiscFerretBackend &operator=(const CDiscFerretBackend &);
+
+	public:
+		/**
+		 * @brief	Open a DiscFerret.
+		 *
+		 * @param	serialnum	Serial number of the unit to open, or an empty
+		 * 						string to open the first one found.
+		 *
+		 * Throws EApplicationError if the library can't be initialised or the
+		 * device can't be opened.
+		 */
+		CDiscFerretBackend(const std::string serialnum);
+		virtual ~CDiscFerretBackend();
+
+		/**
+		 * @brief	List the DiscFerrets which are connected.
+		 *
+		 * Throws EApplicationError if the library can't be initialised or the
+		 * devices can't be listed.
+		 *
+		 * @param	serials		Receives the serial number of each unit
+		 */
+		static void findDevices(std::vector<std::string> &serials);
+
+		virtual DISCFERRET_ERROR getInfo(DISCFERRET_DEVICE_INFO *info);
+		virtual DISCFERRET_ERROR loadMicrocode(void);
+		virtual DISCFERRET_ERROR regPoke(const unsigned int addr, const unsigned char data);
+		virtual long getStatus(void);
+		virtual DISCFERRET_ERROR seekSetRate(const unsigned long steprate_us);
+		virtual DISCFERRET_ERROR seekRecalibrate(const unsigned long maxsteps);
+		virtual DISCFERRET_ERROR seekRelative(const long steps);
+		virtual DISCFERRET_ERROR seekAbsolute(const unsigned long track);
+		virtual DISCFERRET_ERROR ramAddrSet(const unsigned long addr);
+		virtual long ramAddrGet(void);
+		virtual DISCFERRET_ERROR ramRead(unsigned char *block, const size_t len);
+		/// The DiscFerret microcode shares one RAM address counter between
+		/// acquisitions and host reads, and libdiscferret has no way to ask for
+		/// anything else, so this is always false
+		virtual bool hasReadPointer(void)				{ return false; };
+		virtual DISCFERRET_ERROR getIndexFrequency(const bool usecache, double *freq);
+};
+
+#endif // _hpp_DiscFerretBackend
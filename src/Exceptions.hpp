@@ -48,6 +48,8 @@
 
 /// Exception class for DriveSpec parse errors
 XCPTFSN(EDriveSpecParse, "DriveSpec script parse error: ");
+/// Exception class for FormatSpec parse errors
+XCPTFSN(EFormatSpecParse, "FormatSpec script parse error: ");
 /// Internal error in the scripting engine
 XCPTFSN(EInternalScriptingError, "Internal script engine error: ");
 
@@ -55,11 +57,15 @@ XCPTFSN(EInternalScriptingError, "Internal script engine error: ");
 XCPTS(ELuaError, "Lua error: ");
 /// Drivetype not known
 XCPTS(EInvalidDrivetype, "Invalid drive type: ");
+/// Formattype not known
+XCPTS(EInvalidFormattype, "Invalid format type: ");
 
 /// Application error
 XCPTS(EApplicationError, "");
 /// DiscFerret communications error
 XCPT(ECommunicationError, "DiscFerret communication error");
+/// Timed out waiting for the hardware
+XCPTS(ETimeoutError, "Timeout: ");
 
 #undef XCPTFSN
 #undef XCPT
@@ -0,0 +1,267 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <cmath>
+
+// Local headers
+#include "FluxDecoder.hpp"
+#include "DFE2.hpp"
+
+using namespace std;
+
+/// Raw (clock and data) pattern of three MFM A1 sync bytes with a missing clock bit
+static const unsigned long long MFM_SYNC_3A1 = 0x448944894489ULL;
+static const unsigned long long MFM_SYNC_MASK = 0xFFFFFFFFFFFFULL;
+/// Raw patterns of the FM address marks (clock 0xC7)
+static const unsigned int FM_MARK_IDAM = 0xF57E;	///< FE, ID address mark
+static const unsigned int FM_MARK_DAM = 0xF56F;		///< FB, data address mark
+static const unsigned int FM_MARK_DDAM = 0xF56A;	///< F8, deleted data address mark
+
+/// IBM address marks
+static const unsigned char IBM_IDAM = 0xFE;
+static const unsigned char IBM_DAM = 0xFB;
+static const unsigned char IBM_DDAM = 0xF8;
+
+/// How far after an ID record its data record may start, in bytes
+static const size_t DATA_WINDOW = 64;
+
+/// Number of cells in an encoded byte
+static const size_t CELLS_PER_BYTE = 16;
+
+/**
+ * CRC-16/CCITT lookup table, as used by IBM format floppy discs.
+ */
+class CCrcTable {
+	public:
+		unsigned short t[256];
+
+		CCrcTable() {
+			for (unsigned int i=0; i<256; i++) {
+				unsigned short crc = i << 8;
+				for (int j=0; j<8; j++)
+					crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+				t[i] = crc;
+			}
+		}
+};
+static const CCrcTable crctab;
+
+/// Update a CRC-16/CCITT with one byte
+static inline unsigned short crc16(const unsigned short crc, const unsigned char b)
+{
+	return (crc << 8) ^ crctab.t[(crc >> 8) ^ b];
+}
+
+/// Return one cell from a packed cell stream
+static inline unsigned int get_cell(const unsigned char *cells, const size_t pos)
+{
+	return (cells[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+/// Extract the data byte from 16 cells, starting at cell 'pos'
+static inline unsigned char get_byte(const unsigned char *cells, const size_t pos)
+{
+	unsigned char b = 0;
+	for (size_t i=0; i<8; i++) b = (b << 1) | get_cell(cells, pos + (i * 2) + 1);
+	return b;
+}
+
+CFluxDecoder::CFluxDecoder(const Encoding _encoding, const unsigned long datarate, const unsigned long clock_hz) :
+	enc(_encoding), periodAdj(0.05), phaseAdj(0.6), periodLimit(0.1)
+{
+	// Two cells (clock and data) per data bit
+	nominalCell = (double)clock_hz / (datarate * 1000.0 * 2);
+}
+
+bool CFluxDecoder::parseEncoding(const std::string name, Encoding &enc)
+{
+	if (name.compare("fm") == 0) {
+		enc = ENC_FM;
+	} else if (name.compare("mfm") == 0) {
+		enc = ENC_MFM;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void CFluxDecoder::setPLL(const double _periodAdj, const double _phaseAdj, const double _periodLimit)
+{
+	periodAdj = _periodAdj;
+	phaseAdj = _phaseAdj;
+	periodLimit = _periodLimit;
+}
+
+size_t CFluxDecoder::separate(const unsigned char *data, const size_t len, std::vector<unsigned char> &cells, std::vector<size_t> *index) const
+{
+	const double lo = nominalCell * (1.0 - periodLimit), hi = nominalCell * (1.0 + periodLimit);
+	// Longest legal run of zero cells between two transitions
+	const unsigned long maxzeros = (enc == ENC_MFM) ? 3 : 1;
+
+	double clock = nominalCell;		// current cell period
+	double ticks = 0;				// time since the last cell boundary
+	unsigned long count = 0;		// DFE2 running count
+	unsigned long long acc = 0;		// cells waiting to be packed
+	unsigned int nacc = 0;			// number of cells in acc
+	size_t ncells = 0;
+
+	cells.clear();
+	cells.reserve((len / 2) + 16);
+	if (index != NULL) index->clear();
+
+	for (size_t p=0; p<len; p++) {
+		const unsigned char b = data[p];
+		if (b == DFE2_CARRY) {
+			count += DFE2_CARRY;
+			continue;
+		}
+		if (b & DFE2_INDEX_FLAG) {
+			count += b & DFE2_COUNT_MASK;
+			if (index != NULL) index->push_back(ncells);
+			continue;
+		}
+		ticks += count + b;
+		count = 0;
+
+		// Intervals much shorter than a cell are noise; fold them into the next one
+		if (ticks < (clock / 2)) continue;
+
+		// Round to a whole number of cells. What's left over is the phase error.
+		unsigned long n = (unsigned long)((ticks + (clock / 2)) / clock);
+		ticks -= n * clock;
+		unsigned long zeros = n - 1;
+
+		// Pack the cells: (n-1) zeros, then a one
+		ncells += n;
+		while (zeros >= 32) {
+			acc <<= 32;
+			nacc += 32;
+			zeros -= 32;
+			while (nacc >= 8) { nacc -= 8; cells.push_back((unsigned char)(acc >> nacc)); }
+		}
+		acc = (acc << (zeros + 1)) | 1;
+		nacc += zeros + 1;
+		while (nacc >= 8) { nacc -= 8; cells.push_back((unsigned char)(acc >> nacc)); }
+
+		// Correct the period and phase. After a run of zeros longer than the
+		// encoding allows, the phase error means nothing, so drift back
+		// towards the nominal period instead.
+		if (n - 1 <= maxzeros) {
+			clock += ticks * periodAdj;
+		} else {
+			clock += (nominalCell - clock) * periodAdj;
+		}
+		if (clock < lo) clock = lo;
+		if (clock > hi) clock = hi;
+		ticks *= (1.0 - phaseAdj);
+	}
+
+	// Flush the last few cells, padded with zeros
+	if (nacc > 0) cells.push_back((unsigned char)(acc << (8 - nacc)));
+
+	return ncells;
+}
+
+size_t CFluxDecoder::frame(const std::vector<unsigned char> &cellbuf, const size_t ncells, std::vector<CDecodedSector> &sectors) const
+{
+	const unsigned char *cells = cellbuf.empty() ? NULL : &cellbuf[0];
+	const size_t found = sectors.size();
+	unsigned long long shift = 0;
+	bool haveId = false;		// true if the last record was a good ID record
+	size_t idEnd = 0;			// first cell after that ID record
+
+	for (size_t i=0; i<ncells; i++) {
+		shift = (shift << 1) | get_cell(cells, i);
+
+		// Look for an address mark. 'start' is the first cell after it, 'mark'
+		// the address mark byte and 'crc' the CRC of everything up to here.
+		unsigned char mark;
+		size_t start;
+		unsigned short crc = 0xFFFF;
+		if (enc == ENC_MFM) {
+			// Three A1 syncs, then the mark byte
+			if ((shift & MFM_SYNC_MASK) != MFM_SYNC_3A1) continue;
+			if ((i + 1 + CELLS_PER_BYTE) > ncells) break;
+			mark = get_byte(cells, i + 1);
+			start = i + 1 + CELLS_PER_BYTE;
+			for (int j=0; j<3; j++) crc = crc16(crc, 0xA1);
+		} else {
+			unsigned int w = shift & 0xFFFF;
+			if (w == FM_MARK_IDAM) {
+				mark = IBM_IDAM;
+			} else if (w == FM_MARK_DAM) {
+				mark = IBM_DAM;
+			} else if (w == FM_MARK_DDAM) {
+				mark = IBM_DDAM;
+			} else {
+				continue;
+			}
+			start = i + 1;
+		}
+		crc = crc16(crc, mark);
+
+		if (mark == IBM_IDAM) {
+			// ID record: cylinder, head, sector, size, CRC
+			haveId = false;
+			if ((start + (6 * CELLS_PER_BYTE)) > ncells) break;
+			unsigned char id[6];
+			for (int b=0; b<6; b++) {
+				id[b] = get_byte(cells, start + (b * CELLS_PER_BYTE));
+				crc = crc16(crc, id[b]);
+			}
+			if (crc != 0) continue;
+
+			CDecodedSector s;
+			s.cyl = id[0];
+			s.head = id[1];
+			s.sector = id[2];
+			s.size = id[3] & 7;
+			s.position = i;
+			sectors.push_back(s);
+
+			haveId = true;
+			idEnd = start + (6 * CELLS_PER_BYTE);
+			i = idEnd - 1;
+			shift = 0;
+		} else if ((mark == IBM_DAM) || (mark == IBM_DDAM)) {
+			// Data record: only useful straight after a good ID record
+			if (!haveId || (start > (idEnd + (DATA_WINDOW * CELLS_PER_BYTE)))) continue;
+
+			CDecodedSector &s = sectors.back();
+			size_t len = 128 << s.size;
+			if ((start + ((len + 2) * CELLS_PER_BYTE)) > ncells) break;
+
+			vector<unsigned char> buf(len);
+			for (size_t b=0; b<len; b++) {
+				buf[b] = get_byte(cells, start + (b * CELLS_PER_BYTE));
+				crc = crc16(crc, buf[b]);
+			}
+			for (size_t b=len; b<(len + 2); b++) crc = crc16(crc, get_byte(cells, start + (b * CELLS_PER_BYTE)));
+
+			// A bad CRC may be a false address mark, in which case the real one
+			// is still to come. Keep what was read in case it isn't.
+			if (crc != 0) {
+				if (s.data.empty()) {
+					s.data.swap(buf);
+					s.deleted = (mark == IBM_DDAM);
+				}
+				continue;
+			}
+
+			haveId = false;
+			s.data.swap(buf);
+			s.dataOK = true;
+			s.deleted = (mark == IBM_DDAM);
+			i = start + ((len + 2) * CELLS_PER_BYTE) - 1;
+			shift = 0;
+		}
+	}
+
+	return sectors.size() - found;
+}
+
+size_t CFluxDecoder::decodeTrack(const unsigned char *data, const size_t len, std::vector<CDecodedSector> &sectors)
+{
+	size_t ncells = separate(data, len, vCells);
+	return frame(vCells, ncells, sectors);
+}
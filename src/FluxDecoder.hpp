@@ -0,0 +1,132 @@
+#ifndef _hpp_FluxDecoder
+#define _hpp_FluxDecoder
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/**
+ * @brief	A sector found on a decoded track.
+ *
+ * Only sectors with a good ID record are reported. The data record may be
+ * missing (data is empty) or have a bad CRC (dataOK is false, but data holds
+ * what was read).
+ */
+class CDecodedSector {
+	public:
+		unsigned char	cyl;		///< Cylinder number, from the ID record
+		unsigned char	head;		///< Head number, from the ID record
+		unsigned char	sector;		///< Sector number, from the ID record
+		unsigned char	size;		///< Size code, from the ID record (length is 128 << size)
+		bool			dataOK;		///< true if the data record was found and its CRC was good
+		bool			deleted;	///< true if the data record had a deleted data address mark
+		size_t			position;	///< Position of the ID record on the track, in cells
+		std::vector<unsigned char>	data;	///< Sector data
+
+		CDecodedSector() :
+			cyl(0), head(0), sector(0), size(0), dataOK(false), deleted(false), position(0)
+		{ };
+};
+
+/**
+ * @brief	FM/MFM data separator and IBM sector decoder for DFE2 flux data.
+ *
+ * Decoding is done in two stages:
+ *
+ *   - separate() runs the flux transitions through a digital PLL, which
+ *     turns them into a stream of bit cells. The PLL tracks both the cell
+ *     period (so the data rate can drift with the disc speed) and its phase.
+ *   - frame() looks for address marks in the cell stream, and reads and
+ *     checks the IBM ID and data records which follow them.
+ *
+ * decodeTrack() does both on a whole track capture at once. The cell buffer
+ * is kept between calls, so a decoder which is reused for every track of a
+ * disc doesn't spend its time allocating memory.
+ */
+class CFluxDecoder {
+	public:
+		/// Data encoding
+		enum Encoding {
+			ENC_FM,
+			ENC_MFM
+		};
+
+	private:
+		Encoding		enc;
+		double			nominalCell;	///< Nominal bit cell length, in clock cycles
+		double			periodAdj;		///< Fraction of the phase error used to correct the cell period
+		double			phaseAdj;		///< Fraction of the phase error used to correct the phase
+		double			periodLimit;	///< Maximum deviation of the cell period from nominal, as a fraction
+
+		/// Cell buffer for decodeTrack()
+		std::vector<unsigned char>	vCells;
+
+	public:
+		/**
+		 * @param	_encoding	Data encoding
+		 * @param	datarate	Data rate in kbps (e.g. 250 for a DD disc)
+		 * @param	clock_hz	Acquisition clock rate in Hz
+		 */
+		CFluxDecoder(const Encoding _encoding, const unsigned long datarate, const unsigned long clock_hz);
+
+		/**
+		 * @brief	Convert an encoding name ("fm" or "mfm") to an Encoding.
+		 * @return	false if the name isn't recognised
+		 */
+		static bool parseEncoding(const std::string name, Encoding &enc);
+
+		/**
+		 * @brief	Change the PLL loop parameters.
+		 *
+		 * The defaults (0.05, 0.6 and 0.1) suit most discs. Larger adjustments
+		 * lock faster and follow worse speed variation, but pass on more of the
+		 * jitter in the flux timing.
+		 *
+		 * @param	_periodAdj		Fraction of the phase error added to the cell period
+		 * @param	_phaseAdj		Fraction of the phase error removed from the phase
+		 * @param	_periodLimit	Maximum deviation of the cell period from nominal
+		 */
+		void setPLL(const double _periodAdj, const double _phaseAdj, const double _periodLimit);
+
+		/// Return the data encoding
+		Encoding encoding(void) const		{ return enc; };
+
+		/**
+		 * @brief	Run DFE2 flux data through the data separator.
+		 *
+		 * @param	data	DFE2 acquisition data
+		 * @param	len		Length of data, in bytes
+		 * @param	cells	Receives the bit cells, packed eight to a byte, most
+		 * 					significant bit first
+		 * @param	index	If not NULL, receives the position of each index pulse,
+		 * 					in cells
+		 * @return	Number of cells
+		 */
+		size_t separate(const unsigned char *data, const size_t len, std::vector<unsigned char> &cells, std::vector<size_t> *index = NULL) const;
+
+		/**
+		 * @brief	Find the IBM sectors in a cell stream.
+		 *
+		 * @param	cells	Bit cells, as returned by separate()
+		 * @param	ncells	Number of cells
+		 * @param	sectors	Sectors are appended to this, in the order they were found
+		 * @return	Number of sectors found
+		 */
+		size_t frame(const std::vector<unsigned char> &cells, const size_t ncells, std::vector<CDecodedSector> &sectors) const;
+
+		/**
+		 * @brief	Decode every sector in a track capture.
+		 *
+		 * Each revolution in the capture is decoded, so a sector can appear
+		 * more than once.
+		 *
+		 * @param	data	DFE2 acquisition data for the track
+		 * @param	len		Length of data, in bytes
+		 * @param	sectors	Sectors are appended to this, in the order they were found
+		 * @return	Number of sectors found
+		 */
+		size_t decodeTrack(const unsigned char *data, const size_t len, std::vector<CDecodedSector> &sectors);
+};
+
+#endif // _hpp_FluxDecoder
@@ -0,0 +1,206 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Local headers
+#include "FluxHistogram.hpp"
+#include "DFE2Expand.hpp"
+
+using namespace std;
+
+/// Peaks smaller than this fraction of the biggest one are ignored
+static const double PEAK_MIN_HEIGHT = 0.03;
+/// Peaks closer than this (as a fraction of their position) are merged
+static const double PEAK_MIN_SEPARATION = 0.2;
+/// Intervals shorter than this are noise, not data, in microseconds
+static const double PEAK_MIN_US = 0.5;
+/// How close a peak ratio has to be to a whole (or half) number
+static const double RATIO_TOLERANCE = 0.15;
+/// How close a data rate has to be to a standard rate to be rounded to it
+static const double DATARATE_TOLERANCE = 0.05;
+
+/// Standard data rates, in kbps
+static const unsigned long STANDARD_DATARATES[] = { 125, 250, 300, 500, 1000 };
+
+/// Number of sub-histograms used by add()
+static const size_t NSUB = 4;
+
+std::string CFluxAnalysis::spacingName(void) const
+{
+	switch (spacing) {
+		case SPACING_FM:	return "fm";
+		case SPACING_MFM:	return "mfm";
+		case SPACING_GCR:	return "gcr";
+		default:			return "unknown";
+	}
+}
+
+CFluxHistogram::CFluxHistogram(const unsigned long _clock_hz, const double max_us) :
+	clock_hz(_clock_hz)
+{
+	vBins.resize((size_t)(max_us * (clock_hz / 1.0e6)) + 1);
+	clear();
+}
+
+void CFluxHistogram::clear(void)
+{
+	fill(vBins.begin(), vBins.end(), 0);
+	total = 0;
+	longTicks = 0;
+}
+
+void CFluxHistogram::add(const unsigned int *intervals, const size_t n)
+{
+	const size_t nbins = vBins.size();
+
+	// Runs of equal intervals (which is most of them) would make each count
+	// wait for the one before it, so the intervals are spread across four
+	// separate sets of counts, which are added up at the end.
+	vSub.assign(nbins * NSUB, 0);
+	unsigned long *sub[NSUB];
+	for (size_t k=0; k<NSUB; k++) sub[k] = &vSub[k * nbins];
+
+	size_t i = 0;
+	for (; (i + NSUB) <= n; i += NSUB) {
+		for (size_t k=0; k<NSUB; k++) {
+			unsigned int v = intervals[i + k];
+			if (v < nbins) sub[k][v]++; else longTicks += v;
+		}
+	}
+	for (; i<n; i++) {
+		unsigned int v = intervals[i];
+		if (v < nbins) sub[0][v]++; else longTicks += v;
+	}
+
+	for (size_t b=0; b<nbins; b++) vBins[b] += sub[0][b] + sub[1][b] + sub[2][b] + sub[3][b];
+	total += n;
+}
+
+void CFluxHistogram::addCapture(const unsigned char *data, const size_t len)
+{
+	size_t nindex;
+	if (vIntervals.size() < len) vIntervals.resize(len);
+	size_t n = dfe2_expand(data, len, vIntervals.empty() ? NULL : &vIntervals[0], NULL, 0, nindex);
+	add(vIntervals.empty() ? NULL : &vIntervals[0], n);
+}
+
+/// Find the nearest multiple of 'step' to 'x', and return it if it's close enough (or 0 if not)
+static double near_multiple(const double x, const double step)
+{
+	double m = floor((x / step) + 0.5) * step;
+	return (fabs(x - m) <= RATIO_TOLERANCE) ? m : 0;
+}
+
+bool CFluxHistogram::analyse(CFluxAnalysis &result) const
+{
+	const size_t nbins = vBins.size();
+	const double ticks_per_us = clock_hz / 1.0e6;
+
+	result = CFluxAnalysis();
+	if (total < 100) return false;
+
+	// Smooth the histogram over about 100ns, so jitter doesn't turn one peak into several
+	const long h = max(1L, (long)(clock_hz / 20000000));
+	vector<unsigned long> sm(nbins, 0);
+	unsigned long sum = 0, maxsm = 0;
+	for (long i=0; i<(long)nbins + h; i++) {
+		if (i < (long)nbins) sum += vBins[i];
+		if (i - (2 * h) - 1 >= 0) sum -= vBins[i - (2 * h) - 1];
+		if (i - h >= 0) {
+			sm[i - h] = sum;
+			maxsm = max(maxsm, sum);
+		}
+	}
+
+	// Local maxima which are big enough to matter, biggest first
+	vector<pair<unsigned long, size_t> > candidates;
+	for (size_t i = max((size_t)1, (size_t)(PEAK_MIN_US * ticks_per_us)); (i + 1) < nbins; i++) {
+		if ((sm[i] >= sm[i-1]) && (sm[i] > sm[i+1]) && (sm[i] >= (maxsm * PEAK_MIN_HEIGHT)))
+			candidates.push_back(make_pair(sm[i], i));
+	}
+	sort(candidates.rbegin(), candidates.rend());
+
+	// Drop the smaller of any two peaks which are too close together, then
+	// find the centre of each peak that's left
+	vector<size_t> accepted;
+	for (vector<pair<unsigned long, size_t> >::const_iterator c = candidates.begin(); c != candidates.end(); c++) {
+		bool distinct = true;
+		for (vector<size_t>::const_iterator a = accepted.begin(); a != accepted.end(); a++) {
+			double lo = min(*a, c->second), hi = max(*a, c->second);
+			if ((hi - lo) < (lo * PEAK_MIN_SEPARATION)) distinct = false;
+		}
+		if (distinct) accepted.push_back(c->second);
+	}
+	for (vector<size_t>::const_iterator a = accepted.begin(); a != accepted.end(); a++) {
+		size_t lo = (size_t)(*a * (1.0 - (PEAK_MIN_SEPARATION / 2))), hi = min(nbins - 1, (size_t)(*a * (1.0 + (PEAK_MIN_SEPARATION / 2))));
+		double n = 0, m = 0;
+		for (size_t b=lo; b<=hi; b++) {
+			n += vBins[b];
+			m += (double)vBins[b] * b;
+		}
+		result.peaks_us.push_back(((n > 0) ? (m / n) : *a) / ticks_per_us);
+	}
+	sort(result.peaks_us.begin(), result.peaks_us.end());
+	if (result.peaks_us.size() < 2) return false;
+
+	// Classify the spacing from the ratios of the peaks to the shortest one:
+	// MFM has 1.5 (3 cells to 2), GCR has 3 but no 1.5, and FM just has 2.
+	const double p0 = result.peaks_us[0];
+	bool has15 = false, has2 = false, has3 = false;
+	for (size_t k=1; k<result.peaks_us.size(); k++) {
+		double r = result.peaks_us[k] / p0;
+		if (fabs(r - 1.5) <= RATIO_TOLERANCE) has15 = true;
+		if (fabs(r - 2.0) <= RATIO_TOLERANCE) has2 = true;
+		if (fabs(r - 3.0) <= RATIO_TOLERANCE) has3 = true;
+	}
+	double cells0;		// number of cells in the shortest interval
+	if (has15) {
+		result.spacing = CFluxAnalysis::SPACING_MFM;
+		cells0 = 2;
+	} else if (has3) {
+		result.spacing = CFluxAnalysis::SPACING_GCR;
+		cells0 = 1;
+	} else if (has2) {
+		result.spacing = CFluxAnalysis::SPACING_FM;
+		cells0 = 1;
+	} else {
+		return false;
+	}
+
+	// Fit the cell length to all the peaks which are a whole number of cells
+	double num = 0, den = 0;
+	for (vector<double>::const_iterator p = result.peaks_us.begin(); p != result.peaks_us.end(); p++) {
+		double cells = near_multiple((*p / p0) * cells0, 1.0);
+		if (cells == 0) continue;
+		num += *p * cells;
+		den += cells * cells;
+	}
+	result.cell_us = num / den;
+
+	// FM and MFM have two cells (clock and data) per bit; GCR has one
+	double rate = 1000.0 / result.cell_us;
+	if (result.spacing != CFluxAnalysis::SPACING_GCR) rate /= 2;
+	result.datarate = (unsigned long)(rate + 0.5);
+	for (size_t k=0; k<(sizeof(STANDARD_DATARATES) / sizeof(STANDARD_DATARATES[0])); k++) {
+		if (fabs(rate - STANDARD_DATARATES[k]) <= (STANDARD_DATARATES[k] * DATARATE_TOLERANCE))
+			result.datarate = STANDARD_DATARATES[k];
+	}
+
+	return true;
+}
+
+unsigned long long CFluxHistogram::estimateBytes(const unsigned long hz) const
+{
+	// Each interval takes one byte, plus a carry for every 127 clock cycles
+	const double scale = (double)hz / clock_hz;
+	unsigned long long bytes = 0, binned = 0;
+	for (size_t b=0; b<vBins.size(); b++) {
+		if (vBins[b] == 0) continue;
+		bytes += vBins[b] * (1 + (unsigned long long)((b * scale) / 127));
+		binned += vBins[b];
+	}
+	bytes += (total - binned) + (unsigned long long)((longTicks * scale) / 127);
+	return bytes;
+}
@@ -0,0 +1,93 @@
+#ifndef _hpp_FluxHistogram
+#define _hpp_FluxHistogram
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/**
+ * @brief	What a track's flux intervals look like.
+ *
+ * Filled in by CFluxHistogram::analyse().
+ */
+class CFluxAnalysis {
+	public:
+		/// Flux interval spacing
+		enum Spacing {
+			SPACING_UNKNOWN,	///< Not enough peaks, or they don't fit a known pattern
+			SPACING_FM,			///< 1 and 2 cells (FM)
+			SPACING_MFM,		///< 2, 3 and 4 cells (MFM)
+			SPACING_GCR			///< 1, 2, 3 (and more) cells (Apple, Commodore and similar GCR)
+		};
+
+		Spacing				spacing;	///< Interval spacing
+		double				cell_us;	///< Bit cell length, in microseconds
+		unsigned long		datarate;	///< Data rate in kbps, rounded to a standard rate if close to one
+		std::vector<double>	peaks_us;	///< Histogram peaks, shortest first, in microseconds
+
+		CFluxAnalysis() : spacing(SPACING_UNKNOWN), cell_us(0), datarate(0) { };
+
+		/// Return the name of the spacing ("fm", "mfm", "gcr" or "unknown")
+		std::string spacingName(void) const;
+};
+
+/**
+ * @brief	Histogram of flux transition intervals.
+ *
+ * Collects the intervals from one or more track captures, then finds the
+ * peaks and works out which encoding and data rate the track was written
+ * with. Also estimates how much acquisition RAM a capture of the track would
+ * need at other clock rates, which is what limits the choice of clock.
+ */
+class CFluxHistogram {
+	private:
+		unsigned long		clock_hz;	///< Acquisition clock rate
+		std::vector<unsigned long>	vBins;	///< Number of intervals of each length, in clock cycles
+		unsigned long long	total;		///< Number of intervals, including ones too long for a bin
+		unsigned long long	longTicks;	///< Total length of the intervals too long for a bin
+
+		/// Scratch buffers for add() and addCapture()
+		std::vector<unsigned int>	vIntervals;
+		std::vector<unsigned long>	vSub;
+
+	public:
+		/**
+		 * @param	_clock_hz	Acquisition clock rate the intervals were captured at, in Hz
+		 * @param	max_us		Longest interval to count, in microseconds
+		 */
+		CFluxHistogram(const unsigned long _clock_hz, const double max_us = 20.0);
+
+		/// Empty the histogram
+		void clear(void);
+
+		/// Add flux intervals (in clock cycles) to the histogram
+		void add(const unsigned int *intervals, const size_t n);
+
+		/// Add the flux intervals in a DFE2 capture to the histogram
+		void addCapture(const unsigned char *data, const size_t len);
+
+		/// Return the histogram, one bin per clock cycle
+		const std::vector<unsigned long> &bins(void) const	{ return vBins; };
+
+		/// Return the number of intervals counted
+		unsigned long long count(void) const	{ return total; };
+
+		/**
+		 * @brief	Find the peaks and classify the intervals.
+		 * @return	false if the track doesn't look like anything recognisable
+		 * 			(e.g. it's unformatted)
+		 */
+		bool analyse(CFluxAnalysis &result) const;
+
+		/**
+		 * @brief	Estimate the size of the DFE2 data for the intervals in the
+		 * 			histogram, if they had been captured at another clock rate.
+		 *
+		 * @param	hz		Clock rate, in Hz
+		 * @return	Estimated size in bytes
+		 */
+		unsigned long long estimateBytes(const unsigned long hz) const;
+};
+
+#endif // _hpp_FluxHistogram
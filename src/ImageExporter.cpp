@@ -0,0 +1,229 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+// Local headers
+#include "Exceptions.hpp"
+#include "ImageExporter.hpp"
+
+using namespace std;
+
+/// Maximum number of captures waiting to be decoded, per worker
+static const size_t JOBS_PER_WORKER = 2;
+
+/// Default sector length, if no sector has been found yet
+static const size_t DEFAULT_SECTOR_LEN = 512;
+
+/// How good a copy of a sector is: good data, bad data, or just an ID record
+static int sector_score(const CDecodedSector &s)
+{
+	if (s.dataOK) return 2;
+	return s.data.empty() ? 0 : 1;
+}
+
+CImageExporter::CImageExporter(const std::string _filename, const CFluxDecoder::Encoding _encoding,
+		const unsigned long _datarate, const unsigned long _clock_hz,
+		const unsigned long _mintrack, const unsigned long _maxtrack,
+		const unsigned long _minhead, const unsigned long _maxhead,
+		const unsigned long _spt, unsigned int threads) :
+	filename(_filename), mapfilename(_filename + ".bad"),
+	encoding(_encoding), datarate(_datarate), clock_hz(_clock_hz),
+	mintrack(_mintrack), maxtrack(_maxtrack), minhead(_minhead), maxhead(_maxhead), spt(_spt)
+{
+	nextTrack = mintrack;
+	nextHead = minhead;
+	lastSize = DEFAULT_SECTOR_LEN;
+	nGood = nBad = 0;
+	bShutdown = false;
+
+	fp = fopen(filename.c_str(), "wb");
+	if (fp == NULL) {
+		throw EApplicationError("Unable to open sector image '" + filename + "': " + strerror(errno));
+	}
+	fpMap = fopen(mapfilename.c_str(), "w");
+	if (fpMap == NULL) {
+		fclose(fp);
+		throw EApplicationError("Unable to open bad sector map '" + mapfilename + "': " + strerror(errno));
+	}
+	fprintf(fpMap, "# Bad sector map for %s\n# track head sector status\n", filename.c_str());
+
+	if (threads < 1) threads = 1;
+	for (unsigned int i=0; i<threads; i++)
+		vWorkers.push_back(std::thread(&CImageExporter::workerThread, this));
+}
+
+CImageExporter::~CImageExporter()
+{
+	// Make sure the workers have finished; errors are ignored here because
+	// we can't throw from a destructor.
+	try {
+		close();
+	} catch (EApplicationError &) {
+	}
+
+	for (deque<CJob *>::iterator it = qJobs.begin(); it != qJobs.end(); it++)
+		delete *it;
+}
+
+void CImageExporter::workerThread(void)
+{
+	// Each worker has its own decoder, which keeps its buffers between tracks
+	CFluxDecoder decoder(encoding, datarate, clock_hz);
+	vector<CDecodedSector> sectors;
+
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true) {
+		// Wait for something to decode
+		while (qJobs.empty() && !bShutdown)
+			cvJobs.wait(lock);
+		if (qJobs.empty()) break;	// shutdown and nothing left to do
+
+		CJob *job = qJobs.front();
+		qJobs.pop_front();
+		cvSpace.notify_one();
+
+		// Decode without holding the lock
+		lock.unlock();
+		sectors.clear();
+		if (!job->data.empty()) decoder.decodeTrack(&job->data[0], job->data.size(), sectors);
+		lock.lock();
+
+		// Keep the best copy of each sector. Sectors from another track or side
+		// (the heads were in the wrong place) or outside the format are ignored.
+		CTrackState &state = mTracks[make_pair(job->track, job->head)];
+		for (vector<CDecodedSector>::iterator s = sectors.begin(); s != sectors.end(); s++) {
+			if ((s->cyl != (unsigned char)job->track) || (s->head != (unsigned char)job->head) ||
+					(s->sector < 1) || (s->sector > spt)) continue;
+			map<unsigned char, CDecodedSector>::iterator old = state.sectors.find(s->sector);
+			if ((old == state.sectors.end()) || (sector_score(*s) > sector_score(old->second)))
+				state.sectors[s->sector] = *s;
+		}
+		state.pending--;
+		delete job;
+
+		writeReady();
+	}
+}
+
+void CImageExporter::writeReady(void)
+{
+	// Caller must hold the lock. Once an error has occurred, nothing more is
+	// written.
+	while (sError.empty() && (nextTrack <= maxtrack)) {
+		map<pair<unsigned long, unsigned long>, CTrackState>::iterator it = mTracks.find(make_pair(nextTrack, nextHead));
+		if ((it == mTracks.end()) || !it->second.finished || (it->second.pending > 0)) break;
+
+		try {
+			writeTrack(nextTrack, nextHead, it->second);
+		} catch (EApplicationError &e) {
+			sError = e.what();
+			cvSpace.notify_all();
+		}
+		mTracks.erase(it);
+
+		if (++nextHead > maxhead) {
+			nextHead = minhead;
+			nextTrack++;
+		}
+	}
+}
+
+void CImageExporter::writeTrack(const unsigned long track, const unsigned long head, CTrackState &state)
+{
+	// All the sectors are written at the same length: whatever the ID records
+	// on this track say, or failing that, the same as the last track
+	size_t len = lastSize;
+	if (!state.sectors.empty()) len = 128 << state.sectors.begin()->second.size;
+	lastSize = len;
+
+	vector<unsigned char> buf;
+	for (unsigned long sector=1; sector<=spt; sector++) {
+		map<unsigned char, CDecodedSector>::iterator s = state.sectors.find(sector);
+		const char *status = NULL;
+		if (s == state.sectors.end()) {
+			status = "missing";
+			buf.assign(len, 0);
+		} else {
+			buf = s->second.data;
+			buf.resize(len, 0);
+			if (s->second.data.empty()) {
+				status = "nodata";
+			} else if (!s->second.dataOK) {
+				status = "crc";
+			}
+		}
+
+		if (fwrite(&buf[0], 1, len, fp) != len) {
+			throw EApplicationError("Error writing to sector image '" + filename + "': " + strerror(errno));
+		}
+		if (status != NULL) {
+			if (fprintf(fpMap, "%lu %lu %lu %s\n", track, head, sector, status) < 0)
+				throw EApplicationError("Error writing to bad sector map '" + mapfilename + "': " + strerror(errno));
+			nBad++;
+		} else {
+			nGood++;
+		}
+	}
+}
+
+void CImageExporter::checkError(void)
+{
+	// Caller must hold the lock
+	if (!sError.empty()) throw EApplicationError(sError);
+}
+
+void CImageExporter::submit(const unsigned long track, const unsigned long head, const unsigned char *data, const size_t len)
+{
+	CJob *job = new CJob;
+	job->track = track;
+	job->head = head;
+	job->data.assign(data, data + len);
+
+	std::unique_lock<std::mutex> lock(mtx);
+	while ((qJobs.size() >= (JOBS_PER_WORKER * vWorkers.size())) && sError.empty())
+		cvSpace.wait(lock);
+	if (!sError.empty()) {
+		delete job;
+		checkError();
+	}
+
+	mTracks[make_pair(track, head)].pending++;
+	qJobs.push_back(job);
+	cvJobs.notify_one();
+}
+
+void CImageExporter::finishTrack(const unsigned long track, const unsigned long head)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	checkError();
+	mTracks[make_pair(track, head)].finished = true;
+	writeReady();
+	checkError();
+}
+
+void CImageExporter::close(void)
+{
+	if (fp == NULL) return;
+
+	// Ask the workers to finish the queue and exit
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bShutdown = true;
+		cvJobs.notify_all();
+	}
+	for (vector<std::thread>::iterator it = vWorkers.begin(); it != vWorkers.end(); it++)
+		if (it->joinable()) it->join();
+
+	// Tracks which were never finished (e.g. the capture was aborted) are
+	// left out of the image
+	string err = sError;
+	if ((fclose(fp) != 0) && err.empty())
+		err = "Error closing sector image '" + filename + "': " + strerror(errno);
+	if ((fclose(fpMap) != 0) && err.empty())
+		err = "Error closing bad sector map '" + mapfilename + "': " + strerror(errno);
+	fp = fpMap = NULL;
+
+	if (!err.empty()) throw EApplicationError(err);
+}
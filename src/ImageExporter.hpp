@@ -0,0 +1,138 @@
+#ifndef _hpp_ImageExporter
+#define _hpp_ImageExporter
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstdio>
+
+// C++11 threading
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Local headers
+#include "FluxDecoder.hpp"
+
+/**
+ * @brief	Decodes captured tracks into a sector image while the capture runs.
+ *
+ * Captures are handed to a pool of worker threads, which decode them while
+ * the acquisition loop moves on to the next track. A track can be captured
+ * more than once (e.g. re-reads with --verify); the best copy of each sector
+ * from any capture is kept.
+ *
+ * Once a track has been finished with and all of its captures decoded, it
+ * is written to the image -- as soon as every track before it (in cylinder,
+ * head, sector order) has been written too. So the image is complete as
+ * soon as the last track has been decoded, with no second pass.
+ *
+ * The image is a plain sector dump (".img"): sectors 1 to spt of each track,
+ * in order. Sectors which couldn't be read are written anyway, with the data
+ * from a bad-CRC read if there was one, or zeros if not, and are listed in
+ * a bad sector map alongside the image.
+ */
+class CImageExporter {
+	private:
+		/// A capture waiting to be decoded
+		class CJob {
+			public:
+				unsigned long	track, head;
+				std::vector<unsigned char>	data;
+		};
+
+		/// Sectors decoded so far for one track
+		class CTrackState {
+			public:
+				std::map<unsigned char, CDecodedSector>	sectors;	///< Best copy of each sector
+				unsigned int	pending;	///< Captures queued or being decoded
+				bool			finished;	///< No more captures will be added
+
+				CTrackState() : pending(0), finished(false) { };
+		};
+
+		std::string			filename, mapfilename;
+		FILE				*fp, *fpMap;
+		CFluxDecoder::Encoding	encoding;
+		unsigned long		datarate, clock_hz;
+		unsigned long		mintrack, maxtrack, minhead, maxhead, spt;
+
+		std::deque<CJob *>	qJobs;		///< Captures waiting for a worker
+		std::map<std::pair<unsigned long, unsigned long>, CTrackState>	mTracks;	///< Tracks not yet written, by (track, head)
+		unsigned long		nextTrack, nextHead;	///< Next track to be written to the image
+		size_t				lastSize;	///< Sector length used for the last track written
+		unsigned long		nGood, nBad;
+
+		std::vector<std::thread>	vWorkers;
+		std::mutex					mtx;
+		std::condition_variable		cvJobs;		///< Signalled when qJobs gains an entry (or on shutdown)
+		std::condition_variable		cvSpace;	///< Signalled when qJobs loses an entry (or on error)
+		bool						bShutdown;
+		std::string					sError;		///< Worker error message, empty if no error
+
+		void workerThread(void);
+		void writeReady(void);
+		void writeTrack(const unsigned long track, const unsigned long head, CTrackState &state);
+		void checkError(void);
+
+		// Non-copyable
+		CImageExporter(const CImageExporter &);
+		CImageExporter &operator=(const CImageExporter &);
+
+	public:
+		/**
+		 * @brief	Create the image and bad sector map, and start the workers.
+		 *
+		 * @param	_filename	Image filename. The bad sector map is saved as this
+		 * 						with ".bad" on the end.
+		 * @param	_encoding	Data encoding
+		 * @param	_datarate	Data rate in kbps
+		 * @param	_clock_hz	Acquisition clock rate in Hz
+		 * @param	_mintrack	First track to be captured
+		 * @param	_maxtrack	Last track to be captured
+		 * @param	_minhead	First head to be captured
+		 * @param	_maxhead	Last head to be captured
+		 * @param	_spt		Sectors per track (numbered from 1)
+		 * @param	threads		Number of worker threads
+		 */
+		CImageExporter(const std::string _filename, const CFluxDecoder::Encoding _encoding,
+				const unsigned long _datarate, const unsigned long _clock_hz,
+				const unsigned long _mintrack, const unsigned long _maxtrack,
+				const unsigned long _minhead, const unsigned long _maxhead,
+				const unsigned long _spt, unsigned int threads);
+		~CImageExporter();
+
+		/**
+		 * @brief	Queue a capture of a track for decoding.
+		 *
+		 * The data is copied, so the caller's buffer can be reused straight
+		 * away. Only blocks if the workers have fallen well behind.
+		 */
+		void submit(const unsigned long track, const unsigned long head, const unsigned char *data, const size_t len);
+
+		/**
+		 * @brief	Mark a track as finished: no more captures of it will be submitted.
+		 */
+		void finishTrack(const unsigned long track, const unsigned long head);
+
+		/**
+		 * @brief	Decode everything queued, write the finished tracks, stop the
+		 * 			workers and close the files.
+		 *
+		 * Throws EApplicationError if any write failed.
+		 */
+		void close(void);
+
+		/// Return the number of sectors written to the image which were read successfully
+		unsigned long goodSectors(void) const	{ return nGood; };
+
+		/// Return the number of sectors written to the image which couldn't be read
+		unsigned long badSectors(void) const	{ return nBad; };
+
+		/// Return the bad sector map filename
+		std::string mapFilename(void) const		{ return mapfilename; };
+};
+
+#endif // _hpp_ImageExporter
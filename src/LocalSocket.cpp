@@ -0,0 +1,243 @@
+// STL headers
+#include <string>
+#include <ostream>
+#include <cstring>
+#include <cerrno>
+
+// C++11 timekeeping
+#include <chrono>
+
+// Platform headers for sockets
+#ifndef _WIN32
+#  include <unistd.h>
+#  include <poll.h>
+#  include <sys/types.h>
+#  include <sys/time.h>
+#  include <sys/stat.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#endif
+
+// Local headers
+#include "Exceptions.hpp"
+#include "LocalSocket.hpp"
+
+using namespace std;
+
+// Linux can be told not to raise SIGPIPE on each send; elsewhere it's set
+// on the socket, where the platform allows it
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/// Longest time a send can take before the other end is given up on
+static const long SEND_TIMEOUT_MS = 2000;
+
+#ifdef _WIN32
+
+int CLocalSocket::CSendBuf::overflow(int c)				{ return traits_type::eof(); }
+int CLocalSocket::CSendBuf::sync(void)					{ return -1; }
+
+CLocalSocket::CLocalSocket(int _fd) : fd(_fd), sbuf(_fd), os(&sbuf)	{ }
+CLocalSocket::~CLocalSocket()							{ }
+bool CLocalSocket::readLine(std::string &line)			{ return false; }
+CLocalSocket::ReadResult CLocalSocket::readLine(std::string &line, const unsigned long timeout_ms)	{ return READ_CLOSED; }
+
+CLocalSocket *CLocalSocket::connect(const std::string path)
+{
+	throw EApplicationError("Local sockets are not supported on Windows");
+}
+
+CLocalListener::CLocalListener(const std::string _path) : fd(-1), path(_path)
+{
+	throw EApplicationError("Local sockets are not supported on Windows");
+}
+
+CLocalListener::~CLocalListener()						{ }
+CLocalSocket *CLocalListener::accept(const unsigned long timeout_ms)	{ return NULL; }
+
+#else
+
+/**
+ * Fill in the address of a socket file.
+ *
+ * Throws EApplicationError if the path is too long to fit.
+ */
+static void make_address(const std::string path, struct sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || (path.length() >= sizeof(addr.sun_path)))
+		throw EApplicationError("Invalid socket path '" + path + "'");
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+}
+
+int CLocalSocket::CSendBuf::overflow(int c)
+{
+	if (c == traits_type::eof()) return traits_type::not_eof(c);
+	pending += (char)c;
+	return c;
+}
+
+int CLocalSocket::CSendBuf::sync(void)
+{
+	size_t done = 0;
+	while ((fd >= 0) && (done < pending.length())) {
+		ssize_t n = send(fd, pending.data() + done, pending.length() - done, MSG_NOSIGNAL);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) {
+			// The other end has gone away, or stopped reading. Don't try again.
+			fd = -1;
+		} else {
+			done += n;
+		}
+	}
+	pending.clear();
+	return (fd >= 0) ? 0 : -1;
+}
+
+CLocalSocket::CLocalSocket(int _fd) : fd(_fd), sbuf(_fd), os(&sbuf)
+{
+	struct timeval tv;
+	tv.tv_sec = SEND_TIMEOUT_MS / 1000;
+	tv.tv_usec = (SEND_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+CLocalSocket::~CLocalSocket()
+{
+	os.flush();
+	close(fd);
+}
+
+CLocalSocket *CLocalSocket::connect(const std::string path)
+{
+	struct sockaddr_un addr;
+	make_address(path, addr);
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) throw EApplicationError(string("Unable to create socket: ") + strerror(errno));
+	if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		string err = strerror(errno);
+		close(s);
+		throw EApplicationError("Unable to connect to '" + path + "': " + err);
+	}
+	return new CLocalSocket(s);
+}
+
+bool CLocalSocket::readLine(std::string &line)
+{
+	size_t nl;
+	while ((nl = rbuf.find('\n')) == string::npos) {
+		char buf[512];
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) return false;
+		rbuf.append(buf, n);
+	}
+	line = rbuf.substr(0, nl);
+	rbuf.erase(0, nl + 1);
+	if (!line.empty() && (line[line.length() - 1] == '\r')) line.erase(line.length() - 1);
+	return true;
+}
+
+CLocalSocket::ReadResult CLocalSocket::readLine(std::string &line, const unsigned long timeout_ms)
+{
+	// The whole line has to come in time, not just each piece of it
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+	while (rbuf.find('\n') == string::npos) {
+		long left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+		if (left < 0) left = 0;
+
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		int r = poll(&p, 1, left);
+		if ((r < 0) && (errno == EINTR)) continue;
+		if (r < 0) return READ_CLOSED;
+		if (r == 0) return READ_TIMEOUT;
+
+		char buf[512];
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) return READ_CLOSED;
+		rbuf.append(buf, n);
+	}
+	return readLine(line) ? READ_OK : READ_CLOSED;
+}
+
+CLocalListener::CLocalListener(const std::string _path) : fd(-1), path(_path)
+{
+	struct sockaddr_un addr;
+	make_address(path, addr);
+
+	// If there's a socket file already, make sure nothing is using it before
+	// taking it over
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) throw EApplicationError(string("Unable to create socket: ") + strerror(errno));
+	if (::connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		close(s);
+		throw EApplicationError("Something is already listening on '" + path + "'");
+	}
+	struct stat st;
+	if ((errno == ECONNREFUSED) && (stat(path.c_str(), &st) == 0) && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+	close(s);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw EApplicationError(string("Unable to create socket: ") + strerror(errno));
+
+	// Only our own user may connect. The umask closes the window between
+	// bind() and chmod(); accept() checks who's at the other end as well,
+	// for systems which ignore the permissions on a socket file.
+	mode_t oldmask = umask(0177);
+	int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(oldmask);
+	if ((r != 0) || (chmod(path.c_str(), 0600) != 0) || (listen(fd, 8) != 0)) {
+		string err = strerror(errno);
+		close(fd);
+		if (r == 0) unlink(path.c_str());
+		throw EApplicationError("Unable to listen on '" + path + "': " + err);
+	}
+}
+
+CLocalListener::~CLocalListener()
+{
+	close(fd);
+	unlink(path.c_str());
+}
+
+CLocalSocket *CLocalListener::accept(const unsigned long timeout_ms)
+{
+	struct pollfd p;
+	p.fd = fd;
+	p.events = POLLIN;
+	p.revents = 0;
+	if (poll(&p, 1, timeout_ms) <= 0) return NULL;
+
+	int s = ::accept(fd, NULL, NULL);
+	if (s < 0) return NULL;
+
+	// Turn away anyone but our own user and root
+	uid_t uid = (uid_t)-1;
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0) uid = cred.uid;
+#else
+	gid_t gid;
+	if (getpeereid(s, &uid, &gid) != 0) uid = (uid_t)-1;
+#endif
+	if ((uid != geteuid()) && (uid != 0)) {
+		close(s);
+		return NULL;
+	}
+
+	return new CLocalSocket(s);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef _hpp_LocalSocket
+#define _hpp_LocalSocket
+
+// C++ STL headers
+#include <string>
+#include <ostream>
+#include <streambuf>
+
+/**
+ * @brief	One end of a connection on a local (Unix domain) socket.
+ *
+ * The acquisition daemon and its clients talk in lines of text. readLine()
+ * reads them one at a time, and stream() is an ostream which sends whatever
+ * is written to it, each time it's flushed.
+ *
+ * Sends time out rather than block for ever, so a client which stops
+ * reading can't hold up a capture; once a send has failed, anything else
+ * written to stream() is thrown away.
+ */
+class CLocalSocket {
+	private:
+		/// Stream buffer which sends to the socket when flushed
+		class CSendBuf : public std::streambuf {
+			private:
+				int				fd;
+				std::string		pending;	///< Text which hasn't been sent yet
+
+			protected:
+				virtual int overflow(int c);
+				virtual int sync(void);
+
+			public:
+				CSendBuf(int _fd) : fd(_fd) { };
+		};
+
+		int				fd;
+		std::string		rbuf;		///< Text received but not read yet
+		CSendBuf		sbuf;
+		std::ostream	os;
+
+		// Owns a socket; can't be copied
+		CLocalSocket(const CLocalSocket &);
+		CLocalSocket &operator=(const CLocalSocket &);
+
+	public:
+		/// Result of a timed readLine()
+		enum ReadResult {
+			READ_OK,		///< A line was read
+			READ_TIMEOUT,	///< No whole line came in time; the text so far is kept for next time
+			READ_CLOSED		///< The connection was closed before a whole line came in
+		};
+
+		/// Take over a connected socket
+		CLocalSocket(int _fd);
+		~CLocalSocket();
+
+		/**
+		 * @brief	Connect to a listening socket.
+		 *
+		 * Throws EApplicationError if nothing is listening on it.
+		 */
+		static CLocalSocket *connect(const std::string path);
+
+		/**
+		 * @brief	Read a line, without its newline.
+		 * @return	false if the connection was closed before a whole line
+		 * 			came in
+		 */
+		bool readLine(std::string &line);
+
+		/**
+		 * @brief	Read a line, without its newline, giving up after a while.
+		 *
+		 * @param	timeout_ms	Longest time to wait, in milliseconds
+		 */
+		ReadResult readLine(std::string &line, const unsigned long timeout_ms);
+
+		/// Return a stream which sends to the other end
+		std::ostream &stream(void)				{ return os; };
+};
+
+/**
+ * @brief	Local (Unix domain) socket which accepts connections.
+ *
+ * The socket file is only accessible to the user who created it, and
+ * connections from any other user (apart from root) are refused. The socket
+ * file is removed again when the listener is destroyed.
+ */
+class CLocalListener {
+	private:
+		int				fd;
+		std::string		path;
+
+		// Owns a socket; can't be copied
+		CLocalListener(const CLocalListener &);
+		CLocalListener &operator=(const CLocalListener &);
+
+	public:
+		/**
+		 * @brief	Start listening on a socket.
+		 *
+		 * A socket file left behind by a process which has gone away is
+		 * replaced. Throws EApplicationError if the socket can't be created,
+		 * or another process is already listening on it.
+		 */
+		CLocalListener(const std::string _path);
+		~CLocalListener();
+
+		/**
+		 * @brief	Wait for a connection.
+		 *
+		 * @param	timeout_ms	Longest time to wait, in milliseconds
+		 * @return	The new connection, or NULL if there wasn't one in time, or
+		 * 			it came from another user
+		 */
+		CLocalSocket *accept(const unsigned long timeout_ms);
+};
+
+#endif // _hpp_LocalSocket
@@ -0,0 +1,209 @@
+// STL headers
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+// Local headers
+#include "Metrics.hpp"
+
+using namespace std;
+
+unsigned long long CStopwatch::lap(void)
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	unsigned long long us = chrono::duration_cast<chrono::microseconds>(now - tLap).count();
+	tLap = now;
+	return us;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+CAcqMetrics::CAcqMetrics()
+{
+	tStart = chrono::steady_clock::now();
+	clear(current);
+	clear(total);
+	bInTrack = false;
+	fileWrite_us = 0;
+}
+
+void CAcqMetrics::clear(TrackRecord &r)
+{
+	r.track = r.head = r.sector = 0;
+	for (int i=0; i<PHASE_COUNT; i++) r.phase_us[i] = 0;
+	r.polls = 0;
+	r.bytes = 0;
+}
+
+const char *CAcqMetrics::phaseName(const Phase p)
+{
+	switch (p) {
+		case PHASE_SETUP:		return "setup";
+		case PHASE_SEEK:		return "seek";
+		case PHASE_SETTLE:		return "settle";
+		case PHASE_READY:		return "ready";
+		case PHASE_INDEX:		return "index";
+		case PHASE_CAPTURE:		return "capture";
+		case PHASE_READBACK:	return "readback";
+		case PHASE_WRITE:		return "write";
+		case PHASE_VERIFY:		return "verify";
+		default:				return "unknown";
+	}
+}
+
+void CAcqMetrics::beginTrack(const unsigned long track, const unsigned long head, const unsigned long sector)
+{
+	if (bInTrack) endTrack();
+
+	// Anything counted between tracks (e.g. a seek) belongs to the next one,
+	// so don't clear the counters here
+	current.track = track;
+	current.head = head;
+	current.sector = sector;
+	bInTrack = true;
+}
+
+void CAcqMetrics::endTrack(void)
+{
+	if (!bInTrack) return;
+	vTracks.push_back(current);
+	clear(current);
+	bInTrack = false;
+}
+
+void CAcqMetrics::add(const Phase p, const unsigned long long us)
+{
+	current.phase_us[p] += us;
+	total.phase_us[p] += us;
+}
+
+unsigned long long CAcqMetrics::elapsed_us(void) const
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tStart).count();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Export
+
+static void json_phases(FILE *fp, const CAcqMetrics::TrackRecord &r)
+{
+	fprintf(fp, "\"phases_us\": {");
+	for (int i=0; i<CAcqMetrics::PHASE_COUNT; i++) {
+		fprintf(fp, "%s\"%s\": %llu", (i > 0) ? ", " : "",
+				CAcqMetrics::phaseName((CAcqMetrics::Phase)i), r.phase_us[i]);
+	}
+	fprintf(fp, "}");
+}
+
+void CAcqMetrics::writeJSONBody(FILE *fp, const char *indent) const
+{
+	fprintf(fp, "%s\"run\": {\"tracks\": %lu, \"elapsed_us\": %llu, \"polls\": %lu, \"bytes\": %llu, \"file_write_us\": %llu, ",
+			indent, (unsigned long)vTracks.size(), elapsed_us(), total.polls, total.bytes, fileWrite_us);
+	json_phases(fp, total);
+	fprintf(fp, "},\n%s\"tracks\": [", indent);
+
+	for (vector<TrackRecord>::const_iterator it = vTracks.begin(); it != vTracks.end(); it++) {
+		fprintf(fp, "%s\n%s  {\"track\": %lu, \"head\": %lu, \"sector\": %lu, \"polls\": %lu, \"bytes\": %llu, ",
+				(it == vTracks.begin()) ? "" : ",", indent, it->track, it->head, it->sector, it->polls, it->bytes);
+		json_phases(fp, *it);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n%s]", indent);
+}
+
+bool CAcqMetrics::writeJSON(const std::string filename) const
+{
+	return writeJSON(filename, vector<const CAcqMetrics *>(1, this));
+}
+
+bool CAcqMetrics::writeJSON(const std::string filename, const std::vector<const CAcqMetrics *> &runs)
+{
+	FILE *fp = fopen(filename.c_str(), "w");
+	if (fp == NULL) return false;
+
+	if (runs.size() == 1) {
+		fprintf(fp, "{\n");
+		runs[0]->writeJSONBody(fp, "  ");
+		fprintf(fp, "\n}\n");
+	} else {
+		fprintf(fp, "{\n  \"devices\": [");
+		for (vector<const CAcqMetrics *>::const_iterator it = runs.begin(); it != runs.end(); it++) {
+			fprintf(fp, "%s\n    {\n      \"serial\": \"%s\",\n", (it == runs.begin()) ? "" : ",", (*it)->sDevice.c_str());
+			(*it)->writeJSONBody(fp, "      ");
+			fprintf(fp, "\n    }");
+		}
+		fprintf(fp, "\n  ]\n}\n");
+	}
+
+	return (fclose(fp) == 0);
+}
+
+std::string CAcqMetrics::labels(const char *extra) const
+{
+	string l;
+	if (!sDevice.empty()) l = "serial=\"" + sDevice + "\"";
+	if (extra != NULL) l += (l.empty() ? "" : ",") + string(extra);
+	return l.empty() ? "" : ("{" + l + "}");
+}
+
+bool CAcqMetrics::writePrometheus(const std::string filename) const
+{
+	return writePrometheus(filename, vector<const CAcqMetrics *>(1, this));
+}
+
+bool CAcqMetrics::writePrometheus(const std::string filename, const std::vector<const CAcqMetrics *> &runs)
+{
+	string tmpname = filename + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "w");
+	if (fp == NULL) return false;
+	vector<const CAcqMetrics *>::const_iterator it;
+
+	fprintf(fp, "# HELP magpie_phase_seconds_total Time spent in each acquisition phase.\n");
+	fprintf(fp, "# TYPE magpie_phase_seconds_total counter\n");
+	for (it = runs.begin(); it != runs.end(); it++) {
+		for (int i=0; i<PHASE_COUNT; i++) {
+			string phase = string("phase=\"") + phaseName((Phase)i) + "\"";
+			fprintf(fp, "magpie_phase_seconds_total%s %.6f\n", (*it)->labels(phase.c_str()).c_str(), (*it)->total.phase_us[i] / 1.0e6);
+		}
+	}
+
+	fprintf(fp, "# HELP magpie_file_write_seconds_total Time spent writing the output file.\n");
+	fprintf(fp, "# TYPE magpie_file_write_seconds_total counter\n");
+	for (it = runs.begin(); it != runs.end(); it++)
+		fprintf(fp, "magpie_file_write_seconds_total%s %.6f\n", (*it)->labels(NULL).c_str(), (*it)->fileWrite_us / 1.0e6);
+
+	fprintf(fp, "# HELP magpie_tracks_total Tracks acquired.\n");
+	fprintf(fp, "# TYPE magpie_tracks_total counter\n");
+	for (it = runs.begin(); it != runs.end(); it++)
+		fprintf(fp, "magpie_tracks_total%s %lu\n", (*it)->labels(NULL).c_str(), (unsigned long)(*it)->vTracks.size());
+
+	fprintf(fp, "# HELP magpie_status_polls_total DiscFerret status register polls.\n");
+	fprintf(fp, "# TYPE magpie_status_polls_total counter\n");
+	for (it = runs.begin(); it != runs.end(); it++)
+		fprintf(fp, "magpie_status_polls_total%s %lu\n", (*it)->labels(NULL).c_str(), (*it)->total.polls);
+
+	fprintf(fp, "# HELP magpie_read_bytes_total Bytes read from DiscFerret acquisition RAM.\n");
+	fprintf(fp, "# TYPE magpie_read_bytes_total counter\n");
+	for (it = runs.begin(); it != runs.end(); it++)
+		fprintf(fp, "magpie_read_bytes_total%s %llu\n", (*it)->labels(NULL).c_str(), (*it)->total.bytes);
+
+	fprintf(fp, "# HELP magpie_run_seconds Time since the acquisition run started.\n");
+	fprintf(fp, "# TYPE magpie_run_seconds gauge\n");
+	for (it = runs.begin(); it != runs.end(); it++)
+		fprintf(fp, "magpie_run_seconds%s %.6f\n", (*it)->labels(NULL).c_str(), (*it)->elapsed_us() / 1.0e6);
+
+	if (fclose(fp) != 0) {
+		remove(tmpname.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// rename() won't replace an existing file on Windows
+	remove(filename.c_str());
+#endif
+	if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,144 @@
+#ifndef _hpp_Metrics
+#define _hpp_Metrics
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <cstdio>
+
+// C++11 timekeeping
+#include <chrono>
+
+/**
+ * @brief	Interval timer.
+ *
+ * lap() returns the time since the stopwatch was created or last lapped, so
+ * consecutive phases of an operation can be timed without gaps.
+ */
+class CStopwatch {
+	private:
+		std::chrono::steady_clock::time_point	tLap;
+
+	public:
+		CStopwatch()							{ tLap = std::chrono::steady_clock::now(); };
+
+		/// Return the number of microseconds since the last lap, and start a new one
+		unsigned long long lap(void);
+};
+
+/**
+ * @brief	Acquisition timing and transfer counters.
+ *
+ * Records where the time goes for each track (register setup, seek,
+ * settle, waiting for ready, waiting for the index, capture, RAM readback,
+ * handing the data to the output file writer and image exporter, and
+ * verifying the data), along with status poll counts and bytes transferred.
+ * Totals are kept for the whole run.
+ *
+ * The results can be saved as a JSON summary or as a Prometheus textfile
+ * collector file. When several DiscFerrets are capturing at once, each has
+ * its own CAcqMetrics, labelled with its serial number, and they're saved
+ * together in one file.
+ */
+class CAcqMetrics {
+	public:
+		/// Acquisition phases
+		enum Phase {
+			PHASE_SETUP,		///< Programming the DiscFerret registers
+			PHASE_SEEK,			///< Stepping the heads
+			PHASE_SETTLE,		///< Waiting for the heads to settle
+			PHASE_READY,		///< Waiting for the drive to become ready
+			PHASE_INDEX,		///< Waiting for the index pulse(s) before the capture
+			PHASE_CAPTURE,		///< Capturing flux data
+			PHASE_READBACK,		///< Reading acquisition RAM over USB
+			PHASE_WRITE,		///< Waiting for a free output buffer, and handing the data to the image exporter
+			PHASE_VERIFY,		///< Decoding and checking the captured data
+			PHASE_COUNT
+		};
+
+		/// Per-track counters
+		struct TrackRecord {
+			unsigned long		track, head, sector;
+			unsigned long long	phase_us[PHASE_COUNT];	///< Time spent in each phase
+			unsigned long		polls;					///< Status register polls
+			unsigned long long	bytes;					///< Bytes read from acquisition RAM
+		};
+
+	private:
+		std::chrono::steady_clock::time_point	tStart;
+		std::vector<TrackRecord>	vTracks;		///< Completed tracks
+		TrackRecord			current;				///< Track in progress
+		bool				bInTrack;
+		TrackRecord			total;					///< Totals for the run (CHS unused)
+		unsigned long long	fileWrite_us;			///< Time the writer thread spent writing
+		std::string			sDevice;				///< Serial number label, if any
+
+		static void clear(TrackRecord &r);
+		void writeJSONBody(FILE *fp, const char *indent) const;
+		std::string labels(const char *extra) const;
+
+	public:
+		CAcqMetrics();
+
+		/// Return the name of a phase, as used in the exported files
+		static const char *phaseName(const Phase p);
+
+		/// Start collecting counters for a track (finishing the previous one if necessary)
+		void beginTrack(const unsigned long track, const unsigned long head, const unsigned long sector);
+		/// Finish the current track
+		void endTrack(void);
+
+		/// Add time to a phase of the current track
+		void add(const Phase p, const unsigned long long us);
+		/// Add status register polls to the current track
+		void addPolls(const unsigned long n)			{ current.polls += n; total.polls += n; };
+		/// Add bytes read from the DiscFerret to the current track
+		void addBytes(const unsigned long long n)		{ current.bytes += n; total.bytes += n; };
+		/// Set the time the output file writer spent writing
+		void setFileWriteTime(const unsigned long long us)	{ fileWrite_us = us; };
+		/// Label the counters with a DiscFerret serial number
+		void setDevice(const std::string serial)		{ sDevice = serial; };
+
+		/// Return the number of completed tracks
+		size_t tracks(void) const						{ return vTracks.size(); };
+		/// Return the run totals
+		const TrackRecord &totals(void) const			{ return total; };
+		/// Return the number of microseconds since the run started
+		unsigned long long elapsed_us(void) const;
+
+		/**
+		 * @brief	Save the run totals and per-track counters as JSON.
+		 * @return	true on success
+		 */
+		bool writeJSON(const std::string filename) const;
+
+		/**
+		 * @brief	Save the run totals in Prometheus text exposition format.
+		 *
+		 * The file is written under a temporary name and renamed into place,
+		 * so a textfile collector never sees a partial file.
+		 *
+		 * @return	true on success
+		 */
+		bool writePrometheus(const std::string filename) const;
+
+		/**
+		 * @brief	Save the counters for several DiscFerrets as JSON.
+		 *
+		 * Each device's run totals and tracks are listed under its serial
+		 * number. With only one, the file is the same as writeJSON() writes.
+		 *
+		 * @return	true on success
+		 */
+		static bool writeJSON(const std::string filename, const std::vector<const CAcqMetrics *> &runs);
+
+		/**
+		 * @brief	Save the run totals for several DiscFerrets in Prometheus
+		 * 			text exposition format, with a "serial" label on each.
+		 *
+		 * @return	true on success
+		 */
+		static bool writePrometheus(const std::string filename, const std::vector<const CAcqMetrics *> &runs);
+};
+
+#endif // _hpp_Metrics
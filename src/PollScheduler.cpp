@@ -0,0 +1,61 @@
+// STL headers
+#include <string>
+#include <sstream>
+
+// C++11 threading
+#include <thread>
+
+// Local headers
+#include "Exceptions.hpp"
+#include "PollScheduler.hpp"
+
+using namespace std;
+
+CPollScheduler::CPollScheduler(const std::string _what, unsigned long _expected_us, unsigned long _deadline_us)
+{
+	what = _what;
+	expected_us = _expected_us;
+	deadline_us = _deadline_us;
+	interval_us = MIN_INTERVAL_US;
+	nPolls = 0;
+	tStart = chrono::steady_clock::now();
+}
+
+unsigned long CPollScheduler::elapsed_us(void) const
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tStart).count();
+}
+
+void CPollScheduler::wait(void)
+{
+	unsigned long now = elapsed_us();
+
+	// Have we run out of time?
+	if ((deadline_us > 0) && (now >= deadline_us)) {
+		stringstream s;
+		s << "gave up waiting for " << what << " after " << (now / 1000) << "ms (" << nPolls << " polls)";
+		throw ETimeoutError(s.str());
+	}
+
+	unsigned long sleep_us;
+	if ((expected_us > LEAD_US) && (now < (expected_us - LEAD_US))) {
+		// Too early -- sleep until just before the event is due
+		sleep_us = (expected_us - LEAD_US) - now;
+	} else if (nPolls == 0) {
+		// The event is due now, so poll straight away
+		sleep_us = 0;
+	} else {
+		// Overdue. Back off, so a late event doesn't cost us a flood of USB traffic.
+		sleep_us = interval_us;
+		interval_us = (interval_us * 2 > MAX_INTERVAL_US) ? MAX_INTERVAL_US : interval_us * 2;
+	}
+
+	// Never sleep past the deadline
+	if ((deadline_us > 0) && (now + sleep_us > deadline_us))
+		sleep_us = deadline_us - now;
+
+	if (sleep_us > 0)
+		this_thread::sleep_for(chrono::microseconds(sleep_us));
+
+	nPolls++;
+}
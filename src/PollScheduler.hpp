@@ -0,0 +1,70 @@
+#ifndef _hpp_PollScheduler
+#define _hpp_PollScheduler
+
+// C++ STL headers
+#include <string>
+
+// C++11 timekeeping
+#include <chrono>
+
+/**
+ * @brief	Pacing for status-register polling loops.
+ *
+ * Polling the DiscFerret status register in a tight loop saturates the USB
+ * link and keeps a CPU core busy for no benefit. CPollScheduler is given a
+ * prediction of when the event being waited for will happen; it sleeps
+ * until shortly before then, and afterwards polls with an exponentially
+ * increasing interval. If the event hasn't happened by the deadline, an
+ * ETimeoutError is thrown.
+ *
+ * Usage:
+ * @code
+ *   CPollScheduler sched("drive ready", expected_us, timeout_us);
+ *   do {
+ *       sched.wait();
+ *       status = dev->getStatus();
+ *   } while (!ready(status));
+ * @endcode
+ */
+class CPollScheduler {
+	private:
+		std::string		what;			///< Description of the event (for timeout messages)
+		std::chrono::steady_clock::time_point	tStart;
+		unsigned long	expected_us;	///< Time until the event is expected
+		unsigned long	deadline_us;	///< Time until we give up, or zero for no deadline
+		unsigned long	interval_us;	///< Current polling interval
+		unsigned long	nPolls;			///< Number of calls to wait()
+
+	public:
+		/// Poll this far ahead of the expected event time, in microseconds
+		static const unsigned long LEAD_US = 2000;
+		/// Initial polling interval, in microseconds
+		static const unsigned long MIN_INTERVAL_US = 100;
+		/// Maximum polling interval, in microseconds
+		static const unsigned long MAX_INTERVAL_US = 5000;
+
+		/**
+		 * @param	_what			Description of the event, e.g. "drive ready"
+		 * @param	_expected_us	Time (from now) at which the event is expected, in
+		 * 							microseconds. Zero if unknown or immediate.
+		 * @param	_deadline_us	Time (from now) after which to give up, in
+		 * 							microseconds. Zero means wait forever.
+		 */
+		CPollScheduler(const std::string _what, unsigned long _expected_us, unsigned long _deadline_us);
+
+		/**
+		 * @brief	Wait until it's time for the next poll.
+		 *
+		 * The first call returns immediately unless the event is not expected
+		 * for a while. Throws ETimeoutError once the deadline has passed.
+		 */
+		void wait(void);
+
+		/// Return the number of microseconds since the scheduler was created
+		unsigned long elapsed_us(void) const;
+
+		/// Return the number of times wait() has been called
+		unsigned long polls(void) const		{ return nPolls; };
+};
+
+#endif // _hpp_PollScheduler
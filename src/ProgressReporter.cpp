@@ -0,0 +1,91 @@
+// STL headers
+#include <string>
+#include <iostream>
+
+// C++11 timekeeping
+#include <chrono>
+
+// Local headers
+#include "ProgressReporter.hpp"
+
+using namespace std;
+
+CProgressReporter::CProgressReporter(const unsigned long _interval_ms, std::ostream &_out) :
+	out(_out)
+{
+	interval_ms = _interval_ms;
+	bStatusNew = false;
+	bShutdown = false;
+	thReporter = std::thread(&CProgressReporter::reporterThread, this);
+}
+
+CProgressReporter::~CProgressReporter()
+{
+	stop();
+}
+
+void CProgressReporter::status(const std::string s)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	sStatus = s;
+	bStatusNew = true;
+	cv.notify_one();
+}
+
+void CProgressReporter::message(const std::string s)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	qMessages.push_back(s);
+	cv.notify_one();
+}
+
+void CProgressReporter::stop(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bShutdown = true;
+		cv.notify_one();
+	}
+	if (thReporter.joinable()) thReporter.join();
+}
+
+void CProgressReporter::reporterThread(void)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	chrono::steady_clock::time_point tNext = chrono::steady_clock::now();
+
+	while (true) {
+		// Wait for something to print. A new status line has to wait until
+		// the interval is up; messages and shutdown don't.
+		while (qMessages.empty() && !bShutdown) {
+			if (bStatusNew) {
+				if (chrono::steady_clock::now() >= tNext) break;
+				cv.wait_until(lock, tNext);
+			} else {
+				cv.wait(lock);
+			}
+		}
+
+		// Take everything that's due, then print it without holding the lock
+		deque<string> msgs;
+		msgs.swap(qMessages);
+		string st;
+		bool printStatus = bStatusNew && (bShutdown || (chrono::steady_clock::now() >= tNext));
+		if (printStatus) {
+			st = sStatus;
+			bStatusNew = false;
+		}
+		bool done = bShutdown && !bStatusNew;
+
+		lock.unlock();
+		for (deque<string>::const_iterator it = msgs.begin(); it != msgs.end(); it++)
+			out << *it << endl;
+		if (printStatus) {
+			out << st << endl;
+			tNext = chrono::steady_clock::now() + chrono::milliseconds(interval_ms);
+		}
+		lock.lock();
+
+		if (done && qMessages.empty()) break;
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef _hpp_ProgressReporter
+#define _hpp_ProgressReporter
+
+// C++ STL headers
+#include <string>
+#include <deque>
+#include <iostream>
+
+// C++11 threading
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * @brief	Rate-limited console progress output.
+ *
+ * Console output can block (e.g. on a slow terminal or a full pipe), which
+ * would stall the acquisition loop. CProgressReporter moves the printing to
+ * a separate thread. The acquisition thread just posts its latest status;
+ * the reporter prints the most recent status at most once per interval and
+ * drops any in between.
+ *
+ * Messages (e.g. warnings) are never dropped; they are printed in the order
+ * they were posted.
+ */
+class CProgressReporter {
+	private:
+		unsigned long			interval_ms;
+		std::ostream			&out;
+		std::string				sStatus;		///< Latest status line
+		bool					bStatusNew;		///< sStatus hasn't been printed yet
+		std::deque<std::string>	qMessages;		///< Messages waiting to be printed
+
+		std::mutex				mtx;
+		std::condition_variable	cv;
+		std::thread				thReporter;
+		bool					bShutdown;
+
+		void reporterThread(void);
+
+		// Owns a thread; can't be copied
+		CProgressReporter(const CProgressReporter &);
+		CProgressReporter &operator=(const CProgressReporter &);
+
+	public:
+		/**
+		 * @param	_interval_ms	Minimum time between status lines, in milliseconds.
+		 * 							Zero prints every status line.
+		 * @param	_out			Stream to print to
+		 */
+		CProgressReporter(const unsigned long _interval_ms, std::ostream &_out = std::cout);
+		~CProgressReporter();
+
+		/// Post a status line, replacing any which hasn't been printed yet
+		void status(const std::string s);
+
+		/// Post a message to be printed in full
+		void message(const std::string s);
+
+		/// Print anything outstanding and stop the reporter thread
+		void stop(void);
+};
+
+#endif // _hpp_ProgressReporter
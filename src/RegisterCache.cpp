@@ -0,0 +1,60 @@
+// Local headers
+#include "RegisterCache.hpp"
+
+using namespace std;
+
+CRegisterCache::CRegisterCache(CDeviceBackend *_dev)
+{
+	dev = _dev;
+	nWrites = nSaved = 0;
+
+	// Configuration registers -- these hold their value until they're written
+	// again, so a write of the same value is a no-op.
+	//
+	// libdiscferret doesn't provide a multi-register write, so each write
+	// which does need to happen is still a separate transfer.
+	sCacheable.insert(DISCFERRET_R_DRIVE_CONTROL);
+	sCacheable.insert(DISCFERRET_R_ACQ_START_EVT);
+	sCacheable.insert(DISCFERRET_R_ACQ_START_NUM);
+	sCacheable.insert(DISCFERRET_R_ACQ_STOP_EVT);
+	sCacheable.insert(DISCFERRET_R_ACQ_STOP_NUM);
+	sCacheable.insert(DISCFERRET_R_ACQ_CLKSEL);
+	sCacheable.insert(DISCFERRET_R_HSIO_DIR);
+}
+
+DISCFERRET_ERROR CRegisterCache::poke(const unsigned int addr, const unsigned char data)
+{
+	bool cacheable = (sCacheable.find(addr) != sCacheable.end());
+
+	if (cacheable) {
+		map<unsigned int, unsigned char>::const_iterator it = mShadow.find(addr);
+		if ((it != mShadow.end()) && (it->second == data)) {
+			nSaved++;
+			return DISCFERRET_E_OK;
+		}
+	}
+
+	DISCFERRET_ERROR e = dev->regPoke(addr, data);
+	nWrites++;
+
+	if (cacheable) {
+		if (e == DISCFERRET_E_OK) {
+			mShadow[addr] = data;
+		} else {
+			// We don't know what state the register is in now
+			mShadow.erase(addr);
+		}
+	}
+
+	return e;
+}
+
+void CRegisterCache::invalidate(const unsigned int addr)
+{
+	mShadow.erase(addr);
+}
+
+void CRegisterCache::invalidateAll(void)
+{
+	mShadow.clear();
+}
@@ -0,0 +1,51 @@
+#ifndef _hpp_RegisterCache
+#define _hpp_RegisterCache
+
+// C++ STL headers
+#include <map>
+#include <set>
+
+// Local headers
+#include "DeviceBackend.hpp"
+
+/**
+ * @brief	Shadow copy of the DiscFerret's configuration registers.
+ *
+ * Every register write is a separate USB transaction. Most of the registers
+ * the acquisition loop programs for each track hold the same value from one
+ * track to the next, so CRegisterCache remembers what was last written to
+ * each cacheable register and drops writes which wouldn't change anything.
+ *
+ * Command registers (e.g. ACQCON) are never cached; writes to them always go
+ * straight through to the hardware.
+ */
+class CRegisterCache {
+	private:
+		CDeviceBackend						*dev;
+		std::set<unsigned int>				sCacheable;	///< Registers which may be shadowed
+		std::map<unsigned int, unsigned char>	mShadow;	///< Last value written to each shadowed register
+		unsigned long						nWrites;	///< Number of writes sent to the hardware
+		unsigned long						nSaved;		///< Number of writes skipped
+
+	public:
+		CRegisterCache(CDeviceBackend *_dev);
+
+		/**
+		 * @brief	Write to a DiscFerret register, unless it already holds this value.
+		 */
+		DISCFERRET_ERROR poke(const unsigned int addr, const unsigned char data);
+
+		/// Forget the shadowed value of one register (e.g. after the hardware changed it)
+		void invalidate(const unsigned int addr);
+
+		/// Forget all shadowed register values (e.g. after a microcode reload)
+		void invalidateAll(void);
+
+		/// Return the number of register writes sent to the hardware
+		unsigned long writes(void) const	{ return nWrites; };
+
+		/// Return the number of register writes which were skipped
+		unsigned long saved(void) const		{ return nSaved; };
+};
+
+#endif // _hpp_RegisterCache
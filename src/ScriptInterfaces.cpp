@@ -24,12 +24,57 @@ extern "C" {
 	LUALIB_API int luaopen_bit(lua_State *L);
 }
 
+/// lua_dump() writer: append a block of compiled bytecode to a std::string
+static int bytecode_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	((string *)ud)->append((const char *)p, sz);
+	return 0;
+}
+
 CScriptInterface::CScriptInterface(const std::string _filename)
 {
 	int err;
 
 	filename = _filename;
+	init();
+
+	if (filename.length() > 0) {
+		// Compile the script, and keep a copy of the bytecode so it can be
+		// cached (see CDriveScriptManager)
+		err = luaL_loadfile(L, filename.c_str());
+		if (!err) lua_dump(L, bytecode_writer, &bytecode);
+		run(err);
+	}
+}
 
+CScriptInterface::CScriptInterface(const std::string _filename, const std::string &_bytecode)
+{
+	int err;
+
+	filename = _filename;
+	bytecode = _bytecode;
+	init();
+
+	// Load the precompiled script. Use the filename as the chunk name, so
+	// error messages look the same as they would if we'd loaded the source.
+	err = luaL_loadbuffer(L, bytecode.data(), bytecode.length(), ("@" + filename).c_str());
+	run(err);
+}
+
+void CScriptInterface::run(int err)
+{
+	// Run the chunk which was just loaded (if it loaded successfully)
+	if (!err) err = lua_pcall(L, 0, LUA_MULTRET, 0);
+	if (err) {
+		string errstr = lua_tostring(L, -1);
+		lua_pop(L, 1);	// pop error message from stack
+		lua_close(L);	// close down lua
+		throw ELuaError(errstr);
+	}
+}
+
+void CScriptInterface::init(void)
+{
 	// Set up Lua
 	// TODO: error checking! throw exception if something goes wrong!
 	L = luaL_newstate();
@@ -56,17 +101,6 @@ CScriptInterface::CScriptInterface(const std::string _filename)
 		lua_pushnumber(L, LCONSTS[i].val);
 		lua_setglobal(L, LCONSTS[i].name.c_str());
 	}
-
-	if (filename.length() > 0) {
-		// Load the script into Lua
-		err = luaL_dofile(L, filename.c_str());
-		if (err) {
-			const char *errstr = lua_tostring(L, -1);
-			lua_pop(L, 1);	// pop error message from stack
-			lua_close(L);	// close down lua
-			throw ELuaError(errstr);
-		}
-	}
 }
 
 CScriptInterface::~CScriptInterface()
@@ -77,8 +111,33 @@ CScriptInterface::~CScriptInterface()
 
 /////////////////////////////////////////////////////////////////////////////
 
+const unsigned long CDriveScript::READY_STATUS_BITS[] = {
+	DISCFERRET_STATUS_INDEX,
+	DISCFERRET_STATUS_TRACK0,
+	DISCFERRET_STATUS_WRITE_PROTECT,
+	DISCFERRET_STATUS_DISC_CHANGE,
+	DISCFERRET_STATUS_DENSITY
+};
+
+const size_t CDriveScript::NUM_READY_STATUS_BITS = sizeof(READY_STATUS_BITS) / sizeof(READY_STATUS_BITS[0]);
+
 CDriveScript::CDriveScript(const std::string _filename) : CScriptInterface(_filename)
 {
+	parse();
+}
+
+CDriveScript::CDriveScript(const std::string _filename, const std::string &_bytecode) : CScriptInterface(_filename, _bytecode)
+{
+	parse();
+}
+
+void CDriveScript::parse(void)
+{
+	// Does the script allow isDriveReady() to be tabulated? (default: yes)
+	lua_getfield(L, LUA_GLOBALSINDEX, "drivespec_ready_pure");
+	bReadyPure = lua_isnil(L, -1) || lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
 	// Scan through all the Drive Specs in this file -- TODO: error check
 	try {
 		lua_getfield(L, LUA_GLOBALSINDEX, "drivespecs");
@@ -92,7 +151,6 @@ CDriveScript::CDriveScript(const std::string _filename) : CScriptInterface(_file
 			// Make sure this is a table, not an array
 			if (lua_isnumber(L, -2)) {
 				// Key isn't a string identifier. This isn't a table.
-				lua_close(L);
 				throw EDriveSpecParse("drivespecs must be a table, not a numerically-indexed array.", filename);
 			}
 
@@ -100,7 +158,6 @@ CDriveScript::CDriveScript(const std::string _filename) : CScriptInterface(_file
 			if (!lua_istable(L, -1)) {
 				// This isn't a table... what does the user think they're playing at?
 				const char *specname = lua_tostring(L, -2);
-				lua_close(L);
 				throw EDriveSpecParse("drivespecs table contains a non-table entity.", filename, specname);
 			}
 
@@ -211,7 +268,45 @@ CDriveInfo CDriveScript::GetDriveInfo(const std::string drivetype)
 }
 
 
+size_t CDriveScript::readyIndex(const unsigned long status)
+{
+	size_t idx = 0;
+	for (size_t i=0; i<NUM_READY_STATUS_BITS; i++) {
+		if (status & READY_STATUS_BITS[i]) idx |= (1 << i);
+	}
+	return idx;
+}
+
+bool CDriveScript::compileReadyTable(const std::string drivetype)
+{
+	if (!bReadyPure) return false;
+
+	// Evaluate the script for every combination of status bits
+	vector<bool> table(1 << NUM_READY_STATUS_BITS);
+	for (size_t idx=0; idx<table.size(); idx++) {
+		unsigned long status = 0;
+		for (size_t i=0; i<NUM_READY_STATUS_BITS; i++) {
+			if (idx & (1 << i)) status |= READY_STATUS_BITS[i];
+		}
+		table[idx] = callIsDriveReady(drivetype, status);
+	}
+
+	mReadyTables[drivetype] = table;
+	return true;
+}
+
 bool CDriveScript::isDriveReady(const std::string drivetype, const unsigned long status)
+{
+	// Use the precomputed table if there is one
+	map<string, vector<bool> >::const_iterator it = mReadyTables.find(drivetype);
+	if (it != mReadyTables.end()) {
+		return it->second[readyIndex(status)];
+	}
+
+	return callIsDriveReady(drivetype, status);
+}
+
+bool CDriveScript::callIsDriveReady(const std::string drivetype, const unsigned long status)
 {
 	bool result;
 	int err;
@@ -253,6 +348,10 @@ int CDriveScript::getDriveOutputs(const std::string drivetype, const unsigned lo
 		const char *errmsg = lua_tostring(L, -1);
 		lua_pop(L, 1);	// pop error message off of stack
 		throw ELuaError(errmsg);
+	} else if (!lua_isnumber(L, -1)) {
+		// script returned something other than a pin mask
+		lua_pop(L, 1);	// pop result off of stack
+		throw ELuaError("[" + filename + "]: getDriveOutputs() did not return a number");
 	} else {
 		// success -- return drive ready/not ready state
 		result = lua_tointeger(L, -1);
@@ -266,3 +365,165 @@ const std::vector<std::string> CDriveScript::getDrivetypes(void)
 	return svDrivetypes;
 }
 
+
+/////////////////////////////////////////////////////////////////////////////
+
+CFormatScript::CFormatScript(const std::string _filename) : CScriptInterface(_filename)
+{
+	parse();
+}
+
+void CFormatScript::parse(void)
+{
+	// Scan through all the Format Specs in this file
+	lua_getfield(L, LUA_GLOBALSINDEX, "formatspecs");
+	if (!lua_istable(L, -1)) {
+		throw EFormatSpecParse("FormatSpec script does not contain a 'formatspecs' table.", filename);
+	}
+	lua_pushnil(L);		// first key
+	while (lua_next(L, -2) != 0) {
+		// uses 'key' at index -2, and 'value' at index -1
+
+		// Make sure this is a table, not an array
+		if (lua_isnumber(L, -2)) {
+			throw EFormatSpecParse("formatspecs must be a table, not a numerically-indexed array.", filename);
+		}
+
+		// Check that 'value' is a table
+		if (!lua_istable(L, -1)) {
+			const char *specname = lua_tostring(L, -2);
+			throw EFormatSpecParse("formatspecs table contains a non-table entity.", filename, specname);
+		}
+
+		// Get the formattype and store it
+		string key = lua_tostring(L, -2);
+		svFormattypes.push_back(key);
+
+		// remove 'value' from stack, keep 'key' for next iteration
+		lua_pop(L, 1);
+	}
+
+	// pop the table off of the stack
+	lua_pop(L, 1);
+}
+
+CFormatInfo CFormatScript::GetFormatInfo(const std::string formattype)
+{
+	// get the formatspecs table
+	lua_getfield(L, LUA_GLOBALSINDEX, "formatspecs");
+
+	// make sure it's a table
+	if (!lua_istable(L, -1)) {
+		// This is an Internal Error because the ctor checks this...!
+		throw EInternalScriptingError("FormatSpec script does not contain a 'formatspecs' table, but it has already been loaded.", filename);
+	}
+
+	// push the table key and retrieve the entry
+	lua_pushstring(L, formattype.c_str());
+	lua_gettable(L, -2);	// get formatspecs[formattype]
+
+	// make sure the formatspec entry is a table (formatspecs is a table-of-tables)
+	if (!lua_istable(L, -1)) {
+		throw EInternalScriptingError("FormatSpec entry '" + formattype + "' is not a table.", filename);
+	}
+
+	// Temporary storage for formatspec fields
+	string friendlyname = "$$unspecified$$";
+	long mintrack = 0, maxtrack = -1,
+		 trackstep = 1,
+		 minhead = 0, maxhead = 0,
+		 sectors = 0;
+	float tpi = 0;
+	string encoding;
+	long datarate = 0, spt = 0;
+
+	lua_pushnil(L);		// Initial key
+	while (lua_next(L, -2) != 0) {
+		// Get the parameter name and convert it to lower case
+		string key = lua_tostring(L, -2);
+		transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+		// Convert the key->value pairs into local variables, with error checking
+		if (key.compare("friendlyname") == 0) {
+			// [string] Friendly name
+			friendlyname = lua_tostring(L, -1);
+			if (friendlyname.length() == 0)
+				throw EFormatSpecParse("friendlyname not valid.", filename, formattype);
+		} else if (key.compare("mintrack") == 0) {
+			// [integer] First track
+			mintrack = lua_tointeger(L, -1);
+			if (mintrack < 0)
+				throw EFormatSpecParse("Value of 'mintrack' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("maxtrack") == 0) {
+			// [integer] Last track
+			maxtrack = lua_tointeger(L, -1);
+			if (maxtrack < 0)
+				throw EFormatSpecParse("Value of 'maxtrack' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("trackstep") == 0) {
+			// [integer] Track stepping
+			trackstep = lua_tointeger(L, -1);
+			if (trackstep < 1)
+				throw EFormatSpecParse("Value of 'trackstep' parameter must be an integer greater than zero.", filename, formattype);
+		} else if (key.compare("minhead") == 0) {
+			// [integer] First head
+			minhead = lua_tointeger(L, -1);
+			if (minhead < 0)
+				throw EFormatSpecParse("Value of 'minhead' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("maxhead") == 0) {
+			// [integer] Last head
+			maxhead = lua_tointeger(L, -1);
+			if (maxhead < 0)
+				throw EFormatSpecParse("Value of 'maxhead' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("sectors") == 0) {
+			// [integer] Hard sectors, or 0 for soft-sectored
+			sectors = lua_tointeger(L, -1);
+			if (sectors < 0)
+				throw EFormatSpecParse("Value of 'sectors' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("tpi") == 0) {
+			// [float] Number of tracks per inch
+			tpi = lua_tonumber(L, -1);
+			if (tpi < 0)
+				throw EFormatSpecParse("Value of 'tpi' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("encoding") == 0) {
+			// [string] Data encoding
+			encoding = lua_tostring(L, -1);
+			transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+			if ((encoding.compare("fm") != 0) && (encoding.compare("mfm") != 0))
+				throw EFormatSpecParse("Value of 'encoding' parameter must be \"fm\" or \"mfm\".", filename, formattype);
+		} else if (key.compare("datarate") == 0) {
+			// [integer] Data rate in kbps
+			datarate = lua_tointeger(L, -1);
+			if (datarate < 0)
+				throw EFormatSpecParse("Value of 'datarate' parameter must be greater than or equal to zero.", filename, formattype);
+		} else if (key.compare("spt") == 0) {
+			// [integer] Sectors per track
+			spt = lua_tointeger(L, -1);
+			if (spt < 0)
+				throw EFormatSpecParse("Value of 'spt' parameter must be greater than or equal to zero.", filename, formattype);
+		} else {
+			throw EFormatSpecParse("Unrecognised key \"" + key + "\"", filename, formattype);
+		}
+
+		// pop value off of stack, leave key for next iteration
+		lua_pop(L, 1);
+	}
+
+	// Now we have all our keys, sanity check them and make a CFormatInfo
+	if (friendlyname.compare("$$unspecified$$") == 0)
+		throw EFormatSpecParse("Friendlyname string not specified.", filename, formattype);
+	if (maxtrack < mintrack)
+		throw EFormatSpecParse("'maxtrack' must be specified, and must not be less than 'mintrack'.", filename, formattype);
+	if (maxhead < minhead)
+		throw EFormatSpecParse("'maxhead' must not be less than 'minhead'.", filename, formattype);
+	CFormatInfo formatinfo(formattype, friendlyname, mintrack, maxtrack, trackstep, minhead, maxhead, sectors, tpi, encoding, datarate, spt);
+
+	// pop the formatspec entry and the formatspecs table
+	lua_pop(L, 2);
+
+	return formatinfo;
+}
+
+const std::vector<std::string> CFormatScript::getFormattypes(void)
+{
+	return svFormattypes;
+}
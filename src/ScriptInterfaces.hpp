@@ -11,34 +11,100 @@
 
 // Local headers
 #include "CDriveInfo.hpp"
+#include "CFormatInfo.hpp"
 
 /**
  * Interface and common code for script loading.
  */
 class CScriptInterface {
+	private:
+		// Each script owns its Lua state, so script objects can't be copied
+		CScriptInterface(const CScriptInterface &);
+		CScriptInterface &operator=(const CScriptInterface &);
+
+		/// Set up a new Lua state with the standard libraries and constants
+		void init(void);
+		/// Run the chunk on top of the Lua stack, throwing ELuaError on failure
+		void run(int err);
+
 	protected:
 		lua_State *L;
 		std::string filename;
+		std::string bytecode;		///< Compiled script, as produced by lua_dump()
 
 	public:
+		/// Load and run a script from a source file
 		CScriptInterface(const std::string _filename);
+		/// Run a script which has already been compiled to bytecode
+		CScriptInterface(const std::string _filename, const std::string &_bytecode);
 		~CScriptInterface();
+
+		/// Return the compiled bytecode for the script
+		const std::string &getBytecode(void) const	{ return bytecode; };
+
+		/// Return the filename of the script
+		const std::string getFilename(void) const	{ return filename; };
 };
 
 class CDriveScript : public CScriptInterface {
 	private:
 		std::vector<std::string> svDrivetypes;
 
+		/**
+		 * Precomputed isDriveReady() results, one table per drive type. Each
+		 * table has an entry for every combination of the status bits which are
+		 * visible to scripts (see readyIndex()).
+		 */
+		std::map<std::string, std::vector<bool> > mReadyTables;
+
+		/// False if the script says isDriveReady() can't be tabulated
+		bool bReadyPure;
+
+		/// Status bits which are exported to scripts (STATUS_INDEX, STATUS_TRACK0 etc.)
+		static const unsigned long READY_STATUS_BITS[];
+		/// Number of entries in READY_STATUS_BITS
+		static const size_t NUM_READY_STATUS_BITS;
+
+		/// Convert a status register value into an index into a ready table
+		static size_t readyIndex(const unsigned long status);
+
+		/// Call the script's isDriveReady() function
+		bool callIsDriveReady(const std::string drivetype, const unsigned long status);
+
+		/// Read the list of drive types from the drivespecs table
+		void parse(void);
+
 	public:
 		CDriveScript(const std::string _filename);
+		CDriveScript(const std::string _filename, const std::string &_bytecode);
 
 		CDriveInfo GetDriveInfo(const std::string drivetype);
 
 		/**
 		 * @brief	Lua wrapper function for IsDriveReady() DriveSpec function
+		 *
+		 * If a ready table has been built for this drive type (see
+		 * compileReadyTable()), the result comes from the table and the script
+		 * isn't called at all.
 		 */
 		bool isDriveReady(const std::string drivetype, const unsigned long status);
 
+		/**
+		 * @brief	Tabulate the script's isDriveReady() function for a drive type.
+		 *
+		 * Calls isDriveReady() once for every combination of the status bits
+		 * exported to scripts, and stores the results. Subsequent calls to
+		 * isDriveReady() for this drive type become a table lookup.
+		 *
+		 * This assumes isDriveReady() depends on nothing but its parameters, and
+		 * only looks at the exported status bits. Scripts where that isn't true
+		 * can set the global 'drivespec_ready_pure' to false, in which case this
+		 * function does nothing and every status poll calls into the script.
+		 *
+		 * @return	true if a table was built, false if the script opted out.
+		 */
+		bool compileReadyTable(const std::string drivetype);
+
 		/**
 		 * @brief	Lua wrapper function for GetDriveOutputs() DriveSpec function
 		 */
@@ -47,5 +113,20 @@ class CDriveScript : public CScriptInterface {
 		const std::vector<std::string> getDrivetypes(void);
 };
 
+class CFormatScript : public CScriptInterface {
+	private:
+		std::vector<std::string> svFormattypes;
+
+		/// Read the list of format types from the formatspecs table
+		void parse(void);
+
+	public:
+		CFormatScript(const std::string _filename);
+
+		CFormatInfo GetFormatInfo(const std::string formattype);
+
+		const std::vector<std::string> getFormattypes(void);
+};
+
 #endif // _hpp_ScriptInterfaces
 
@@ -1,7 +1,12 @@
 // TODO: eliminate cout / cerr and need for iostream
 #include <iostream>
+#include <cstdio>
+#include <cstring>
 #include <dirent.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
 
 #include "Exceptions.hpp"
 #include "ScriptManagers.hpp"
@@ -43,7 +48,208 @@ void GenericScriptManager::scandir(const std::string path, int recursionLimit)
 	closedir(dp);
 }
 
-CDriveScript CDriveScriptManager::load(const std::string drivetype)
+/////////////////////////////////////////////////////////////////////////////
+// Drive script catalog file I/O
+//
+// The catalog is a binary file:
+//   magic "MAGPIECAT2"
+//   uint32 number of entries, then for each entry:
+//     string filename, uint64 contents hash, int64 size,
+//     uint32 number of drive types, then that many strings,
+//     string bytecode
+// Integers are little-endian; strings are a uint32 length followed by the
+// string data.
+
+static const char CATALOG_MAGIC[] = "MAGPIECAT2";
+
+static void cat_put_u32(string &out, unsigned long v)
+{
+	for (int i=0; i<4; i++) out += (char)((v >> (i*8)) & 0xff);
+}
+
+static void cat_put_u64(string &out, unsigned long long v)
+{
+	for (int i=0; i<8; i++) out += (char)((v >> (i*8)) & 0xff);
+}
+
+static void cat_put_str(string &out, const string &s)
+{
+	cat_put_u32(out, s.length());
+	out += s;
+}
+
+static bool cat_get_u32(const string &in, size_t &pos, unsigned long &v)
+{
+	if (pos + 4 > in.length()) return false;
+	v = 0;
+	for (int i=0; i<4; i++) v |= ((unsigned long)(unsigned char)in[pos++]) << (i*8);
+	return true;
+}
+
+static bool cat_get_u64(const string &in, size_t &pos, unsigned long long &v)
+{
+	if (pos + 8 > in.length()) return false;
+	v = 0;
+	for (int i=0; i<8; i++) v |= ((unsigned long long)(unsigned char)in[pos++]) << (i*8);
+	return true;
+}
+
+static bool cat_get_str(const string &in, size_t &pos, string &s)
+{
+	unsigned long len;
+	if (!cat_get_u32(in, pos, len) || (pos + len > in.length())) return false;
+	s = in.substr(pos, len);
+	pos += len;
+	return true;
+}
+
+/**
+ * Read a script and hash its contents (64-bit FNV-1a), so the catalog can
+ * tell whether it has changed.
+ *
+ * @return	false if the script can't be read
+ */
+static bool hash_file(const string &filename, unsigned long long &hash, long long &size)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+	hash = 14695981039346656037ULL;
+	size = 0;
+	unsigned char buf[16384];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (size_t i=0; i<n; i++) hash = (hash ^ buf[i]) * 1099511628211ULL;
+		size += n;
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+CDriveScriptManager::CDriveScriptManager()
+{
+	bCatalogDirty = false;
+}
+
+CDriveScriptManager::~CDriveScriptManager()
+{
+	// Free any scripts which weren't claimed by load()
+	for (map<string, CDriveScript *>::iterator it = mScripts.begin(); it != mScripts.end(); it++)
+		delete it->second;
+}
+
+bool CDriveScriptManager::loadCatalog(const std::string path)
+{
+	// Read the whole catalog into memory
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (fp == NULL) return false;
+
+#ifndef _WIN32
+	// Don't run bytecode which someone else could have put there
+	struct stat st;
+	if ((fstat(fileno(fp), &st) != 0) || (st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		fclose(fp);
+		return false;
+	}
+#endif
+
+	string in;
+	char buf[16384];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) in.append(buf, n);
+	fclose(fp);
+
+	// Check the magic string
+	size_t pos = strlen(CATALOG_MAGIC);
+	if (in.compare(0, pos, CATALOG_MAGIC) != 0) return false;
+
+	// Parse the entries. Don't touch the real catalog until we know the file is intact.
+	map<string, CatalogEntry> cat;
+	unsigned long count;
+	if (!cat_get_u32(in, pos, count)) return false;
+	for (unsigned long i=0; i<count; i++) {
+		string filename;
+		CatalogEntry ent;
+		unsigned long long hash, size;
+		unsigned long ndt;
+
+		if (!cat_get_str(in, pos, filename)) return false;
+		if (!cat_get_u64(in, pos, hash) || !cat_get_u64(in, pos, size)) return false;
+		if (!cat_get_u32(in, pos, ndt)) return false;
+		for (unsigned long j=0; j<ndt; j++) {
+			string dt;
+			if (!cat_get_str(in, pos, dt)) return false;
+			ent.drivetypes.push_back(dt);
+		}
+		if (!cat_get_str(in, pos, ent.bytecode)) return false;
+
+		ent.hash = hash;
+		ent.size = size;
+		ent.seen = false;
+		cat[filename] = ent;
+	}
+
+	mCatalog = cat;
+	bCatalogDirty = false;
+	return true;
+}
+
+bool CDriveScriptManager::saveCatalog(const std::string path)
+{
+	// Drop entries for scripts which have gone away
+	for (map<string, CatalogEntry>::iterator it = mCatalog.begin(); it != mCatalog.end(); ) {
+		if (!it->second.seen) {
+			mCatalog.erase(it++);
+			bCatalogDirty = true;
+		} else {
+			it++;
+		}
+	}
+
+	if (!bCatalogDirty) return true;
+
+	string out = CATALOG_MAGIC;
+	cat_put_u32(out, mCatalog.size());
+	for (map<string, CatalogEntry>::const_iterator it = mCatalog.begin(); it != mCatalog.end(); it++) {
+		cat_put_str(out, it->first);
+		cat_put_u64(out, it->second.hash);
+		cat_put_u64(out, it->second.size);
+		cat_put_u32(out, it->second.drivetypes.size());
+		for (vector<string>::const_iterator dt = it->second.drivetypes.begin(); dt != it->second.drivetypes.end(); dt++)
+			cat_put_str(out, *dt);
+		cat_put_str(out, it->second.bytecode);
+	}
+
+	// Write to a temporary file, then move it into place, so a crash (or
+	// another copy of magpie) never sees a half-written catalog
+	string tmpname = path + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if (fp == NULL) return false;
+	bool ok = (fwrite(out.data(), 1, out.length(), fp) == out.length());
+	ok = (fclose(fp) == 0) && ok;
+#ifndef _WIN32
+	// loadCatalog() ignores a catalog which others can write to
+	if (ok) ok = (chmod(tmpname.c_str(), 0644) == 0);
+#endif
+#ifdef _WIN32
+	// Windows won't rename over an existing file
+	if (ok) remove(path.c_str());
+#endif
+	if (ok) ok = (rename(tmpname.c_str(), path.c_str()) == 0);
+	if (!ok) {
+		remove(tmpname.c_str());
+		return false;
+	}
+
+	bCatalogDirty = false;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+CDriveScript *CDriveScriptManager::load(const std::string drivetype)
 {
 	// Look up the drive type
 	map<string,string>::const_iterator it = mDrivetypes.find(drivetype);
@@ -51,20 +257,102 @@ CDriveScript CDriveScriptManager::load(const std::string drivetype)
 		throw EInvalidDrivetype(drivetype);
 	}
 
-	// Drive type is valid, and it->second contains the script file name
-	return CDriveScript(it->second);
+	// Drive type is valid, and it->second contains the script file name.
+	// If scan() already built this script, hand that copy over.
+	map<string, CDriveScript *>::iterator sit = mScripts.find(it->second);
+	if (sit != mScripts.end()) {
+		CDriveScript *script = sit->second;
+		mScripts.erase(sit);
+		return script;
+	}
+
+	// Otherwise use the cached bytecode, to save compiling the script again.
+	// If that fails for any reason (e.g. bytecode from a different Lua
+	// build), fall back to the source.
+	map<string, CatalogEntry>::const_iterator cit = mCatalog.find(it->second);
+	if ((cit != mCatalog.end()) && (cit->second.bytecode.length() > 0)) {
+		try {
+			return new CDriveScript(it->second, cit->second.bytecode);
+		} catch (ELuaError &) {
+		}
+	}
+
+	return new CDriveScript(it->second);
 }
 
 void CDriveScriptManager::scan(const std::string filename)
 {
-//	if (bVerbose) cout << "loading drivescript: " << filename << endl;
-	CDriveScript script(filename);	// TODO: CAN_THROW --> catch exception
+	vector<string> drivelist;
+	unsigned long long hash;
+	long long size;
+
+	if (!hash_file(filename, hash, size)) return;
+
+	map<string, CatalogEntry>::iterator cit = mCatalog.find(filename);
+	if ((cit != mCatalog.end()) && (cit->second.hash == hash) && (cit->second.size == size)) {
+		// Script hasn't changed since it was catalogued -- no need to run it
+		drivelist = cit->second.drivetypes;
+		cit->second.seen = true;
+	} else {
+//		if (bVerbose) cout << "loading drivescript: " << filename << endl;
+		CDriveScript *script = new CDriveScript(filename);	// TODO: CAN_THROW --> catch exception
+		drivelist = script->getDrivetypes();
+
+		// Keep the script around in case load() wants it
+		map<string, CDriveScript *>::iterator sit = mScripts.find(filename);
+		if (sit != mScripts.end()) delete sit->second;
+		mScripts[filename] = script;
+
+		// Update the catalog
+		CatalogEntry ent;
+		ent.hash = hash;
+		ent.size = size;
+		ent.drivetypes = drivelist;
+		ent.bytecode = script->getBytecode();
+		ent.seen = true;
+		mCatalog[filename] = ent;
+		bCatalogDirty = true;
+	}
 
 	// merge script's drivetype list with CDS's list
-	vector<string> drivelist = script.getDrivetypes();
 	for (vector<string>::const_iterator it = drivelist.begin(); it != drivelist.end(); it++) {
 		// TODO: make sure this dt hasn't already been defined
 		mDrivetypes[*it] = filename;
 	}
 }
 
+
+/////////////////////////////////////////////////////////////////////////////
+
+CFormatScript *CFormatScriptManager::load(const std::string formattype)
+{
+	// Look up the format type
+	map<string,string>::const_iterator it = mFormattypes.find(formattype);
+	if (it == mFormattypes.end()) {
+		throw EInvalidFormattype(formattype);
+	}
+
+	// Format type is valid, and it->second contains the script file name.
+	return new CFormatScript(it->second);
+}
+
+void CFormatScriptManager::scan(const std::string filename)
+{
+	// Format scripts are small and there are only a few of them, so there's
+	// no catalog -- just run the script to find out what it defines
+	CFormatScript script(filename);	// TODO: CAN_THROW --> catch exception
+	vector<string> formatlist = script.getFormattypes();
+
+	// merge script's formattype list with CFS's list
+	for (vector<string>::const_iterator it = formatlist.begin(); it != formatlist.end(); it++) {
+		mFormattypes[*it] = filename;
+	}
+}
+
+const std::vector<std::string> CFormatScriptManager::getFormattypes(void) const
+{
+	vector<string> v;
+	for (map<string,string>::const_iterator it = mFormattypes.begin(); it != mFormattypes.end(); it++)
+		v.push_back(it->first);
+	return v;
+}
@@ -2,6 +2,7 @@
 #define _hpp_ScriptManagers
 
 #include <string>
+#include <vector>
 #include <map>
 
 #include "ScriptInterfaces.hpp"
@@ -22,10 +23,93 @@ class CDriveScriptManager : public GenericScriptManager {
 		 */
 		std::map<std::string, std::string> mDrivetypes;
 
+		/**
+		 * Catalog entry for a drive script.
+		 *
+		 * The catalog remembers which drive types each script defines, along with
+		 * its compiled bytecode. If a script hasn't changed since it was last
+		 * scanned (same size and contents hash), scan() takes its drive types
+		 * from the catalog instead of running the script.
+		 */
+		struct CatalogEntry {
+			unsigned long long			hash;		///< Hash of the script's contents
+			long long					size;		///< Size of the script in bytes
+			std::vector<std::string>	drivetypes;	///< Drive types defined by the script
+			std::string					bytecode;	///< Compiled script, from lua_dump()
+			bool						seen;		///< Script was found by the last scan
+		};
+
+		/// Script catalog, indexed by filename
+		std::map<std::string, CatalogEntry> mCatalog;
+
+		/// True if the catalog has changed since it was loaded
+		bool bCatalogDirty;
+
+		/**
+		 * Scripts which were built by scan(). Handed over by load() rather than
+		 * being built (and run) a second time.
+		 */
+		std::map<std::string, CDriveScript *> mScripts;
+
+		// Owns CDriveScript objects; can't be copied
+		CDriveScriptManager(const CDriveScriptManager &);
+		CDriveScriptManager &operator=(const CDriveScriptManager &);
+
 	public:
-		CDriveScript load(const std::string drivetype);
+		CDriveScriptManager();
+		~CDriveScriptManager();
+
+		/**
+		 * @brief	Load the script for a drive type.
+		 *
+		 * The caller takes ownership of the returned object.
+		 */
+		CDriveScript *load(const std::string drivetype);
 		void scan(const std::string filename);
+
+		/**
+		 * @brief	Load a drive script catalog.
+		 *
+		 * Call before scan() or scandir(). A missing or unreadable catalog is
+		 * not an error; scripts will just be scanned the slow way. The catalog
+		 * holds bytecode which will be run, so it's ignored unless it belongs
+		 * to the user running magpie and nobody else can write to it.
+		 *
+		 * @return	true if the catalog was loaded
+		 */
+		bool loadCatalog(const std::string path);
+
+		/**
+		 * @brief	Save the drive script catalog, if it has changed.
+		 *
+		 * Entries for scripts which weren't found by the last scan are dropped.
+		 *
+		 * @return	true if the catalog is up to date on disc
+		 */
+		bool saveCatalog(const std::string path);
 };
 
-#endif // _hpp_ScriptManagers
+class CFormatScriptManager : public GenericScriptManager {
+	private:
+		/**
+		 * Map between format types and script filenames.
+		 *
+		 * This map is used to find out which script must be loaded to gain access
+		 * to a given format type.
+		 */
+		std::map<std::string, std::string> mFormattypes;
 
+	public:
+		/**
+		 * @brief	Load the script for a format type.
+		 *
+		 * The caller takes ownership of the returned object.
+		 */
+		CFormatScript *load(const std::string formattype);
+		void scan(const std::string filename);
+
+		/// Return the list of known format types
+		const std::vector<std::string> getFormattypes(void) const;
+};
+
+#endif // _hpp_ScriptManagers
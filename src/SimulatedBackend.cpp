@@ -0,0 +1,519 @@
+// STL headers
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <map>
+
+// C++11 threading
+#include <thread>
+
+// DiscFerret
+#include <discferret/discferret.h>
+
+// Local headers
+#include "Exceptions.hpp"
+#include "DFE2.hpp"
+#include "SimulatedBackend.hpp"
+
+using namespace std;
+
+/// Size of the acquisition RAM
+static const unsigned long SIM_RAM_SIZE = 512*1024;
+/// Width of the index pulse
+static const unsigned long SIM_INDEX_WIDTH_US = 2000;
+/// Time taken to load the microcode
+static const unsigned long SIM_FPGA_LOAD_US = 500000;
+
+/// Acquisition status value meaning "not idle"
+static const long SIM_ACQ_BUSY = DISCFERRET_STATUS_ACQSTATUS_MASK & ~DISCFERRET_STATUS_ACQ_IDLE;
+
+CSimulatedBackend::Params::Params()
+{
+	source		= "synthetic";
+	rpm			= 300;
+	settle_us	= 15000;
+	latency_us	= 250;
+	bandwidth	= 20000 * 1024;
+	tracks		= 84;
+	datarate	= 250;
+	sectors		= 9;
+}
+
+void CSimulatedBackend::Params::parse(const std::string spec)
+{
+	size_t pos = spec.find(',');
+	source = spec.substr(0, pos);
+	if (source.length() == 0) throw EApplicationError("Simulator source not specified");
+
+	while (pos != string::npos) {
+		size_t next = spec.find(',', pos + 1);
+		string kv = spec.substr(pos + 1, (next == string::npos) ? string::npos : next - pos - 1);
+		pos = next;
+
+		size_t eq = kv.find('=');
+		if (eq == string::npos) throw EApplicationError("Invalid simulator parameter '" + kv + "'");
+		string key = kv.substr(0, eq);
+		double val = strtod(kv.substr(eq + 1).c_str(), NULL);
+		if (val <= 0) throw EApplicationError("Invalid value for simulator parameter '" + key + "'");
+
+		if (key.compare("rpm") == 0) {
+			rpm = val;
+		} else if (key.compare("settle") == 0) {
+			settle_us = val * 1000;
+		} else if (key.compare("latency") == 0) {
+			latency_us = val;
+		} else if (key.compare("bandwidth") == 0) {
+			bandwidth = val * 1024;
+		} else if (key.compare("tracks") == 0) {
+			tracks = val;
+		} else if (key.compare("datarate") == 0) {
+			datarate = val;
+		} else if (key.compare("sectors") == 0) {
+			sectors = val;
+		} else {
+			throw EApplicationError("Unknown simulator parameter '" + key + "'");
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+CSimulatedBackend::CSimulatedBackend(const Params &_params)
+{
+	params = _params;
+	tEpoch = clock::now();
+	period_us = 60.0e6 / params.rpm;
+
+	cylinder = 0;
+	steprate_us = 3000;
+	tSettled = tEpoch;
+
+	bAcqArmed = false;
+	acqBase = acqBytes = 0;
+	bRamFull = false;
+	ramAddr = 0;
+	vRam.resize(SIM_RAM_SIZE);
+
+	cachedTrackId = make_pair((unsigned long)-1, (unsigned long)-1);
+	cachedClock = -1;
+
+	nTransactions = 0;
+	nBytesRead = 0;
+
+	if (params.source.compare("synthetic") != 0) loadFile(params.source);
+}
+
+CSimulatedBackend::~CSimulatedBackend()
+{
+}
+
+void CSimulatedBackend::usbTransaction(const size_t bytes)
+{
+	nTransactions++;
+	nBytesRead += bytes;
+	unsigned long us = params.latency_us + (unsigned long)((double)bytes * 1.0e6 / params.bandwidth);
+	this_thread::sleep_for(chrono::microseconds(us));
+}
+
+double CSimulatedBackend::revolutions(const time_point t) const
+{
+	return chrono::duration_cast<chrono::duration<double, micro> >(t - tEpoch).count() / period_us;
+}
+
+CSimulatedBackend::time_point CSimulatedBackend::nextIndex(const time_point t, const unsigned long skip) const
+{
+	double n = floor(revolutions(t)) + 1 + skip;
+	return tEpoch + chrono::duration_cast<clock::duration>(chrono::duration<double, micro>(n * period_us));
+}
+
+void CSimulatedBackend::loadFile(const std::string filename)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) throw EApplicationError("Unable to open simulator source file '" + filename + "'");
+
+	char magic[4];
+	if ((fread(magic, 1, 4, fp) != 4) || (memcmp(magic, DFE2_MAGIC, 4) != 0)) {
+		fclose(fp);
+		throw EApplicationError("Simulator source file '" + filename + "' is not a DFE2 image");
+	}
+
+	unsigned char hdr[DFE2_RECORD_HEADER_LEN];
+	while (fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)) {
+		unsigned long track = (hdr[0] << 8) | hdr[1];
+		unsigned long head = (hdr[2] << 8) | hdr[3];
+		unsigned long len = ((unsigned long)hdr[6] << 24) | (hdr[7] << 16) | (hdr[8] << 8) | hdr[9];
+
+		vector<unsigned char> data(len);
+		if ((len > 0) && (fread(&data[0], 1, len, fp) != len)) break;
+
+		// Only the first copy of each track is used
+		pair<unsigned long, unsigned long> id = make_pair(track, head);
+		if (mFileTracks.find(id) != mFileTracks.end()) continue;
+
+		// Cut out one revolution (index to index), if there is one
+		size_t first = 0, second = 0;
+		bool found = false;
+		for (size_t i=0; i<data.size(); i++) {
+			if ((data[i] & DFE2_INDEX_FLAG) && ((data[i] & DFE2_COUNT_MASK) != DFE2_CARRY)) {
+				if (!found) {
+					first = i;
+					found = true;
+				} else {
+					second = i;
+					break;
+				}
+			}
+		}
+		if (second > first) {
+			mFileTracks[id] = vector<unsigned char>(data.begin() + first, data.begin() + second);
+		} else {
+			mFileTracks[id] = data;
+		}
+	}
+
+	fclose(fp);
+}
+
+const std::vector<unsigned char> &CSimulatedBackend::trackData(void)
+{
+	unsigned long head = (mRegs[DISCFERRET_R_DRIVE_CONTROL] & DISCFERRET_DRIVE_CONTROL_SIDESEL) ? 1 : 0;
+	int clksel = mRegs[DISCFERRET_R_ACQ_CLKSEL];
+	pair<unsigned long, unsigned long> id = make_pair(cylinder, head);
+
+	if ((id == cachedTrackId) && (clksel == cachedClock)) return vCachedTrack;
+
+	vCachedTrack.clear();
+	if (params.source.compare("synthetic") == 0) {
+		unsigned long clock_hz;
+		switch (clksel) {
+			case DISCFERRET_ACQ_RATE_25MHZ:		clock_hz = 25000000; break;
+			case DISCFERRET_ACQ_RATE_50MHZ:		clock_hz = 50000000; break;
+			default:							clock_hz = 100000000; break;
+		}
+		synthesiseTrack(cylinder, head, clock_hz, vCachedTrack);
+	} else {
+		map<pair<unsigned long, unsigned long>, vector<unsigned char> >::const_iterator it = mFileTracks.find(id);
+		if (it != mFileTracks.end()) {
+			vCachedTrack = it->second;
+		} else {
+			// Unformatted track: nothing but the index pulse. Roughly the right
+			// amount of data for one revolution at 100MHz.
+			dfe2_put_index(vCachedTrack, 0);
+			vCachedTrack.resize((unsigned long)(period_us * 100 / DFE2_CARRY), DFE2_CARRY);
+		}
+	}
+	if (vCachedTrack.empty()) dfe2_put_index(vCachedTrack, 0);
+
+	cachedTrackId = id;
+	cachedClock = clksel;
+	return vCachedTrack;
+}
+
+/// CRC-16/CCITT, as used by IBM format floppy discs
+static unsigned short sim_crc16(const unsigned char *buf, size_t len, unsigned short crc = 0xFFFF)
+{
+	while (len--) {
+		crc ^= (*buf++) << 8;
+		for (int i=0; i<8; i++)
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc;
+}
+
+void CSimulatedBackend::synthesiseTrack(const unsigned long track, const unsigned long head, const unsigned long clock_hz, std::vector<unsigned char> &out) const
+{
+	// Build the track layout as a list of bytes, each with a flag saying
+	// whether it's a sync mark (which is written with a missing clock bit)
+	vector<unsigned char> bytes;
+	vector<bool> sync;
+	#define PUT(val, n, s)	do { for (int _i=0; _i<(n); _i++) { bytes.push_back(val); sync.push_back(s); } } while (0)
+
+	PUT(0x4E, 80, false);		// Gap 4a
+	PUT(0x00, 12, false);
+	PUT(0xC2, 3, true);			// Index address mark
+	PUT(0xFC, 1, false);
+	PUT(0x4E, 50, false);		// Gap 1
+
+	for (unsigned long sector = 1; sector <= params.sectors; sector++) {
+		unsigned char buf[3 + 1 + 512 + 2];
+		unsigned short crc;
+
+		// ID field
+		PUT(0x00, 12, false);
+		PUT(0xA1, 3, true);
+		buf[0] = buf[1] = buf[2] = 0xA1;
+		buf[3] = 0xFE;
+		buf[4] = track;
+		buf[5] = head;
+		buf[6] = sector;
+		buf[7] = 2;				// 512 bytes per sector
+		crc = sim_crc16(buf, 8);
+		for (int i=3; i<8; i++) PUT(buf[i], 1, false);
+		PUT(crc >> 8, 1, false);
+		PUT(crc & 0xff, 1, false);
+		PUT(0x4E, 22, false);	// Gap 2
+
+		// Data field -- the contents identify the sector they came from
+		PUT(0x00, 12, false);
+		PUT(0xA1, 3, true);
+		buf[3] = 0xFB;
+		for (int i=0; i<512; i++) buf[4+i] = (track * 7) + (head * 13) + (sector * 17) + i;
+		crc = sim_crc16(buf, 4 + 512);
+		for (int i=3; i<4+512; i++) PUT(buf[i], 1, false);
+		PUT(crc >> 8, 1, false);
+		PUT(crc & 0xff, 1, false);
+		PUT(0x4E, 84, false);	// Gap 3
+	}
+	#undef PUT
+
+	// Work out how many MFM cells fit on a revolution, and pad the track out to that length
+	double cell_ns = 1.0e9 / (params.datarate * 1000.0 * 2);
+	unsigned long ncells = (unsigned long)(period_us * 1000.0 / cell_ns);
+	while ((bytes.size() * 16) < ncells) {
+		bytes.push_back(0x4E);
+		sync.push_back(false);
+	}
+
+	// MFM encode and convert to DFE2
+	dfe2_put_index(out, 0);
+	unsigned long cells = 0, pos = 0;
+	unsigned int prev = 0;
+	unsigned long seed = (track * 2) + head + 1;
+	for (size_t i=0; (i < bytes.size()) && (pos < ncells); i++) {
+		unsigned int raw = 0;
+		for (int b=7; b>=0; b--) {
+			unsigned int d = (bytes[i] >> b) & 1;
+			unsigned int c = (prev | d) ? 0 : 1;
+			raw = (raw << 2) | (c << 1) | d;
+			prev = d;
+		}
+		// Sync marks: A1 loses the clock bit between data bits 4 and 3, C2
+		// between bits 3 and 2 (giving 0x4489 and 0x5224 respectively)
+		if (sync[i]) raw &= (bytes[i] == 0xA1) ? ~0x0020 : ~0x0080;
+
+		for (int b=15; (b>=0) && (pos < ncells); b--, pos++) {
+			cells++;
+			if (raw & (1 << b)) {
+				// Flux transition, with a little (repeatable) timing jitter
+				seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+				double jitter = (((double)(seed % 1001) / 1000.0) - 0.5) * 0.05;
+				double ticks = cells * cell_ns * (1.0 + jitter) * clock_hz / 1.0e9;
+				dfe2_put_transition(out, (unsigned long)(ticks + 0.5));
+				cells = 0;
+			}
+		}
+	}
+}
+
+void CSimulatedBackend::startAcquisition(void)
+{
+	time_point now = clock::now();
+	const vector<unsigned char> &trk = trackData();
+	double bytes_per_rev = trk.size();
+	double us_per_byte = period_us / bytes_per_rev;
+
+	// When does the acquisition start recording?
+	if (mRegs[DISCFERRET_R_ACQ_START_EVT] == DISCFERRET_ACQ_EVENT_INDEX) {
+		tAcqStart = nextIndex(now, mRegs[DISCFERRET_R_ACQ_START_NUM]);
+	} else {
+		tAcqStart = now;
+	}
+
+	// How much data will it record?
+	unsigned long maxbytes = SIM_RAM_SIZE - ((ramAddr < SIM_RAM_SIZE) ? ramAddr : SIM_RAM_SIZE);
+	double nbytes;
+	if (mRegs[DISCFERRET_R_ACQ_STOP_EVT] == DISCFERRET_ACQ_EVENT_INDEX) {
+		time_point tStop = nextIndex(tAcqStart, mRegs[DISCFERRET_R_ACQ_STOP_NUM]);
+		nbytes = (revolutions(tStop) - revolutions(tAcqStart)) * bytes_per_rev;
+	} else {
+		nbytes = maxbytes;
+	}
+
+	bRamFull = (nbytes >= maxbytes);
+	if (bRamFull) nbytes = maxbytes;
+	acqBytes = nbytes;
+	acqBase = ramAddr;
+	tAcqStop = tAcqStart + chrono::duration_cast<clock::duration>(chrono::duration<double, micro>(acqBytes * us_per_byte));
+
+	// Fill in the RAM now; it can't be read until the acquisition has moved past it
+	double startrev = revolutions(tAcqStart);
+	size_t offset = (size_t)((startrev - floor(startrev)) * bytes_per_rev) % trk.size();
+	for (unsigned long i=0; i<acqBytes; i++) {
+		vRam[acqBase + i] = trk[offset++];
+		if (offset >= trk.size()) offset = 0;
+	}
+
+	bAcqArmed = true;
+}
+
+void CSimulatedBackend::updateAcquisition(void)
+{
+	if (bAcqArmed && (clock::now() >= tAcqStop)) {
+		bAcqArmed = false;
+		ramAddr = acqBase + acqBytes;
+	}
+}
+
+void CSimulatedBackend::step(const long steps)
+{
+	long target = (long)cylinder + steps;
+	if (target < 0) target = 0;
+	if (target >= (long)params.tracks) target = params.tracks - 1;
+
+	unsigned long nsteps = labs(steps);
+	this_thread::sleep_for(chrono::microseconds(nsteps * steprate_us));
+	cylinder = target;
+	if (nsteps > 0) tSettled = clock::now() + chrono::microseconds(params.settle_us);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+DISCFERRET_ERROR CSimulatedBackend::getInfo(DISCFERRET_DEVICE_INFO *info)
+{
+	usbTransaction();
+	memset(info, 0, sizeof(*info));
+	strncpy(info->serialnumber, "SIMULATOR", sizeof(info->serialnumber) - 1);
+	info->hardware_rev = 0;
+	info->firmware_ver = 0;
+	info->microcode_type = 0;
+	info->microcode_ver = 0x0030;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::loadMicrocode(void)
+{
+	this_thread::sleep_for(chrono::microseconds(SIM_FPGA_LOAD_US));
+	mRegs.clear();
+	bAcqArmed = false;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::regPoke(const unsigned int addr, const unsigned char data)
+{
+	usbTransaction();
+
+	if (addr == DISCFERRET_R_ACQCON) {
+		// Command register -- not latched
+		updateAcquisition();
+		if (data & DISCFERRET_ACQCON_ABORT) {
+			if (bAcqArmed) {
+				// Keep whatever was recorded before the abort
+				time_point now = clock::now();
+				if (now > tAcqStart) {
+					double frac = chrono::duration_cast<chrono::duration<double> >(now - tAcqStart).count() /
+						chrono::duration_cast<chrono::duration<double> >(tAcqStop - tAcqStart).count();
+					ramAddr = acqBase + (unsigned long)(frac * acqBytes);
+				} else {
+					ramAddr = acqBase;
+				}
+				bRamFull = false;
+			}
+			bAcqArmed = false;
+		}
+		if (data & DISCFERRET_ACQCON_START) startAcquisition();
+	} else {
+		mRegs[addr] = data;
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+long CSimulatedBackend::getStatus(void)
+{
+	usbTransaction();
+	updateAcquisition();
+
+	time_point now = clock::now();
+	long status = 0;
+
+	double rev = revolutions(now);
+	if (((rev - floor(rev)) * period_us) < SIM_INDEX_WIDTH_US) status |= DISCFERRET_STATUS_INDEX;
+	if (cylinder == 0) status |= DISCFERRET_STATUS_TRACK0;
+	// READY is always asserted; DENSITY doubles as SEEK COMPLETE on Winchester adapters
+	status |= DISCFERRET_STATUS_DISC_CHANGE;
+	if (now >= tSettled) status |= DISCFERRET_STATUS_DENSITY;
+
+	if (bAcqArmed) {
+		status = (status & ~DISCFERRET_STATUS_ACQSTATUS_MASK) | SIM_ACQ_BUSY;
+	} else {
+		status = (status & ~DISCFERRET_STATUS_ACQSTATUS_MASK) | DISCFERRET_STATUS_ACQ_IDLE;
+		if (bRamFull) status |= DISCFERRET_STATUS_RAM_FULL;
+	}
+
+	return status;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::seekSetRate(const unsigned long steprate)
+{
+	usbTransaction();
+	steprate_us = steprate;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::seekRecalibrate(const unsigned long maxsteps)
+{
+	usbTransaction();
+	if (cylinder > maxsteps) return DISCFERRET_E_HARDWARE_ERROR;
+	step(-(long)cylinder);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::seekRelative(const long steps)
+{
+	usbTransaction();
+	step(steps);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::seekAbsolute(const unsigned long track)
+{
+	usbTransaction();
+	step((long)track - (long)cylinder);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::ramAddrSet(const unsigned long addr)
+{
+	usbTransaction();
+	if (addr >= SIM_RAM_SIZE) return DISCFERRET_E_BAD_PARAMETER;
+	ramAddr = addr;
+	return DISCFERRET_E_OK;
+}
+
+long CSimulatedBackend::ramAddrGet(void)
+{
+	usbTransaction();
+	updateAcquisition();
+
+	if (bAcqArmed) {
+		// Acquisition in progress: return the write pointer
+		time_point now = clock::now();
+		if (now <= tAcqStart) return acqBase;
+		double frac = chrono::duration_cast<chrono::duration<double> >(now - tAcqStart).count() /
+			chrono::duration_cast<chrono::duration<double> >(tAcqStop - tAcqStart).count();
+		return acqBase + (unsigned long)(frac * acqBytes);
+	}
+
+	return ramAddr;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::ramRead(unsigned char *block, const size_t len)
+{
+	usbTransaction(len);
+	if (ramAddr + len > SIM_RAM_SIZE) return DISCFERRET_E_BAD_PARAMETER;
+	memcpy(block, &vRam[ramAddr], len);
+	ramAddr += len;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR CSimulatedBackend::getIndexFrequency(const bool usecache, double *freq)
+{
+	usbTransaction();
+	// A real measurement takes a revolution
+	if (!usecache) this_thread::sleep_for(chrono::microseconds((unsigned long)period_us));
+	*freq = params.rpm;
+	return DISCFERRET_E_OK;
+}
@@ -0,0 +1,128 @@
+#ifndef _hpp_SimulatedBackend
+#define _hpp_SimulatedBackend
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// C++11 timekeeping
+#include <chrono>
+
+// Local headers
+#include "DeviceBackend.hpp"
+
+/**
+ * @brief	Simulated DiscFerret and disc drive.
+ *
+ * Models enough of a DiscFerret and an attached drive to run the host-side
+ * acquisition code without hardware: disc rotation and the index pulse,
+ * stepping and head settle time, USB transaction latency and bandwidth, and
+ * the acquisition engine's start/stop events and RAM.
+ *
+ * Everything runs against the real clock, so the time taken by the host
+ * code is measured along with the simulated hardware delays.
+ *
+ * Flux data comes either from an existing DFE2 image (one revolution of each
+ * track is replayed), or from a synthetic IBM-format MFM track. The head is
+ * taken from the SIDESEL drive control output.
+ */
+class CSimulatedBackend : public CDeviceBackend {
+	public:
+		/// Simulation parameters
+		class Params {
+			public:
+				std::string		source;			///< "synthetic", or the name of a DFE2 file
+				double			rpm;			///< Disc rotation speed
+				unsigned long	settle_us;		///< Head settle time after a seek
+				unsigned long	latency_us;		///< Time per USB transaction
+				unsigned long	bandwidth;		///< USB bulk transfer rate, bytes per second
+				unsigned long	tracks;			///< Number of physical tracks on the drive
+				unsigned long	datarate;		///< Synthetic tracks: data rate in kbps
+				unsigned long	sectors;		///< Synthetic tracks: sectors per track (512 bytes each)
+
+				Params();
+
+				/**
+				 * @brief	Parse a parameter string.
+				 *
+				 * Format is "source[,key=value...]", where source is "synthetic"
+				 * or a DFE2 filename, and keys are rpm, settle (ms), latency (us),
+				 * bandwidth (KB/s), tracks, datarate (kbps) and sectors.
+				 *
+				 * Throws EApplicationError if the string is invalid.
+				 */
+				void parse(const std::string spec);
+		};
+
+	private:
+		typedef std::chrono::steady_clock			clock;
+		typedef std::chrono::steady_clock::time_point	time_point;
+
+		Params			params;
+		time_point		tEpoch;			///< Time the disc was at index (rotation reference)
+		double			period_us;		///< Time for one revolution
+
+		std::map<unsigned int, unsigned char>	mRegs;	///< Register values
+
+		unsigned long	cylinder;		///< Current head position
+		unsigned long	steprate_us;	///< Step rate
+		time_point		tSettled;		///< Time the heads finish settling
+
+		// Acquisition engine
+		bool			bAcqArmed;		///< An acquisition has been started
+		time_point		tAcqStart;		///< Time the acquisition starts recording
+		time_point		tAcqStop;		///< Time the acquisition stops recording
+		unsigned long	acqBase;		///< RAM address the acquisition started at
+		unsigned long	acqBytes;		///< Number of bytes the acquisition will record
+		bool			bRamFull;		///< The acquisition filled RAM
+		unsigned long	ramAddr;		///< RAM address register
+		std::vector<unsigned char>	vRam;	///< Acquisition RAM
+
+		// Flux data
+		std::map<std::pair<unsigned long, unsigned long>, std::vector<unsigned char> >	mFileTracks;
+		std::pair<unsigned long, unsigned long>	cachedTrackId;	///< Track held in vCachedTrack
+		int				cachedClock;	///< Clock select value used for vCachedTrack
+		std::vector<unsigned char>	vCachedTrack;	///< One revolution of DFE2 data
+
+		// Statistics
+		unsigned long	nTransactions;
+		unsigned long long	nBytesRead;
+
+		void usbTransaction(const size_t bytes = 0);
+		double revolutions(const time_point t) const;
+		time_point nextIndex(const time_point t, const unsigned long skip) const;
+		void updateAcquisition(void);
+		void startAcquisition(void);
+		void step(const long steps);
+		void loadFile(const std::string filename);
+		const std::vector<unsigned char> &trackData(void);
+		void synthesiseTrack(const unsigned long track, const unsigned long head, const unsigned long clock_hz, std::vector<unsigned char> &out) const;
+
+	public:
+		CSimulatedBackend(const Params &_params);
+		virtual ~CSimulatedBackend();
+
+		virtual DISCFERRET_ERROR getInfo(DISCFERRET_DEVICE_INFO *info);
+		virtual DISCFERRET_ERROR loadMicrocode(void);
+		virtual DISCFERRET_ERROR regPoke(const unsigned int addr, const unsigned char data);
+		virtual long getStatus(void);
+		virtual DISCFERRET_ERROR seekSetRate(const unsigned long steprate_us);
+		virtual DISCFERRET_ERROR seekRecalibrate(const unsigned long maxsteps);
+		virtual DISCFERRET_ERROR seekRelative(const long steps);
+		virtual DISCFERRET_ERROR seekAbsolute(const unsigned long track);
+		virtual DISCFERRET_ERROR ramAddrSet(const unsigned long addr);
+		virtual long ramAddrGet(void);
+		virtual DISCFERRET_ERROR ramRead(unsigned char *block, const size_t len);
+		/// The simulator keeps the acquisition write pointer apart from ramAddr
+		virtual bool hasReadPointer(void)				{ return true; };
+		virtual DISCFERRET_ERROR getIndexFrequency(const bool usecache, double *freq);
+
+		/// Return the number of simulated USB transactions so far
+		unsigned long transactions(void) const			{ return nTransactions; };
+		/// Return the number of bytes read from acquisition RAM so far
+		unsigned long long bytesRead(void) const		{ return nBytesRead; };
+};
+
+#endif // _hpp_SimulatedBackend
@@ -0,0 +1,91 @@
+// STL headers
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+
+// Platform headers for directories
+#ifdef _WIN32
+#  include <direct.h>
+#  include <io.h>
+#  define mkdir(path, mode)	_mkdir(path)
+#  define access(path, mode)	_access(path, mode)
+#  define W_OK 2
+#else
+#  include <unistd.h>
+#  include <sys/stat.h>
+#endif
+
+// Local headers
+#include "TimingProfile.hpp"
+
+using namespace std;
+
+CTimingProfile::CTimingProfile()
+{
+	steprate_us = 0;
+	settle_us = 0;
+	spinup_ms = 0;
+}
+
+std::string CTimingProfile::filename(const std::string dir, const std::string serial, const std::string drivetype)
+{
+	// Keep the filename safe, whatever the serial number looks like
+	string name = serial + "-" + drivetype;
+	for (string::iterator it = name.begin(); it != name.end(); it++) {
+		if (!isalnum((unsigned char)*it) && (*it != '-') && (*it != '_')) *it = '_';
+	}
+	return dir + "/" + name + ".timing";
+}
+
+bool CTimingProfile::prepareDir(const std::string dir)
+{
+	if ((mkdir(dir.c_str(), 0755) != 0) && (errno != EEXIST)) return false;
+	return (access(dir.c_str(), W_OK) == 0);
+}
+
+bool CTimingProfile::load(const std::string filename)
+{
+	FILE *fp = fopen(filename.c_str(), "r");
+	if (fp == NULL) return false;
+
+	CTimingProfile p;
+	char line[256];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		string s = line;
+		if ((s.length() == 0) || (s[0] == '#')) continue;
+		size_t eq = s.find('=');
+		if (eq == string::npos) continue;
+
+		string key = s.substr(0, eq);
+		unsigned long val = strtoul(s.c_str() + eq + 1, NULL, 10);
+		if (key.compare("steprate_us") == 0) {
+			p.steprate_us = val;
+		} else if (key.compare("settle_us") == 0) {
+			p.settle_us = val;
+		} else if (key.compare("spinup_ms") == 0) {
+			p.spinup_ms = val;
+		}
+	}
+	fclose(fp);
+
+	// A profile without a step rate is no use to anyone
+	if (p.steprate_us == 0) return false;
+
+	*this = p;
+	return true;
+}
+
+bool CTimingProfile::save(const std::string filename, const std::string drivetype) const
+{
+	FILE *fp = fopen(filename.c_str(), "w");
+	if (fp == NULL) return false;
+
+	fprintf(fp, "# Drive timing profile for drive type '%s', written by magpie --autotune\n", drivetype.c_str());
+	fprintf(fp, "steprate_us=%lu\n", steprate_us);
+	fprintf(fp, "settle_us=%lu\n", settle_us);
+	fprintf(fp, "spinup_ms=%lu\n", spinup_ms);
+
+	return (fclose(fp) == 0);
+}
@@ -0,0 +1,58 @@
+#ifndef _hpp_TimingProfile
+#define _hpp_TimingProfile
+
+// C++ STL headers
+#include <string>
+
+/**
+ * @brief	Measured timing parameters for one physical disc drive.
+ *
+ * Written by the autotuner (see CAutotune) and picked up by later runs in
+ * place of the drive script's conservative defaults. Profiles are keyed by
+ * DiscFerret serial number and drive type, because the timing belongs to the
+ * drive mechanism plugged into a particular DiscFerret, not to the drive type
+ * in general.
+ *
+ * The file is plain text, one "key=value" per line; lines starting with '#'
+ * are comments.
+ */
+class CTimingProfile {
+	public:
+		unsigned long	steprate_us;	///< Step rate, microseconds per step
+		unsigned long	settle_us;		///< Head settle time after a seek, microseconds
+		unsigned long	spinup_ms;		///< Spin-up time, milliseconds
+
+		CTimingProfile();
+
+		/**
+		 * @brief	Return the profile filename for a drive.
+		 *
+		 * @param	dir			Profile directory
+		 * @param	serial		DiscFerret serial number
+		 * @param	drivetype	Drive type string
+		 */
+		static std::string filename(const std::string dir, const std::string serial, const std::string drivetype);
+
+		/**
+		 * @brief	Make sure profiles can be saved in a directory.
+		 *
+		 * Creates the directory if it doesn't exist yet.
+		 *
+		 * @return	true if the directory exists and can be written to
+		 */
+		static bool prepareDir(const std::string dir);
+
+		/**
+		 * @brief	Load a profile.
+		 * @return	true if the profile was loaded, false if the file doesn't exist or is invalid
+		 */
+		bool load(const std::string filename);
+
+		/**
+		 * @brief	Save a profile.
+		 * @return	true on success
+		 */
+		bool save(const std::string filename, const std::string drivetype) const;
+};
+
+#endif // _hpp_TimingProfile
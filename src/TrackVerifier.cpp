@@ -0,0 +1,44 @@
+// STL headers
+#include <string>
+#include <vector>
+#include <map>
+
+// Local headers
+#include "TrackVerifier.hpp"
+
+using namespace std;
+
+CTrackVerifier::CTrackVerifier(const CFluxDecoder::Encoding encoding, const unsigned long datarate, const unsigned long clock_hz, const unsigned long _spt) :
+	decoder(encoding, datarate, clock_hz), spt(_spt)
+{
+	reset(0, 0);
+}
+
+void CTrackVerifier::reset(const unsigned long _track, const unsigned long _head)
+{
+	track = _track;
+	head = _head;
+	mGood.clear();
+	nOnTrack = nOffTrack = 0;
+}
+
+void CTrackVerifier::addCapture(const unsigned char *data, const size_t len)
+{
+	vSectors.clear();
+	decoder.decodeTrack(data, len, vSectors);
+
+	for (vector<CDecodedSector>::iterator it = vSectors.begin(); it != vSectors.end(); it++) {
+		if (it->cyl != (unsigned char)track) {
+			nOffTrack++;
+			continue;
+		}
+		nOnTrack++;
+
+		// Only sectors this format has on this side of the disc count
+		if ((it->head != (unsigned char)head) || (it->sector < 1) || (it->sector > spt)) continue;
+
+		if (it->dataOK && (mGood.find(it->sector) == mGood.end())) {
+			mGood[it->sector].swap(it->data);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef _hpp_TrackVerifier
+#define _hpp_TrackVerifier
+
+// C++ STL headers
+#include <string>
+#include <vector>
+#include <map>
+
+// Local headers
+#include "FluxDecoder.hpp"
+
+/**
+ * @brief	In-line check of captured tracks against an IBM-style disc format.
+ *
+ * Decodes each capture with a CFluxDecoder, and keeps track of which sectors
+ * have been read with good ID and data CRCs. Several captures of the same
+ * track (e.g. re-reads) can be added; a sector counts as good if any capture
+ * had a good copy of it.
+ *
+ * The acquisition loop uses this to decide whether a track needs to be
+ * read again.
+ */
+class CTrackVerifier {
+	private:
+		CFluxDecoder	decoder;
+		unsigned long	spt;			///< Expected sectors per track
+
+		unsigned long	track, head;	///< Track being checked
+		std::map<unsigned char, std::vector<unsigned char> >	mGood;	///< Good sectors, by sector number
+		unsigned long	nOnTrack;		///< ID records for this track
+		unsigned long	nOffTrack;		///< ID records for other tracks
+
+		/// Sectors found in the last capture
+		std::vector<CDecodedSector>	vSectors;
+
+	public:
+		/**
+		 * @param	encoding	Data encoding
+		 * @param	datarate	Data rate in kbps
+		 * @param	clock_hz	Acquisition clock rate in Hz
+		 * @param	_spt		Number of sectors expected on each track
+		 */
+		CTrackVerifier(const CFluxDecoder::Encoding encoding, const unsigned long datarate, const unsigned long clock_hz, const unsigned long _spt);
+
+		/// Start checking a new track
+		void reset(const unsigned long _track, const unsigned long _head);
+
+		/// Decode a capture of the current track (DFE2 data) and add its sectors
+		void addCapture(const unsigned char *data, const size_t len);
+
+		/// Return true if every expected sector has been read successfully
+		bool complete(void) const		{ return mGood.size() >= spt; };
+
+		/// Return the number of sectors read successfully
+		unsigned long goodSectors(void) const	{ return mGood.size(); };
+
+		/// Return the number of sectors expected on each track
+		unsigned long expectedSectors(void) const	{ return spt; };
+
+		/**
+		 * @brief	Return true if the heads seem to be on the wrong track.
+		 *
+		 * That's when most of the ID records found so far were for another
+		 * track, which usually means the drive lost a step.
+		 */
+		bool offTrack(void) const		{ return nOffTrack > nOnTrack; };
+};
+
+#endif // _hpp_TrackVerifier
@@ -0,0 +1,388 @@
+// STL headers
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+// C++11 timekeeping
+#include <chrono>
+
+// Platform headers for fsync / preallocation
+#ifdef _WIN32
+#  include <io.h>
+#  define fsync(fd)			_commit(fd)
+#  define ftruncate(fd, sz)	_chsize(fd, sz)
+#  define fseeko(f, o, w)	_fseeki64(f, o, w)
+#else
+#  include <unistd.h>
+#  include <fcntl.h>
+#endif
+
+// Local headers
+#include "Exceptions.hpp"
+#include "TrackWriter.hpp"
+#include "DFE2.hpp"
+#include "DFEZ.hpp"
+
+using namespace std;
+
+CTrackBuffer::CTrackBuffer(size_t _capacity)
+{
+	capacity = _capacity;
+	data = new unsigned char[capacity];
+	track = head = sector = 0;
+	clock_hz = 0;
+	revs = 0;
+	len = 0;
+	ready = false;
+}
+
+CTrackBuffer::~CTrackBuffer()
+{
+	delete[] data;
+}
+
+void CTrackBuffer::reserve(const size_t n)
+{
+	if (n <= capacity) return;
+	unsigned char *p = new unsigned char[n];
+	if (len > 0) memcpy(p, data, len);
+	delete[] data;
+	data = p;
+	capacity = n;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+CTrackWriter::CTrackWriter(const std::string _filename, const std::string magic,
+		size_t depth, size_t buflen, FsyncPolicy fsync, unsigned long long prealloc, bool indexed,
+		unsigned int compressors, CCaptureJournal *_journal)
+{
+	filename = _filename;
+	fsyncPolicy = fsync;
+	bPreallocated = false;
+	bIndexed = indexed;
+	journal = _journal;
+	bytesWritten = 0;
+	dataWritten = 0;
+	writeTime_us = 0;
+	bShutdown = false;
+
+	// Carrying on from an earlier capture means opening the old file, and
+	// cutting off anything after the last record in the journal (a partial
+	// record, or the track directory)
+	const bool bResume = (journal != NULL) && journal->resumed();
+	fp = fopen(filename.c_str(), bResume ? "r+b" : "wb");
+	if (fp == NULL) {
+		throw EApplicationError("Unable to open output file '" + filename + "': " + strerror(errno));
+	}
+	if (bResume) {
+		bytesWritten = journal->dataEnd(magic);
+		if ((ftruncate(fileno(fp), bytesWritten) != 0) || (fseeko(fp, bytesWritten, SEEK_SET) != 0)) {
+			string err = strerror(errno);
+			fclose(fp);
+			throw EApplicationError("Unable to resume output file '" + filename + "': " + err);
+		}
+		if (bIndexed) vIndex = journal->records();
+	}
+
+	// Reserve space for the whole image up front. This avoids fragmentation
+	// and metadata updates on every track (which is expensive on network
+	// filesystems). The file is trimmed back to size when it is closed.
+#ifdef __linux__
+	if (prealloc > 0) {
+		if (posix_fallocate(fileno(fp), 0, prealloc) == 0)
+			bPreallocated = true;
+	}
+#else
+	(void)prealloc;
+#endif
+
+	// Write the magic string
+	if (!bResume) {
+		try {
+			writeBytes(magic.c_str(), magic.length());
+		} catch (EApplicationError &) {
+			fclose(fp);
+			throw;
+		}
+	}
+
+	// Allocate the track buffers -- we need at least two, otherwise the
+	// acquisition thread would wait for every write to complete. Each
+	// compressor needs one more, or some of them would have nothing to do.
+	if (depth < (2 + compressors)) depth = 2 + compressors;
+	for (size_t i=0; i<depth; i++) {
+		CTrackBuffer *b = new CTrackBuffer(buflen);
+		vBuffers.push_back(b);
+		qFree.push_back(b);
+	}
+
+	// Start the writer and compressors
+	thWriter = std::thread(&CTrackWriter::writerThread, this);
+	for (unsigned int i=0; i<compressors; i++)
+		vCompressors.push_back(std::thread(&CTrackWriter::compressorThread, this));
+}
+
+CTrackWriter::~CTrackWriter()
+{
+	// Make sure the writer thread has finished; errors are ignored here
+	// because we can't throw from a destructor.
+	try {
+		close();
+	} catch (EApplicationError &) {
+	}
+
+	for (vector<CTrackBuffer *>::iterator it = vBuffers.begin(); it != vBuffers.end(); it++)
+		delete *it;
+}
+
+void CTrackWriter::writeBytes(const void *p, size_t len)
+{
+	if (fwrite(p, 1, len, fp) != len) {
+		throw EApplicationError("Error writing to output file '" + filename + "': " + strerror(errno));
+	}
+	bytesWritten += len;
+}
+
+void CTrackWriter::flushToDisc(void)
+{
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		throw EApplicationError("Error flushing output file '" + filename + "': " + strerror(errno));
+	}
+}
+
+void CTrackWriter::writeRecord(const CTrackBuffer *buf)
+{
+	unsigned char x[16];
+	size_t i=0;
+
+	// The record holds the compressed block, if there is one
+	const unsigned char *payload = buf->data;
+	size_t len = buf->len;
+	if (!vCompressors.empty()) {
+		payload = &buf->packed[0];
+		len = buf->packed.size();
+	}
+
+	// Track header: track, head, sector (16 bits each), then data length (32 bits), all big-endian
+	x[i++] = (buf->track >> 8);
+	x[i++] = (buf->track & 0xff);
+	x[i++] = (buf->head >> 8);
+	x[i++] = (buf->head & 0xff);
+	x[i++] = (buf->sector >> 8);
+	x[i++] = (buf->sector & 0xff);
+	x[i++] = (len >> 24) & 0xff;
+	x[i++] = (len >> 16) & 0xff;
+	x[i++] = (len >> 8) & 0xff;
+	x[i++] = (len) & 0xff;
+	writeBytes(x, i);
+
+	CJournalRecord ent;
+	ent.track = buf->track;
+	ent.head = buf->head;
+	ent.sector = buf->sector;
+	ent.offset = bytesWritten;
+	ent.len = len;
+	ent.clock_hz = buf->clock_hz;
+	ent.revs = buf->revs;
+	if (bIndexed || (journal != NULL)) {
+		unsigned long long ticks = dfe2_revolution_ticks(buf->data, buf->len);
+		ent.rpm_milli = (ticks > 0) ? (unsigned long)((60000.0 * buf->clock_hz / ticks) + 0.5) : 0;
+	}
+
+	writeBytes(payload, len);
+	dataWritten += buf->len;
+
+	if (fsyncPolicy == FSYNC_TRACK) flushToDisc();
+
+	// The record only goes in the journal once it's out of our buffers
+	if (journal != NULL) {
+		if ((fsyncPolicy != FSYNC_TRACK) && (fflush(fp) != 0))
+			throw EApplicationError("Error writing to output file '" + filename + "': " + strerror(errno));
+		journal->add(ent);
+	}
+	if (bIndexed) vIndex.push_back(ent);
+}
+
+/// Store a big-endian value in 'n' bytes
+static void put_be(vector<unsigned char> &out, unsigned long long v, const int n)
+{
+	for (int i=n-1; i>=0; i--) out.push_back((v >> (i * 8)) & 0xff);
+}
+
+void CTrackWriter::writeDirectory(void)
+{
+	const unsigned long long offset = bytesWritten;
+	const unsigned long payload = DFE2_INDEX_HEADER_LEN + (vIndex.size() * DFE2_INDEX_ENTRY_LEN) + DFE2_INDEX_TRAILER_LEN;
+	vector<unsigned char> x;
+	x.reserve(DFE2_RECORD_HEADER_LEN + payload);
+
+	// The directory is a record of its own, so sequential readers can skip it
+	put_be(x, DFE2_INDEX_RECORD_ID, 2);
+	put_be(x, DFE2_INDEX_RECORD_ID, 2);
+	put_be(x, DFE2_INDEX_RECORD_ID, 2);
+	put_be(x, payload, 4);
+
+	x.insert(x.end(), DFE2_INDEX_MAGIC, DFE2_INDEX_MAGIC + 4);
+	put_be(x, DFE2_INDEX_VERSION, 2);
+	put_be(x, DFE2_INDEX_ENTRY_LEN, 2);
+	put_be(x, vIndex.size(), 4);
+
+	for (vector<CJournalRecord>::const_iterator it = vIndex.begin(); it != vIndex.end(); it++) {
+		put_be(x, it->track, 2);
+		put_be(x, it->head, 2);
+		put_be(x, it->sector, 2);
+		put_be(x, 0, 2);			// flags
+		put_be(x, it->offset, 8);
+		put_be(x, it->len, 4);
+		put_be(x, it->clock_hz, 4);
+		put_be(x, it->revs, 2);
+		put_be(x, 0, 2);			// reserved
+		put_be(x, it->rpm_milli, 4);
+	}
+
+	put_be(x, offset, 8);
+	put_be(x, payload, 4);
+	x.insert(x.end(), DFE2_INDEX_MAGIC, DFE2_INDEX_MAGIC + 4);
+
+	writeBytes(&x[0], x.size());
+}
+
+void CTrackWriter::writerThread(void)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while (true) {
+		// Wait for the next track to be ready to write. If it's still being
+		// compressed, the ones after it have to wait too.
+		while ((qPending.empty() && !bShutdown) || (!qPending.empty() && !qPending.front()->ready))
+			cvPending.wait(lock);
+		if (qPending.empty()) break;	// shutdown and nothing left to do
+
+		CTrackBuffer *buf = qPending.front();
+		qPending.pop_front();
+
+		// Write the track without holding the lock, so the acquisition
+		// thread can carry on queueing tracks. Once an error has occurred,
+		// we just recycle buffers until we're told to shut down.
+		if (sError.empty()) {
+			lock.unlock();
+			string err;
+			chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+			try {
+				writeRecord(buf);
+			} catch (EApplicationError &e) {
+				err = e.what();
+			}
+			writeTime_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count();
+			lock.lock();
+			if (!err.empty()) sError = err;
+		}
+
+		qFree.push_back(buf);
+		cvFree.notify_one();
+	}
+}
+
+void CTrackWriter::compressorThread(void)
+{
+	// Each compressor has its own codec, which keeps its tables between tracks
+	CDFEZCodec codec;
+
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true) {
+		while (qCompress.empty() && !bShutdown)
+			cvCompress.wait(lock);
+		if (qCompress.empty()) break;	// shutdown and nothing left to do
+
+		CTrackBuffer *buf = qCompress.front();
+		qCompress.pop_front();
+
+		lock.unlock();
+		codec.compress(buf->data, buf->len, buf->packed);
+		lock.lock();
+
+		// The writer is waiting for the tracks in order, so wake it up even if
+		// this one isn't next
+		buf->ready = true;
+		cvPending.notify_one();
+	}
+}
+
+void CTrackWriter::checkError(void)
+{
+	// Caller must hold the lock
+	if (!sError.empty()) throw EApplicationError(sError);
+}
+
+CTrackBuffer *CTrackWriter::getBuffer(void)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	while (qFree.empty() && sError.empty())
+		cvFree.wait(lock);
+	checkError();
+
+	CTrackBuffer *buf = qFree.front();
+	qFree.pop_front();
+	buf->len = 0;
+	return buf;
+}
+
+void CTrackWriter::submit(CTrackBuffer *buf)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	checkError();
+	qPending.push_back(buf);
+	if (vCompressors.empty()) {
+		buf->ready = true;
+		cvPending.notify_one();
+	} else {
+		buf->ready = false;
+		qCompress.push_back(buf);
+		cvCompress.notify_one();
+	}
+}
+
+void CTrackWriter::close(void)
+{
+	if (fp == NULL) return;
+
+	// Ask the writer and compressor threads to drain the queues and exit
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		bShutdown = true;
+		cvPending.notify_one();
+		cvCompress.notify_all();
+	}
+	for (vector<std::thread>::iterator it = vCompressors.begin(); it != vCompressors.end(); it++)
+		if (it->joinable()) it->join();
+	if (thWriter.joinable()) thWriter.join();
+
+	string err = sError;
+	try {
+		// The writer thread has gone, so the directory is ours. It's only
+		// written if all the tracks were, otherwise it might point at
+		// records which aren't there.
+		if (bIndexed && err.empty()) writeDirectory();
+
+		// Trim off any unused preallocated space
+		if (bPreallocated) {
+			if (fflush(fp) != 0 || ftruncate(fileno(fp), bytesWritten) != 0)
+				throw EApplicationError("Error truncating output file '" + filename + "': " + strerror(errno));
+		}
+		if (fsyncPolicy != FSYNC_NEVER) flushToDisc();
+	} catch (EApplicationError &e) {
+		if (err.empty()) err = e.what();
+	}
+
+	if (fclose(fp) != 0 && err.empty())
+		err = "Error closing output file '" + filename + "': " + strerror(errno);
+	fp = NULL;
+
+	if (!err.empty()) throw EApplicationError(err);
+}
+
+unsigned long long CTrackWriter::written(void)
+{
+	return bytesWritten;
+}
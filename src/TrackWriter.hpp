@@ -0,0 +1,182 @@
+#ifndef _hpp_TrackWriter
+#define _hpp_TrackWriter
+
+// C++ STL headers
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstdio>
+
+// C++11 threading
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Local headers
+#include "CaptureJournal.hpp"
+
+/**
+ * @brief	A captured track, waiting to be written to the output file.
+ *
+ * Track buffers are owned by a CTrackWriter. The acquisition thread takes a
+ * free buffer with CTrackWriter::getBuffer(), fills it with acquisition data
+ * and hands it back with CTrackWriter::submit().
+ */
+class CTrackBuffer {
+	private:
+		// Track buffers are big; don't let anyone copy them by accident
+		CTrackBuffer(const CTrackBuffer &);
+		CTrackBuffer &operator=(const CTrackBuffer &);
+
+	public:
+		unsigned long	track;		///< Physical track (cylinder) number
+		unsigned long	head;		///< Physical head number
+		unsigned long	sector;		///< Physical sector number
+		unsigned long	clock_hz;	///< Acquisition clock rate, for the track directory
+		unsigned int	revs;		///< Number of revolutions captured, for the track directory
+		unsigned char	*data;		///< Acquisition data
+		size_t			len;		///< Number of valid bytes in data
+		size_t			capacity;	///< Size of data, in bytes
+
+		std::vector<unsigned char>	packed;	///< Compressed block, filled in by the writer
+		bool			ready;		///< Set by the writer once the buffer can be written
+
+		CTrackBuffer(size_t _capacity);
+		~CTrackBuffer();
+
+		/**
+		 * @brief	Make sure the buffer can hold at least 'n' bytes.
+		 *
+		 * Only the thread which has the buffer (between getBuffer() and
+		 * submit()) may call this. The first 'len' bytes are kept.
+		 */
+		void reserve(const size_t n);
+};
+
+/**
+ * @brief	Background writer for DiscFerret acquisition data.
+ *
+ * Decouples the output file from the acquisition loop. Track buffers are
+ * passed through a bounded queue to a writer thread, which serialises them
+ * to disc in the order they were submitted. As long as the writer keeps up
+ * on average, the acquisition thread never waits for file I/O.
+ *
+ * If asked to, the writer also keeps a note of where each track record went,
+ * and ends the file with a track directory (see DFE2.hpp).
+ *
+ * The writer can also compress each track into a DFEZ block (see DFEZ.hpp).
+ * Compression is done by a pool of threads, so several tracks can be in
+ * hand at once, and the records are still written in the order they were
+ * submitted.
+ *
+ * Each record can be noted in a capture journal once it has been written.
+ * If the journal was loaded from an earlier capture, the writer carries on
+ * the existing output file after the last record in the journal, instead of
+ * starting a new one.
+ */
+class CTrackWriter {
+	public:
+		/// When should the output file be flushed to stable storage?
+		enum FsyncPolicy {
+			FSYNC_NEVER,		///< Leave it to the operating system
+			FSYNC_TRACK,		///< After every track
+			FSYNC_CLOSE			///< Once, when the file is closed
+		};
+
+	private:
+		std::string		filename;
+		FILE			*fp;
+		FsyncPolicy		fsyncPolicy;
+		bool			bPreallocated;
+		bool			bIndexed;
+		std::vector<CJournalRecord>	vIndex;	///< Track directory, if bIndexed
+		CCaptureJournal	*journal;	///< Journal of the records written, or NULL
+		std::atomic<unsigned long long>	bytesWritten;
+		std::atomic<unsigned long long>	dataWritten;	///< Acquisition data written, before compression
+		std::atomic<unsigned long long>	writeTime_us;	///< Time spent writing track records
+
+		std::vector<CTrackBuffer *>	vBuffers;	///< All buffers owned by this writer
+		std::deque<CTrackBuffer *>	qFree;		///< Buffers available to the acquisition thread
+		std::deque<CTrackBuffer *>	qPending;	///< Buffers waiting to be written
+		std::deque<CTrackBuffer *>	qCompress;	///< Buffers waiting to be compressed
+
+		std::mutex				mtx;
+		std::condition_variable	cvPending;	///< Signalled when qPending gains an entry (or on shutdown)
+		std::condition_variable	cvFree;		///< Signalled when qFree gains an entry (or on error)
+		std::condition_variable	cvCompress;	///< Signalled when qCompress gains an entry (or on shutdown)
+		std::thread				thWriter;
+		std::vector<std::thread>	vCompressors;
+		bool					bShutdown;
+		std::string				sError;		///< Writer error message, empty if no error
+
+		void writerThread(void);
+		void compressorThread(void);
+		void writeRecord(const CTrackBuffer *buf);
+		void writeDirectory(void);
+		void writeBytes(const void *p, size_t len);
+		void flushToDisc(void);
+		void checkError(void);
+
+	public:
+		/**
+		 * @brief	Open an output file and start the writer thread.
+		 *
+		 * @param	_filename	Output filename
+		 * @param	magic		File magic string (written before any track data)
+		 * @param	depth		Number of track buffers to allocate
+		 * @param	buflen		Size of each track buffer in bytes
+		 * @param	fsync		Fsync policy
+		 * @param	prealloc	Number of bytes to preallocate, or zero to grow the
+		 * 						file as needed
+		 * @param	indexed		If true, end the file with a track directory
+		 * @param	compressors	Number of threads to compress the tracks with, or
+		 * 						zero to write them as they are. If the tracks are
+		 * 						compressed, the magic should be DFEZ_MAGIC.
+		 * @param	_journal	Capture journal, or NULL. If it was loaded from an
+		 * 						earlier capture, its records must have been
+		 * 						checked against the file with validate(), and
+		 * 						start() must have been called.
+		 */
+		CTrackWriter(const std::string _filename, const std::string magic,
+				size_t depth, size_t buflen,
+				FsyncPolicy fsync = FSYNC_NEVER,
+				unsigned long long prealloc = 0,
+				bool indexed = false,
+				unsigned int compressors = 0,
+				CCaptureJournal *_journal = NULL);
+		~CTrackWriter();
+
+		/**
+		 * @brief	Get an empty track buffer.
+		 *
+		 * Only blocks if every buffer is waiting to be written.
+		 */
+		CTrackBuffer *getBuffer(void);
+
+		/**
+		 * @brief	Queue a filled track buffer for writing.
+		 *
+		 * Ownership of the buffer returns to the writer.
+		 */
+		void submit(CTrackBuffer *buf);
+
+		/**
+		 * @brief	Write all pending tracks (and the track directory, if there is
+		 * 			one), stop the writer thread and close the file.
+		 *
+		 * Throws EApplicationError if any write failed.
+		 */
+		void close(void);
+
+		/// Return the number of bytes written to the output file so far
+		unsigned long long written(void);
+
+		/// Return the number of bytes of acquisition data written so far, before compression
+		unsigned long long dataBytes(void)		{ return dataWritten; };
+
+		/// Return the time the writer thread has spent writing track records, in microseconds
+		unsigned long long writeTime(void)		{ return writeTime_us; };
+};
+
+#endif // _hpp_TrackWriter
@@ -0,0 +1,791 @@
+/****************************************************************************
+ * Magpie host-side microbenchmarks
+ *
+ * Times the host code paths which sit between the DiscFerret and the output
+ * file: drive script calls, script scanning, DFE2 encoding and writing, and
+ * FM/MFM decoding.
+ *
+ * Results are printed one per line as "name<TAB>value<TAB>unit". Names are
+ * stable between builds, so two result files can be compared directly; see
+ * --baseline.
+ ****************************************************************************/
+
+// C++ stdlib
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <getopt.h>
+#include <dirent.h>
+
+// C++11 timekeeping
+#include <chrono>
+
+// Local headers
+#include "ScriptInterfaces.hpp"
+#include "ScriptManagers.hpp"
+#include "TrackWriter.hpp"
+#include "DFE2.hpp"
+#include "DFE2Expand.hpp"
+#include "FluxDecoder.hpp"
+#include "FluxHistogram.hpp"
+#include "DFEImage.hpp"
+#include "DFEZ.hpp"
+#include "Exceptions.hpp"
+
+using namespace std;
+
+/// Minimum time to spend on each measurement, in seconds
+static double minTime = 0.25;
+
+/// Only run benchmarks whose names contain this string
+static string filter;
+
+/// Results, in the order they were produced
+static vector<pair<string, pair<double, string> > > vResults;
+
+/**
+ * Check a benchmark name against the filter.
+ */
+static bool wanted(const string name)
+{
+	return filter.empty() || (name.find(filter) != string::npos);
+}
+
+/**
+ * Record and print a result.
+ */
+static void report(const string name, const double value, const string unit)
+{
+	vResults.push_back(make_pair(name, make_pair(value, unit)));
+	printf("%s\t%.3f\t%s\n", name.c_str(), value, unit.c_str());
+	fflush(stdout);
+}
+
+/**
+ * Time an operation.
+ *
+ * Runs fn() in batches, doubling the batch size until a batch takes at least
+ * minTime, then returns the time per call in nanoseconds.
+ */
+template <typename F>
+static double time_per_op(F fn)
+{
+	unsigned long n = 1;
+	while (true) {
+		chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+		for (unsigned long i=0; i<n; i++) fn();
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+		if ((secs >= minTime) || (n >= (1UL << 30))) return (secs * 1.0e9) / n;
+		n *= 2;
+	}
+}
+
+/**
+ * Time a single run of an operation, in milliseconds.
+ */
+template <typename F>
+static double time_once(F fn)
+{
+	chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+	fn();
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Drive scripts
+
+/**
+ * Per-call overhead of the drive script functions used in the acquisition loop.
+ */
+static void bench_drivescripts(const string dir)
+{
+	DIR *dp = opendir(dir.c_str());
+	if (dp == NULL) {
+		cerr << "Unable to open drive script directory '" << dir << "'" << endl;
+		return;
+	}
+
+	vector<string> files;
+	struct dirent *dt;
+	while ((dt = readdir(dp)) != NULL) {
+		string fn = dt->d_name;
+		if ((fn.length() > 4) && (fn[0] != '.') && (fn.substr(fn.length()-4).compare(".lua") == 0))
+			files.push_back(fn);
+	}
+	closedir(dp);
+	sort(files.begin(), files.end());
+
+	for (vector<string>::const_iterator f = files.begin(); f != files.end(); f++) {
+		string script = f->substr(0, f->length() - 4);
+		CDriveScript ds(dir + "/" + *f);
+		vector<string> types = ds.getDrivetypes();
+		sort(types.begin(), types.end());
+
+		for (vector<string>::const_iterator t = types.begin(); t != types.end(); t++) {
+			string prefix = "drivescript." + script + "." + *t + ".";
+			unsigned long status = 0;
+			volatile bool rdy;
+			volatile int outputs;
+
+			// The Lua path has to be measured before the ready table is compiled
+			if (wanted(prefix + "isDriveReady.lua")) {
+				report(prefix + "isDriveReady.lua", time_per_op([&]() {
+					status += 0x0800;
+					rdy = ds.isDriveReady(*t, status & 0xF800);
+				}), "ns/call");
+			}
+
+			if (ds.compileReadyTable(*t) && wanted(prefix + "isDriveReady.table")) {
+				report(prefix + "isDriveReady.table", time_per_op([&]() {
+					status += 0x0800;
+					rdy = ds.isDriveReady(*t, status & 0xF800);
+				}), "ns/call");
+			}
+
+			if (wanted(prefix + "getDriveOutputs")) {
+				CDriveInfo info = ds.GetDriveInfo(*t);
+				unsigned long trk = 0, hd = 0;
+				report(prefix + "getDriveOutputs", time_per_op([&]() {
+					outputs = ds.getDriveOutputs(*t, trk, hd, 1);
+					if (++hd >= info.heads()) {
+						hd = 0;
+						if (++trk >= info.tracks()) trk = 0;
+					}
+				}), "ns/call");
+			}
+			(void)rdy;
+			(void)outputs;
+		}
+	}
+}
+
+/**
+ * Startup cost of scanning the drive script directory.
+ */
+static void bench_scandir(const string dir, const string tmpfile)
+{
+	if (wanted("scriptmgr.scandir.cold")) {
+		report("scriptmgr.scandir.cold", time_once([&]() {
+			CDriveScriptManager mgr;
+			mgr.scandir(dir);
+		}), "ms");
+	}
+
+	if (wanted("scriptmgr.scandir.catalog")) {
+		string catalog = tmpfile + ".catalog";
+		{
+			CDriveScriptManager mgr;
+			mgr.scandir(dir);
+			mgr.saveCatalog(catalog);
+		}
+		report("scriptmgr.scandir.catalog", time_once([&]() {
+			CDriveScriptManager mgr;
+			mgr.loadCatalog(catalog);
+			mgr.scandir(dir);
+		}), "ms");
+		remove(catalog.c_str());
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// DFE2 data
+
+/**
+ * Build a representative track: one revolution of 250kbps MFM at 100MHz
+ * (transitions at 4, 6 and 8us), with an index marker at the start.
+ */
+static void make_track(vector<unsigned char> &out, vector<unsigned long> &intervals)
+{
+	unsigned long seed = 1;
+	unsigned long total = 0;
+	while (total < 20000000) {		// 200ms at 100MHz
+		seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+		unsigned long v = 400 + (200 * ((seed >> 16) % 3)) + ((seed >> 8) % 21) - 10;
+		intervals.push_back(v);
+		total += v;
+	}
+
+	dfe2_put_index(out, 0);
+	for (vector<unsigned long>::const_iterator it = intervals.begin(); it != intervals.end(); it++)
+		dfe2_put_transition(out, *it);
+}
+
+/**
+ * DFE2 encoding rate.
+ */
+static void bench_dfe2_encode(void)
+{
+	if (!wanted("dfe2.encode")) return;
+
+	vector<unsigned char> trk;
+	vector<unsigned long> intervals;
+	make_track(trk, intervals);
+
+	vector<unsigned char> out;
+	out.reserve(trk.size());
+	double ns = time_per_op([&]() {
+		out.clear();
+		dfe2_put_index(out, 0);
+		for (vector<unsigned long>::const_iterator it = intervals.begin(); it != intervals.end(); it++)
+			dfe2_put_transition(out, *it);
+	});
+	report("dfe2.encode", (intervals.size() / 1.0e6) / (ns / 1.0e9), "Mtrans/s");
+}
+
+/**
+ * DFE2 record header + payload write throughput, through the output file writer.
+ */
+static void bench_dfe2_write(const string tmpfile)
+{
+	if (!wanted("dfe2.write")) return;
+
+	vector<unsigned char> trk;
+	vector<unsigned long> intervals;
+	make_track(trk, intervals);
+
+	// 80 tracks, 2 heads, 2 revolutions per track
+	const unsigned long TRACKS = 80, HEADS = 2;
+	size_t len = trk.size() * 2;
+	unsigned long long total = 0;
+
+	double ms = time_once([&]() {
+		CTrackWriter writer(tmpfile, DFE2_MAGIC, 4, len);
+		for (unsigned long t=0; t<TRACKS; t++) {
+			for (unsigned long h=0; h<HEADS; h++) {
+				CTrackBuffer *tb = writer.getBuffer();
+				tb->track = t;
+				tb->head = h;
+				tb->sector = 1;
+				memcpy(tb->data, &trk[0], trk.size());
+				memcpy(tb->data + trk.size(), &trk[0], trk.size());
+				tb->len = len;
+				writer.submit(tb);
+			}
+		}
+		writer.close();
+		total = writer.written();
+	});
+	remove(tmpfile.c_str());
+
+	report("dfe2.write", (total / 1048576.0) / (ms / 1000.0), "MB/s");
+}
+
+/**
+ * Opening an 80-track, 2-head image and finding the last track in it, with
+ * and without a track directory. This is what a tool which only needs one or
+ * two tracks from each of a lot of images pays per image.
+ */
+static void bench_dfe2_open(const string tmpfile)
+{
+	const bool wantIndexed = wanted("dfe2.open.indexed"), wantScan = wanted("dfe2.open.scan");
+	if (!wantIndexed && !wantScan) return;
+
+	vector<unsigned char> trk;
+	vector<unsigned long> intervals;
+	make_track(trk, intervals);
+
+	for (int indexed=0; indexed<2; indexed++) {
+		const string name = indexed ? "dfe2.open.indexed" : "dfe2.open.scan";
+		if (!(indexed ? wantIndexed : wantScan)) continue;
+
+		// 80 tracks, 2 heads, 2 revolutions per track
+		const unsigned long TRACKS = 80, HEADS = 2;
+		size_t len = trk.size() * 2;
+		CTrackWriter writer(tmpfile, DFE2_MAGIC, 4, len, CTrackWriter::FSYNC_NEVER, 0, indexed);
+		for (unsigned long t=0; t<TRACKS; t++) {
+			for (unsigned long h=0; h<HEADS; h++) {
+				CTrackBuffer *tb = writer.getBuffer();
+				tb->track = t;
+				tb->head = h;
+				tb->sector = 1;
+				tb->clock_hz = 100000000;
+				tb->revs = 2;
+				memcpy(tb->data, &trk[0], trk.size());
+				memcpy(tb->data + trk.size(), &trk[0], trk.size());
+				tb->len = len;
+				writer.submit(tb);
+			}
+		}
+		writer.close();
+
+		// Check the last track can be found, and is what was written
+		{
+			CDFEImage img(tmpfile);
+			const CDFETrack *t = img.find(TRACKS - 1, HEADS - 1);
+			if ((img.indexed() != (indexed != 0)) || (t == NULL) || (t->len != len) || (memcmp(t->data, &trk[0], trk.size()) != 0)) {
+				cerr << name << ": track " << (TRACKS - 1) << "." << (HEADS - 1) << " not read back correctly" << endl;
+				report(name, 0, "opens/s");
+				continue;
+			}
+		}
+
+		volatile unsigned char sample;
+		double ns = time_per_op([&]() {
+			CDFEImage img(tmpfile);
+			const CDFETrack *t = img.find(TRACKS - 1, HEADS - 1);
+			sample = t->data[t->len / 2];
+		});
+		(void)sample;
+		report(name, 1.0e9 / ns, "opens/s");
+	}
+	remove(tmpfile.c_str());
+}
+
+/**
+ * Check every DFE2 expander against the scalar one, on a real-looking track
+ * and on random data (which has plenty of index markers, carries and odd
+ * lengths).
+ *
+ * @return	true if they all gave exactly the same output
+ */
+static bool check_dfe2_expand(const vector<unsigned char> &trk)
+{
+	const DFE2ExpandPath paths[] = { DFE2_EXPAND_SSE2, DFE2_EXPAND_AVX2 };
+	unsigned long seed = 1;
+	bool ok = true;
+
+	for (int n=0; n<1000; n++) {
+		vector<unsigned char> data;
+		if (n == 0) {
+			data = trk;
+		} else {
+			size_t len = n % 300;
+			for (size_t i=0; i<len; i++) {
+				seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+				data.push_back(seed >> 16);
+			}
+		}
+		const size_t MAXINDEX = 4;
+		vector<unsigned int> ref(data.size() + 1), iv(data.size() + 1);
+		size_t refidx[MAXINDEX], idx[MAXINDEX], nref, ni;
+		size_t nt = dfe2_expand(data.empty() ? NULL : &data[0], data.size(), &ref[0], refidx, MAXINDEX, nref, DFE2_EXPAND_SCALAR);
+
+		for (size_t p=0; p<(sizeof(paths) / sizeof(paths[0])); p++) {
+			if (!dfe2_expand_supported(paths[p])) continue;
+			size_t np = dfe2_expand(data.empty() ? NULL : &data[0], data.size(), &iv[0], idx, MAXINDEX, ni, paths[p]);
+			if ((np != nt) || (ni != nref) || !equal(ref.begin(), ref.begin() + nt, iv.begin()) ||
+					!equal(refidx, refidx + min(nref, MAXINDEX), idx)) {
+				cerr << "dfe2.expand." << dfe2_expand_name(paths[p]) << ": output differs from scalar (test " << n << ")" << endl;
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+/**
+ * DFE2 expansion rate, for each expander this CPU supports.
+ */
+static void bench_dfe2_expand(void)
+{
+	const DFE2ExpandPath paths[] = { DFE2_EXPAND_SCALAR, DFE2_EXPAND_SSE2, DFE2_EXPAND_AVX2 };
+	const size_t npaths = sizeof(paths) / sizeof(paths[0]);
+
+	// Only go to the trouble of checking the expanders if one of them is wanted
+	bool any = false;
+	for (size_t p=0; p<npaths; p++)
+		if (dfe2_expand_supported(paths[p]) && wanted(string("dfe2.expand.") + dfe2_expand_name(paths[p]))) any = true;
+	if (!any) return;
+
+	vector<unsigned char> trk;
+	vector<unsigned long> intervals;
+	make_track(trk, intervals);
+	bool ok = check_dfe2_expand(trk);
+
+	vector<unsigned int> iv(trk.size());
+	size_t index[16], nindex;
+	for (size_t p=0; p<npaths; p++) {
+		if (!dfe2_expand_supported(paths[p])) continue;
+		string name = string("dfe2.expand.") + dfe2_expand_name(paths[p]);
+		if (!wanted(name)) continue;
+		if (!ok) {
+			report(name, 0, "MB/s");
+			continue;
+		}
+		double ns = time_per_op([&]() {
+			dfe2_expand(&trk[0], trk.size(), &iv[0], index, 16, nindex, paths[p]);
+		});
+		report(name, (trk.size() / 1048576.0) / (ns / 1.0e9), "MB/s");
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// FM/MFM decoding
+
+/**
+ * Cell stream builder for a synthetic IBM format track.
+ */
+class CTrackBuilder {
+	private:
+		CFluxDecoder::Encoding	enc;
+		bool					lastData;	///< Last data bit written (for MFM clocking)
+
+		void raw(const unsigned int pattern) {
+			for (int i=15; i>=0; i--) cells.push_back((pattern >> i) & 1);
+			lastData = pattern & 1;
+		}
+
+	public:
+		std::vector<unsigned char>	cells;
+		unsigned short				crc;
+
+		CTrackBuilder(const CFluxDecoder::Encoding _enc) : enc(_enc), lastData(false), crc(0xFFFF) { };
+
+		/// Add a data byte
+		void byte(const unsigned char b) {
+			for (int i=7; i>=0; i--) {
+				bool d = (b >> i) & 1;
+				cells.push_back((enc == CFluxDecoder::ENC_FM) ? 1 : !(d || lastData));
+				cells.push_back(d);
+				lastData = d;
+			}
+			crc ^= b << 8;
+			for (int i=0; i<8; i++)
+				crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+
+		/// Add a data byte several times
+		void fill(const unsigned char b, const size_t n) {
+			for (size_t i=0; i<n; i++) byte(b);
+		}
+
+		/// Add an address mark (with its sync bytes, for MFM) and start a CRC
+		void mark(const unsigned char m) {
+			crc = 0xFFFF;
+			if (enc == CFluxDecoder::ENC_MFM) {
+				for (int i=0; i<3; i++) { raw(0x4489); byte(0xA1); cells.resize(cells.size() - 16); }
+				byte(m);
+			} else {
+				// Clock pattern C7 interleaved with the mark
+				unsigned int w = 0;
+				for (int i=7; i>=0; i--) w = (w << 2) | (((0xC7 >> i) & 1) << 1) | ((m >> i) & 1);
+				byte(m);
+				cells.resize(cells.size() - 16);
+				raw(w);
+			}
+		}
+
+		/// Add the CRC
+		void putcrc(void) {
+			unsigned short c = crc;
+			byte(c >> 8);
+			byte(c & 0xFF);
+		}
+};
+
+/**
+ * Build a synthetic two-revolution IBM format track as DFE2 data: MFM is
+ * 9 x 512-byte sectors at 250kbps, FM 8 x 256-byte sectors at 125kbps,
+ * both at 300rpm. The flux timing has random jitter and a slow speed
+ * wobble, like a real drive.
+ */
+static void make_ibm_track(const CFluxDecoder::Encoding enc, const unsigned long clock_hz, vector<unsigned char> &out, unsigned long &datarate, unsigned long &spt)
+{
+	const bool mfm = (enc == CFluxDecoder::ENC_MFM);
+	datarate = mfm ? 250 : 125;
+	spt = mfm ? 9 : 8;
+	const unsigned char sizecode = mfm ? 2 : 1;
+	const size_t revcells = datarate * 1000 * 2 / 5;		// 200ms per revolution
+
+	CTrackBuilder tb(enc);
+	unsigned char gap = mfm ? 0x4E : 0xFF;
+	tb.fill(gap, mfm ? 80 : 40);
+	for (unsigned long s=1; s<=spt; s++) {
+		tb.fill(0x00, mfm ? 12 : 6);
+		tb.mark(0xFE);
+		tb.byte(5);	tb.byte(0);	tb.byte(s);	tb.byte(sizecode);
+		tb.putcrc();
+		tb.fill(gap, mfm ? 22 : 11);
+		tb.fill(0x00, mfm ? 12 : 6);
+		tb.mark(0xFB);
+		for (size_t i=0; i<(128U << sizecode); i++) tb.byte((unsigned char)(s * 7 + i));
+		tb.putcrc();
+		tb.fill(gap, mfm ? 80 : 27);
+	}
+	while (tb.cells.size() < revcells) tb.fill(gap, 1);
+	tb.cells.resize(revcells);
+
+	const double cell = (double)clock_hz / (datarate * 1000.0 * 2);
+	unsigned long seed = 1;
+	double t = 0, last = 0;
+	out.clear();
+	dfe2_put_index(out, 0);
+	for (int rev=0; rev<2; rev++) {
+		for (size_t i=0; i<revcells; i++) {
+			t += cell * (1.0 + 0.01 * sin((rev * revcells + i) / 20000.0));
+			if (!tb.cells[i]) continue;
+			seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+			double jitter = cell * ((long)((seed >> 8) % 101) - 50) / 500.0;	// +/-10% of a cell
+			dfe2_put_transition(out, (unsigned long)(t + jitter - last));
+			last = t + jitter;
+		}
+		dfe2_put_index(out, 0);
+	}
+}
+
+/**
+ * Whole-track FM and MFM decoding rate, at each acquisition clock rate.
+ * Each synthetic track is checked first, so a decoder which has got faster
+ * by getting things wrong doesn't go unnoticed.
+ */
+static void bench_flux_decode(void)
+{
+	const CFluxDecoder::Encoding encs[] = { CFluxDecoder::ENC_FM, CFluxDecoder::ENC_MFM };
+	const unsigned long clocks[] = { 25000000, 50000000, 100000000 };
+
+	for (size_t e=0; e<(sizeof(encs) / sizeof(encs[0])); e++) {
+		for (size_t c=0; c<(sizeof(clocks) / sizeof(clocks[0])); c++) {
+			stringstream ss;
+			ss << "flux.decode." << ((encs[e] == CFluxDecoder::ENC_MFM) ? "mfm" : "fm") << "." << (clocks[c] / 1000000) << "mhz";
+			string name = ss.str();
+			if (!wanted(name)) continue;
+
+			vector<unsigned char> trk;
+			unsigned long datarate, spt;
+			make_ibm_track(encs[e], clocks[c], trk, datarate, spt);
+
+			CFluxDecoder dec(encs[e], datarate, clocks[c]);
+			vector<CDecodedSector> sectors;
+			dec.decodeTrack(&trk[0], trk.size(), sectors);
+			unsigned long good = 0;
+			for (vector<CDecodedSector>::const_iterator it = sectors.begin(); it != sectors.end(); it++)
+				if (it->dataOK) good++;
+			if (good != (spt * 2)) {
+				cerr << name << ": decoded " << good << " good sectors, expected " << (spt * 2) << endl;
+				report(name, 0, "tracks/s");
+				continue;
+			}
+
+			double ns = time_per_op([&]() {
+				sectors.clear();
+				dec.decodeTrack(&trk[0], trk.size(), sectors);
+			});
+			report(name, 1.0e9 / ns, "tracks/s");
+		}
+	}
+}
+
+/**
+ * Flux interval histogram rate, including the DFE2 expansion. The track is
+ * checked to be recognised as MFM at 250kbps first.
+ */
+static void bench_flux_histogram(void)
+{
+	if (!wanted("flux.histogram")) return;
+
+	vector<unsigned char> trk;
+	unsigned long datarate, spt;
+	make_ibm_track(CFluxDecoder::ENC_MFM, 100000000, trk, datarate, spt);
+
+	CFluxHistogram hist(100000000);
+	CFluxAnalysis result;
+	hist.addCapture(&trk[0], trk.size());
+	if (!hist.analyse(result) || (result.spacing != CFluxAnalysis::SPACING_MFM) || (result.datarate != datarate)) {
+		cerr << "flux.histogram: detected " << result.spacingName() << " at " << result.datarate << "kbps, expected mfm at " << datarate << "kbps" << endl;
+		report("flux.histogram", 0, "tracks/s");
+		return;
+	}
+
+	double ns = time_per_op([&]() {
+		hist.clear();
+		hist.addCapture(&trk[0], trk.size());
+	});
+	report("flux.histogram", 1.0e9 / ns, "tracks/s");
+}
+
+/**
+ * DFEZ track compression: packing and unpacking rates (in MB of acquisition
+ * data), and the packed size as a percentage of the original. The track is
+ * checked to come back out exactly as it went in first.
+ */
+static void bench_dfez(void)
+{
+	const bool wantCompress = wanted("dfez.compress"), wantDecompress = wanted("dfez.decompress"), wantSize = wanted("dfez.size");
+	if (!wantCompress && !wantDecompress && !wantSize) return;
+
+	vector<unsigned char> trk, packed, unpacked;
+	unsigned long datarate, spt;
+	make_ibm_track(CFluxDecoder::ENC_MFM, 100000000, trk, datarate, spt);
+
+	CDFEZCodec codec;
+	codec.compress(&trk[0], trk.size(), packed);
+	if (!codec.decompress(&packed[0], packed.size(), unpacked) || (unpacked != trk)) {
+		cerr << "dfez: track doesn't survive compression" << endl;
+		if (wantCompress) report("dfez.compress", 0, "MB/s");
+		if (wantDecompress) report("dfez.decompress", 0, "MB/s");
+		return;
+	}
+
+	if (wantCompress) {
+		double ns = time_per_op([&]() {
+			codec.compress(&trk[0], trk.size(), packed);
+		});
+		report("dfez.compress", (trk.size() / 1048576.0) / (ns / 1.0e9), "MB/s");
+	}
+	if (wantDecompress) {
+		double ns = time_per_op([&]() {
+			codec.decompress(&packed[0], packed.size(), unpacked);
+		});
+		report("dfez.decompress", (trk.size() / 1048576.0) / (ns / 1.0e9), "MB/s");
+	}
+	if (wantSize) report("dfez.size", (packed.size() * 100.0) / trk.size(), "%");
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Baseline comparison
+
+/**
+ * Compare the results against a baseline result file.
+ *
+ * Units ending in "/s" are rates (higher is better); everything else is a
+ * time or a size (lower is better).
+ *
+ * @return	Number of results which regressed by more than tolerance percent
+ */
+static int compare_baseline(const string filename, const double tolerance)
+{
+	ifstream f(filename.c_str());
+	if (!f.is_open()) {
+		cerr << "Unable to open baseline file '" << filename << "'" << endl;
+		return -1;
+	}
+
+	map<string, double> baseline;
+	string line;
+	while (getline(f, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		size_t tab = line.find('\t');
+		if (tab == string::npos) continue;
+		baseline[line.substr(0, tab)] = strtod(line.c_str() + tab + 1, NULL);
+	}
+
+	int regressions = 0;
+	for (vector<pair<string, pair<double, string> > >::const_iterator it = vResults.begin(); it != vResults.end(); it++) {
+		map<string, double>::const_iterator b = baseline.find(it->first);
+		if ((b == baseline.end()) || (b->second <= 0)) continue;
+
+		const string &unit = it->second.second;
+		bool rate = (unit.length() >= 2) && (unit.substr(unit.length()-2).compare("/s") == 0);
+		double change = ((it->second.first - b->second) / b->second) * 100.0;
+		double worse = rate ? -change : change;
+
+		if (worse > tolerance) {
+			fprintf(stderr, "REGRESSION %s: %.3f -> %.3f %s (%+.1f%%)\n",
+					it->first.c_str(), b->second, it->second.first, unit.c_str(), change);
+			regressions++;
+		}
+	}
+	return regressions;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void usage(char *appname)
+{
+	cout
+		<< "Usage:" << endl
+		<< "   " << appname << " [--scripts dir] [--filter name] [--mintime ms]" << endl
+		<< "      [--tmpfile filename] [--baseline resultfile [--tolerance pct]]" << endl
+		<< endl
+		<< "Where:" << endl
+		<< "   dir         Drive script directory (default is ./scripts/drive)." << endl
+		<< "   name        Only run benchmarks whose names contain this string." << endl
+		<< "   ms          Minimum time to spend on each measurement (default 250)." << endl
+		<< "   filename    Scratch file for write benchmarks (default magpie-bench.tmp)." << endl
+		<< "   resultfile  Results from an earlier run to compare against. The exit" << endl
+		<< "               status is non-zero if anything got slower by more than pct" << endl
+		<< "               percent (default 10)." << endl
+		<< endl
+		<< "Results are printed as 'name<TAB>value<TAB>unit', one per line." << endl;
+}
+
+int main(int argc, char **argv)
+{
+	string scriptdir = "./scripts/drive";
+	string tmpfile = "magpie-bench.tmp";
+	string baseline;
+	double tolerance = 10;
+
+	while (1) {
+		static const struct option opts_long[] = {
+			// name			has_arg				flag	val
+			{"help",		no_argument,		0,		'h'},
+			{"scripts",		required_argument,	0,		's'},
+			{"filter",		required_argument,	0,		'f'},
+			{"mintime",		required_argument,	0,		'm'},
+			{"tmpfile",		required_argument,	0,		't'},
+			{"baseline",	required_argument,	0,		'b'},
+			{"tolerance",	required_argument,	0,		'T'},
+			{0, 0, 0, 0}	// end sentinel / terminator
+		};
+		static const char *opts_short = "hs:f:m:t:b:T:";
+
+		int idx = 0;
+		int c;
+		if ((c = getopt_long(argc, argv, opts_short, opts_long, &idx)) == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(argv[0]);
+				return EXIT_SUCCESS;
+			case 's':
+				scriptdir = optarg;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'm':
+				minTime = atof(optarg) / 1000.0;
+				break;
+			case 't':
+				tmpfile = optarg;
+				break;
+			case 'b':
+				baseline = optarg;
+				break;
+			case 'T':
+				tolerance = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	try {
+		bench_drivescripts(scriptdir);
+		bench_scandir(scriptdir, tmpfile);
+		bench_dfe2_encode();
+		bench_dfe2_write(tmpfile);
+		bench_dfe2_open(tmpfile);
+		bench_dfe2_expand();
+		bench_flux_decode();
+		bench_flux_histogram();
+		bench_dfez();
+	} catch (EApplicationError &e) {
+		cerr << "Application error: " << e.what() << endl;
+		return EXIT_FAILURE;
+	} catch (EDriveSpecParse &e) {
+		cerr << "[" << e.filename() << ", drivespec '" << e.spec() << "']: DriveSpec error: " << e.error() << endl;
+		return EXIT_FAILURE;
+	} catch (ELuaError &e) {
+		cerr << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!baseline.empty()) {
+		int r = compare_baseline(baseline, tolerance);
+		if (r != 0) return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
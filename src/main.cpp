@@ -10,15 +10,25 @@
 // C++ stdlib
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <algorithm>
+#include <cmath>
 #include <getopt.h>
-#include <unistd.h> // FIXME: remove when the usleep head settle delay is removed
+#include <unistd.h>
+
+// C++11 threads and timekeeping
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <system_error>
 
 // Windows
 #ifdef _WIN32
@@ -43,6 +53,25 @@
 // Local headers
 #include "ScriptInterfaces.hpp"
 #include "ScriptManagers.hpp"
+#include "AcquisitionPlan.hpp"
+#include "TrackWriter.hpp"
+#include "RegisterCache.hpp"
+#include "PollScheduler.hpp"
+#include "Metrics.hpp"
+#include "ProgressReporter.hpp"
+#include "DeviceBackend.hpp"
+#include "DiscFerretBackend.hpp"
+#include "SimulatedBackend.hpp"
+#include "TimingProfile.hpp"
+#include "Autotune.hpp"
+#include "DFE2.hpp"
+#include "DFEZ.hpp"
+#include "CaptureJournal.hpp"
+#include "TrackVerifier.hpp"
+#include "FluxHistogram.hpp"
+#include "ImageExporter.hpp"
+#include "ConsoleStream.hpp"
+#include "LocalSocket.hpp"
 #include "Exceptions.hpp"
 
 using namespace std;
@@ -51,12 +80,26 @@ using namespace std;
 #ifndef DRIVESCRIPTDIR
 #define DRIVESCRIPTDIR "./scripts/drive"
 #endif
+#ifndef FORMATSCRIPTDIR
+#define FORMATSCRIPTDIR "./scripts/format"
+#endif
+
+// Drive script catalog (caches script contents between runs)
+#ifndef DRIVESCRIPTCATALOG
+#define DRIVESCRIPTCATALOG DRIVESCRIPTDIR "/.catalog"
+#endif
+
+// Drive timing profiles (written by --autotune)
+#ifndef TIMINGPROFILEDIR
+#define TIMINGPROFILEDIR "./profiles"
+#endif
 
 /// Verbosity flag; true if verbose mode enabled.
 int bVerbose = false;
 
-/// Abort flag. Set by the trap handler when the user presses Ctrl-C.
-int bAbort = false;
+/// Abort flag. Set by the trap handler when the user presses Ctrl-C, and
+/// read by every capture thread, so it has to be atomic.
+atomic<int> bAbort(false);
 
 /////////////////////////////////////////////////////////////////////////////
 // Ctrl-C trap handling
@@ -103,6 +146,18 @@ void trap_break(bool act)
 /////////////////////////////////////////////////////////////////////////////
 // Helper functions
 
+/// Default timeout for the drive to become ready, in milliseconds
+const int READY_TIMEOUT_MS = 10000;
+
+/// Timeout for an acquisition which can't be predicted (e.g. no index sense), in milliseconds
+const int ACQ_TIMEOUT_MS = 30000;
+
+/// Size of the DiscFerret's acquisition RAM, in bytes
+const unsigned long ACQ_RAM_BYTES = 524288;
+
+/// Head settle time without index sense, if there's no timing profile, in microseconds
+const unsigned long NOINDEX_SETTLE_US = 500000;
+
 /**
  * Wait for the drive to become ready, using the DriveScript to determine
  * readiness.
@@ -110,20 +165,96 @@ void trap_break(bool act)
  * Reads the status of the disc drive, then passes the status value on to the
  * Drive Script in order to determine if the drive is ready.
  *
- * @param	dh			DiscFerret device handle
+ * @param	dev			DiscFerret device
  * @param	drivescript	Pointer to the drive script in use
  * @param	drivetype	String ID of the current disc drive type
- * @param	timeout		Timeout in milliseconds
- *
- * @todo	Implement timeout
+ * @param	timeout		Timeout in milliseconds, or -1 to wait forever. Throws
+ * 						ETimeoutError if the drive isn't ready in time.
+ * @param	expect_us	When the drive is expected to become ready (e.g. the time
+ * 						it takes to step the heads), in microseconds
+ * @return	Number of times the status register was polled
  */
-void wait_drive_ready(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, string drivetype, int timeout = -1)
+unsigned long wait_drive_ready(CDeviceBackend *dev, CDriveScript *drivescript, string drivetype, int timeout = READY_TIMEOUT_MS, unsigned long expect_us = 0)
 {
+	CPollScheduler sched("drive ready", expect_us, (timeout < 0) ? 0 : (timeout * 1000UL));
 	long stat;
 	do {
-		stat = discferret_get_status(dh);
+		sched.wait();
+		stat = dev->getStatus();
 	} while ((stat >= 0) && (!drivescript->isDriveReady(drivetype, stat)));
 	if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+	return sched.polls();
+}
+
+/**
+ * Read back acquisition RAM while an acquisition is in progress.
+ *
+ * Polls the acquisition RAM address while the capture runs, and reads each
+ * completed chunk behind the write pointer. When the acquisition finishes,
+ * only the data written since the last chunk still has to be transferred,
+ * so most of the USB transfer time is hidden behind disc rotation.
+ *
+ * This relies on RAM reads leaving the acquisition write pointer alone. No
+ * DiscFerret microcode has a separate read pointer yet, so this is only a
+ * testing mode for the simulator (--streamread, which isn't listed in the
+ * help), and is refused on any device without one
+ * (CDeviceBackend::hasReadPointer()).
+ *
+ * @param	dev			DiscFerret device
+ * @param	buf			Buffer to store acquisition data in
+ * @param	buflen		Size of buf in bytes
+ * @param	deadline_us	Time allowed for the acquisition to finish, in microseconds
+ * @param	polls		Incremented by the number of status register polls
+ * @param	out			Stream for warnings
+ * @return	Number of bytes of acquisition data read
+ */
+long read_acq_ram_streaming(CDeviceBackend *dev, unsigned char *buf, size_t buflen, unsigned long deadline_us, unsigned long &polls, ostream &out)
+{
+	// Transfer size for each read-behind chunk, and a safety margin behind the
+	// write pointer (the last few bytes may not have reached RAM yet)
+	const long CHUNK = 32768;
+	const long GUARD = 512;
+
+	DISCFERRET_ERROR e;
+	long done = 0, wptr, stat;
+	bool idle;
+
+	// There's no point predicting the end of the capture here, because we want
+	// to be polling while it runs; just back off when there's nothing to read.
+	CPollScheduler sched("acquisition to complete", 0, deadline_us);
+
+	do {
+		long before = done;
+
+		stat = dev->getStatus();
+		polls++;
+		if (stat < 0) throw EApplicationError("Error reading DiscFerret status register");
+		idle = ((stat & DISCFERRET_STATUS_ACQSTATUS_MASK) == DISCFERRET_STATUS_ACQ_IDLE);
+
+		wptr = dev->ramAddrGet();
+		if (wptr < 0) throw EApplicationError("Error reading RAM address");
+		if (idle && (stat & DISCFERRET_STATUS_RAM_FULL)) {
+			out << "*** WARNING: RAM Full when reading -- the RAM buffer may have overflowed!" << endl;
+			wptr = ACQ_RAM_BYTES;
+		}
+		if ((size_t)wptr > buflen) wptr = buflen;
+
+		// Once the capture has finished, everything up to the write pointer is
+		// valid. Until then, only read whole chunks which are clear of the guard.
+		while ((idle && (done < wptr)) || (!idle && ((wptr - GUARD - done) >= CHUNK))) {
+			long n = idle ? (wptr - done) : CHUNK;
+			e = dev->ramAddrSet(done);
+			if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
+			e = dev->ramRead(buf + done, n);
+			if (e != DISCFERRET_E_OK) throw EApplicationError("Error reading data from acquisition RAM");
+			done += n;
+		}
+
+		if (!idle && (done == before)) sched.wait();
+	} while (!idle);
+
+	if (done < 1) throw EApplicationError("Invalid byte count!");
+	return done;
 }
 
 /**
@@ -131,28 +262,33 @@ void wait_drive_ready(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, s
  *
  * Moves the disc heads back to track zero, retrying where necessary.
  *
- * @param	dh			DiscFerret device handle
+ * @param	dev			DiscFerret device
  * @param	drivescript	Pointer to the drive script in use
  * @param	driveinfo	Pointer to the DriveInfo object representing this drive.
  * @param	drivetype	String ID of the current disc drive type
+ * @param	out			Stream for progress messages
  * @param	tries		Number of attempts to make, default 3.
  */
-void do_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, CDriveInfo *driveinfo, string drivetype, int tries = 3)
+void do_recalibrate(CDeviceBackend *dev, CDriveScript *drivescript, CDriveInfo *driveinfo, string drivetype, ostream &out, int tries = 3)
 {
 	DISCFERRET_ERROR e;
 
+	// A recalibrate can step the heads all the way across the disc; allow
+	// plenty of time for that on top of the usual ready timeout.
+	int timeout = READY_TIMEOUT_MS + (2 * driveinfo->tracks() * driveinfo->steprate_us() / 1000);
+
 	// Try several times to recalibrate
 	int i=tries;
 	while (i > 0) {
-		// Wait for drive ready -- TODO: timeout
-		wait_drive_ready(dh, drivescript, drivetype);
+		// Wait for drive ready
+		wait_drive_ready(dev, drivescript, drivetype, timeout);
 
 		// Initiate a Recalibrate (seek to zero)
-		e = discferret_seek_recalibrate(dh, driveinfo->tracks());
+		e = dev->seekRecalibrate(driveinfo->tracks());
 		if (e != DISCFERRET_E_OK) {
-			cout << "Recalibration attempt " << (tries-i+1) << " failed with code " << e << "... Retrying...\n";
+			out << "Recalibration attempt " << (tries-i+1) << " failed with code " << e << "... Retrying...\n";
 		} else {
-			cout << "Recalibration attempt " << (tries-i+1) << " succeeded.\n";
+			out << "Recalibration attempt " << (tries-i+1) << " succeeded.\n";
 			break;
 		}
 
@@ -160,8 +296,8 @@ void do_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, CDr
 		i--;
 	}
 
-	// Wait for drive ready -- TODO: timeout
-	wait_drive_ready(dh, drivescript, drivetype);
+	// Wait for drive ready
+	wait_drive_ready(dev, drivescript, drivetype, timeout);
 }
 
 
@@ -170,13 +306,14 @@ void do_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, CDr
  *
  * Moves the disc heads back to track zero, retrying where necessary.
  *
- * @param	dh			DiscFerret device handle
+ * @param	dev			DiscFerret device
  * @param	drivescript	Pointer to the drive script in use
  * @param	driveinfo	Pointer to the DriveInfo object representing this drive.
  * @param	drivetype	String ID of the current disc drive type
+ * @param	out			Stream for progress messages
  * @param	tries		Number of attempts to make, default 3.
  */
-void do_scrub(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, CDriveInfo *driveinfo, string drivetype, unsigned int passes = 3)
+void do_scrub(CDeviceBackend *dev, CDriveScript *drivescript, CDriveInfo *driveinfo, string drivetype, ostream &out, unsigned int passes = 3)
 {
 	DISCFERRET_ERROR e;
 
@@ -184,286 +321,472 @@ void do_scrub(DISCFERRET_DEVICE_HANDLE *dh, CDriveScript *drivescript, CDriveInf
 
 	int step = (CYLINDERS < 16) ? 2 : (CYLINDERS / 8);
 	for (unsigned int pass = 0; pass < passes; pass++) {
-		printf("Cleaning drive heads -- pass %d of %d...\n", pass+1, passes);
+		out << "Cleaning drive heads -- pass " << (pass+1) << " of " << passes << "..." << endl;
 
 		int a;
 		for (int cyl=0; cyl < CYLINDERS; cyl += step) {
 			a = (cyl + (step - 1));
-			cout << a << " ";
-			cout.flush();
+			out << a << " ";
+			out.flush();
 			if (a > CYLINDERS) {
-				discferret_seek_absolute(dh, CYLINDERS-1);
+				dev->seekAbsolute(CYLINDERS-1);
 			} else {
-				discferret_seek_absolute(dh, a);
+				dev->seekAbsolute(a);
 			}
 			usleep(100000);		// 100ms delay
 
 			a = cyl;
-			cout << a << " ";
+			out << a << " ";
 			if (a > CYLINDERS) {
-				discferret_seek_absolute(dh, CYLINDERS-1);
+				dev->seekAbsolute(CYLINDERS-1);
 			} else {
-				discferret_seek_absolute(dh, a);
+				dev->seekAbsolute(a);
 			}
 			usleep(100000);		// 100ms delay
 		}
-		cout << endl;
+		out << endl;
 	}
 
 	// Initiate a Recalibrate (seek to zero)
-	e = discferret_seek_recalibrate(dh, driveinfo->tracks());
+	e = dev->seekRecalibrate(driveinfo->tracks());
 
 	if (e != DISCFERRET_E_OK) {
-		cout << "Recalibration failed with code " << e << endl;
+		out << "Recalibration failed with code " << e << endl;
 	} else {
-		cout << "Recalibration succeeded.\n";
+		out << "Recalibration succeeded.\n";
 	}
 
-	// Wait for drive ready -- TODO: timeout
-	wait_drive_ready(dh, drivescript, drivetype);
+	// Wait for drive ready
+	wait_drive_ready(dev, drivescript, drivetype, READY_TIMEOUT_MS + (2 * CYLINDERS * driveinfo->steprate_us() / 1000));
 }
 
-/////////////////////////////////////////////////////////////////////////////
-
-void usage(char *appname)
+/**
+ * Capture one revolution of the track under the heads, for --autodetect.
+ *
+ * @param	dev			DiscFerret device
+ * @param	regs		Register cache for the device
+ * @param	clksel		Acquisition clock select (DISCFERRET_ACQ_RATE_*)
+ * @param	noindex		true if index sense is disabled; the capture is then timed
+ * @param	buf			Buffer to store acquisition data in
+ * @param	buflen		Size of buf in bytes
+ * @return	Number of bytes of acquisition data
+ */
+long probe_capture(CDeviceBackend *dev, CRegisterCache &regs, const int clksel, const bool noindex, unsigned char *buf, const size_t buflen)
 {
-	cout
-		<< "Usage:" << endl
-		<< "   " << appname << " [--verbose]" << endl
-		<< "      --drive drivetype --format formattype --outfile outputfile" << endl
-		<< "      [--serial serialnum] [--clock clockrate] [--multi numreads]" << endl
-		<< "      [--waitidx numidx] [--noindex] [--scrub]" << endl
-		<< endl
-		<< "Where:" << endl
-		<< "   drivetype   Type of disc drive attached to the DiscFerret" << endl
-		<< "   outputfile  Output filename" << endl
-		<< "   formattype  Type of the disc inserted in the drive" << endl
-		<< "   serialnum   Serial number of the DiscFerret to connect to. If this is" << endl
-		<< "               not specified, then the first DiscFerret will be used." << endl
-		<< "   clockrate   Clock rate in MHz. Either 25, 50 or 100 (default is 100)." << endl
-		<< "   numreads    MultiRead mode -- number of reads per cycle (default is 1)." << endl
-		<< "   numidx      Number of index pulses to wait before attempting to read a" << endl
-		<< "               track (default is 0, read on active edge of first index pulse)." << endl
-		<< endl
-		<< "If '--scrub' is specified, the disc drive heads will be cleaned. Insert a" << endl
-		<< "cleaning disc before running this command. In this mode, the output filename" << endl
-		<< "is optional." << endl;
-}
+	DISCFERRET_ERROR e;
 
-//////////////////////////////////////////////////////////////////////////////
-// "I am main(), king of kings. Look upon my works, ye mighty, and despair!"
-//////////////////////////////////////////////////////////////////////////////
+	e = regs.poke(DISCFERRET_R_ACQ_START_EVT, noindex ? DISCFERRET_ACQ_EVENT_ALWAYS : DISCFERRET_ACQ_EVENT_INDEX);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event");
+	e = regs.poke(DISCFERRET_R_ACQ_START_NUM, 0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event count");
+	e = regs.poke(DISCFERRET_R_ACQ_STOP_EVT, noindex ? DISCFERRET_ACQ_EVENT_NEVER : DISCFERRET_ACQ_EVENT_INDEX);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event");
+	e = regs.poke(DISCFERRET_R_ACQ_STOP_NUM, 0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event count");
+	e = regs.poke(DISCFERRET_R_ACQ_CLKSEL, clksel);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq clock rate");
+	e = dev->ramAddrSet(0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
+
+	e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_START);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error starting acquisition");
+
+	if (noindex) {
+		// A quarter of a second is a revolution at 300 or 360 RPM
+		this_thread::sleep_for(chrono::milliseconds(250));
+		e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
+		if (e != DISCFERRET_E_OK) throw EApplicationError("Error stopping acquisition");
+	} else {
+		CPollScheduler sched("probe capture to complete", 0, ACQ_TIMEOUT_MS * 1000UL);
+		long i;
+		do {
+			sched.wait();
+			i = dev->getStatus();
+		} while ((i > 0) && ((i & DISCFERRET_STATUS_ACQSTATUS_MASK) != DISCFERRET_STATUS_ACQ_IDLE));
+		if (i < 0) throw EApplicationError("Error reading DiscFerret status register");
+	}
 
-int main(int argc, char **argv)
+	long nbytes = dev->ramAddrGet();
+	if ((nbytes > (long)buflen) || (dev->getStatus() & DISCFERRET_STATUS_RAM_FULL)) nbytes = buflen;
+	if (nbytes < 1) throw EApplicationError("Invalid byte count!");
+	e = dev->ramAddrSet(0);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address to zero");
+	e = dev->ramRead(buf, nbytes);
+	if (e != DISCFERRET_E_OK) throw EApplicationError("Error reading data from acquisition RAM");
+	return nbytes;
+}
+
+/**
+ * Take a setting from the journal of a capture which is being resumed. If it
+ * was given on the command line as well, the two have to match.
+ *
+ * @param	journal		Capture journal
+ * @param	name		Setting name
+ * @param	value		Value from the command line; receives the value from the journal
+ * @param	given		true if the setting was given on the command line
+ * @param	err			Stream for errors
+ * @return	false (after printing an error) if the settings don't match
+ */
+bool resume_setting(const CCaptureJournal &journal, const string name, string &value, const bool given, ostream &err)
 {
-	string drivetype, formattype, serialnum, outfile;
-	int iClockRate = DISCFERRET_ACQ_RATE_100MHZ;
-	int waitidx = 0;
-	int bNoIndex = false;
-	int bScrub = false;
-	int numReads = 1;
+	string saved = journal.get(name);
+	if (given && (value != saved)) {
+		err << "Error: the capture being resumed used " << name << " '" << saved << "', not '" << value << "'." << endl;
+		return false;
+	}
+	value = saved;
+	return true;
+}
 
-	while (1) {
-		// Getopt option table
-		static const struct option opts_long[] = {
-			// name			has_arg				flag			val
-			{"help",		no_argument,		0,				'h'},
-			{"verbose",		no_argument,		&bVerbose,		true},
-			{"drive",		required_argument,	0,				'd'},
-			{"format",		required_argument,	0,				'f'},
-			{"serial",		required_argument,	0,				's'},
-			{"outfile",		required_argument,	0,				'o'},
-			{"clock",		required_argument,	0,				'c'},
-			{"multi",		required_argument,	0,				'm'},
-			{"waitidx",		required_argument,	0,				'w'},
-			{"scrub",		no_argument,		&bScrub,		true},
-			{"noindex",		no_argument,		&bNoIndex,		true},
-			{0, 0, 0, 0}	// end sentinel / terminator
-		};
-		static const char *opts_short = "hd:f:s:o:c:m:w:";
+/**
+ * Work out the filename to use for one of several DiscFerrets, by putting its
+ * serial number in front of the extension ("disc.dfe" becomes
+ * "disc-SERIAL.dfe").
+ *
+ * @param	filename	Filename given on the command line
+ * @param	serial		DiscFerret serial number
+ * @return	Filename for this DiscFerret
+ */
+string device_filename(const string filename, const string serial)
+{
+	size_t dot = filename.rfind('.');
+	size_t dir = filename.find_last_of("/\\");
+	size_t base = (dir == string::npos) ? 0 : (dir + 1);
+	if ((dot == string::npos) || (dot <= base)) return filename + "-" + serial;
+	return filename.substr(0, dot) + "-" + serial + filename.substr(dot);
+}
 
-		// getopt stores the option index here
-		int idx = 0;
-		int c;
-		if ((c = getopt_long(argc, argv, opts_short, opts_long, &idx)) == -1)
-			break;
+/////////////////////////////////////////////////////////////////////////////
+// Capture
 
-		// check option value
-		switch (c) {
-			case 0:	break;			// option set a flag (ignore this)
+/**
+ * @brief	Capture settings from the command line. These are the same for
+ * 			every DiscFerret, and don't change once the captures start.
+ */
+class CCaptureSettings {
+	public:
+		string			drivetype, formattype;
+		int				iClockRate;
+		int				waitidx;
+		int				bNoIndex, bScrub, bStreamRead, bSeekAhead, bAutotune, bAutodetect;
+		bool			bClockSet;
+		int				bImmediate, bVerify, bIndexed, bCompress;
+		int				maxRetries;
+		int				numReads;
+		int				writeDepth;
+		CTrackWriter::FsyncPolicy	fsyncPolicy;
+		unsigned long long	preallocBytes;
+		bool			bSimulate;
+		CSimulatedBackend::Params	simParams;
+		unsigned long	progressInterval;
+		unsigned int	devices;	///< Number of DiscFerrets capturing at once
+		unsigned int	workers;	///< Threads each DiscFerret gets for compression and --image
+
+		CCaptureSettings() :
+			iClockRate(DISCFERRET_ACQ_RATE_100MHZ), waitidx(0),
+			bNoIndex(false), bScrub(false), bStreamRead(false), bSeekAhead(false), bAutotune(false), bAutodetect(false),
+			bClockSet(false), bImmediate(false), bVerify(false), bIndexed(false), bCompress(false),
+			maxRetries(4), numReads(1), writeDepth(4), fsyncPolicy(CTrackWriter::FSYNC_NEVER), preallocBytes(0),
+			bSimulate(false), progressInterval(500), devices(1), workers(1)
+		{ };
+};
 
-			case 'h':
-				// show help and quit
-				usage(argv[0]);
-				return EXIT_SUCCESS;
+/**
+ * @brief	One DiscFerret's capture: the unit to open, and everything which
+ * 			can't be shared with the captures on other DiscFerrets.
+ */
+class CDeviceJob {
+	public:
+		string			serialnum;		///< Serial number, or empty for the first DiscFerret found
+		string			outfile;		///< Output filename
+		string			imagefile;		///< Sector image filename, or empty
+		CDriveScript	*drivescript;	///< Drive script, only used by this capture
+		CFormatScript	*formatscript;	///< Format script, only used by this capture (or NULL)
+		CCaptureJournal	*journal;		///< Journal for the output file
+		CDeviceBackend	*dev;			///< DiscFerret which is already open with its microcode loaded, or NULL to open one
+		ostream			*out, *err;		///< Console output
+		ostream			*progress;		///< Console output for the progress reporter thread
+		CAcqMetrics		metrics;
+		int				errcode;		///< Result of the capture
+
+		CDeviceJob() :
+			drivescript(NULL), formatscript(NULL), journal(NULL), dev(NULL), out(NULL), err(NULL), progress(NULL), errcode(EXIT_SUCCESS)
+		{ };
+};
 
-			case 'd':
-				// set drive type
-				drivetype = optarg;
-				break;
+/**
+ * Load the journal of an interrupted capture, and carry on with the settings
+ * it was using. Any of them which were given again have to match.
+ *
+ * @param	opt			Capture settings; receives the settings from the journal
+ * @param	bRevsSet	true if the number of revolutions was given
+ * @param	journal		Journal for the output file
+ * @param	outfile		Output filename
+ * @param	imagefile	Sector image filename, or empty
+ * @param	err			Stream for errors
+ * @return	false (after printing an error) if the capture can't be resumed
+ */
+bool resume_capture(CCaptureSettings &opt, const bool bRevsSet, CCaptureJournal &journal, const string &outfile, const string &imagefile, ostream &err)
+{
+	if (outfile.empty()) {
+		err << "Error: --resume needs the output filename of the capture to carry on." << endl;
+		return false;
+	}
+	if (!imagefile.empty()) {
+		err << "Error: --image can't be used with --resume." << endl;
+		return false;
+	}
+	try {
+		if (!journal.load()) {
+			err << "Error: there is no capture journal for '" << outfile << "', so there's nothing to resume." << endl;
+			return false;
+		}
+	} catch (EApplicationError &e) {
+		err << "Error: " << e.what() << endl;
+		return false;
+	}
 
-			case 'f':
-				// set format type
-				formattype = optarg;
-				break;
+	string clock = (opt.iClockRate == DISCFERRET_ACQ_RATE_25MHZ) ? "25" : (opt.iClockRate == DISCFERRET_ACQ_RATE_50MHZ) ? "50" : "100";
+	stringstream ssRevs;
+	ssRevs << opt.numReads;
+	string revs = ssRevs.str(), indexed = opt.bIndexed ? "1" : "0", compress = opt.bCompress ? "1" : "0";
+	if (!resume_setting(journal, "drive", opt.drivetype, !opt.drivetype.empty(), err) ||
+			!resume_setting(journal, "format", opt.formattype, !opt.formattype.empty(), err) ||
+			!resume_setting(journal, "clock", clock, opt.bClockSet, err) ||
+			!resume_setting(journal, "revs", revs, bRevsSet, err) ||
+			!resume_setting(journal, "indexed", indexed, opt.bIndexed, err) ||
+			!resume_setting(journal, "compress", compress, opt.bCompress, err)) {
+		return false;
+	}
+	opt.iClockRate = (clock == "25") ? DISCFERRET_ACQ_RATE_25MHZ : (clock == "50") ? DISCFERRET_ACQ_RATE_50MHZ : DISCFERRET_ACQ_RATE_100MHZ;
+	opt.bClockSet = true;
+	opt.numReads = atoi(revs.c_str());
+	opt.bIndexed = (indexed == "1");
+	opt.bCompress = (compress == "1");
+	return true;
+}
 
-			case 's':
-				// discferret unit serial number
-				serialnum = optarg;
-				break;
+/**
+ * Make sure the capture settings can be used together.
+ *
+ * @param	opt			Capture settings
+ * @param	outfile		Output filename
+ * @param	imagefile	Sector image filename, or empty
+ * @param	err			Stream for errors
+ * @return	false (after printing an error) if they can't
+ */
+bool check_settings(const CCaptureSettings &opt, const string &outfile, const string &imagefile, ostream &err)
+{
+	// Make sure the user specified an output file
+	if (!opt.bScrub && !opt.bAutotune && !opt.bAutodetect && outfile == "") {
+		err << "Error: output filename not specified." << endl;
+		return false;
+	}
 
-			case 'o':
-				// output filename
-				outfile = optarg;
-				break;
+	// Autotune times the drive using the index pulse
+	if (opt.bAutotune && opt.bNoIndex) {
+		err << "Error: --autotune can't be used with --noindex." << endl;
+		return false;
+	}
 
-			case 'c':
-				// set clock rate
-				switch (atoi(optarg)) {
-					case 25:
-						iClockRate = DISCFERRET_ACQ_RATE_25MHZ; break;
-					case 50:
-						iClockRate = DISCFERRET_ACQ_RATE_50MHZ; break;
-					case 100:
-						iClockRate = DISCFERRET_ACQ_RATE_100MHZ; break;
-					default:
-						cerr << "Invalid clock rate specified." << endl;
-						usage(argv[0]);
-						exit(EXIT_FAILURE);
-						break;
-				}
-				break;
+	// Streamed readback needs a RAM read pointer which only the simulator has
+	if (opt.bStreamRead && !opt.bSimulate) {
+		err << "Error: --streamread is a testing option, which only works with --simulate." << endl;
+		return false;
+	}
 
-			case 'm':
-				numReads = atoi(optarg);
-				if ((numReads < 1) || (numReads > 16)) {
-					cerr << "Invalid number of reads (min 1, max 16)" << endl;
-					usage(argv[0]);
-					exit(EXIT_FAILURE);
-				}
-				break;
+	// Immediate-start captures are lined up on the index pulse afterwards, and
+	// need all of the data in one piece to do it
+	if (opt.bImmediate && (opt.bNoIndex || opt.bStreamRead || (opt.waitidx > 0))) {
+		err << "Error: --immediate can't be used with --noindex, --streamread or --waitidx." << endl;
+		return false;
+	}
 
-			case 'w':
-				waitidx = atoi(optarg);
-				if ((waitidx < 0) || (waitidx > 15)) {
-					cerr << "Invalid waitidx value (min 0, max 15)" << endl;
-					usage(argv[0]);
-					exit(EXIT_FAILURE);
-				}
-				break;
+	// Verification needs to know what should be on the disc
+	if ((opt.bVerify || !imagefile.empty()) && opt.formattype.empty() && !opt.bAutodetect) {
+		err << "Error: --verify and --image need a format type or --autodetect." << endl;
+		return false;
+	}
 
-			case '?':
-				// option unknown; getopt already printed the error, but we need to bail out here.
-				exit(EXIT_FAILURE);
-				break;
+	return true;
+}
 
-			default:
-				// unhandled option -- an option we should have handled, but didn't!
-				printf("unhandled option %c! man the lifeboats, women and children first!\n", c);
-				abort();
-				break;
-		}
+/**
+ * Load the drive script which defines a drive type.
+ *
+ * @param	dsmgr		Drive script manager, which has scanned the scripts
+ * @param	drivetype	Drive type
+ * @param	err			Stream for errors
+ * @return	The drive script, or NULL (after printing an error) if there isn't one
+ */
+CDriveScript *load_drive_script(CDriveScriptManager &dsmgr, const string drivetype, ostream &err)
+{
+	if (drivetype.length() == 0) {
+		err << "Error: drive type not specified." << endl;
+		return NULL;
 	}
+	try {
+		return dsmgr.load(drivetype);
+	} catch (...) {
+		err << "Error: drive type '" << drivetype << "' was not defined by a drive script." << endl;
+		return NULL;
+	}
+}
 
-	if (bVerbose) cout << "Verbose mode ON\n";
-
-	// Scan for drive scripts
-	CDriveScriptManager dsmgr;
-	dsmgr.scandir(DRIVESCRIPTDIR);
+/**
+ * Scan the format script directory.
+ *
+ * @param	fsmgr		Format script manager
+ * @param	err			Stream for errors
+ * @return	false (after printing an error) if a script couldn't be run
+ */
+bool scan_format_scripts(CFormatScriptManager &fsmgr, ostream &err)
+{
+	try {
+		fsmgr.scandir(FORMATSCRIPTDIR);
+	} catch (EFormatSpecParse &e) {
+		err << "[" << e.filename() << ", formatspec '" << e.spec() << "']: FormatSpec error: " << e.error() << endl;
+		return false;
+	} catch (ELuaError &e) {
+		err << e.what() << endl;
+		return false;
+	}
+	return true;
+}
 
-	// Make sure the user specified a valid drive type
-	CDriveScript *drivescript;
+/**
+ * Load the format script which defines a format type.
+ *
+ * @param	fsmgr		Format script manager, which has scanned the scripts
+ * @param	formattype	Format type
+ * @param	err			Stream for errors
+ * @return	The format script, or NULL (after printing an error) if there isn't one
+ */
+CFormatScript *load_format_script(CFormatScriptManager &fsmgr, const string formattype, ostream &err)
+{
 	try {
-		if (drivetype.length() != 0) {
-			drivescript = new CDriveScript(dsmgr.load(drivetype));
-		} else {
-			cerr << "Error: drive type not specified." << endl;
-			return EXIT_FAILURE;
-		}
-	} catch (...) {
-		cerr << "Error: drive type '" << drivetype << "' was not defined by a drive script." << endl;
-		return EXIT_FAILURE;
+		return fsmgr.load(formattype);
+	} catch (EInvalidFormattype &e) {
+		err << "Error: format type '" << formattype << "' was not defined by a format script." << endl;
+		err << "Known format types:";
+		vector<string> ft = fsmgr.getFormattypes();
+		for (vector<string>::const_iterator it = ft.begin(); it != ft.end(); it++) err << " " << *it;
+		err << endl;
+	} catch (EFormatSpecParse &e) {
+		err << "[" << e.filename() << ", formatspec '" << e.spec() << "']: FormatSpec error: " << e.error() << endl;
+	} catch (ELuaError &e) {
+		err << e.what() << endl;
 	}
+	return NULL;
+}
 
-	// Make sure the user specified an output file
-	if (!bScrub && outfile == "") {
-		cerr << "Error: output filename not specified." << endl;
-		return EXIT_FAILURE;
+/**
+ * Open a DiscFerret (or start the simulator), and upload the microcode.
+ *
+ * Throws EApplicationError if the device can't be opened or the microcode
+ * can't be loaded.
+ *
+ * @param	opt			Capture settings
+ * @param	serialnum	Serial number, or empty for the first DiscFerret found
+ * @param	out			Stream for progress messages
+ * @return	The open device
+ */
+CDeviceBackend *open_device(const CCaptureSettings &opt, const string serialnum, ostream &out)
+{
+	CDeviceBackend *dev;
+	if (opt.bSimulate) {
+		out << "Using simulated DiscFerret (" << opt.simParams.source << ")" << endl;
+		dev = new CSimulatedBackend(opt.simParams);
+	} else {
+		dev = new CDiscFerretBackend(serialnum);
 	}
 
-	// TODO: implement format scripts to allow for weird stuff like Amiga mfmsync and MultiCycle Sampling
+	// Upload the DiscFerret microcode
+	out << "Loading microcode..." << endl;
+	if (dev->loadMicrocode() != DISCFERRET_E_OK) {
+		delete dev;
+		throw EApplicationError("Error loading DiscFerret microcode.");
+	}
+	out << "Microcode loaded successfully." << endl;
+	return dev;
+}
+
+/**
+ * Capture a disc with one DiscFerret. When several DiscFerrets are in use,
+ * this runs on a thread of its own for each of them.
+ *
+ * @param	opt		Capture settings
+ * @param	job		The DiscFerret to use, and its scripts, files and console
+ * @return	EXIT_SUCCESS, or EXIT_FAILURE (after printing an error)
+ */
+int capture_device(const CCaptureSettings &opt, CDeviceJob &job)
+{
+	ostream &out = *job.out, &err = *job.err;
+	CDriveScript *drivescript = job.drivescript;
+	CFormatScript *formatscript = job.formatscript;
+	CCaptureJournal &journal = *job.journal;
+	CAcqMetrics &metrics = job.metrics;
+	const string &outfile = job.outfile, &imagefile = job.imagefile;
+
+	// --autodetect can change the clock rate
+	int iClockRate = opt.iClockRate;
 
 	int errcode = EXIT_SUCCESS;
-	DISCFERRET_DEVICE_HANDLE *dh = NULL;
+	CDeviceBackend *dev = job.dev;
+	CTrackVerifier *verifier = NULL;
+	CImageExporter *exporter = NULL;
 	try {
-		// Try and initialise the DiscFerret API
 		DISCFERRET_ERROR e;
-		
-		e = discferret_init();
-		if (e != DISCFERRET_E_OK) {
-			stringstream s;
-			s << "Error initialising libdiscferret. Error code: ";
-			s << e;
-			throw EApplicationError(s.str());
-		}
 
-		// Did the user spec a DiscFerret serial number to look for?
-		if (serialnum.length() > 0) {
-			// Yep -- open the specific DiscFerret requested
-			e = discferret_open(serialnum.c_str(), &dh);
-		} else {
-			// No serial number specified, open the first DiscFerret
-			e = discferret_open_first(&dh);
-		}
-
-		if (e != DISCFERRET_E_OK) {
-			stringstream s;
-			s << "Error opening DiscFerret device. Is it connected and powered on? (error code ";
-			s << e << ")";
-			throw EApplicationError(s.str());
+		// Open the DiscFerret (or start the simulator) and upload the microcode,
+		// unless the daemon has already done it
+		if (job.dev == NULL) {
+			dev = open_device(opt, job.serialnum, out);
 		}
 
-		// Upload the DiscFerret microcode
-		cout << "Loading microcode..." << endl;
-		e = discferret_fpga_load_default(dh);
-		if (e != DISCFERRET_E_OK) throw EApplicationError("Error loading DiscFerret microcode.");
-		cout << "Microcode loaded successfully." << endl;
+		// Register writes go through a shadow cache, to avoid re-sending
+		// register values the DiscFerret already has.
+		CRegisterCache regs(dev);
 
 		// Show information about the DiscFerret in use
 		DISCFERRET_DEVICE_INFO devinfo;
-		e = discferret_get_info(dh, &devinfo);
+		e = dev->getInfo(&devinfo);
 		if (e != DISCFERRET_E_OK) throw ECommunicationError();
-		cout << "Connected to DiscFerret with serial number " << devinfo.serialnumber << endl;
-		cout << "Revision info: hardware " << devinfo.hardware_rev << ", firmware " << devinfo.firmware_ver << endl;
-		cout << "Microcode type " << devinfo.microcode_type << ", revision " << devinfo.microcode_ver << endl;
-		cout << endl;
-
-		// Get some information about the disc type
-		CDriveInfo driveinfo = drivescript->GetDriveInfo(drivetype);
-		cout << "Drive type: '" << drivetype << "' (" << driveinfo.friendly_name() << ")" << endl;
-		cout << driveinfo.tpi() << " tpi, " << driveinfo.tracks() << " tracks, " << driveinfo.heads() << " heads." << endl;
-
-		// Set up the step rate
-		e = discferret_seek_set_rate(dh, driveinfo.steprate_us());
-		if (e != DISCFERRET_E_OK) {
-			if (e == DISCFERRET_E_BAD_PARAMETER) {
-				throw EApplicationError("Seek rate out of range.");
-			} else {
-				throw EApplicationError("Error setting seek rate.");
-			}
+		out << "Connected to DiscFerret with serial number " << devinfo.serialnumber << endl;
+		out << "Revision info: hardware " << devinfo.hardware_rev << ", firmware " << devinfo.firmware_ver << endl;
+		out << "Microcode type " << devinfo.microcode_type << ", revision " << devinfo.microcode_ver << endl;
+		out << endl;
+
+		// Reading RAM during a capture moves the capture's write pointer, unless
+		// host reads have an address counter of their own
+		if (opt.bStreamRead && !dev->hasReadPointer()) {
+			throw EApplicationError("--streamread needs microcode with a separate RAM read pointer, which this DiscFerret doesn't have.");
 		}
 
-		// Set HSIOs to input mode (we don't use them)
-		e = discferret_reg_poke(dh, DISCFERRET_R_HSIO_DIR, 0xff);
-		if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting HSIO pin direction");
-
+		// Get some information about the disc type
+		CDriveInfo driveinfo = drivescript->GetDriveInfo(opt.drivetype);
 
-		// Now we're basically good to go. Select the drive.
-		e = discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, drivescript->getDriveOutputs(drivetype, 0, 0, 1));
-		if (e != DISCFERRET_E_OK) throw EApplicationError("Error selecting disc drive");
+		// Work out the drive control outputs for every track, head and sector
+		// before going anywhere near the drive, so script errors show up now
+		// rather than part way through the acquisition
+		CAcquisitionPlan plan(drivescript, opt.drivetype, driveinfo);
 
-		// Wait for the drive to spin up
-		sleep((driveinfo.spinup_ms() % 1000)>0 ? (driveinfo.spinup_ms() / 1000) + 1 : driveinfo.spinup_ms() / 1000);
+		// Turn the drive-ready check into a table lookup, so polling the drive
+		// status doesn't have to call into Lua every time
+		if (!drivescript->compileReadyTable(opt.drivetype) && bVerbose) {
+			out << "Drive script opted out of ready-state caching; isDriveReady() will be called on every status poll." << endl;
+		}
+		out << "Drive type: '" << opt.drivetype << "' (" << driveinfo.friendly_name() << ")" << endl;
+		out << driveinfo.tpi() << " tpi, " << driveinfo.tracks() << " tracks, " << driveinfo.heads() << " heads." << endl;
+
+		// Get the tracks and heads used by the disc format (or the whole drive if
+		// no format was specified)
+		CFormatInfo formatinfo;
+		if (formatscript != NULL) {
+			formatinfo = formatscript->GetFormatInfo(opt.formattype);
+		} else {
+			formatinfo = CFormatInfo("", "whole drive", 0, driveinfo.tracks() - 1, 1, 0, driveinfo.heads() - 1, 0, 0, "", 0, 0);
+		}
 
 		/***
 		 * Figure out the track stepping, and if the drive and media are compatible.
@@ -471,90 +794,374 @@ int main(int argc, char **argv)
 		 * If frac(drive.tpi / format.tpi) == 0, then the formats are compatible.
 		 *    int(drive.tpi / format.tpi) gives the stepping interval (1=single
 		 *                                stepped, 2=double stepped etc.)
+		 * Otherwise use the format's trackstep setting.
 		 */
-		// TODO! REALLY BIG TODO! Implement this after implementing format spec scripts
-		int trackstep = 1;
-
-		// TODO: Multiply format.tracks by trackstep, if > drive.tracks, bail!
-
-		// Abort any current acquisitions
-		e = discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
-		if (e != DISCFERRET_E_OK) throw EApplicationError("Error resetting acquisition engine");
+		unsigned long trackstep = formatinfo.trackstep();
+		if ((driveinfo.tpi() > 0) && (formatinfo.tpi() > 0)) {
+			double ratio = driveinfo.tpi() / formatinfo.tpi();
+			trackstep = (unsigned long)(ratio + 0.5);
+			if ((trackstep < 1) || (fabs(ratio - trackstep) > 0.01)) {
+				stringstream s;
+				s << "Format '" << opt.formattype << "' (" << formatinfo.tpi() << " tpi) can't be read in drive '"
+					<< opt.drivetype << "' (" << driveinfo.tpi() << " tpi).";
+				throw EApplicationError(s.str());
+			}
+		}
+
+		// Make sure the format fits on the drive
+		if ((formatinfo.maxtrack() * trackstep) >= driveinfo.tracks()) {
+			stringstream s;
+			s << "Format '" << opt.formattype << "' needs " << ((formatinfo.maxtrack() * trackstep) + 1)
+				<< " physical tracks, but drive '" << opt.drivetype << "' only has " << driveinfo.tracks() << ".";
+			throw EApplicationError(s.str());
+		}
+		if (formatinfo.maxhead() >= driveinfo.heads()) {
+			stringstream s;
+			s << "Format '" << opt.formattype << "' uses head " << formatinfo.maxhead()
+				<< ", but drive '" << opt.drivetype << "' only has " << driveinfo.heads() << " heads.";
+			throw EApplicationError(s.str());
+		}
+		if (formatinfo.sectors() > 0) {
+			out << "WARNING: hard-sectored formats are not supported yet; each track will be captured as a whole." << endl;
+		}
+
+		if (formatscript != NULL) {
+			out << "Format type: '" << opt.formattype << "' (" << formatinfo.friendly_name() << ")" << endl;
+		}
+		out << "Capturing tracks " << formatinfo.mintrack() << "-" << formatinfo.maxtrack()
+			<< ", heads " << formatinfo.minhead() << "-" << formatinfo.maxhead();
+		if (trackstep > 1) out << ", stepping " << trackstep << " physical tracks per track";
+		out << "." << endl;
+
+		// Use the drive's measured timings if it's been autotuned. Otherwise fall
+		// back on the drive script, and without index sense allow plenty of time
+		// for the heads to settle.
+		CTimingProfile timing;
+		timing.steprate_us = driveinfo.steprate_us();
+		timing.spinup_ms = driveinfo.spinup_ms();
+		timing.settle_us = opt.bNoIndex ? NOINDEX_SETTLE_US : 0;
+		string profilename = CTimingProfile::filename(TIMINGPROFILEDIR, devinfo.serialnumber, opt.drivetype);
+		if (!opt.bAutotune && timing.load(profilename)) {
+			out << "Using drive timing profile " << profilename << ": step rate " << timing.steprate_us
+				<< "us, settle " << (timing.settle_us / 1000) << "ms, spin-up " << timing.spinup_ms << "ms." << endl;
+		}
+
+		// Set up the step rate
+		e = dev->seekSetRate(timing.steprate_us);
+		if (e != DISCFERRET_E_OK) {
+			if (e == DISCFERRET_E_BAD_PARAMETER) {
+				throw EApplicationError("Seek rate out of range.");
+			} else {
+				throw EApplicationError("Error setting seek rate.");
+			}
+		}
+
+		// Set HSIOs to input mode (we don't use them)
+		e = regs.poke(DISCFERRET_R_HSIO_DIR, 0xff);
+		if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting HSIO pin direction");
+
+
+		// Now we're basically good to go. Select the drive.
+		e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(0, 0, 1));
+		if (e != DISCFERRET_E_OK) throw EApplicationError("Error selecting disc drive");
+
+		// Wait for the drive to spin up
+		this_thread::sleep_for(chrono::milliseconds(timing.spinup_ms));
+
+		// Abort any current acquisitions
+		e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
+		if (e != DISCFERRET_E_OK) throw EApplicationError("Error resetting acquisition engine");
 
 		// Seek one track out from zero to move the head off the track-0 end stop.
 		// No error check because we really don't care if this fails.
-		e = discferret_seek_relative(dh, 1);
+		e = dev->seekRelative(1);
 
 		// Deselect then reselect. Clears seek errors. TODO: does it really?
-		e = discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, 0);
+		e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, 0);
 		if (e != DISCFERRET_E_OK) throw EApplicationError("Error deselecting disc drive");
-		e = discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, drivescript->getDriveOutputs(drivetype, 0, 0, 1));
+		e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(0, 0, 1));
 		if (e != DISCFERRET_E_OK) throw EApplicationError("Error reselecting disc drive");
 
 		// Recalibrate to zero
-		do_recalibrate(dh, drivescript, &driveinfo, drivetype);
+		do_recalibrate(dev, drivescript, &driveinfo, opt.drivetype, out);
 
-		if (!bNoIndex) {
+		// Disc rotation speed in RPM, or zero if not known
+		double freq = 0;
+
+		if (!opt.bNoIndex) {
 			// Measure and display disc rotation speed
-			double freq;
 			// Measure three times, take the most recent measurement
-			e = discferret_get_index_frequency(dh, true, &freq);
-			e = discferret_get_index_frequency(dh, true, &freq);
-			e = discferret_get_index_frequency(dh, true, &freq);
-			cout << "Measured disc rotation speed: " << freq << " RPM" << endl;
+			e = dev->getIndexFrequency(true, &freq);
+			e = dev->getIndexFrequency(true, &freq);
+			e = dev->getIndexFrequency(true, &freq);
+			out << "Measured disc rotation speed: " << freq << " RPM" << endl;
 		} else {
 			// Index sense disabled. Don't even try and read the index frequency.
-			cout << "Index sense disabled. Disc rotation speed will not be measured." << endl;
+			out << "Index sense disabled. Disc rotation speed will not be measured." << endl;
+		}
+
+		// Handle a request to tune the drive timing. Tuning takes a while, so
+		// make sure the result can be saved before starting.
+		if (opt.bAutotune) {
+			if (!CTimingProfile::prepareDir(TIMINGPROFILEDIR))
+				throw EApplicationError("Unable to write timing profiles to '" TIMINGPROFILEDIR "': " + string(strerror(errno)));
+			CAutotune tuner(dev, regs, drivescript, opt.drivetype, driveinfo, plan, iClockRate, out, bVerbose);
+			timing = tuner.run();
+			out << "Drive timing: step rate " << timing.steprate_us << "us (drive script says " << driveinfo.steprate_us()
+				<< "us), settle " << (timing.settle_us / 1000) << "ms, spin-up " << timing.spinup_ms
+				<< "ms (drive script says " << driveinfo.spinup_ms() << "ms)." << endl;
+			if (!timing.save(profilename, opt.drivetype)) throw EApplicationError("Unable to save timing profile '" + profilename + "'");
+			out << "Saved timing profile " << profilename << endl;
+			do_recalibrate(dev, drivescript, &driveinfo, opt.drivetype, out);
+			throw 0;
 		}
 
 		// Handle a request to clean the heads
-		if (bScrub) {
-			do_scrub(dh, drivescript, &driveinfo, drivetype);
+		if (opt.bScrub) {
+			do_scrub(dev, drivescript, &driveinfo, opt.drivetype, out);
 			throw 0;
 		}
 
-		// 512K timing data buffer (the DiscFerret has 512K of RAM)
-		unsigned char *buffer = new unsigned char[512*1024];
+		// Work out what's on the disc from a probe capture of the first track
+		CFluxAnalysis detected;
+		unsigned long detectedSpt = 0;
+		unsigned long long detectedRevBytes = 0;
+
+		// Index-triggered captures can be split into segments which each fit
+		// in acquisition RAM
+		const bool bSegment = !opt.bNoIndex && !opt.bImmediate && !opt.bStreamRead;
+		if (opt.bAutodetect) {
+			const int PROBE_CLKSEL = DISCFERRET_ACQ_RATE_50MHZ;
+			const unsigned long PROBE_HZ = 50000000;
+
+			unsigned long cyl = formatinfo.mintrack() * trackstep;
+			e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(cyl, formatinfo.minhead(), 1));
+			if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting disc drive control outputs");
+			dev->seekAbsolute(cyl);
+			this_thread::sleep_for(chrono::microseconds(timing.settle_us));
+			wait_drive_ready(dev, drivescript, opt.drivetype);
+
+			vector<unsigned char> probe(ACQ_RAM_BYTES);
+			long nbytes = probe_capture(dev, regs, PROBE_CLKSEL, opt.bNoIndex, &probe[0], probe.size());
+
+			CFluxHistogram hist(PROBE_HZ);
+			hist.addCapture(&probe[0], nbytes);
+			if (!hist.analyse(detected)) {
+				out << "Autodetect: unable to recognise the data on track " << formatinfo.mintrack()
+					<< " (" << hist.count() << " flux transitions)." << endl;
+			} else {
+				out << "Autodetect: " << detected.spacingName() << ", " << detected.datarate << "kbps (bit cell "
+					<< detected.cell_us << "us); peaks at";
+				for (vector<double>::const_iterator p = detected.peaks_us.begin(); p != detected.peaks_us.end(); p++)
+					out << " " << *p << "us";
+				out << endl;
+
+				// Count the sectors on the track, if they can be decoded
+				CFluxDecoder::Encoding enc;
+				if (CFluxDecoder::parseEncoding(detected.spacingName(), enc)) {
+					CFluxDecoder dec(enc, detected.datarate, PROBE_HZ);
+					vector<CDecodedSector> sectors;
+					dec.decodeTrack(&probe[0], nbytes, sectors);
+					map<unsigned char, bool> ids;
+					for (vector<CDecodedSector>::const_iterator it = sectors.begin(); it != sectors.end(); it++) ids[it->sector] = true;
+					detectedSpt = ids.size();
+					out << "Autodetect: " << detectedSpt << " IBM format sectors per track." << endl;
+				}
+			}
 
-		// Prepare to save the data
-		ofstream of;
-		of.open(outfile.c_str(), ios::out | ios::binary);
+			// Use the fastest clock rate. Captures which don't fit in RAM are
+			// split into segments, unless they can't be; then use the fastest
+			// at which a capture still fits, with a margin for speed variation.
+			const int clksels[] = { DISCFERRET_ACQ_RATE_100MHZ, DISCFERRET_ACQ_RATE_50MHZ, DISCFERRET_ACQ_RATE_25MHZ };
+			const unsigned long clocks[] = { 100000000, 50000000, 25000000 };
+			int best = bSegment ? 0 : 2;
+			for (int i=0; (i<3) && !bSegment; i++) {
+				if ((hist.estimateBytes(clocks[i]) * opt.numReads * 1.1) <= ACQ_RAM_BYTES) {
+					best = i;
+					break;
+				}
+			}
+			if (opt.bClockSet) {
+				if (iClockRate != clksels[best]) {
+					out << "Autodetect: a clock rate of " << (clocks[best] / 1000000) << "MHz is recommended for "
+						<< opt.numReads << " revolutions per track." << endl;
+				}
+			} else {
+				iClockRate = clksels[best];
+			}
+
+			// Size of one revolution at the clock rate which will be used, for
+			// working out how to split the captures
+			for (int i=0; i<3; i++)
+				if (clksels[i] == iClockRate) detectedRevBytes = hist.estimateBytes(clocks[i]);
+
+			if (outfile == "") throw 0;
+		}
 
-		char x[5];
+		// Prepare to save the data
+		string magic;
 		if (devinfo.microcode_ver <= 0x0026) {
-			strcpy(x, "DFER");
-			cerr << "WARNING: Your DiscFerret is running old microcode and will not produce" << endl
+			magic = "DFER";
+			err << "WARNING: Your DiscFerret is running old microcode and will not produce" << endl
 				 << "valid disc images. Update your copy of libdiscferret!" << endl;
+			if (opt.bCompress) err << "WARNING: Old-format data can't be compressed; ignoring --compress." << endl;
 		} else {
 			// New bitstream format
-			strcpy(x, "DFE2");
+			magic = opt.bCompress ? DFEZ_MAGIC : DFE2_MAGIC;
+		}
+
+		// Compression gets this device's share of the spare cores
+		unsigned int compressors = 0;
+		if (opt.bCompress && (magic == DFEZ_MAGIC)) compressors = opt.workers;
+
+		// Check what an interrupted capture managed to save, and work out where
+		// to carry on from. Otherwise, start a new journal.
+		unsigned long firstTrack = formatinfo.mintrack(), firstHead = formatinfo.minhead();
+		if (journal.resumed()) {
+			if (journal.get("magic") != magic)
+				throw EApplicationError("The capture being resumed was saved as " + journal.get("magic") + ", but this one would be " + magic + ".");
+			size_t good = journal.validate(outfile, magic);
+			size_t listed = journal.records().size();
+
+			// With --verify, the last track might have been waiting to be read again
+			if (opt.bVerify && (good > 0)) {
+				const CJournalRecord last = journal.records().back();
+				while ((good > 0) && (journal.records()[good-1].track == last.track) && (journal.records()[good-1].head == last.head))
+					good--;
+				journal.truncate(good);
+			}
+
+			if (good > 0) {
+				const CJournalRecord &last = journal.records().back();
+				firstTrack = last.track;
+				firstHead = last.head + 1;
+				if (firstHead > formatinfo.maxhead()) {
+					firstHead = formatinfo.minhead();
+					firstTrack++;
+				}
+			}
+			out << "Resuming: " << good << " track records kept";
+			if (good < listed) out << " (" << (listed - good) << " dropped)";
+			if (firstTrack <= formatinfo.maxtrack()) {
+				out << ", carrying on from track " << firstTrack << " head " << firstHead << "." << endl;
+			} else {
+				out << ", all tracks have been captured." << endl;
+			}
+		} else {
+			stringstream ss;
+			ss << opt.numReads;
+			journal.set("drive", opt.drivetype);
+			journal.set("format", opt.formattype);
+			journal.set("clock", (iClockRate == DISCFERRET_ACQ_RATE_25MHZ) ? "25" : (iClockRate == DISCFERRET_ACQ_RATE_50MHZ) ? "50" : "100");
+			journal.set("revs", ss.str());
+			journal.set("indexed", opt.bIndexed ? "1" : "0");
+			journal.set("compress", opt.bCompress ? "1" : "0");
+			journal.set("magic", magic);
 		}
-		of.write(x, 4);
+		journal.start(opt.fsyncPolicy == CTrackWriter::FSYNC_TRACK);
+
+		// Start the output file writer. Each track buffer starts out the size of
+		// acquisition RAM, and grows if a capture is split into segments.
+		CTrackWriter writer(outfile, magic, opt.writeDepth, ACQ_RAM_BYTES, opt.fsyncPolicy, opt.preallocBytes, opt.bIndexed, compressors, &journal);
 
 		// Set up the Ctrl-C handler
 		trap_break(true);
 
-		cout << "Acquiring data from disc at ";
+		out << "Acquiring data from disc at ";
+		unsigned long clock_hz = 100000000;
 		switch (iClockRate) {
 			case DISCFERRET_ACQ_RATE_25MHZ:
-				cout << "25"; break;
+				out << "25"; clock_hz = 25000000; break;
 			case DISCFERRET_ACQ_RATE_50MHZ:
-				cout << "50"; break;
+				out << "50"; clock_hz = 50000000; break;
 			case DISCFERRET_ACQ_RATE_100MHZ:
-				cout << "100"; break;
+				out << "100"; clock_hz = 100000000; break;
+		}
+		out << "MHz" << endl;
+
+		// Time for one revolution, or zero if not known
+		double period_us = (!opt.bNoIndex && (freq > 0)) ? (60.0e6 / freq) : 0;
+
+		// Immediate-start captures are lined up on the index afterwards, which
+		// needs to know how long a revolution is
+		unsigned long long rev_ticks = 0;
+		if (opt.bImmediate) {
+			if (period_us <= 0) throw EApplicationError("Unable to measure the disc rotation speed, which --immediate needs.");
+			rev_ticks = (60.0 / freq) * clock_hz;
+		}
+
+		// Work out how to decode the tracks, for --verify and --image. Anything
+		// the format doesn't say can come from --autodetect.
+		CFluxDecoder::Encoding enc = CFluxDecoder::ENC_MFM;
+		string encoding = formatinfo.encoding();
+		unsigned long datarate = formatinfo.datarate(), spt = formatinfo.spt();
+		if (encoding.empty()) encoding = detected.spacingName();
+		if (datarate == 0) datarate = detected.datarate;
+		if (spt == 0) spt = detectedSpt;
+		if (opt.bVerify || !imagefile.empty()) {
+			if (!CFluxDecoder::parseEncoding(encoding, enc) || (datarate == 0) || (spt == 0))
+				throw EApplicationError("Unable to work out the encoding, datarate and spt needed for --verify and --image.");
 		}
-		cout << "MHz" << endl;
 
-		// Loop over all possible tracks
-		for (unsigned long track = 0; track < driveinfo.tracks(); track++) {
+		// With --verify, decode each track as it's captured, and read it again
+		// (with more revolutions) if any sectors are missing or bad
+		unsigned long rereads = 0, badtracks = 0;
+		if (opt.bVerify) {
+			verifier = new CTrackVerifier(enc, datarate, clock_hz, spt);
+		}
+
+		// With --image, decode the captures on other cores while the drive
+		// carries on
+		if (!imagefile.empty()) {
+			exporter = new CImageExporter(imagefile, enc, datarate, clock_hz, formatinfo.mintrack(), formatinfo.maxtrack(),
+					formatinfo.minhead(), formatinfo.maxhead(), spt, opt.workers);
+		}
+
+		// Predicted size of one revolution of acquisition data, for splitting
+		// captures which won't fit in RAM. Until a track has been captured, use
+		// the --autodetect probe, or failing that the least it can be: a byte
+		// for every 127 clock cycles.
+		double revBytes = 0;
+		unsigned long splitCaptures = 0;
+		if (bSegment) {
+			if (detectedRevBytes > 0) {
+				revBytes = detectedRevBytes;
+			} else if (period_us > 0) {
+				revBytes = (period_us * clock_hz / 1.0e6) / DFE2_CARRY;
+			}
+		}
+
+		// Progress is printed by a separate thread so the console can't hold up the acquisition
+		CProgressReporter progress(opt.progressInterval, *job.progress);
+		CStopwatch sw;
+
+		// Physical track the heads were last sent to, or -1 if not known
+		long headpos = -1;
+		// How long until the drive is expected to be ready after the last seek
+		unsigned long settle_us = 0;
+		// When the heads will have settled after the last seek
+		chrono::steady_clock::time_point tSettled = chrono::steady_clock::now();
+
+		// Loop over all the tracks used by the format. 'track' is the format's
+		// track number; 'cyl' is the physical track the heads have to be on.
+		for (unsigned long track = firstTrack; track <= formatinfo.maxtrack(); track++) {
 			// Bail out if we've been asked to do so
 			if (bAbort) break;
 
-			// Seek to the required track
-			discferret_seek_absolute(dh, track * trackstep);
+			unsigned long cyl = track * trackstep;
+
+			// Seek to the required track, unless a seek-ahead already took us there
+			if (headpos != (long)cyl) {
+				sw.lap();
+				dev->seekAbsolute(cyl);
+				metrics.add(CAcqMetrics::PHASE_SEEK, sw.lap());
+				headpos = cyl;
+				settle_us = timing.steprate_us * trackstep;
+				tSettled = chrono::steady_clock::now() + chrono::microseconds(timing.settle_us);
+			}
 
 			// Loop over all possible heads
-			for (unsigned long head = 0; head < driveinfo.heads(); head++) {
+			for (unsigned long head = (track == firstTrack) ? firstHead : formatinfo.minhead(); head <= formatinfo.maxhead(); head++) {
 				// Bail out if we've been asked to do so
 				if (bAbort) break;
 
@@ -563,114 +1170,1605 @@ int main(int argc, char **argv)
 					// Bail out if we've been asked to do so
 					if (bAbort) break;
 
-					// Set disc drive outputs based on current CHS address
-					e = discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, drivescript->getDriveOutputs(drivetype, track, head, sector));
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting disc drive control outputs");
-
-					// Set acq start event -- TODO: get this from the format spec
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_EVT, bNoIndex ? DISCFERRET_ACQ_EVENT_ALWAYS : DISCFERRET_ACQ_EVENT_INDEX);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event");
-					// This used to be set to 1 (trigger on second index pulse), which is insanely pessimistic. The DiscFerret logic
-					// will ONLY trigger on an index edge, NOT index simply being active when an acquisition starts.
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_NUM, waitidx);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event count");
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_EVT, bNoIndex ? DISCFERRET_ACQ_EVENT_NEVER : DISCFERRET_ACQ_EVENT_INDEX);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event");
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_NUM, numReads-1);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event count");
-
-					// Set capture rate
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQ_CLKSEL, iClockRate);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq clock rate");
-
-					// Set RAM pointer to zero
-					e = discferret_ram_addr_set(dh, 0);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
-
-					if (bNoIndex) {
-						// FIXME: hackhackhack -- head settling delay.
-						usleep(500000);
+					metrics.beginTrack(track, head, sector);
+					if (verifier) verifier->reset(track, head);
+
+					// Capture the track. With --verify, keep capturing until all the
+					// sectors have been read, or we run out of retries.
+					int revs = opt.numReads, segments = 0;
+					long nbytes = 0;
+					for (int attempt = 0; ; attempt++) {
+						// Split the capture into segments of whole revolutions, each of
+						// which should fit in acquisition RAM with a margin for speed
+						// variation
+						int segRevs = revs;
+						if (bSegment && (revBytes > 0))
+							segRevs = max(1, min(revs, (int)((ACQ_RAM_BYTES * 0.9) / revBytes)));
+
+						// A re-read may need the heads moving back
+						if (headpos != (long)cyl) {
+							sw.lap();
+							dev->seekAbsolute(cyl);
+							metrics.add(CAcqMetrics::PHASE_SEEK, sw.lap());
+							headpos = cyl;
+							settle_us = timing.steprate_us * trackstep;
+							tSettled = chrono::steady_clock::now() + chrono::microseconds(timing.settle_us);
+						}
+
+						sw.lap();
+
+						// Set disc drive outputs based on current CHS address
+						e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(cyl, head, sector));
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting disc drive control outputs");
+
+						// Set acq start event -- TODO: get this from the format spec
+						e = regs.poke(DISCFERRET_R_ACQ_START_EVT, (opt.bNoIndex || opt.bImmediate) ? DISCFERRET_ACQ_EVENT_ALWAYS : DISCFERRET_ACQ_EVENT_INDEX);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event");
+						// This used to be set to 1 (trigger on second index pulse), which is insanely pessimistic. The DiscFerret logic
+						// will ONLY trigger on an index edge, NOT index simply being active when an acquisition starts.
+						e = regs.poke(DISCFERRET_R_ACQ_START_NUM, opt.waitidx);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event count");
+						e = regs.poke(DISCFERRET_R_ACQ_STOP_EVT, (opt.bNoIndex || opt.bImmediate) ? DISCFERRET_ACQ_EVENT_NEVER : DISCFERRET_ACQ_EVENT_INDEX);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event");
+						e = regs.poke(DISCFERRET_R_ACQ_STOP_NUM, segRevs-1);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event count");
+
+						// Set capture rate
+						e = regs.poke(DISCFERRET_R_ACQ_CLKSEL, iClockRate);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq clock rate");
+
+						// Set RAM pointer to zero
+						e = dev->ramAddrSet(0);
+						if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
+						metrics.add(CAcqMetrics::PHASE_SETUP, sw.lap());
+
+						// Give the heads time to settle after a seek
+						this_thread::sleep_until(tSettled);
+						metrics.add(CAcqMetrics::PHASE_SETTLE, sw.lap());
+
+						// Wait for drive to become ready. Up to settle_us of this is the
+						// heads settling; anything after that is the drive.
+						metrics.addPolls(wait_drive_ready(dev, drivescript, opt.drivetype, READY_TIMEOUT_MS, settle_us));
+						unsigned long long us = sw.lap();
+						metrics.add(CAcqMetrics::PHASE_SETTLE, min(us, (unsigned long long)settle_us));
+						metrics.add(CAcqMetrics::PHASE_READY, us - min(us, (unsigned long long)settle_us));
+						settle_us = 0;
+
+						// Grab a free track buffer for the acquisition data. Once it's been
+						// submitted, the writer thread saves it to disc while we carry on
+						// with the next track.
+						CTrackBuffer *tb = writer.getBuffer();
+						tb->len = 0;
+						metrics.add(CAcqMetrics::PHASE_WRITE, sw.lap());
+
+						// Capture the segments one at a time, reading each one back into
+						// the track buffer after the one before it. Each segment starts
+						// and ends on an index pulse, so joined together they cover the
+						// same revolutions as one long capture. They aren't quite the
+						// same, though: the flux interval running across the index pulse
+						// at each join is cut in two, which leaves one partial interval
+						// per join.
+						nbytes = 0;
+						segments = 0;
+						for (int done = 0, acqs = 0; done < revs; acqs++) {
+							int n = min(segRevs, revs - done);
+
+							// Only the first acquisition waits for 'waitidx' index pulses; the
+							// rest start on the next one
+							if (acqs > 0) {
+								e = regs.poke(DISCFERRET_R_ACQ_START_NUM, 0);
+								if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq start event count");
+								e = regs.poke(DISCFERRET_R_ACQ_STOP_NUM, n-1);
+								if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting acq stop event count");
+								e = dev->ramAddrSet(0);
+								if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address");
+								metrics.add(CAcqMetrics::PHASE_SETUP, sw.lap());
+							}
+
+							// Work out how long this acquisition should take. With index
+							// sensing, an acquisition starts on the next index pulse (up to
+							// one revolution away), skips 'waitidx' pulses, then runs for
+							// 'n' revolutions. An immediate-start capture runs for 'n'
+							// revolutions from whenever it starts, plus a little for speed
+							// variation, and stopping it is up to us.
+							unsigned long skip = (acqs == 0) ? opt.waitidx : 0;
+							unsigned long acq_expect_us = 0, acq_deadline_us = ACQ_TIMEOUT_MS * 1000UL;
+							unsigned long capture_us = 0, immediate_us = 0;
+							if (period_us > 0) {
+								acq_expect_us = (skip + n) * period_us;
+								acq_deadline_us = 2 * (skip + n + 1) * period_us + 1000000;
+								capture_us = n * period_us;
+								if (opt.bImmediate) immediate_us = (n * period_us * 1.03) + 1000;
+							}
+
+							// Start the acquisition
+							e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_START);
+							if (e != DISCFERRET_E_OK) throw EApplicationError("Error starting acquisition");
+							metrics.add(CAcqMetrics::PHASE_SETUP, sw.lap());
+
+							long seglen;
+							if (opt.bStreamRead) {
+								// Read the acquisition RAM back while the capture is running. Most
+								// of the readback is hidden in the capture, so it's counted there.
+								unsigned long polls = 0;
+								seglen = read_acq_ram_streaming(dev, tb->data, tb->capacity, acq_deadline_us, polls, out);
+								metrics.addPolls(polls);
+								us = sw.lap();
+								unsigned long long cap = (capture_us > 0) ? min(us, (unsigned long long)capture_us) : us;
+								metrics.add(CAcqMetrics::PHASE_INDEX, us - cap);
+								metrics.add(CAcqMetrics::PHASE_CAPTURE, cap);
+							} else {
+								if (opt.bImmediate) {
+									// Let the capture run for 'n' revolutions, then stop it
+									this_thread::sleep_for(chrono::microseconds(immediate_us));
+									e = regs.poke(DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
+									if (e != DISCFERRET_E_OK) throw EApplicationError("Error stopping acquisition");
+									metrics.add(CAcqMetrics::PHASE_CAPTURE, sw.lap());
+								} else {
+									// Wait for the acquisition to complete
+									do { // scope limiter
+										CPollScheduler sched("acquisition to complete", acq_expect_us, acq_deadline_us);
+										long i;
+										do {
+											sched.wait();
+											i = dev->getStatus();
+										} while ((i > 0) && ((i & DISCFERRET_STATUS_ACQSTATUS_MASK) != DISCFERRET_STATUS_ACQ_IDLE));
+										metrics.addPolls(sched.polls());
+										if (i < 0) throw EApplicationError("Error reading DiscFerret status register");
+									} while (false);
+									us = sw.lap();
+									unsigned long long cap = (capture_us > 0) ? min(us, (unsigned long long)capture_us) : us;
+									metrics.add(CAcqMetrics::PHASE_INDEX, us - cap);
+									metrics.add(CAcqMetrics::PHASE_CAPTURE, cap);
+								}
+
+								seglen = dev->ramAddrGet();
+								if (dev->getStatus() & DISCFERRET_STATUS_RAM_FULL) {
+									if (bSegment && (n > 1)) {
+										// The revolutions are bigger than predicted. Capture this
+										// segment again as two smaller ones.
+										revBytes = max(revBytes, (double)ACQ_RAM_BYTES / n);
+										segRevs = n / 2;
+										metrics.add(CAcqMetrics::PHASE_READBACK, sw.lap());
+										continue;
+									}
+									progress.message("*** WARNING: RAM Full when reading -- the RAM buffer may have overflowed!");
+									seglen = ACQ_RAM_BYTES;
+								}
+								if (seglen < 1) throw EApplicationError("Invalid byte count!");
+								metrics.add(CAcqMetrics::PHASE_READBACK, sw.lap());
+
+								if (opt.bSeekAhead && (done + n >= revs) && ((verifier == NULL) || (attempt >= opt.maxRetries))) {
+									// The flux data is safe in acquisition RAM and no longer depends
+									// on where the heads are. Start moving to the next track (or
+									// select the next head) now, so the step and settle time overlap
+									// the RAM readback. Not while --verify might still want to read
+									// this track again, which would cost a seek there and back.
+									unsigned long ntrack = track, nhead = head + 1;
+									if (nhead > formatinfo.maxhead()) {
+										nhead = formatinfo.minhead();
+										ntrack++;
+									}
+									if (ntrack <= formatinfo.maxtrack()) {
+										if (ntrack != track) {
+											dev->seekAbsolute(ntrack * trackstep);
+											headpos = ntrack * trackstep;
+											settle_us = timing.steprate_us * trackstep;
+											tSettled = chrono::steady_clock::now() + chrono::microseconds(timing.settle_us);
+										}
+										e = regs.poke(DISCFERRET_R_DRIVE_CONTROL, plan.driveOutputs(ntrack * trackstep, nhead, 1));
+										if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting disc drive control outputs");
+									}
+									metrics.add(CAcqMetrics::PHASE_SEEK, sw.lap());
+								}
+
+								tb->len = nbytes;
+								tb->reserve(nbytes + seglen);
+								e = dev->ramAddrSet(0);
+								if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address to zero");
+								e = dev->ramRead(tb->data + nbytes, seglen);
+								// out << "\tacqram read code " << e << endl;
+								if (e != DISCFERRET_E_OK) throw EApplicationError("Error reading data from acquisition RAM");
+								metrics.add(CAcqMetrics::PHASE_READBACK, sw.lap());
+							}
+
+							nbytes += seglen;
+							done += n;
+							segments++;
+						}
+						metrics.addBytes(nbytes);
+
+						// Use this track to predict how big the next one will be
+						if (bSegment) revBytes = (double)nbytes / revs;
+						if (segments > 1) splitCaptures++;
+
+						if (opt.bImmediate) {
+							// Line the capture up on the index pulse
+							size_t len = dfe2_rotate_to_index(tb->data, nbytes, rev_ticks, revs);
+							if (len > 0) {
+								nbytes = len;
+							} else {
+								stringstream ss;
+								ss << "*** WARNING: CHS " << track << ":" << head << ":" << sector << " has no index pulse or is too short; saved as captured.";
+								progress.message(ss.str());
+							}
+						}
+
+						// Check the track before the buffer goes to the writer
+						if (verifier != NULL) {
+							verifier->addCapture(tb->data, nbytes);
+							metrics.add(CAcqMetrics::PHASE_VERIFY, sw.lap());
+						}
+						if (exporter != NULL) {
+							exporter->submit(track, head, tb->data, nbytes);
+							metrics.add(CAcqMetrics::PHASE_WRITE, sw.lap());
+						}
+
+						tb->track = track;
+						tb->head = head;
+						tb->sector = sector;
+						tb->clock_hz = clock_hz;
+						tb->revs = revs;
+						tb->len = nbytes;
+						writer.submit(tb);
+
+						// Decide whether to read the track again
+						if ((verifier == NULL) || verifier->complete() || bAbort) break;
+						if (attempt >= opt.maxRetries) {
+							badtracks++;
+							stringstream ss;
+							ss << "*** CHS " << track << ":" << head << ":" << sector << ": only " << verifier->goodSectors()
+								<< " of " << verifier->expectedSectors() << " sectors read after " << (attempt + 1) << " captures";
+							progress.message(ss.str());
+							break;
+						}
+
+						// Read more revolutions next time. If the heads look like they're
+						// on the wrong track, or a second re-read is needed, re-seat them
+						// by recalibrating; the seek back happens before the next capture.
+						rereads++;
+						revs = min(revs * 2, 16);
+						bool reseat = verifier->offTrack() || (attempt >= 1);
+						stringstream ss;
+						ss << "CHS " << track << ":" << head << ":" << sector << ": " << verifier->goodSectors()
+							<< " of " << verifier->expectedSectors() << " sectors good, re-reading " << revs << " revolutions"
+							<< (reseat ? " after re-seating the heads" : "");
+						progress.message(ss.str());
+						if (reseat) {
+							sw.lap();
+							if (dev->seekRecalibrate(driveinfo.tracks()) != DISCFERRET_E_OK) throw EApplicationError("Error recalibrating");
+							headpos = 0;
+							metrics.add(CAcqMetrics::PHASE_SEEK, sw.lap());
+						}
 					}
+					if (exporter != NULL) exporter->finishTrack(track, head);
+					metrics.endTrack();
 
-					// Wait for drive to become ready
-					wait_drive_ready(dh, drivescript, drivetype);
-
-					// Start the acquisition
-					e = discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_START);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error starting acquisition");
-
-					// Wait for the acquisition to complete
-					do { // scope limiter
-						long i;
-						do {
-							i = discferret_get_status(dh);
-						} while ((i > 0) && ((i & DISCFERRET_STATUS_ACQSTATUS_MASK) != DISCFERRET_STATUS_ACQ_IDLE));
-						if (i < 0) throw EApplicationError("Error reading DiscFerret status register");
-					} while (false);
-
-					// TODO: offload data ==> save to file!
-					long nbytes = discferret_ram_addr_get(dh);
-					if (discferret_get_status(dh) & DISCFERRET_STATUS_RAM_FULL) {
-						cout << "*** WARNING: RAM Full when reading -- the RAM buffer may have overflowed!" << endl;
-						nbytes = 524288;
-					}
-					cout << "CHS " << track << ":" << head << ":" << sector << ", " << nbytes << " bytes of acq data" << endl;
-					if (nbytes < 1) throw EApplicationError("Invalid byte count!");
-					e = discferret_ram_addr_set(dh, 0);
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error setting RAM address to zero");
-					e = discferret_ram_read(dh, buffer, nbytes);
-					// cout << "\tacqram read code " << e << endl;
-					if (e != DISCFERRET_E_OK) throw EApplicationError("Error reading data from acquisition RAM");
-
-					do {	// scope limiter
-						char x[16];
-						size_t i=0;
-
-						x[i++] = (track >> 8);
-						x[i++] = (track & 0xff);
-						x[i++] = (head >> 8);
-						x[i++] = (head & 0xff);
-						x[i++] = (sector >> 8);
-						x[i++] = (sector & 0xff);
-						x[i++] = (nbytes >> 24) & 0xff;
-						x[i++] = (nbytes >> 16) & 0xff;
-						x[i++] = (nbytes >> 8) & 0xff;
-						x[i++] = (nbytes) & 0xff;
-						of.write(x, i);
-						of.write((char *)buffer, nbytes);
-					} while (false);
+					stringstream ss;
+					ss << "CHS " << track << ":" << head << ":" << sector << ", " << nbytes << " bytes of acq data";
+					if (segments > 1) ss << " in " << segments << " segments";
+					progress.status(ss.str());
 				}
 			}
 		}
+		progress.stop();
+
+		// Wait for the writer to finish, then close the output file. Once the
+		// capture is complete, the journal isn't needed any more.
+		writer.close();
+		metrics.setFileWriteTime(writer.writeTime());
+		if (!bAbort) journal.remove();
+
+		if (compressors > 0) {
+			out << "Compressed " << writer.dataBytes() << " bytes of acq data to " << writer.written() << " bytes";
+			if (writer.dataBytes() > 0) out << " (" << ((writer.written() * 100) / writer.dataBytes()) << "%)";
+			out << "." << endl;
+		}
+
+		if (splitCaptures > 0) {
+			out << "Split " << splitCaptures << " captures into segments to fit in acquisition RAM." << endl;
+		}
+
+		if (verifier != NULL) {
+			out << "Verify: " << rereads << " re-reads, " << badtracks << " tracks with unreadable sectors." << endl;
+		}
+
+		// Wait for the last tracks to be decoded, then close the sector image
+		if (exporter != NULL) {
+			exporter->close();
+			out << "Sector image: " << exporter->goodSectors() << " sectors read, " << exporter->badSectors()
+				<< " unreadable (listed in " << exporter->mapFilename() << ")." << endl;
+		}
+
+		if (bVerbose) {
+			out << "Register writes: " << regs.writes() << " sent, " << regs.saved() << " skipped (already set)" << endl;
 
-		// Close the output file
-		of.close();
+			const CAcqMetrics::TrackRecord &tot = metrics.totals();
+			out << "Time per phase (ms):";
+			for (int i=0; i<CAcqMetrics::PHASE_COUNT; i++)
+				out << " " << CAcqMetrics::phaseName((CAcqMetrics::Phase)i) << "=" << (tot.phase_us[i] / 1000);
+			out << endl;
+			out << "Status polls: " << tot.polls << ", bytes read: " << tot.bytes << ", file write time: " << (writer.writeTime() / 1000) << "ms" << endl;
+		}
 
 		// We're done. Seek back to track 0 (the Landing Zone)
-		cout << "Moving heads back to track zero..." << endl;
-		do_recalibrate(dh, drivescript, &driveinfo, drivetype);
+		out << "Moving heads back to track zero..." << endl;
+		do_recalibrate(dev, drivescript, &driveinfo, opt.drivetype, out);
 
 		// Did the recal succeed?
 		if (e != DISCFERRET_E_OK) throw EApplicationError("Error seeking to track zero");
+	} catch (EApplicationError &e) {
+		err << "Application error: " << e.what() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (ECommunicationError &e) {
+		err << e.what() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (ETimeoutError &e) {
+		err << e.what() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (EDriveSpecParse &e) {
+		err << "[" << e.filename() << ", drivespec '" << e.spec() << "']: DriveSpec error: " << e.error() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (EFormatSpecParse &e) {
+		err << "[" << e.filename() << ", formatspec '" << e.spec() << "']: FormatSpec error: " << e.error() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (ELuaError &e) {
+		err << e.what() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (std::exception &e) {
+		// Out of memory, no more threads, and the like
+		err << "Unexpected error: " << e.what() << endl;
+		errcode = EXIT_FAILURE;
+	} catch (int &e) {
+		// Thrown int means early-exit requested by scrub(), autotune or autodetect
+	} catch (...) {
+		err << "Unexpected error." << endl;
+		errcode = EXIT_FAILURE;
+	}
+
+	if (dev != NULL) {
+		// Deselect the drive
+		dev->regPoke(DISCFERRET_R_DRIVE_CONTROL, 0);
+
+		if (bVerbose && opt.bSimulate) {
+			CSimulatedBackend *sim = static_cast<CSimulatedBackend *>(dev);
+			out << "Simulator: " << sim->transactions() << " USB transactions, " << sim->bytesRead() << " bytes read" << endl;
+		}
+
+		// When it's all over, we still have to clean up...
+		// Close the DiscFerret (and shut down libdiscferret), if it's ours
+		if (job.dev == NULL) delete dev;
+	}
+
+	delete exporter;
+	delete verifier;
+
+	// If the capture didn't finish, say how to carry on with it
+	if (journal.active()) {
+		if (opt.devices > 1) {
+			err << "The tracks saved so far are listed in '" << outfile << ".journal'. To carry on, capture" << endl
+				<< "from this DiscFerret on its own, with '--serial " << job.serialnum << " --outfile " << outfile << " --resume'." << endl;
+		} else {
+			err << "The tracks saved so far are listed in '" << outfile << ".journal'. Run the same command" << endl
+				<< "again with --resume added to carry on." << endl;
+		}
+	}
+
+	return errcode;
+}
+
+/**
+ * Thread function for capture_device(), when several DiscFerrets are in use.
+ * The result is left in job->errcode.
+ */
+void capture_thread(const CCaptureSettings *opt, CDeviceJob *job)
+{
+	// Nothing can be allowed to escape the thread
+	try {
+		job->errcode = capture_device(*opt, *job);
+	} catch (std::exception &e) {
+		*job->err << "Unexpected error: " << e.what() << endl;
+		job->errcode = EXIT_FAILURE;
+	} catch (...) {
+		*job->err << "Unexpected error." << endl;
+		job->errcode = EXIT_FAILURE;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Daemon
+
+/// How often the daemon checks for Ctrl-C while it waits for a job, in milliseconds
+const unsigned long DAEMON_POLL_MS = 250;
+
+/// Longest time a client can take to send a job, in milliseconds
+const unsigned long DAEMON_READ_TIMEOUT_MS = 10000;
+
+/**
+ * @brief	A capture job sent to the daemon.
+ *
+ * The client sends the job as lines of "option value", using the long
+ * command line option names without the dashes (options which don't take a
+ * value are sent on their own), and a blank line to end it. While the job is
+ * waiting and running, the daemon sends back console lines starting with
+ * "out " or "err ", and finally "exit " and the exit code.
+ */
+class CDaemonJob {
+	public:
+		unsigned long		id;				///< Job number, for the daemon's console
+		CCaptureSettings	opt;
+		bool				bRevsSet;		///< Number of revolutions was given
+		bool				bResume;		///< Carry on with an interrupted capture
+		string				serialnum;		///< DiscFerret to use, or empty for whichever is free first
+		string				outfile, imagefile;
+		string				metricsJSON, metricsProm;
+		CDriveScript		*drivescript;	///< Drive script (belongs to the CDaemonDevice)
+		CFormatScript		*formatscript;	///< Format script (belongs to the CDaemonDevice), or NULL
+		CCaptureJournal		*journal;		///< Journal for the output file
+		CLocalSocket		*client;		///< Connection to the client which sent the job
+
+		CDaemonJob(CLocalSocket *_client, const CCaptureSettings &_opt) :
+			id(0), opt(_opt), bRevsSet(false), bResume(false), drivescript(NULL), formatscript(NULL), journal(NULL), client(_client)
+		{ };
+		~CDaemonJob()					{ delete journal; delete client; };
+
+	private:
+		// Owns a connection; can't be copied
+		CDaemonJob(const CDaemonJob &);
+		CDaemonJob &operator=(const CDaemonJob &);
+};
+
+/**
+ * @brief	One of the daemon's DiscFerrets, with its queue of capture jobs.
+ *
+ * The DiscFerret stays open, with its microcode loaded, for as long as the
+ * daemon runs. Its jobs are run one at a time by a worker thread, which is
+ * the only thread to use the device or (once they've been loaded) its
+ * scripts.
+ */
+class CDaemonDevice {
+	public:
+		string				serialnum;
+		CDeviceBackend		*dev;
+		map<string, CDriveScript *>		drivescripts;	///< Drive scripts loaded so far, by drive type
+		map<string, CFormatScript *>	formatscripts;	///< Format scripts loaded so far, by format type
+		ostream				*log;			///< Daemon console, labelled with the serial number
+
+		mutex				mtx;
+		condition_variable	cv;
+		deque<CDaemonJob *>	queue;			///< Jobs waiting to start
+		CDaemonJob			*current;		///< Job being run, or NULL
+		bool				bShutdown;
+		thread				thWorker;
+
+		CDaemonDevice() : dev(NULL), log(NULL), current(NULL), bShutdown(false) { };
+		~CDaemonDevice();
+
+	private:
+		// Owns a device and a thread; can't be copied
+		CDaemonDevice(const CDaemonDevice &);
+		CDaemonDevice &operator=(const CDaemonDevice &);
+};
+
+/**
+ * @brief	Thread which reads a capture job from a client and queues it.
+ *
+ * Each connection gets one, so a slow client doesn't hold up the others.
+ */
+class CDaemonReader {
+	public:
+		thread				th;
+		atomic<bool>		bDone;			///< The thread has finished, and can be joined
+
+		CDaemonReader() : bDone(false) { };
+
+	private:
+		// Owns a thread; can't be copied
+		CDaemonReader(const CDaemonReader &);
+		CDaemonReader &operator=(const CDaemonReader &);
+};
+
+CDaemonDevice::~CDaemonDevice()
+{
+	for (map<string, CDriveScript *>::iterator it = drivescripts.begin(); it != drivescripts.end(); it++) delete it->second;
+	for (map<string, CFormatScript *>::iterator it = formatscripts.begin(); it != formatscripts.end(); it++) delete it->second;
+	for (deque<CDaemonJob *>::iterator it = queue.begin(); it != queue.end(); it++) delete *it;
+	delete log;
+	delete dev;
+}
+
+/// Capture options which don't take a value, as sent to the daemon
+static const struct {
+	const char			*name;
+	int CCaptureSettings::*flag;
+} DAEMON_FLAGS[] = {
+	{"noindex",		&CCaptureSettings::bNoIndex},
+	{"scrub",		&CCaptureSettings::bScrub},
+	{"streamread",	&CCaptureSettings::bStreamRead},
+	{"seekahead",	&CCaptureSettings::bSeekAhead},
+	{"autotune",	&CCaptureSettings::bAutotune},
+	{"autodetect",	&CCaptureSettings::bAutodetect},
+	{"immediate",	&CCaptureSettings::bImmediate},
+	{"verify",		&CCaptureSettings::bVerify},
+	{"indexed",		&CCaptureSettings::bIndexed},
+	{"compress",	&CCaptureSettings::bCompress}
+};
+
+/**
+ * Make a filename absolute, so the daemon (which may be running in another
+ * directory) saves the file where the client expects.
+ */
+string absolute_path(const string path)
+{
+	if (path.empty() || (path[0] == '/')) return path;
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) return path;
+	return string(cwd) + "/" + path;
+}
+
+/**
+ * Send a capture job to the daemon.
+ *
+ * @param	s			Connection to the daemon
+ * @param	opt			Capture settings from the command line
+ * @param	bRevsSet	true if the number of revolutions was given
+ * @param	bResume		true to carry on with an interrupted capture
+ * @param	serialnum	DiscFerret to use, or empty for whichever is free first
+ */
+void send_job(ostream &s, const CCaptureSettings &opt, const bool bRevsSet, const bool bResume, const string serialnum,
+		const string outfile, const string imagefile, const string metricsJSON, const string metricsProm)
+{
+	// Settings which a resumed capture can take from its journal are only
+	// sent if they were given
+	if (!opt.drivetype.empty())		s << "drive " << opt.drivetype << "\n";
+	if (!opt.formattype.empty())	s << "format " << opt.formattype << "\n";
+	if (opt.bClockSet)				s << "clock " << ((opt.iClockRate == DISCFERRET_ACQ_RATE_25MHZ) ? 25 : (opt.iClockRate == DISCFERRET_ACQ_RATE_50MHZ) ? 50 : 100) << "\n";
+	if (bRevsSet)					s << "multi " << opt.numReads << "\n";
+
+	if (!serialnum.empty())			s << "serial " << serialnum << "\n";
+	if (!outfile.empty())			s << "outfile " << absolute_path(outfile) << "\n";
+	if (!imagefile.empty())			s << "image " << absolute_path(imagefile) << "\n";
+	if (!metricsJSON.empty())		s << "metrics-json " << absolute_path(metricsJSON) << "\n";
+	if (!metricsProm.empty())		s << "metrics-prom " << absolute_path(metricsProm) << "\n";
+
+	s << "waitidx " << opt.waitidx << "\n";
+	s << "retries " << opt.maxRetries << "\n";
+	s << "wqdepth " << opt.writeDepth << "\n";
+	s << "fsync " << ((opt.fsyncPolicy == CTrackWriter::FSYNC_TRACK) ? "track" : (opt.fsyncPolicy == CTrackWriter::FSYNC_CLOSE) ? "close" : "never") << "\n";
+	s << "prealloc " << (opt.preallocBytes / (1024 * 1024)) << "\n";
+	s << "progress " << opt.progressInterval << "\n";
+	for (size_t i=0; i<(sizeof(DAEMON_FLAGS) / sizeof(DAEMON_FLAGS[0])); i++) {
+		if (opt.*DAEMON_FLAGS[i].flag) s << DAEMON_FLAGS[i].name << "\n";
+	}
+	if (bResume) s << "resume\n";
+
+	// A blank line ends the job
+	s << endl;
+}
+
+/**
+ * Take one setting of a job sent to the daemon.
+ *
+ * @param	job		Capture job
+ * @param	name	Option name
+ * @param	value	Option value (empty for options which don't take one)
+ * @return	false if the option isn't known, or the value is out of range
+ */
+bool job_setting(CDaemonJob &job, const string &name, const string &value)
+{
+	CCaptureSettings &opt = job.opt;
+	int n = atoi(value.c_str());
+
+	for (size_t i=0; i<(sizeof(DAEMON_FLAGS) / sizeof(DAEMON_FLAGS[0])); i++) {
+		if (name == DAEMON_FLAGS[i].name) {
+			opt.*DAEMON_FLAGS[i].flag = true;
+			return true;
+		}
+	}
+
+	if (name == "drive") {
+		opt.drivetype = value;
+	} else if (name == "format") {
+		opt.formattype = value;
+	} else if (name == "serial") {
+		job.serialnum = value;
+	} else if (name == "outfile") {
+		job.outfile = value;
+	} else if (name == "image") {
+		job.imagefile = value;
+	} else if (name == "metrics-json") {
+		job.metricsJSON = value;
+	} else if (name == "metrics-prom") {
+		job.metricsProm = value;
+	} else if (name == "resume") {
+		job.bResume = true;
+	} else if (name == "clock") {
+		switch (n) {
+			case 25:	opt.iClockRate = DISCFERRET_ACQ_RATE_25MHZ; break;
+			case 50:	opt.iClockRate = DISCFERRET_ACQ_RATE_50MHZ; break;
+			case 100:	opt.iClockRate = DISCFERRET_ACQ_RATE_100MHZ; break;
+			default:	return false;
+		}
+		opt.bClockSet = true;
+	} else if (name == "multi") {
+		if ((n < 1) || (n > 16)) return false;
+		opt.numReads = n;
+		job.bRevsSet = true;
+	} else if (name == "waitidx") {
+		if ((n < 0) || (n > 15)) return false;
+		opt.waitidx = n;
+	} else if (name == "retries") {
+		if ((n < 0) || (n > 16)) return false;
+		opt.maxRetries = n;
+	} else if (name == "wqdepth") {
+		if ((n < 2) || (n > 64)) return false;
+		opt.writeDepth = n;
+	} else if (name == "fsync") {
+		if (value == "never") {
+			opt.fsyncPolicy = CTrackWriter::FSYNC_NEVER;
+		} else if (value == "track") {
+			opt.fsyncPolicy = CTrackWriter::FSYNC_TRACK;
+		} else if (value == "close") {
+			opt.fsyncPolicy = CTrackWriter::FSYNC_CLOSE;
+		} else {
+			return false;
+		}
+	} else if (name == "prealloc") {
+		if (n < 0) return false;
+		opt.preallocBytes = (unsigned long long)n * 1024 * 1024;
+	} else if (name == "progress") {
+		if (n < 0) return false;
+		opt.progressInterval = n;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Send a capture job to the daemon, and show its console output until it
+ * has finished.
+ *
+ * @param	socketpath	The daemon's socket
+ * @return	The exit code of the capture
+ */
+int submit_job(const string socketpath, const CCaptureSettings &opt, const bool bRevsSet, const bool bResume, const string serialnum,
+		const string outfile, const string imagefile, const string metricsJSON, const string metricsProm)
+{
+	CLocalSocket *sock;
+	try {
+		sock = CLocalSocket::connect(socketpath);
+	} catch (EApplicationError &e) {
+		cerr << "Error: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	send_job(sock->stream(), opt, bRevsSet, bResume, serialnum, outfile, imagefile, metricsJSON, metricsProm);
+
+	int errcode = -1;
+	string line;
+	while ((errcode < 0) && sock->readLine(line)) {
+		if (line.compare(0, 4, "out ") == 0) {
+			cout << line.substr(4) << endl;
+		} else if (line.compare(0, 4, "err ") == 0) {
+			cerr << line.substr(4) << endl;
+		} else if (line.compare(0, 5, "exit ") == 0) {
+			errcode = atoi(line.c_str() + 5);
+		}
+	}
+	delete sock;
+
+	if (errcode < 0) {
+		cerr << "Error: lost the connection to the daemon before the capture finished." << endl;
+		return EXIT_FAILURE;
+	}
+	return errcode;
+}
+
+/**
+ * Read the settings of a capture job from its client, up to the blank line
+ * which ends them. Gives up if the client takes longer than
+ * DAEMON_READ_TIMEOUT_MS, or the daemon is stopped.
+ *
+ * @param	job		New job, with the connection it came in on
+ * @param	err		Error messages for the client
+ * @return	true if the settings were all read
+ */
+bool read_job(CDaemonJob *job, ostream &err)
+{
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(DAEMON_READ_TIMEOUT_MS);
+	string line;
+	while (true) {
+		CLocalSocket::ReadResult r = job->client->readLine(line, DAEMON_POLL_MS);
+		if ((r == CLocalSocket::READ_CLOSED) || bAbort) return false;
+		if (r == CLocalSocket::READ_TIMEOUT) {
+			if (chrono::steady_clock::now() < deadline) continue;
+			err << "Error: timed out waiting for the capture settings." << endl;
+			return false;
+		}
+		if (line.empty()) return true;
+
+		size_t sp = line.find(' ');
+		string name = line.substr(0, sp), value = (sp == string::npos) ? "" : line.substr(sp + 1);
+		if (!job_setting(*job, name, value)) {
+			err << "Error: invalid setting '" << line << "'." << endl;
+			return false;
+		}
+	}
+}
+
+/**
+ * Read a capture job from a client, check it, and queue it on one of the
+ * daemon's DiscFerrets. Errors are sent back to the client.
+ *
+ * @param	job			New job, with the connection it came in on
+ * @param	devices		The daemon's DiscFerrets
+ * @param	dsmgr		Drive script manager
+ * @param	fsmgr		Format script manager
+ * @param	mtx			Held while the job is checked and queued; guards the
+ * 						script managers and the DiscFerrets' script caches
+ * @param	log			Daemon console
+ * @return	true if the job was queued (it then belongs to the DiscFerret's
+ * 			worker thread)
+ */
+bool queue_job(CDaemonJob *job, vector<CDaemonDevice *> &devices, CDriveScriptManager &dsmgr, CFormatScriptManager &fsmgr, mutex &mtx, ostream &log)
+{
+	CConsoleStream out(job->client->stream(), "out "), err(job->client->stream(), "err ");
+
+	if (!read_job(job, err)) return false;
+
+	// One job at a time from here, so two jobs can't both claim the same
+	// output file, or load the same script
+	lock_guard<mutex> queueLock(mtx);
+
+	// Use the DiscFerret which was asked for, or else the one with the
+	// fewest jobs ahead. Two jobs can't save to the same file.
+	CDaemonDevice *d = NULL;
+	size_t best = 0;
+	for (vector<CDaemonDevice *>::iterator it = devices.begin(); it != devices.end(); it++) {
+		lock_guard<mutex> lock((*it)->mtx);
+		if (!job->outfile.empty()) {
+			bool inUse = ((*it)->current != NULL) && ((*it)->current->outfile == job->outfile);
+			for (deque<CDaemonJob *>::const_iterator q = (*it)->queue.begin(); q != (*it)->queue.end(); q++)
+				if ((*q)->outfile == job->outfile) inUse = true;
+			if (inUse) {
+				err << "Error: '" << job->outfile << "' is already being captured." << endl;
+				return false;
+			}
+		}
+		size_t ahead = (*it)->queue.size() + (((*it)->current != NULL) ? 1 : 0);
+		if (job->serialnum.empty() ? ((d == NULL) || (ahead < best)) : ((*it)->serialnum == job->serialnum)) {
+			d = *it;
+			best = ahead;
+		}
+	}
+	if (d == NULL) {
+		err << "Error: DiscFerret " << job->serialnum << " isn't one of the daemon's." << endl;
+		return false;
+	}
+
+	// Check the settings, the same as for a capture from the command line
+	job->journal = new CCaptureJournal(job->outfile + ".journal");
+	if (job->bResume && !resume_capture(job->opt, job->bRevsSet, *job->journal, job->outfile, job->imagefile, err)) {
+		return false;
+	}
+	if (!check_settings(job->opt, job->outfile, job->imagefile, err)) {
+		return false;
+	}
+
+	// Each DiscFerret keeps the scripts its jobs have used, so the next job
+	// for the same drive and format doesn't have to load them again
+	map<string, CDriveScript *>::iterator ds = d->drivescripts.find(job->opt.drivetype);
+	if (ds != d->drivescripts.end()) {
+		job->drivescript = ds->second;
+	} else {
+		if ((job->drivescript = load_drive_script(dsmgr, job->opt.drivetype, err)) == NULL) return false;
+		d->drivescripts[job->opt.drivetype] = job->drivescript;
+	}
+	if (!job->opt.formattype.empty()) {
+		map<string, CFormatScript *>::iterator fs = d->formatscripts.find(job->opt.formattype);
+		if (fs != d->formatscripts.end()) {
+			job->formatscript = fs->second;
+		} else {
+			if ((job->formatscript = load_format_script(fsmgr, job->opt.formattype, err)) == NULL) return false;
+			d->formatscripts[job->opt.formattype] = job->formatscript;
+		}
+	}
+
+	log << "Job " << job->id << " (" << (job->outfile.empty() ? "no output file" : job->outfile) << ") queued on DiscFerret " << d->serialnum << endl;
+	{
+		lock_guard<mutex> lock(d->mtx);
+		size_t ahead = d->queue.size() + ((d->current != NULL) ? 1 : 0);
+		out << "Queued on DiscFerret " << d->serialnum << ", with " << ahead << " job" << ((ahead == 1) ? "" : "s") << " ahead." << endl;
+		d->queue.push_back(job);
+	}
+	d->cv.notify_one();
+	return true;
+}
+
+/**
+ * Reader thread for one connection to the daemon. Queues the job it sends,
+ * or tells the client why it couldn't be.
+ */
+void daemon_reader(CDaemonReader *r, CDaemonJob *job, vector<CDaemonDevice *> *devices,
+		CDriveScriptManager *dsmgr, CFormatScriptManager *fsmgr, mutex *mtx)
+{
+	CConsoleStream log(cout, "");
+	bool queued = false;
+	try {
+		queued = queue_job(job, *devices, *dsmgr, *fsmgr, *mtx, log);
+	} catch (std::exception &e) {
+		job->client->stream() << "err Unexpected error: " << e.what() << endl;
+	} catch (...) {
+		job->client->stream() << "err Unexpected error." << endl;
+	}
+	if (!queued) {
+		job->client->stream() << "exit " << EXIT_FAILURE << endl;
+		delete job;
+	}
+	r->bDone = true;
+}
+
+/**
+ * Worker thread for one of the daemon's DiscFerrets. Runs its capture jobs
+ * one at a time, in the order they were queued, until the daemon stops.
+ */
+void daemon_worker(CDaemonDevice *d)
+{
+	while (true) {
+		CDaemonJob *job;
+		{
+			unique_lock<mutex> lock(d->mtx);
+			while (!d->bShutdown && d->queue.empty()) d->cv.wait(lock);
+			if (d->bShutdown || bAbort) return;
+			job = d->queue.front();
+			d->queue.pop_front();
+			d->current = job;
+		}
+
+		*d->log << "Job " << job->id << " started" << endl;
+		int errcode = EXIT_FAILURE;
+		try {
+			CConsoleStream out(job->client->stream(), "out "), err(job->client->stream(), "err "), progress(job->client->stream(), "out ");
+
+			// The device is already open, so the capture goes straight to the drive
+			CDeviceJob dj;
+			dj.serialnum = d->serialnum;
+			dj.outfile = job->outfile;
+			dj.imagefile = job->imagefile;
+			dj.drivescript = job->drivescript;
+			dj.formatscript = job->formatscript;
+			dj.journal = job->journal;
+			dj.dev = d->dev;
+			dj.out = &out;
+			dj.err = &err;
+			dj.progress = &progress;
+			errcode = capture_device(job->opt, dj);
+
+			if (!job->metricsJSON.empty() && !dj.metrics.writeJSON(job->metricsJSON))
+				err << "Unable to save metrics to '" << job->metricsJSON << "'" << endl;
+			if (!job->metricsProm.empty() && !dj.metrics.writePrometheus(job->metricsProm))
+				err << "Unable to save metrics to '" << job->metricsProm << "'" << endl;
+		} catch (std::exception &e) {
+			// Nothing can be allowed to escape the thread; fail the job instead
+			job->client->stream() << "err Unexpected error: " << e.what() << endl;
+			errcode = EXIT_FAILURE;
+		} catch (...) {
+			job->client->stream() << "err Unexpected error." << endl;
+			errcode = EXIT_FAILURE;
+		}
+		*d->log << "Job " << job->id << " " << ((errcode == EXIT_SUCCESS) ? "finished" : "FAILED") << endl;
+
+		{
+			lock_guard<mutex> lock(d->mtx);
+			d->current = NULL;
+		}
+		job->client->stream() << "exit " << errcode << endl;
+		delete job;
+	}
+}
+
+/**
+ * Run as a daemon: open the DiscFerrets and load their microcode, then run
+ * the capture jobs sent to the socket until Ctrl-C (or SIGTERM).
+ *
+ * @param	socketpath	Socket to listen on
+ * @param	opt			Settings from the command line (the simulator, and
+ * 						how many worker threads each capture gets)
+ * @param	serials		DiscFerrets to use
+ * @return	Exit code
+ */
+int run_daemon(const string socketpath, const CCaptureSettings &opt, const vector<string> &serials)
+{
+	// The scripts are only scanned once. Jobs load the ones they need.
+	CDriveScriptManager dsmgr;
+	dsmgr.loadCatalog(DRIVESCRIPTCATALOG);
+	dsmgr.scandir(DRIVESCRIPTDIR);
+	if (!dsmgr.saveCatalog(DRIVESCRIPTCATALOG) && bVerbose) {
+		cout << "Unable to save drive script catalog " << DRIVESCRIPTCATALOG << endl;
+	}
+	CFormatScriptManager fsmgr;
+	if (!scan_format_scripts(fsmgr, cerr)) {
+		return EXIT_FAILURE;
+	}
+
+	// Each job gets the same share of the spare cores as a capture on the
+	// command line would, and the resume hint for a single DiscFerret
+	CCaptureSettings jobopt = opt;
+	jobopt.devices = 1;
+
+	int errcode = EXIT_SUCCESS;
+	vector<CDaemonDevice *> devices;
+	CLocalListener *listener = NULL;
+	try {
+		for (vector<string>::const_iterator it = serials.begin(); it != serials.end(); it++) {
+			CDaemonDevice *d = new CDaemonDevice();
+			devices.push_back(d);
+			d->dev = open_device(opt, *it, cout);
+
+			DISCFERRET_DEVICE_INFO devinfo;
+			if (d->dev->getInfo(&devinfo) != DISCFERRET_E_OK) throw ECommunicationError();
+			d->serialnum = devinfo.serialnumber;
+			cout << "DiscFerret " << devinfo.serialnumber << " ready: hardware " << devinfo.hardware_rev << ", firmware " << devinfo.firmware_ver
+				<< ", microcode type " << devinfo.microcode_type << " revision " << devinfo.microcode_ver << endl;
+		}
+		listener = new CLocalListener(socketpath);
 	} catch (EApplicationError &e) {
 		cerr << "Application error: " << e.what() << endl;
 		errcode = EXIT_FAILURE;
 	} catch (ECommunicationError &e) {
 		cerr << e.what() << endl;
 		errcode = EXIT_FAILURE;
-	} catch (int &e) {
-		// Thrown int means early-exit requested by scrub()
 	}
 
-	// Deselect the drive
-	discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, 0);
+	if (errcode == EXIT_SUCCESS) {
+		// Ctrl-C or SIGTERM stops the daemon, aborting any captures in progress.
+		// A client going away mustn't kill the daemon.
+		trap_break(true);
+#ifndef _WIN32
+		signal(SIGTERM, &sighandler);
+		signal(SIGPIPE, SIG_IGN);
+#endif
+
+		for (vector<CDaemonDevice *>::iterator it = devices.begin(); it != devices.end(); it++) {
+			(*it)->log = new CConsoleStream(cout, "[" + (*it)->serialnum + "] ");
+			(*it)->thWorker = thread(daemon_worker, *it);
+		}
+
+		CConsoleStream log(cout, "");
+		log << "Waiting for capture jobs on '" << socketpath << "'. Press Ctrl-C to stop." << endl;
+		unsigned long jobs = 0;
+		mutex queueMutex;
+		vector<CDaemonReader *> readers;
+		while (!bAbort) {
+			// Tidy up after the readers which have finished
+			for (vector<CDaemonReader *>::iterator it = readers.begin(); it != readers.end(); ) {
+				if ((*it)->bDone) {
+					(*it)->th.join();
+					delete *it;
+					it = readers.erase(it);
+				} else {
+					it++;
+				}
+			}
+
+			CLocalSocket *client = listener->accept(DAEMON_POLL_MS);
+			if (client == NULL) continue;
+
+			CDaemonJob *job = new CDaemonJob(client, jobopt);
+			job->id = ++jobs;
+			CDaemonReader *r = new CDaemonReader();
+			try {
+				r->th = thread(daemon_reader, r, job, &devices, &dsmgr, &fsmgr, &queueMutex);
+			} catch (system_error &e) {
+				client->stream() << "err Unable to start a thread for the job: " << e.what() << endl << "exit " << EXIT_FAILURE << endl;
+				delete job;
+				delete r;
+				continue;
+			}
+			readers.push_back(r);
+		}
+		log << "Stopping..." << endl;
+
+		// The readers give up once they see the abort flag
+		for (vector<CDaemonReader *>::iterator it = readers.begin(); it != readers.end(); it++) {
+			(*it)->th.join();
+			delete *it;
+		}
+
+		// Wait for the captures in progress to abort, and tell the clients
+		// whose jobs never started
+		for (vector<CDaemonDevice *>::iterator it = devices.begin(); it != devices.end(); it++) {
+			{
+				lock_guard<mutex> lock((*it)->mtx);
+				(*it)->bShutdown = true;
+			}
+			(*it)->cv.notify_one();
+			(*it)->thWorker.join();
+			for (deque<CDaemonJob *>::iterator q = (*it)->queue.begin(); q != (*it)->queue.end(); q++)
+				(*q)->client->stream() << "err The daemon was stopped before the capture started." << endl << "exit " << EXIT_FAILURE << endl;
+		}
+
+#ifndef _WIN32
+		signal(SIGTERM, SIG_DFL);
+#endif
+		trap_break(false);
+	}
+
+	delete listener;
+	for (vector<CDaemonDevice *>::iterator it = devices.begin(); it != devices.end(); it++) delete *it;
+
+	return errcode;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void usage(char *appname)
+{
+	cout
+		<< "Usage:" << endl
+		<< "   " << appname << " [--verbose]" << endl
+		<< "      --drive drivetype [--format formattype] --outfile outputfile" << endl
+		<< "      [--serial serialnum|all ...] [--clock clockrate] [--multi numreads]" << endl
+		<< "      [--waitidx numidx] [--noindex] [--scrub]" << endl
+		<< "      [--wqdepth numbufs] [--fsync policy] [--prealloc mbytes]" << endl
+		<< "      [--seekahead] [--simulate simspec]" << endl
+		<< "      [--progress ms] [--metrics-json jsonfile] [--metrics-prom promfile]" << endl
+		<< "      [--autotune] [--autodetect] [--immediate] [--verify [--retries n]]" << endl
+		<< "      [--image imgfile] [--indexed] [--compress] [--resume]" << endl
+		<< "      [--connect socket]" << endl
+		<< "   " << appname << " [--verbose] --daemon socket [--serial serialnum|all ...]" << endl
+		<< "      [--simulate simspec]" << endl
+		<< endl
+		<< "Where:" << endl
+		<< "   drivetype   Type of disc drive attached to the DiscFerret" << endl
+		<< "   outputfile  Output filename" << endl
+		<< "   formattype  Type of the disc inserted in the drive. Only the tracks and" << endl
+		<< "               heads used by the format are captured. If this is not" << endl
+		<< "               specified, every track and head on the drive is captured." << endl
+		<< "   serialnum   Serial number of the DiscFerret to connect to. If this is" << endl
+		<< "               not specified, then the first DiscFerret will be used. Give" << endl
+		<< "               it more than once, or 'all', to use several at once." << endl
+		<< "   clockrate   Clock rate in MHz. Either 25, 50 or 100 (default is 100)." << endl
+		<< "   numreads    MultiRead mode -- number of reads per cycle (default is 1)." << endl
+		<< "   numidx      Number of index pulses to wait before attempting to read a" << endl
+		<< "               track (default is 0, read on active edge of first index pulse)." << endl
+		<< "   numbufs     Number of track buffers queued for the output file writer" << endl
+		<< "               (default is 4)." << endl
+		<< "   policy      When to flush the output file to disc: 'never' (leave it to" << endl
+		<< "               the OS, default), 'track' (after every track) or 'close'." << endl
+		<< "   mbytes      Preallocate this many megabytes for the output file." << endl
+		<< "   simspec     Use a simulated DiscFerret and drive instead of real hardware." << endl
+		<< "               Format is 'source[,key=value...]'. The source is 'synthetic'" << endl
+		<< "               (generated IBM MFM tracks) or the name of a DFE2 image to" << endl
+		<< "               replay. Keys are rpm, settle (ms), latency (us per USB" << endl
+		<< "               transaction), bandwidth (KB/s), tracks, datarate (kbps) and" << endl
+		<< "               sectors." << endl
+		<< "   ms          Minimum time between progress lines, in milliseconds" << endl
+		<< "               (default is 500; 0 shows every track)." << endl
+		<< "   jsonfile    Save per-track and total timings (seek, settle, ready, index," << endl
+		<< "               capture, readback, write), poll counts and bytes transferred" << endl
+		<< "               as JSON." << endl
+		<< "   promfile    Save the totals as a Prometheus textfile collector file." << endl
+		<< "   n           Number of times to re-read a track which fails verification" << endl
+		<< "               (default is 4)." << endl
+		<< "   imgfile     Also decode the tracks into a sector image, as they are" << endl
+		<< "               captured. A bad sector map is saved as imgfile.bad." << endl
+		<< endl
+		<< "If '--serial' is given more than once, or as 'all' (every DiscFerret which" << endl
+		<< "is connected), the discs in all the DiscFerrets are captured at the same" << endl
+		<< "time, each on a thread of its own with its own copy of the drive and format" << endl
+		<< "scripts. The settings are the same for all of them. Each one's output file" << endl
+		<< "(and sector image and journal) has its serial number added to the name, e.g." << endl
+		<< "'disc-SERIAL.dfe', and its console messages start with '[SERIAL]'. The" << endl
+		<< "metrics files cover all of them, labelled by serial number. '--autotune' and" << endl
+		<< "'--resume' work on one DiscFerret at a time." << endl
+		<< endl
+		<< "With '--daemon', the DiscFerrets are opened and their microcode loaded once," << endl
+		<< "and kept open for capture jobs sent to the local socket 'socket'. The drive" << endl
+		<< "and format scripts are scanned once, and each DiscFerret keeps the scripts" << endl
+		<< "its jobs have loaded. Each DiscFerret runs its jobs one at a time, in the" << endl
+		<< "order they came in. The daemon runs until Ctrl-C (or SIGTERM), which aborts" << endl
+		<< "the captures in progress. Restart it to pick up changed scripts. Only the" << endl
+		<< "user running the daemon (and root) can connect to it." << endl
+		<< endl
+		<< "With '--connect', the capture is sent to the daemon on 'socket' instead of" << endl
+		<< "being done here, with the same options as usual. It's queued on the" << endl
+		<< "DiscFerret given with '--serial', or else the one with the fewest jobs" << endl
+		<< "waiting, and its messages are shown as it runs. If the client is stopped," << endl
+		<< "the capture carries on. '--simulate' is given to the daemon, not the job." << endl
+		<< endl
+		<< "If '--scrub' is specified, the disc drive heads will be cleaned. Insert a" << endl
+		<< "cleaning disc before running this command. In this mode, the output filename" << endl
+		<< "is optional." << endl
+		<< endl
+		<< "If '--autotune' is specified, the step rate, head settle time and spin-up" << endl
+		<< "time of the drive are measured and saved as a timing profile in" << endl
+		<< "'" TIMINGPROFILEDIR "', which later runs with the same DiscFerret and drive" << endl
+		<< "type use in place of the drive script's defaults. Insert a formatted disc" << endl
+		<< "(of any format) before running this command. In this mode, the output" << endl
+		<< "filename is optional." << endl
+		<< endl
+		<< "If '--autodetect' is specified, one revolution of the first track is captured" << endl
+		<< "before anything else, and its flux intervals are used to work out the" << endl
+		<< "encoding (FM, MFM or GCR) and data rate. Unless '--clock' was given, the" << endl
+		<< "fastest clock rate is used; for captures which can't be split (see below)," << endl
+		<< "the fastest at which 'numreads' revolutions fit in acquisition RAM. '--verify'" << endl
+		<< "uses the detected encoding, data rate and sectors per track where the format" << endl
+		<< "doesn't give them. Without an output filename, the results are printed and" << endl
+		<< "nothing else is done." << endl
+		<< endl
+		<< "A capture which won't fit in the 512K of acquisition RAM is split into" << endl
+		<< "segments of whole revolutions, each of which starts and ends on the index" << endl
+		<< "pulse, and the segments are joined back together in the output file. How" << endl
+		<< "many revolutions fit in a segment is predicted from the rotation speed, the" << endl
+		<< "clock rate and the tracks captured so far; if a segment overflows anyway, it" << endl
+		<< "is captured again as two smaller ones. Captures with '--noindex' or" << endl
+		<< "'--immediate' can't be split, and are cut short if they overflow." << endl
+		<< endl
+		<< "If '--immediate' is specified, each capture starts as soon as the drive is" << endl
+		<< "ready instead of waiting for the index pulse, and is stopped once it has" << endl
+		<< "recorded 'numreads' revolutions. The data is then rotated so that it starts" << endl
+		<< "at the index pulse, as usual. This saves half a revolution per track on" << endl
+		<< "average, at the cost of one bad flux interval where the end of the capture" << endl
+		<< "is joined to the start. It can't be used with '--noindex' or '--waitidx'." << endl
+		<< endl
+		<< "If '--verify' is specified, each track is decoded as soon as it has been" << endl
+		<< "captured and checked for the number of sectors, and good ID and data CRCs," << endl
+		<< "given by the format. A track which fails is read again with twice as many" << endl
+		<< "revolutions (up to 16), re-seating the heads from the second re-read on," << endl
+		<< "until every sector has been read at least once. Every capture is saved." << endl
+		<< "This needs a format which specifies the encoding, datarate and spt, or" << endl
+		<< "'--autodetect'." << endl
+		<< endl
+		<< "If '--indexed' is specified, the output file ends with a directory of the" << endl
+		<< "track records (with the clock rate, revolutions and rotation speed of each)," << endl
+		<< "so tools can go straight to any track. The directory is stored as an extra" << endl
+		<< "record for track 65535, so programs which don't know about it can skip it." << endl
+		<< endl
+		<< "If '--compress' is specified, each track is compressed as it's saved, and the" << endl
+		<< "output file is a DFEZ image instead of DFE2. Each track is compressed on its" << endl
+		<< "own, so tools can unpack any one of them without the rest. The compression" << endl
+		<< "is done by a pool of worker threads, off the acquisition path." << endl
+		<< endl
+		<< "While a capture is running, the tracks saved so far are listed in a journal" << endl
+		<< "(outfile.journal), which is deleted once the capture has finished. If the" << endl
+		<< "capture is interrupted, run it again with '--resume' added: the tracks in the" << endl
+		<< "journal are checked against the output file, and the capture carries on" << endl
+		<< "after the last good one, with the same drive, format, clock rate, number of" << endl
+		<< "revolutions, '--indexed' and '--compress' settings. With '--verify', the last" << endl
+		<< "track is read again, in case it was waiting for a re-read. '--resume' can't be" << endl
+		<< "used with '--image'." << endl
+		<< endl
+		<< "If '--image' is specified, each capture is decoded by a pool of worker" << endl
+		<< "threads while the drive moves on, and the sectors are written to imgfile in" << endl
+		<< "track, head, sector order as soon as each track is done. Sectors which" << endl
+		<< "couldn't be read are listed in the bad sector map. Like '--verify', this needs" << endl
+		<< "the encoding, datarate and spt from the format or '--autodetect'." << endl
+		<< endl
+		<< "If '--seekahead' is specified, the heads are moved to the next track (or the" << endl
+		<< "next head is selected) as soon as each capture finishes, so the drive steps" << endl
+		<< "and settles while the acquisition RAM is being read back." << endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// "I am main(), king of kings. Look upon my works, ye mighty, and despair!"
+//////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	CCaptureSettings opt;
+	string outfile, imagefile;
+	vector<string> serials;
+	int bResume = false;
+	bool bRevsSet = false;
+	string metricsJSON, metricsProm;
+	string daemonSocket, connectSocket;
+
+	while (1) {
+		// Getopt option table
+		static const struct option opts_long[] = {
+			// name			has_arg				flag			val
+			{"help",		no_argument,		0,				'h'},
+			{"verbose",		no_argument,		&bVerbose,		true},
+			{"drive",		required_argument,	0,				'd'},
+			{"format",		required_argument,	0,				'f'},
+			{"serial",		required_argument,	0,				's'},
+			{"outfile",		required_argument,	0,				'o'},
+			{"clock",		required_argument,	0,				'c'},
+			{"multi",		required_argument,	0,				'm'},
+			{"waitidx",		required_argument,	0,				'w'},
+			{"scrub",		no_argument,		&opt.bScrub,		true},
+			{"noindex",		no_argument,		&opt.bNoIndex,		true},
+			{"streamread",	no_argument,		&opt.bStreamRead,	true},
+			{"seekahead",	no_argument,		&opt.bSeekAhead,	true},
+			{"autotune",	no_argument,		&opt.bAutotune,		true},
+			{"autodetect",	no_argument,		&opt.bAutodetect,	true},
+			{"immediate",	no_argument,		&opt.bImmediate,	true},
+			{"verify",		no_argument,		&opt.bVerify,		true},
+			{"retries",		required_argument,	0,				'r'},
+			{"image",		required_argument,	0,				'I'},
+			{"indexed",		no_argument,		&opt.bIndexed,		true},
+			{"compress",	no_argument,		&opt.bCompress,		true},
+			{"resume",		no_argument,		&bResume,		true},
+			{"wqdepth",		required_argument,	0,				'q'},
+			{"fsync",		required_argument,	0,				'y'},
+			{"prealloc",	required_argument,	0,				'p'},
+			{"simulate",	required_argument,	0,				'S'},
+			{"progress",	required_argument,	0,				'P'},
+			{"metrics-json",	required_argument,	0,			'J'},
+			{"metrics-prom",	required_argument,	0,			'R'},
+			{"daemon",		required_argument,	0,				'D'},
+			{"connect",		required_argument,	0,				'C'},
+			{0, 0, 0, 0}	// end sentinel / terminator
+		};
+		static const char *opts_short = "hd:f:s:o:c:m:w:q:y:p:S:P:J:R:r:I:D:C:";
+
+		// getopt stores the option index here
+		int idx = 0;
+		int c;
+		if ((c = getopt_long(argc, argv, opts_short, opts_long, &idx)) == -1)
+			break;
+
+		// check option value
+		switch (c) {
+			case 0:	break;			// option set a flag (ignore this)
+
+			case 'h':
+				// show help and quit
+				usage(argv[0]);
+				return EXIT_SUCCESS;
+
+			case 'd':
+				// set drive type
+				opt.drivetype = optarg;
+				break;
+
+			case 'f':
+				// set format type
+				opt.formattype = optarg;
+				break;
+
+			case 's':
+				// discferret unit serial number (more than one for several units at once)
+				serials.push_back(optarg);
+				break;
+
+			case 'o':
+				// output filename
+				outfile = optarg;
+				break;
 
-	// When it's all over, we still have to clean up...
-	// Shut down libdiscferret
-	discferret_close(dh);
-	discferret_done();
+			case 'c':
+				// set clock rate
+				switch (atoi(optarg)) {
+					case 25:
+						opt.iClockRate = DISCFERRET_ACQ_RATE_25MHZ; break;
+					case 50:
+						opt.iClockRate = DISCFERRET_ACQ_RATE_50MHZ; break;
+					case 100:
+						opt.iClockRate = DISCFERRET_ACQ_RATE_100MHZ; break;
+					default:
+						cerr << "Invalid clock rate specified." << endl;
+						usage(argv[0]);
+						exit(EXIT_FAILURE);
+						break;
+				}
+				opt.bClockSet = true;
+				break;
+
+			case 'm':
+				opt.numReads = atoi(optarg);
+				if ((opt.numReads < 1) || (opt.numReads > 16)) {
+					cerr << "Invalid number of reads (min 1, max 16)" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				bRevsSet = true;
+				break;
+
+			case 'w':
+				opt.waitidx = atoi(optarg);
+				if ((opt.waitidx < 0) || (opt.waitidx > 15)) {
+					cerr << "Invalid waitidx value (min 0, max 15)" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'q':
+				opt.writeDepth = atoi(optarg);
+				if ((opt.writeDepth < 2) || (opt.writeDepth > 64)) {
+					cerr << "Invalid write queue depth (min 2, max 64)" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'y':
+				if (strcmp(optarg, "never") == 0) {
+					opt.fsyncPolicy = CTrackWriter::FSYNC_NEVER;
+				} else if (strcmp(optarg, "track") == 0) {
+					opt.fsyncPolicy = CTrackWriter::FSYNC_TRACK;
+				} else if (strcmp(optarg, "close") == 0) {
+					opt.fsyncPolicy = CTrackWriter::FSYNC_CLOSE;
+				} else {
+					cerr << "Invalid fsync policy (must be 'never', 'track' or 'close')" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'p':
+				if (atoi(optarg) < 0) {
+					cerr << "Invalid preallocation size" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				opt.preallocBytes = (unsigned long long)atoi(optarg) * 1024 * 1024;
+				break;
+
+			case 'S':
+				// simulate a DiscFerret instead of using real hardware
+				try {
+					opt.simParams.parse(optarg);
+				} catch (EApplicationError &e) {
+					cerr << e.what() << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				opt.bSimulate = true;
+				break;
+
+			case 'P':
+				if (atoi(optarg) < 0) {
+					cerr << "Invalid progress interval" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				opt.progressInterval = atoi(optarg);
+				break;
+
+			case 'J':
+				// acquisition metrics: JSON summary
+				metricsJSON = optarg;
+				break;
+
+			case 'R':
+				// acquisition metrics: Prometheus textfile
+				metricsProm = optarg;
+				break;
+
+			case 'I':
+				imagefile = optarg;
+				break;
+
+			case 'D':
+				// run as a daemon, taking capture jobs on this socket
+				daemonSocket = optarg;
+				break;
+
+			case 'C':
+				// send the capture to a daemon on this socket
+				connectSocket = optarg;
+				break;
+
+			case 'r':
+				opt.maxRetries = atoi(optarg);
+				if ((opt.maxRetries < 0) || (opt.maxRetries > 16)) {
+					cerr << "Invalid number of retries (min 0, max 16)" << endl;
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case '?':
+				// option unknown; getopt already printed the error, but we need to bail out here.
+				exit(EXIT_FAILURE);
+				break;
+
+			default:
+				// unhandled option -- an option we should have handled, but didn't!
+				printf("unhandled option %c! man the lifeboats, women and children first!\n", c);
+				abort();
+				break;
+		}
+	}
+
+	if (bVerbose) cout << "Verbose mode ON\n";
+
+	// With --connect, the capture is queued on a daemon which already has the
+	// DiscFerret open. The daemon checks the settings and does the rest.
+	if (!connectSocket.empty()) {
+		if (!daemonSocket.empty() || opt.bSimulate || (serials.size() > 1) || (find(serials.begin(), serials.end(), "all") != serials.end())) {
+			cerr << "Error: --connect queues a capture on one of the daemon's DiscFerrets; it can't be used with" << endl
+				<< "--daemon, --simulate or more than one --serial." << endl;
+			return EXIT_FAILURE;
+		}
+		return submit_job(connectSocket, opt, bRevsSet, bResume, serials.empty() ? "" : serials[0], outfile, imagefile, metricsJSON, metricsProm);
+	}
+
+	// Work out which DiscFerrets to use: the ones given with --serial ("all"
+	// for every one which is connected), or else the first one found
+	if (find(serials.begin(), serials.end(), "all") != serials.end()) {
+		if (opt.bSimulate) {
+			serials.assign(1, "");
+		} else {
+			try {
+				CDiscFerretBackend::findDevices(serials);
+			} catch (EApplicationError &e) {
+				cerr << "Error: " << e.what() << endl;
+				return EXIT_FAILURE;
+			}
+			if (serials.empty()) {
+				cerr << "Error: no DiscFerrets are connected." << endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	if (serials.empty()) serials.push_back("");
+	opt.devices = serials.size();
+	if (opt.devices > 1) {
+		for (vector<string>::iterator it = serials.begin(); it != serials.end(); it++) {
+			if (it->empty() || (find(serials.begin(), it, *it) != it)) {
+				cerr << "Error: each DiscFerret has to be given once, by its serial number." << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		if (bResume) {
+			cerr << "Error: --resume carries on the capture from one DiscFerret; use --serial to say which." << endl;
+			return EXIT_FAILURE;
+		}
+		if (opt.bAutotune) {
+			cerr << "Error: --autotune can only tune one DiscFerret at a time." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Compression and --image decoding get the spare cores (one is left for
+	// each DiscFerret's acquisition), shared out between the DiscFerrets
+	unsigned int cores = thread::hardware_concurrency();
+	opt.workers = (cores > opt.devices) ? min((cores - opt.devices) / opt.devices, 4U) : 1;
+	if (opt.workers < 1) opt.workers = 1;
+
+	// With --daemon, the DiscFerrets are opened now and kept open for the
+	// capture jobs sent to the daemon, which each have their own settings
+	if (!daemonSocket.empty()) {
+		if (!opt.drivetype.empty() || !opt.formattype.empty() || !outfile.empty() || !imagefile.empty() ||
+				!metricsJSON.empty() || !metricsProm.empty() || bResume) {
+			cerr << "Error: the drive type, format, output files and --resume are given with each job sent to the" << endl
+				<< "daemon (with --connect), not to the daemon itself." << endl;
+			return EXIT_FAILURE;
+		}
+		return run_daemon(daemonSocket, opt, serials);
+	}
+
+	// The journal lists the tracks which have been saved. With --resume, the
+	// journal from the interrupted capture has the settings to carry on with.
+	CCaptureJournal journal(outfile + ".journal");
+	if (bResume && !resume_capture(opt, bRevsSet, journal, outfile, imagefile, cerr)) {
+		return EXIT_FAILURE;
+	}
+
+	if (!check_settings(opt, outfile, imagefile, cerr)) {
+		return EXIT_FAILURE;
+	}
+
+	// Scan for drive scripts
+	CDriveScriptManager dsmgr;
+	dsmgr.loadCatalog(DRIVESCRIPTCATALOG);
+	dsmgr.scandir(DRIVESCRIPTDIR);
+	if (!dsmgr.saveCatalog(DRIVESCRIPTCATALOG) && bVerbose) {
+		cout << "Unable to save drive script catalog " << DRIVESCRIPTCATALOG << endl;
+	}
+
+	// Make sure the user specified a valid drive type
+	CDriveScript *drivescript = load_drive_script(dsmgr, opt.drivetype, cerr);
+	if (drivescript == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	// If the user specified a format type, load its format script. Without
+	// one, every track and head on the drive is captured.
+	CFormatScript *formatscript = NULL;
+	CFormatScriptManager fsmgr;
+	if (opt.formattype.length() != 0) {
+		if (!scan_format_scripts(fsmgr, cerr) || ((formatscript = load_format_script(fsmgr, opt.formattype, cerr)) == NULL)) {
+			delete drivescript;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// TODO: use format scripts for weird stuff like Amiga mfmsync and MultiCycle Sampling
+
+	int errcode = EXIT_SUCCESS;
+
+	// Set up a capture job for each DiscFerret. With more than one, each gets
+	// its own copy of the scripts (a Lua state can only be used by one thread
+	// at a time), its own output files and journal, and its console lines are
+	// labelled with its serial number.
+	vector<CDeviceJob> jobs(opt.devices);
+	try {
+		for (size_t i=0; i<jobs.size(); i++) {
+			CDeviceJob &job = jobs[i];
+			job.serialnum = serials[i];
+			if (opt.devices == 1) {
+				job.outfile = outfile;
+				job.imagefile = imagefile;
+				job.drivescript = drivescript;
+				job.formatscript = formatscript;
+				job.journal = &journal;
+				job.out = job.progress = &cout;
+				job.err = &cerr;
+			} else {
+				string prefix = "[" + serials[i] + "] ";
+				job.outfile = outfile.empty() ? "" : device_filename(outfile, serials[i]);
+				job.imagefile = imagefile.empty() ? "" : device_filename(imagefile, serials[i]);
+				job.drivescript = (i == 0) ? drivescript : dsmgr.load(opt.drivetype);
+				job.formatscript = ((i == 0) || (formatscript == NULL)) ? formatscript : fsmgr.load(opt.formattype);
+				job.journal = new CCaptureJournal(job.outfile + ".journal");
+				job.out = new CConsoleStream(cout, prefix);
+				job.err = new CConsoleStream(cerr, prefix);
+				job.progress = new CConsoleStream(cout, prefix);
+				job.metrics.setDevice(serials[i]);
+			}
+		}
+	} catch (...) {
+		cerr << "Error: unable to load the drive and format scripts for each DiscFerret." << endl;
+		errcode = EXIT_FAILURE;
+	}
+
+	if (errcode == EXIT_SUCCESS) {
+		if (opt.devices == 1) {
+			errcode = capture_device(opt, jobs[0]);
+		} else {
+			// Run all the captures at once, then wait for them to finish
+			cout << "Capturing from " << opt.devices << " DiscFerrets:";
+			for (vector<CDeviceJob>::const_iterator it = jobs.begin(); it != jobs.end(); it++)
+				cout << " " << it->serialnum << " (" << it->outfile << ")";
+			cout << endl;
+
+			vector<thread> threads;
+			for (size_t i=0; i<jobs.size(); i++) {
+				try {
+					threads.push_back(thread(capture_thread, &opt, &jobs[i]));
+				} catch (system_error &e) {
+					*jobs[i].err << "Unable to start a capture thread: " << e.what() << endl;
+					jobs[i].errcode = EXIT_FAILURE;
+				}
+			}
+			for (vector<thread>::iterator it = threads.begin(); it != threads.end(); it++)
+				it->join();
+
+			for (vector<CDeviceJob>::const_iterator it = jobs.begin(); it != jobs.end(); it++) {
+				cout << "DiscFerret " << it->serialnum << ": " << ((it->errcode == EXIT_SUCCESS) ? "finished" : "FAILED") << endl;
+				if (it->errcode != EXIT_SUCCESS) errcode = EXIT_FAILURE;
+			}
+		}
+
+		// Save the acquisition metrics -- even after an error, they show how far we got
+		vector<const CAcqMetrics *> runs;
+		for (vector<CDeviceJob>::const_iterator it = jobs.begin(); it != jobs.end(); it++) runs.push_back(&it->metrics);
+		if (!metricsJSON.empty() && !CAcqMetrics::writeJSON(metricsJSON, runs))
+			cerr << "Unable to save metrics to '" << metricsJSON << "'" << endl;
+		if (!metricsProm.empty() && !CAcqMetrics::writePrometheus(metricsProm, runs))
+			cerr << "Unable to save metrics to '" << metricsProm << "'" << endl;
+	}
 
 	// Final cleanup
+	if (opt.devices > 1) {
+		for (size_t i=0; i<jobs.size(); i++) {
+			if (i > 0) {
+				if (jobs[i].formatscript != formatscript) delete jobs[i].formatscript;
+				if (jobs[i].drivescript != drivescript) delete jobs[i].drivescript;
+			}
+			delete jobs[i].journal;
+			delete jobs[i].out;
+			delete jobs[i].err;
+			delete jobs[i].progress;
+		}
+	}
+	delete formatscript;
 	delete drivescript;
 
 	// Release Ctrl-C trap